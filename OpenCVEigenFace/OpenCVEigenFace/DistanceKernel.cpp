@@ -0,0 +1,295 @@
+#include "DistanceKernel.h"
+#include <float.h>
+#include <stddef.h>
+#include <algorithm>
+
+#if defined(__AVX512F__)
+#define DISTANCE_KERNEL_AVX512
+#include <immintrin.h>
+#elif defined(__AVX2__)
+#define DISTANCE_KERNEL_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define DISTANCE_KERNEL_SSE2
+#include <emmintrin.h>
+#endif
+
+
+
+/*
+Function:   Distance
+Purpose:    squared distance between a and b, the kernel used by both exported functions
+Notes:      b is aligned, a may not be.  n is a multiple of DISTANCE_KERNEL_WIDTH
+Throws
+returns:    squared distance
+*/
+static inline float Distance( const float* a, const float* b, int n )
+{
+#if defined(DISTANCE_KERNEL_AVX512)
+
+   __m512 sum = _mm512_setzero_ps();
+   for ( int i = 0; i < n; i += 16 )
+   {
+      __m512 d = _mm512_sub_ps( _mm512_loadu_ps(a+i), _mm512_load_ps(b+i) );
+      sum = _mm512_fmadd_ps( d, d, sum );
+   }
+   return _mm512_reduce_add_ps(sum);
+
+#elif defined(DISTANCE_KERNEL_AVX2)
+
+   // two accumulators so consecutive fmas do not wait on each other
+   __m256 sum0 = _mm256_setzero_ps();
+   __m256 sum1 = _mm256_setzero_ps();
+   for ( int i = 0; i < n; i += 16 )
+   {
+      __m256 d0 = _mm256_sub_ps( _mm256_loadu_ps(a+i), _mm256_load_ps(b+i) );
+      __m256 d1 = _mm256_sub_ps( _mm256_loadu_ps(a+i+8), _mm256_load_ps(b+i+8) );
+#if defined(__FMA__)
+      sum0 = _mm256_fmadd_ps( d0, d0, sum0 );
+      sum1 = _mm256_fmadd_ps( d1, d1, sum1 );
+#else
+      sum0 = _mm256_add_ps( sum0, _mm256_mul_ps(d0, d0) );
+      sum1 = _mm256_add_ps( sum1, _mm256_mul_ps(d1, d1) );
+#endif
+   }
+   __m256 sum = _mm256_add_ps(sum0, sum1);
+   __m128 s = _mm_add_ps( _mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1) );
+   s = _mm_add_ps( s, _mm_movehl_ps(s, s) );
+   s = _mm_add_ss( s, _mm_shuffle_ps(s, s, 1) );
+   return _mm_cvtss_f32(s);
+
+#elif defined(DISTANCE_KERNEL_SSE2)
+
+   __m128 sum0 = _mm_setzero_ps();
+   __m128 sum1 = _mm_setzero_ps();
+   __m128 sum2 = _mm_setzero_ps();
+   __m128 sum3 = _mm_setzero_ps();
+   for ( int i = 0; i < n; i += 16 )
+   {
+      __m128 d0 = _mm_sub_ps( _mm_loadu_ps(a+i), _mm_load_ps(b+i) );
+      __m128 d1 = _mm_sub_ps( _mm_loadu_ps(a+i+4), _mm_load_ps(b+i+4) );
+      __m128 d2 = _mm_sub_ps( _mm_loadu_ps(a+i+8), _mm_load_ps(b+i+8) );
+      __m128 d3 = _mm_sub_ps( _mm_loadu_ps(a+i+12), _mm_load_ps(b+i+12) );
+      sum0 = _mm_add_ps( sum0, _mm_mul_ps(d0, d0) );
+      sum1 = _mm_add_ps( sum1, _mm_mul_ps(d1, d1) );
+      sum2 = _mm_add_ps( sum2, _mm_mul_ps(d2, d2) );
+      sum3 = _mm_add_ps( sum3, _mm_mul_ps(d3, d3) );
+   }
+   __m128 s = _mm_add_ps( _mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3) );
+   s = _mm_add_ps( s, _mm_movehl_ps(s, s) );
+   s = _mm_add_ss( s, _mm_shuffle_ps(s, s, 1) );
+   return _mm_cvtss_f32(s);
+
+#else
+
+   // portable version, same four way split so the compiler can vectorize it
+   float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+   for ( int i = 0; i < n; i += 4 )
+   {
+      for ( int j = 0; j < 4; j++ )
+      {
+         float d = a[i+j] - b[i+j];
+         sum[j] += d*d;
+      }
+   }
+   return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+
+#endif
+}
+
+
+
+/*
+Function:   Dot
+Purpose:    dot product of a and b, the same layout as Distance
+Notes:      b is aligned, a may not be.  n is a multiple of DISTANCE_KERNEL_WIDTH
+Throws
+returns:    dot product
+*/
+static inline float Dot( const float* a, const float* b, int n )
+{
+#if defined(DISTANCE_KERNEL_AVX512)
+
+   __m512 sum = _mm512_setzero_ps();
+   for ( int i = 0; i < n; i += 16 )
+      sum = _mm512_fmadd_ps( _mm512_loadu_ps(a+i), _mm512_load_ps(b+i), sum );
+   return _mm512_reduce_add_ps(sum);
+
+#elif defined(DISTANCE_KERNEL_AVX2)
+
+   __m256 sum0 = _mm256_setzero_ps();
+   __m256 sum1 = _mm256_setzero_ps();
+   for ( int i = 0; i < n; i += 16 )
+   {
+#if defined(__FMA__)
+      sum0 = _mm256_fmadd_ps( _mm256_loadu_ps(a+i), _mm256_load_ps(b+i), sum0 );
+      sum1 = _mm256_fmadd_ps( _mm256_loadu_ps(a+i+8), _mm256_load_ps(b+i+8), sum1 );
+#else
+      sum0 = _mm256_add_ps( sum0, _mm256_mul_ps( _mm256_loadu_ps(a+i), _mm256_load_ps(b+i) ) );
+      sum1 = _mm256_add_ps( sum1, _mm256_mul_ps( _mm256_loadu_ps(a+i+8), _mm256_load_ps(b+i+8) ) );
+#endif
+   }
+   __m256 sum = _mm256_add_ps(sum0, sum1);
+   __m128 s = _mm_add_ps( _mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1) );
+   s = _mm_add_ps( s, _mm_movehl_ps(s, s) );
+   s = _mm_add_ss( s, _mm_shuffle_ps(s, s, 1) );
+   return _mm_cvtss_f32(s);
+
+#elif defined(DISTANCE_KERNEL_SSE2)
+
+   __m128 sum0 = _mm_setzero_ps();
+   __m128 sum1 = _mm_setzero_ps();
+   __m128 sum2 = _mm_setzero_ps();
+   __m128 sum3 = _mm_setzero_ps();
+   for ( int i = 0; i < n; i += 16 )
+   {
+      sum0 = _mm_add_ps( sum0, _mm_mul_ps( _mm_loadu_ps(a+i), _mm_load_ps(b+i) ) );
+      sum1 = _mm_add_ps( sum1, _mm_mul_ps( _mm_loadu_ps(a+i+4), _mm_load_ps(b+i+4) ) );
+      sum2 = _mm_add_ps( sum2, _mm_mul_ps( _mm_loadu_ps(a+i+8), _mm_load_ps(b+i+8) ) );
+      sum3 = _mm_add_ps( sum3, _mm_mul_ps( _mm_loadu_ps(a+i+12), _mm_load_ps(b+i+12) ) );
+   }
+   __m128 s = _mm_add_ps( _mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3) );
+   s = _mm_add_ps( s, _mm_movehl_ps(s, s) );
+   s = _mm_add_ss( s, _mm_shuffle_ps(s, s, 1) );
+   return _mm_cvtss_f32(s);
+
+#else
+
+   // portable version, same four way split so the compiler can vectorize it
+   float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+   for ( int i = 0; i < n; i += 4 )
+   {
+      for ( int j = 0; j < 4; j++ )
+         sum[j] += a[i+j] * b[i+j];
+   }
+   return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+
+#endif
+}
+
+
+
+/*
+Function:   SquaredDistance
+Purpose:    squared Euclidean distance between two padded vectors
+Notes:      see DistanceKernel.h for the length and alignment rules
+Throws
+returns:    squared distance
+*/
+float SquaredDistance( const float* a, const float* b, int n )
+{
+   return Distance(a, b, n);
+}
+
+
+
+/*
+Function:   DotProduct
+Purpose:    dot product of two padded vectors
+Notes:      see DistanceKernel.h for the length and alignment rules, the padding only has to be zero in one
+Throws
+returns:    dot product
+*/
+float DotProduct( const float* a, const float* b, int n )
+{
+   return Dot(a, b, n);
+}
+
+
+
+/*
+Function:   ClosestRow
+Purpose:    scans every row for the one closest to probe
+Notes:      the first row wins a tie.  see DistanceKernel.h for the length and alignment rules.
+            A skipped row costs one byte compare, its distance is never computed
+Throws
+returns:    index of the closest row, -1 if there are no rows
+*/
+int ClosestRow( const float* probe, const float* rows, int nRows, int stride, float& distance, const unsigned char* skip )
+{
+   float bestDistance = FLT_MAX;
+   int bestRow = -1;
+
+   for ( int row = 0; row < nRows; row++ )
+   {
+      if ( skip && skip[row] )
+         continue;
+
+      float d = Distance( probe, rows + (size_t)row * stride, stride );
+
+      if ( d < bestDistance )
+      {
+         bestDistance = d;
+         bestRow = row;
+      }
+   }
+
+   distance = bestDistance;
+   return bestRow;
+}
+
+
+
+/*
+Function:   ClosestRows
+Purpose:    scans every row keeping the k closest
+Notes:      best is used as a bounded max heap while scanning, the farthest of the k rows so far
+            is at best[0] so most rows are rejected with one compare.  It is sorted at the end.
+            Skipped rows are never compared
+Throws
+returns:    number of rows in best
+*/
+int ClosestRows( const float* probe, const float* rows, int nRows, int stride, int k, RowDistance* best, const unsigned char* skip )
+{
+   if ( k <= 0 )
+      return 0;
+
+   int nBest = 0;
+
+   for ( int row = 0; row < nRows; row++ )
+   {
+      if ( skip && skip[row] )
+         continue;
+
+      RowDistance candidate;
+      candidate.m_Distance = Distance( probe, rows + (size_t)row * stride, stride );
+      candidate.m_Row = row;
+
+      if ( nBest < k )
+      {
+         best[nBest++] = candidate;
+         std::push_heap( best, best + nBest );
+      }
+      else if ( candidate < best[0] )
+      {
+         std::pop_heap( best, best + nBest );
+         best[nBest-1] = candidate;
+         std::push_heap( best, best + nBest );
+      }
+   }
+
+   std::sort_heap( best, best + nBest );
+   return nBest;
+}
+
+
+
+/*
+Function:   DistanceKernelName
+Purpose:    reports which version of the kernel was compiled
+Notes:
+Throws
+returns:    name of the instruction set
+*/
+const char* DistanceKernelName()
+{
+#if defined(DISTANCE_KERNEL_AVX512)
+   return "AVX-512";
+#elif defined(DISTANCE_KERNEL_AVX2)
+   return "AVX2";
+#elif defined(DISTANCE_KERNEL_SSE2)
+   return "SSE2";
+#else
+   return "portable";
+#endif
+}
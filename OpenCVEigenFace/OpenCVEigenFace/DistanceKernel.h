@@ -0,0 +1,55 @@
+#ifndef DISTANCEKERNEL_H
+#define DISTANCEKERNEL_H
+
+/*
+   DistanceKernel.h
+   Description:   squared Euclidean distance between a projected probe and the class rows of the
+                  gallery, and the dot product a probe image is projected with.  The instruction set
+                  is picked when the file is compiled: AVX-512, AVX2, SSE2 or plain C++.
+
+   Notes:         vectors are processed DISTANCE_KERNEL_WIDTH floats at a time with no remainder loop,
+                  so the length and the row stride must be a multiple of DISTANCE_KERNEL_WIDTH and any
+                  padding after the real values must be zero in both vectors.  AlignedStride from
+                  ModelFile.h gives such a stride.  Rows must be MODEL_FILE_ALIGN aligned, the probe
+                  does not have to be.
+*/
+
+#include <stddef.h>
+
+
+#define DISTANCE_KERNEL_WIDTH   16          // floats per step, one 64 byte row block
+
+
+// squared distance between a and b, n floats each
+float SquaredDistance( const float* a, const float* b, int n );
+
+// dot product of a and b, n floats each, the padding has to be zero in at least one of them
+float DotProduct( const float* a, const float* b, int n );
+
+// a row and its distance from the probe
+struct RowDistance
+{
+   float    m_Distance;
+   int      m_Row;
+
+   // closer first, lower row first on a tie
+   bool operator<( const RowDistance& other ) const
+   {
+      return m_Distance < other.m_Distance || ( m_Distance == other.m_Distance && m_Row < other.m_Row );
+   }
+};
+
+
+// finds the row closest to probe, rows are stride floats apart, returns -1 if nRows is 0
+// rows with skip[row] set are left out, a NULL skip leaves none out
+int   ClosestRow( const float* probe, const float* rows, int nRows, int stride, float& distance, const unsigned char* skip = NULL );
+
+// finds the k rows closest to probe, best must have room for k, it is filled closest first
+// returns the number of rows found, the smaller of k and the rows not skipped
+int   ClosestRows( const float* probe, const float* rows, int nRows, int stride, int k, RowDistance* best, const unsigned char* skip = NULL );
+
+// name of the instruction set the kernel was compiled for
+const char* DistanceKernelName();
+
+
+#endif
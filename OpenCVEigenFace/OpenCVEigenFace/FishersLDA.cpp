@@ -11,6 +11,9 @@ Date:          Mar 15th 2010
 #include <algorithm>
 #include <cctype>
 #include <string>
+#include <fstream>
+#include <cmath>
+#include <cfloat>
 #include <cv.h>
 #include <cvaux.h>
 #include <cxcore.h>
@@ -19,17 +22,27 @@ Date:          Mar 15th 2010
 #include "Utilities.h"
 #include "PreProcess.h"
 #include "Training.h"
+#include "ShardedTraining.h"
+#include "ImagePack.h"
 #include "TrainingFile.h"
 #include "Recognize.h"
 #include "Standardize.h"
+#include "TrainingStats.h"
 
 void PrintUsage();
+bool TestStatsPrecision();
 
 int main( int argc, char** argv )
 {
 	system("clear");
 	std::string command = "";
 
+	// keep the recognizer around so the database is only loaded once.  Searches open it search only,
+	// so they write nothing and work while another process changes the database
+	Recognizer* recognizer = NULL;
+	std::string recognizerDatabase = "";
+	bool recognizerSearchOnly = true;
+
 	while (1)
 	{
 		PrintUsage();
@@ -111,11 +124,112 @@ int main( int argc, char** argv )
 				if ( !resultsdir.empty() &&  resultsdir[resultsdir.size()-1] != '//' ) 
 					resultsdir.append("//"); 
 
-				Train( trainingfile.c_str(), outputfile.c_str(), resultsdir );
+				std::string buildindex = "";
+				cout << "Build HNSW index (y/n):";
+				cin >> buildindex;
+
+				std::string buildpq = "";
+				cout << "Build product quantized index (y/n):";
+				cin >> buildpq;
+
+				TrainingOptions options;
+				options.m_bBuildHNSW = ( buildindex == "y" || buildindex == "Y" );
+				options.m_bBuildPQ = ( buildpq == "y" || buildpq == "Y" );
+
+				cout << "Enter number of eigenfaces (0 for all):";
+				cin >> options.m_nEigenFaces;
+				cout << "Enter fraction of variance to keep (0 for all):";
+				cin >> options.m_RetainedVariance;
+				cout << "Enter number of fisherfaces (0 for all):";
+				cin >> options.m_nFisherFaces;
+
+				std::string randomized = "";
+				cout << "Use randomized PCA (y/n):";
+				cin >> randomized;
+				if ( randomized == "y" || randomized == "Y" )
+					options.m_PCAMethod = PCA_RANDOMIZED;
+
+				cout << "Enter number of training shards (1 for none):";
+				cin >> options.m_nShards;
+				if ( options.m_nShards > 1 )
+				{
+					std::string external = "";
+					cout << "Run the shards on other machines (y/n):";
+					cin >> external;
+					options.m_bExternalShards = ( external == "y" || external == "Y" );
+					if ( options.m_bExternalShards )
+					{
+						int timeout = 0;
+						cout << "Enter seconds to wait for the shards (0 to wait forever):";
+						cin >> timeout;
+						options.m_ShardTimeoutSeconds = timeout;
+						cout << "Waiting for shards, run shard on each machine once " << ShardBasisFileName(outputfile.c_str()) << " exists" << endl;
+					}
+				}
+
+				std::string cachedir = "";
+				cout << "Enter stage cache directory (none for no cache):";
+				cin >> cachedir;
+				if ( cachedir != "none" )
+				{
+					options.m_CacheDir = cachedir;
+
+					std::string incremental = "";
+					cout << "Update the database's previous training with the image list changes (y/n):";
+					cin >> incremental;
+					options.m_bIncremental = ( incremental == "y" || incremental == "Y" );
+				}
+
+				Train( trainingfile.c_str(), outputfile.c_str(), resultsdir, options );
+
+				// training replaced the database and removed its gallery and log, a recognizer of it still
+				// has the old model mapped and the old log open
+				if ( recognizer && recognizerDatabase == outputfile )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizerDatabase = "";
+				}
 
 				cout << "Database created: " << outputfile << endl;
+				if ( options.m_bBuildHNSW )
+					cout << "Index created: " << HNSWIndexFileName(outputfile.c_str()) << endl;
+				if ( options.m_bBuildPQ )
+					cout << "Index created: " << PQIndexFileName(outputfile.c_str()) << endl;
 
 			}
+			else if ( command == "PACK" )
+			{
+				std::string trainingfile = "";
+				std::string packfile = "";
+				cout << "Enter Training File:";
+				cin >> trainingfile;
+				cout << "Enter pack file name:";
+				cin >> packfile;
+
+				int nImages = PackImages( trainingfile.c_str(), packfile.c_str() );
+
+				cout << "Pack created: " << packfile << " (" << nImages << " images)" << endl;
+			}
+			else if ( command == "SHARD" )
+			{
+				std::string trainingfile = "";
+				std::string database = "";
+				int shard = 0;
+				int nShards = 0;
+				cout << "Enter Training File:";
+				cin >> trainingfile;
+				cout << "Enter database name:";
+				cin >> database;
+				cout << "Enter shard number (from 0):";
+				cin >> shard;
+				cout << "Enter number of shards:";
+				cin >> nShards;
+
+				TrainShard( trainingfile.c_str(), database.c_str(), shard, nShards );
+
+				cout << "Shard created: " << ShardPartialFileName(database.c_str(), shard) << endl;
+			}
 			else if ( command == "SEARCH" )
 			{
 				std::string imagename = "";
@@ -132,8 +246,17 @@ int main( int argc, char** argv )
 				if ( !resultsdir.empty() &&  resultsdir[resultsdir.size()-1] != '//' )
 					resultsdir.append("//");
 
+				if ( !recognizer || recognizerDatabase != database )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizer = new Recognizer(database.c_str(), true);
+					recognizerDatabase = database;
+					recognizerSearchOnly = true;
+				}
+
          			double distance = DBL_MAX;
-         			std::string result = Recognize(imagename.c_str(),database.c_str(), distance, resultsdir );
+         			std::string result = recognizer->Recognize(imagename.c_str(), distance);
          			if ( result.empty() )
          			{
             				cout << "Could not find person" << endl;
@@ -145,6 +268,242 @@ int main( int argc, char** argv )
             				cout << "Distance: " << distance << endl;
          			}
 			}
+			else if ( command == "SEARCHLIST" )
+			{
+				std::string probelist = "";
+				std::string database = "";
+				std::string outputfile = "";
+				int k = 1;
+				cout << "Enter file listing the images to search for, one per line. Note: Images should be preprocessed:";
+				cin >> probelist;
+				cout << "Enter trained database file name: ";
+				cin >> database;
+				cout << "Enter number of people to find for each image (k):";
+				cin >> k;
+				cout << "Enter results file name:";
+				cin >> outputfile;
+
+				if ( !recognizer || recognizerDatabase != database )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizer = new Recognizer(database.c_str(), true);
+					recognizerDatabase = database;
+					recognizerSearchOnly = true;
+				}
+
+				std::ifstream list(probelist.c_str());
+				if ( !list.is_open() )
+					throw std::string("Could not open probe list ") + probelist;
+
+				std::vector<std::string> images;
+				std::string imagename;
+				while ( list >> imagename )
+					images.push_back(imagename);
+
+				std::vector< std::vector<RecognitionResult> > results;
+				std::vector<std::string> errors;
+				int64 start = cvGetTickCount();
+				recognizer->RecognizeFiles(images, k, results, errors);
+				double seconds = (cvGetTickCount() - start) / ( cvGetTickFrequency() * 1000000.0 );
+
+				// one line per image in the order of the list: image, then id name distance of each person found
+				std::ofstream output(outputfile.c_str());
+				if ( !output.is_open() )
+					throw std::string("Could not create results file ") + outputfile;
+
+				int nFailed = 0;
+				for ( size_t i = 0; i < images.size(); i++ )
+				{
+					output << images[i];
+					if ( !errors[i].empty() )
+					{
+						output << " ERROR " << errors[i];
+						nFailed++;
+					}
+					for ( size_t j = 0; j < results[i].size(); j++ )
+						output << " " << results[i][j].m_ID << " " << results[i][j].m_Name << " " << results[i][j].m_Distance;
+					output << endl;
+				}
+
+				cout << "Searched " << images.size() - nFailed << " of " << images.size() << " images in " << seconds << " seconds";
+				if ( seconds > 0.0 )
+					cout << " (" << images.size() / seconds << " per second)";
+				cout << endl;
+				cout << "Results: " << outputfile << endl;
+			}
+			else if ( command == "ENROLL" )
+			{
+				std::string name = "";
+				std::string facelist = "";
+				std::string database = "";
+				cout << "Enter name of person to enroll:";
+				cin >> name;
+				cout << "Enter file listing the person's images, one per line. Note: Images should be preprocessed:";
+				cin >> facelist;
+				cout << "Enter trained database file name: ";
+				cin >> database;
+
+				if ( !recognizer || recognizerDatabase != database || recognizerSearchOnly )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizer = new Recognizer(database.c_str());
+					recognizerDatabase = database;
+					recognizerSearchOnly = false;
+				}
+
+				std::ifstream list(facelist.c_str());
+				if ( !list.is_open() )
+					throw std::string("Could not open image list ") + facelist;
+
+				std::vector<const IplImage*> faces;
+				std::string imagename;
+				while ( list >> imagename )
+				{
+					IplImage* face = cvLoadImage(imagename.c_str(), 0);
+					if ( face )
+						faces.push_back(face);
+					else
+						cout << "Could not load image " << imagename << endl;
+				}
+
+				personIDType id = 0;
+				try
+				{
+					id = recognizer->Enroll(name, faces);
+				}
+				catch (...)
+				{
+					for ( size_t i = 0; i < faces.size(); i++ )
+						cvReleaseImage( (IplImage**)&faces[i] );
+					throw;
+				}
+				for ( size_t i = 0; i < faces.size(); i++ )
+					cvReleaseImage( (IplImage**)&faces[i] );
+
+				cout << "Enrolled " << name << " as person ID " << id << " from " << faces.size() << " images" << endl;
+				cout << "Gallery: " << GalleryFileName(database.c_str()) << " (" << recognizer->Classes() << " people)" << endl;
+			}
+			else if ( command == "REMOVE" )
+			{
+				personIDType id = 0;
+				std::string database = "";
+				cout << "Enter person ID to remove:";
+				cin >> id;
+				cout << "Enter trained database file name: ";
+				cin >> database;
+
+				if ( !recognizer || recognizerDatabase != database || recognizerSearchOnly )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizer = new Recognizer(database.c_str());
+					recognizerDatabase = database;
+					recognizerSearchOnly = false;
+				}
+
+				recognizer->Remove(id);
+
+				cout << "Removed person ID " << id << endl;
+				cout << "Gallery: " << GalleryFileName(database.c_str()) << " (" << recognizer->Classes() << " people)" << endl;
+			}
+			else if ( command == "CHECKPOINT" )
+			{
+				std::string database = "";
+				cout << "Enter trained database file name: ";
+				cin >> database;
+
+				if ( !recognizer || recognizerDatabase != database || recognizerSearchOnly )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizer = new Recognizer(database.c_str());
+					recognizerDatabase = database;
+					recognizerSearchOnly = false;
+				}
+
+				recognizer->Checkpoint();
+
+				cout << "Gallery: " << GalleryFileName(database.c_str()) << " (" << recognizer->Classes() << " people)" << endl;
+				cout << "Log emptied: " << GalleryLogFileName(database.c_str()) << endl;
+			}
+			else if ( command == "BENCHMARK" )
+			{
+				std::string probelist = "";
+				std::string database = "";
+				std::string indextype = "";
+				int k = 1;
+				int knob = 0;
+				cout << "Enter file listing the probe images, one per line:";
+				cin >> probelist;
+				cout << "Enter trained database file name: ";
+				cin >> database;
+				cout << "Enter index to test (hnsw/pq):";
+				cin >> indextype;
+				std::transform( indextype.begin(), indextype.end(), indextype.begin(),(int(*)(int)) std::toupper );
+				SearchMode mode = ( indextype == "PQ" ) ? SEARCH_PQ : SEARCH_HNSW;
+				cout << "Enter number of people to find (k):";
+				cin >> k;
+				if ( mode == SEARCH_HNSW )
+					cout << "Enter efSearch:";
+				else
+					cout << "Enter number of candidates to re-rank:";
+				cin >> knob;
+
+				if ( !recognizer || recognizerDatabase != database )
+				{
+					delete recognizer;
+					recognizer = NULL;
+					recognizer = new Recognizer(database.c_str(), true);
+					recognizerDatabase = database;
+					recognizerSearchOnly = true;
+				}
+				SearchMode previousMode = recognizer->GetSearchMode();
+				recognizer->SetSearchMode(mode);
+				if ( mode == SEARCH_HNSW )
+					recognizer->SetEfSearch(knob);
+				else
+					recognizer->SetRerank(knob);
+
+				std::ifstream list(probelist.c_str());
+				if ( !list.is_open() )
+					throw std::string("Could not open probe list ") + probelist;
+
+				std::vector<const IplImage*> probes;
+				std::string imagename;
+				while ( list >> imagename )
+				{
+					IplImage* probe = cvLoadImage(imagename.c_str(), 0);
+					if ( probe )
+						probes.push_back(probe);
+					else
+						cout << "Could not load probe " << imagename << endl;
+				}
+
+				SearchBenchmark benchmark;
+				try
+				{
+					recognizer->BenchmarkIndex(probes, k, benchmark);
+				}
+				catch (...)
+				{
+					for ( size_t i = 0; i < probes.size(); i++ )
+						cvReleaseImage( (IplImage**)&probes[i] );
+					recognizer->SetSearchMode(previousMode);
+					throw;
+				}
+				for ( size_t i = 0; i < probes.size(); i++ )
+					cvReleaseImage( (IplImage**)&probes[i] );
+				recognizer->SetSearchMode(previousMode);
+
+				cout << "Eigenfaces: " << recognizer->EigenFaces() << " Fisherfaces: " << recognizer->FisherFaces() << endl;
+				cout << "Probes: " << benchmark.m_nProbes << ( mode == SEARCH_HNSW ? " efSearch: " : " re-ranked: " ) << knob
+				     << " kernel: " << DistanceKernelName() << endl;
+				cout << "Recall@" << benchmark.m_k << ": " << benchmark.m_Recall << endl;
+				cout << "Exact search: " << benchmark.m_ExactMs << " ms per probe" << endl;
+				cout << ( mode == SEARCH_HNSW ? "HNSW" : "PQ" ) << " search: " << benchmark.m_IndexMs << " ms per probe" << endl;
+			}
          else if ( command == "TEST" )
          {
             int nrows = 3;
@@ -184,6 +543,13 @@ int main( int argc, char** argv )
             }
 
             i = 0;
+         }
+         else if ( command == "STATSTEST" )
+         {
+            if ( TestStatsPrecision() )
+               cout << "Training statistics match the direct scatter" << endl;
+            else
+               cout << "Training statistics do NOT match the direct scatter" << endl;
          }
 			else if ( command == "EXIT" )
 			{
@@ -196,24 +562,183 @@ int main( int argc, char** argv )
 		catch ( std::string err )
 		{
 			cout << "Error: " << err << endl;
+			delete recognizer;
 			return 1;
 		}
 	}
 
+   delete recognizer;
    return 0;
 }
 
 
 
 
+/*
+Function:   StatsError
+Purpose:    largest difference between stats' within class scatter and class means and the direct ones
+Notes:      relative to the largest entry of the direct scatter and of the direct means
+Throws
+returns:    the larger of the two relative errors
+*/
+static double StatsError( const TrainingStats& stats, const CvMat* scatter, const CvMat* means )
+{
+   CvMat* sw = cvCreateMat( scatter->rows, scatter->cols, CV_64FC1 );
+   CvMat* cm = cvCreateMat( means->rows, means->cols, CV_64FC1 );
+   stats.WithinScatter( sw );
+   stats.ClassMeans( cm );
+
+   double swError = 0.0, swLargest = 0.0;
+   for ( int i = 0; i < scatter->rows * scatter->cols; i++ )
+   {
+      swError = std::max( swError, fabs( sw->data.db[i] - scatter->data.db[i] ) );
+      swLargest = std::max( swLargest, fabs( scatter->data.db[i] ) );
+   }
+
+   double meanError = 0.0, meanLargest = 0.0;
+   for ( int i = 0; i < means->rows * means->cols; i++ )
+   {
+      meanError = std::max( meanError, fabs( cm->data.db[i] - means->data.db[i] ) );
+      meanLargest = std::max( meanLargest, fabs( means->data.db[i] ) );
+   }
+
+   cvReleaseMat(&sw);
+   cvReleaseMat(&cm);
+
+   return std::max( swError / std::max( swLargest, DBL_MIN ), meanError / std::max( meanLargest, DBL_MIN ) );
+}
+
+
+
+/*
+Function:   TestStatsPrecision
+Purpose:    checks TrainingStats against the within class scatter worked out directly
+Notes:      the faces are near 1000 with a spread of 1e-2, where a sum of x x^T would cancel away
+            nearly every digit.  They are added one at a time, added with extra faces that are then
+            removed, and split into shards that are merged, and each result is compared with the
+            scatter found by subtracting the class means first.  The faces come from a fixed
+            generator so every run checks the same numbers
+Throws      std::string if the statistics throw
+returns:    true if every way matches the direct scatter
+*/
+bool TestStatsPrecision()
+{
+   const int dimension = 6;
+   const int nClasses = 5;
+   const int perClass = 200;
+   const int nFaces = nClasses * perClass;
+   const int nShards = 4;
+   const double tolerance = 1e-9;
+
+   // the faces, then as many again to add and remove, the extra ones in a class of their own too
+   CvMat* faces = cvCreateMat( 2 * nFaces, dimension, CV_32FC1 );
+   std::vector<personIDType> classes( 2 * nFaces );
+
+   unsigned int seed = 12345;
+   for ( int i = 0; i < 2 * nFaces; i++ )
+   {
+      classes[i] = ( i < nFaces ) ? i % nClasses : i % ( nClasses + 1 );
+      for ( int j = 0; j < dimension; j++ )
+      {
+         seed = seed * 1103515245 + 12345;
+         double spread = ( ( seed >> 8 ) & 0xFFFF ) / 65535.0 - 0.5;
+         faces->data.fl[(size_t)i * dimension + j] = (float)( 1000.0 + 10.0 * classes[i] + 1e-2 * spread );
+      }
+   }
+
+   // the direct answer, the class means first then the scatter about them
+   CvMat* means = cvCreateMat( nClasses, dimension, CV_64FC1 );
+   CvMat* scatter = cvCreateMat( dimension, dimension, CV_64FC1 );
+   cvZero( means );
+   cvZero( scatter );
+
+   for ( int i = 0; i < nFaces; i++ )
+   {
+      for ( int j = 0; j < dimension; j++ )
+         means->data.db[classes[i] * dimension + j] += faces->data.fl[(size_t)i * dimension + j] / (double)perClass;
+   }
+   for ( int i = 0; i < nFaces; i++ )
+   {
+      for ( int r = 0; r < dimension; r++ )
+      {
+         double dr = faces->data.fl[(size_t)i * dimension + r] - means->data.db[classes[i] * dimension + r];
+         for ( int c = 0; c < dimension; c++ )
+         {
+            double dc = faces->data.fl[(size_t)i * dimension + c] - means->data.db[classes[i] * dimension + c];
+            scatter->data.db[r * dimension + c] += dr * dc;
+         }
+      }
+   }
+
+   double errors[3];
+   try
+   {
+      // one at a time
+      TrainingStats added( dimension );
+      for ( int i = 0; i < nFaces; i++ )
+         added.Add( classes[i], faces->data.fl + (size_t)i * dimension );
+      errors[0] = StatsError( added, scatter, means );
+
+      // every face then the extra ones taken back out
+      CvMat all, extra;
+      cvGetRows( faces, &all, 0, 2 * nFaces );
+      cvGetRows( faces, &extra, nFaces, 2 * nFaces );
+      TrainingStats removed( dimension );
+      removed.AddRows( &all, &classes[0] );
+      removed.RemoveRows( &extra, &classes[nFaces] );
+      errors[1] = StatsError( removed, scatter, means );
+
+      // every nShards'th face in each shard, merged
+      std::vector<TrainingStats> shards( nShards, TrainingStats(dimension) );
+      for ( int i = 0; i < nFaces; i++ )
+         shards[i % nShards].Add( classes[i], faces->data.fl + (size_t)i * dimension );
+      TrainingStats merged( dimension );
+      for ( int shard = 0; shard < nShards; shard++ )
+         merged.Merge( shards[shard] );
+      errors[2] = StatsError( merged, scatter, means );
+   }
+   catch (...)
+   {
+      cvReleaseMat(&faces);
+      cvReleaseMat(&means);
+      cvReleaseMat(&scatter);
+      throw;
+   }
+
+   cvReleaseMat(&faces);
+   cvReleaseMat(&means);
+   cvReleaseMat(&scatter);
+
+   const char* names[3] = { "added one at a time", "added then removed", "merged from shards" };
+   bool passed = true;
+   for ( int i = 0; i < 3; i++ )
+   {
+      cout << names[i] << ": relative error " << errors[i] << endl;
+      if ( !( errors[i] <= tolerance ) )
+         passed = false;
+   }
+
+   return passed;
+}
+
+
+
 void PrintUsage()
 {
    cout << "Please select a command:" << endl << endl;
    cout << "preprocess - detect a face and preprocess the image, then store face on disk" << endl;
    cout << "genfile    - create a training file" << endl;
+   cout << "pack       - pack the images of a training file into one file that train can use instead" << endl;
    cout << "train      - train the system" << endl;
+   cout << "shard      - train one shard of a sharded training run on another machine" << endl;
    cout << "search     - search the database for a face in an image" << endl;
+   cout << "searchlist - search the database for the faces in a list of images on all the cores" << endl;
+   cout << "enroll     - add a person to a trained database without training again" << endl;
+   cout << "remove     - remove a person from a trained database without training again" << endl;
+   cout << "checkpoint - write the enrollments and removals logged since the last checkpoint into the gallery" << endl;
+   cout << "benchmark  - compare the HNSW or product quantized index with the exact search" << endl;
    cout << "test       - run a test" << endl;
+   cout << "statstest  - check the training statistics against the scatter worked out directly" << endl;
    cout << "exit" << endl << ":";
 }
 
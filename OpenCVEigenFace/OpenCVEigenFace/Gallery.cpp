@@ -0,0 +1,637 @@
+#include "Gallery.h"
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+
+
+
+/*
+Function:   GalleryFileName
+Purpose:    where the classes enrolled into a database are stored
+Notes:
+Throws
+returns:    <database>.gallery
+*/
+std::string GalleryFileName( const char* database )
+{
+   std::string name = database;
+   name += ".gallery";
+   return name;
+}
+
+
+
+/*
+Function:   GalleryChunk constructor
+Purpose:    an empty chunk of enrolled rows
+Notes:
+Throws      std::string if it can't allocate memory
+*/
+GalleryChunk::GalleryChunk( int stride ) : m_Stride(stride), m_nRows(0), m_nRemoved(0), m_Block(NULL), m_Rows(NULL)
+{
+   Allocate();
+}
+
+
+
+/*
+Function:   GalleryChunk copy constructor
+Purpose:    a copy of chunk to change
+Notes:      only the rows chunk has are copied
+Throws      std::string if it can't allocate memory
+*/
+GalleryChunk::GalleryChunk( const GalleryChunk& chunk ) : m_Stride(chunk.m_Stride), m_nRows(chunk.m_nRows), m_nRemoved(chunk.m_nRemoved),
+   m_Block(NULL), m_Rows(NULL)
+{
+   Allocate();
+
+   memcpy( m_Rows, chunk.m_Rows, (size_t)m_nRows * m_Stride * sizeof(float) );
+   memcpy( m_IDs, chunk.m_IDs, m_nRows * sizeof(personIDType) );
+   memcpy( m_Thresholds, chunk.m_Thresholds, m_nRows * sizeof(float) );
+   memcpy( m_Removed, chunk.m_Removed, m_nRows * sizeof(uchar) );
+   for ( int i = 0; i < m_nRows; i++ )
+      m_Names[i] = chunk.m_Names[i];
+}
+
+
+
+/*
+Function:   GalleryChunk destructor
+Purpose:    frees the rows
+Notes:
+Throws
+*/
+GalleryChunk::~GalleryChunk()
+{
+   if ( m_Block )
+      cvFree(&m_Block);
+}
+
+
+
+/*
+Function:   Allocate
+Purpose:    allocates room for GALLERY_CHUNK_ROWS rows
+Notes:      cvAlloc doesn't align to MODEL_FILE_ALIGN so the block is over allocated and the rows start at
+            the first aligned float
+Throws      std::string if it can't allocate memory
+returns:    void
+*/
+void GalleryChunk::Allocate()
+{
+   m_Block = cvAlloc( (size_t)GALLERY_CHUNK_ROWS * m_Stride * sizeof(float) + MODEL_FILE_ALIGN );
+   if ( !m_Block )
+      throw std::string("Gallery could not allocate the enrolled rows");
+
+   m_Rows = (float*)( ( (size_t)m_Block + MODEL_FILE_ALIGN - 1 ) & ~(size_t)(MODEL_FILE_ALIGN - 1) );
+}
+
+
+
+/*
+Function:   Gallery constructor
+Purpose:
+Notes:      Open has to be called before anything else
+Throws
+*/
+Gallery::Gallery() : m_Model(NULL), m_nFisherFaces(0), m_Stride(0), m_NextID(1), m_Sequence(0), m_nTrained(0), m_TrainedRows(NULL),
+   m_TrainedIDs(NULL), m_TrainedThresholds(NULL), m_nTrainedRemoved(0), m_OwnsTrainedRemoved(false), m_nEnrolled(0), m_nEnrolledRemoved(0)
+{
+}
+
+
+
+/*
+Function:   Gallery copy constructor
+Purpose:    a copy of gallery that can be changed while gallery is still being searched
+Notes:      the trained rows stay in the model.  The copy shares gallery's chunks and removed flags and
+            copies one only when it changes it, so copying costs a reference per chunk
+Throws
+*/
+Gallery::Gallery( const Gallery& gallery ) : m_FileName(gallery.m_FileName), m_Model(gallery.m_Model), m_nFisherFaces(gallery.m_nFisherFaces),
+   m_Stride(gallery.m_Stride), m_NextID(gallery.m_NextID), m_Sequence(gallery.m_Sequence), m_nTrained(gallery.m_nTrained), m_TrainedRows(gallery.m_TrainedRows),
+   m_TrainedIDs(gallery.m_TrainedIDs), m_TrainedThresholds(gallery.m_TrainedThresholds), m_nTrainedRemoved(gallery.m_nTrainedRemoved),
+   m_TrainedRemoved(gallery.m_TrainedRemoved), m_OwnsTrainedRemoved(false), m_nEnrolled(gallery.m_nEnrolled),
+   m_nEnrolledRemoved(gallery.m_nEnrolledRemoved), m_Chunks(gallery.m_Chunks), m_OwnsChunk(gallery.m_Chunks.size(), 0)
+{
+}
+
+
+
+/*
+Function:   Gallery destructor
+Purpose:
+Notes:      the trained rows belong to the model, a chunk is freed with the last gallery that has it
+Throws
+*/
+Gallery::~Gallery()
+{
+}
+
+
+
+/*
+Function:   Open
+Purpose:    uses the trained classes of model and loads the classes enrolled into it
+Notes:      nothing is copied from the model.  A missing filename means nothing has been enrolled
+Throws      std::string if the model's class tables are not valid or filename is not a gallery of this model
+returns:    void
+*/
+void Gallery::Open( const ModelFile& model, const char* filename )
+{
+   const ModelFileHeader& header = model.Header();
+
+   m_Model = &model;
+   m_FileName = filename;
+   m_nFisherFaces = header.m_nFisherFaces;
+   m_Stride = header.m_CentroidStride;
+   m_nTrained = header.m_nClasses;
+
+   m_TrainedIDs = (const personIDType*)model.RequiredSection( MODEL_SECTION_CLASS_IDS, m_nTrained * sizeof(personIDType) );
+   m_TrainedThresholds = (const float*)model.RequiredSection( MODEL_SECTION_THRESHOLDS, m_nTrained * sizeof(float) );
+   m_TrainedRows = (const float*)model.RequiredSection( MODEL_SECTION_CENTROIDS, (uint64)m_nTrained * m_Stride * sizeof(float) );
+   m_TrainedRemoved = cv::Ptr< std::vector<uchar> >( new std::vector<uchar>( m_nTrained, 0 ) );
+   m_OwnsTrainedRemoved = true;
+   m_nTrainedRemoved = 0;
+
+   m_NextID = 1;
+   m_Sequence = 0;
+   for ( int row = 0; row < m_nTrained; row++ )
+   {
+      if ( m_TrainedIDs[row] >= m_NextID )
+         m_NextID = m_TrainedIDs[row] + 1;
+   }
+
+   std::ifstream exists( filename );
+   if ( exists.is_open() )
+   {
+      exists.close();
+      Load();
+   }
+}
+
+
+
+/*
+Function:   Apply
+Purpose:    makes the change a log record describes
+Notes:      an enrolled class is appended after the others, a removed class's row is only marked, see
+            Compact.  Records are applied in sequence order, the gallery remembers the last one
+Throws      std::string naming the record and person id if the class to remove is not in the gallery,
+            the id to enroll is already used or its centroid is the wrong size, or the record is not a
+            change this gallery knows
+returns:    void
+*/
+void Gallery::Apply( const GalleryLogRecord& record )
+{
+   std::stringstream err;
+
+   if ( record.m_Type == GALLERY_LOG_ENROLL )
+   {
+      if ( record.m_ID < m_NextID )
+      {
+         err << "Gallery::Apply - record " << record.m_Sequence << " can't enroll person id " << record.m_ID
+             << ", ids up to " << m_NextID - 1 << " are already used";
+         throw err.str();
+      }
+      if ( (int)record.m_Centroid.size() != m_nFisherFaces )
+      {
+         err << "Gallery::Apply - record " << record.m_Sequence << " can't enroll person id " << record.m_ID
+             << ", its centroid has " << record.m_Centroid.size() << " values instead of " << m_nFisherFaces;
+         throw err.str();
+      }
+
+      Append( record.m_ID, record.m_Name, &record.m_Centroid[0], record.m_Threshold );
+   }
+   else if ( record.m_Type == GALLERY_LOG_REMOVE )
+   {
+      int row = Find( record.m_ID );
+      if ( row == -1 )
+      {
+         err << "Gallery::Apply - record " << record.m_Sequence << " can't remove person id " << record.m_ID
+             << ", it is not in the gallery or was already removed";
+         throw err.str();
+      }
+
+      SetRemoved( row, 1 );
+   }
+   else
+   {
+      err << "Gallery::Apply - record " << record.m_Sequence << " for person id " << record.m_ID
+          << " has unknown change type " << record.m_Type;
+      throw err.str();
+   }
+
+   m_Sequence = record.m_Sequence;
+}
+
+
+
+/*
+Function:   NeedsCompaction
+Purpose:    checks if enough enrolled rows are removed to be worth compacting
+Notes:      
+Throws
+returns:    true once GALLERY_COMPACT_RATIO of the enrolled rows are removed
+*/
+bool Gallery::NeedsCompaction() const
+{
+   return m_nEnrolledRemoved > 0 && m_nEnrolledRemoved >= m_nEnrolled * GALLERY_COMPACT_RATIO;
+}
+
+
+
+/*
+Function:   Compact
+Purpose:    drops the removed enrolled rows
+Notes:      the enrolled rows left are copied into new chunks in order, so their ids stay in increasing
+            order.  Nothing is written, the gallery file never has the removed enrolled classes.  Removed
+            trained rows are left, they are rows of the model
+Throws
+returns:    void
+*/
+void Gallery::Compact()
+{
+   std::vector< cv::Ptr<GalleryChunk> > chunks;
+   GalleryChunk* live = NULL;
+
+   for ( int c = 0; c < (int)m_Chunks.size(); c++ )
+   {
+      const GalleryChunk& chunk = *m_Chunks[c];
+      for ( int i = 0; i < chunk.m_nRows; i++ )
+      {
+         if ( chunk.m_Removed[i] )
+            continue;
+
+         if ( !live || live->m_nRows == GALLERY_CHUNK_ROWS )
+         {
+            chunks.push_back( cv::Ptr<GalleryChunk>( new GalleryChunk( m_Stride ) ) );
+            live = chunks.back();
+         }
+
+         int n = live->m_nRows++;
+         memcpy( live->m_Rows + (size_t)n * m_Stride, chunk.m_Rows + (size_t)i * m_Stride, m_Stride * sizeof(float) );
+         live->m_IDs[n] = chunk.m_IDs[i];
+         live->m_Names[n] = chunk.m_Names[i];
+         live->m_Thresholds[n] = chunk.m_Thresholds[i];
+         live->m_Removed[n] = 0;
+      }
+   }
+
+   m_nEnrolled -= m_nEnrolledRemoved;
+   m_nEnrolledRemoved = 0;
+   m_Chunks.swap( chunks );
+   m_OwnsChunk.assign( m_Chunks.size(), 1 );
+}
+
+
+
+/*
+Function:   Find
+Purpose:    finds the row of a class
+Notes:      scans the ids, it is for changing the gallery not for searching
+Throws
+returns:    the row, -1 if id is not in the gallery or was removed
+*/
+int Gallery::Find( personIDType id ) const
+{
+   for ( int row = 0; row < m_nTrained; row++ )
+   {
+      if ( m_TrainedIDs[row] == id )
+         return (*m_TrainedRemoved)[row] ? -1 : row;
+   }
+
+   for ( int c = 0; c < (int)m_Chunks.size(); c++ )
+   {
+      const GalleryChunk& chunk = *m_Chunks[c];
+      for ( int i = 0; i < chunk.m_nRows; i++ )
+      {
+         if ( chunk.m_IDs[i] == id )
+            return chunk.m_Removed[i] ? -1 : m_nTrained + c * GALLERY_CHUNK_ROWS + i;
+      }
+   }
+
+   return -1;
+}
+
+
+
+/*
+Function:   Removed
+Purpose:    checks if a row was removed
+Notes:
+Throws
+returns:    true if it was
+*/
+bool Gallery::Removed( int row ) const
+{
+   if ( row < m_nTrained )
+      return (*m_TrainedRemoved)[row] != 0;
+   row -= m_nTrained;
+   return m_Chunks[row / GALLERY_CHUNK_ROWS]->m_Removed[row % GALLERY_CHUNK_ROWS] != 0;
+}
+
+
+
+/*
+Function:   Row
+Purpose:    a trained or enrolled row
+Notes:
+Throws
+returns:    Stride() floats, FisherFaces() of them used and the rest zero
+*/
+const float* Gallery::Row( int row ) const
+{
+   if ( row < m_nTrained )
+      return m_TrainedRows + (size_t)row * m_Stride;
+   row -= m_nTrained;
+   return m_Chunks[row / GALLERY_CHUNK_ROWS]->m_Rows + (size_t)(row % GALLERY_CHUNK_ROWS) * m_Stride;
+}
+
+
+
+/*
+Function:   ID
+Purpose:    person id of a row
+Notes:
+Throws
+returns:    the id
+*/
+personIDType Gallery::ID( int row ) const
+{
+   if ( row < m_nTrained )
+      return m_TrainedIDs[row];
+   row -= m_nTrained;
+   return m_Chunks[row / GALLERY_CHUNK_ROWS]->m_IDs[row % GALLERY_CHUNK_ROWS];
+}
+
+
+
+/*
+Function:   Name
+Purpose:    person name of a row
+Notes:      a trained name points into the model, an enrolled name is valid while the gallery is
+Throws
+returns:    nul terminated name
+*/
+const char* Gallery::Name( int row ) const
+{
+   if ( row < m_nTrained )
+      return m_Model->String( MODEL_SECTION_NAMES, row );
+   row -= m_nTrained;
+   return m_Chunks[row / GALLERY_CHUNK_ROWS]->m_Names[row % GALLERY_CHUNK_ROWS].c_str();
+}
+
+
+
+/*
+Function:   Threshold
+Purpose:    largest distance of one of a row's images from its centroid
+Notes:
+Throws
+returns:    the squared distance
+*/
+float Gallery::Threshold( int row ) const
+{
+   if ( row < m_nTrained )
+      return m_TrainedThresholds[row];
+   row -= m_nTrained;
+   return m_Chunks[row / GALLERY_CHUNK_ROWS]->m_Thresholds[row % GALLERY_CHUNK_ROWS];
+}
+
+
+
+/*
+Function:   Append
+Purpose:    adds an enrolled row in memory
+Notes:      the row goes at the end of the last chunk, or a new chunk when it is full.  The row is zero
+            padded to the stride
+Throws      std::string if it can't allocate memory
+returns:    void
+*/
+void Gallery::Append( personIDType id, const std::string& name, const float* centroid, float threshold )
+{
+   if ( m_Chunks.empty() || m_Chunks.back()->m_nRows == GALLERY_CHUNK_ROWS )
+   {
+      m_Chunks.push_back( cv::Ptr<GalleryChunk>( new GalleryChunk( m_Stride ) ) );
+      m_OwnsChunk.push_back( 1 );
+   }
+
+   GalleryChunk& chunk = WritableChunk( (int)m_Chunks.size() - 1 );
+   int n = chunk.m_nRows;
+   float* row = chunk.m_Rows + (size_t)n * m_Stride;
+   memcpy( row, centroid, m_nFisherFaces * sizeof(float) );
+   memset( row + m_nFisherFaces, 0, (m_Stride - m_nFisherFaces) * sizeof(float) );
+
+   chunk.m_IDs[n] = id;
+   chunk.m_Names[n] = name;
+   chunk.m_Thresholds[n] = threshold;
+   chunk.m_Removed[n] = 0;
+   chunk.m_nRows++;
+   m_nEnrolled++;
+
+   if ( id >= m_NextID )
+      m_NextID = id + 1;
+}
+
+
+
+/*
+Function:   SetRemoved
+Purpose:    sets or clears the removed flag of a row
+Notes:      keeps the removed counts.  The trained flags or the row's chunk are copied first if they are
+            shared with another gallery
+Throws      std::string if it can't allocate memory
+returns:    void
+*/
+void Gallery::SetRemoved( int row, uchar removed )
+{
+   if ( row < m_nTrained )
+   {
+      if ( !m_OwnsTrainedRemoved )
+      {
+         m_TrainedRemoved = cv::Ptr< std::vector<uchar> >( new std::vector<uchar>( *m_TrainedRemoved ) );
+         m_OwnsTrainedRemoved = true;
+      }
+
+      uchar& flag = (*m_TrainedRemoved)[row];
+      m_nTrainedRemoved += (int)removed - (int)flag;
+      flag = removed;
+      return;
+   }
+
+   row -= m_nTrained;
+   GalleryChunk& chunk = WritableChunk( row / GALLERY_CHUNK_ROWS );
+   uchar& flag = chunk.m_Removed[row % GALLERY_CHUNK_ROWS];
+   chunk.m_nRemoved += (int)removed - (int)flag;
+   m_nEnrolledRemoved += (int)removed - (int)flag;
+   flag = removed;
+}
+
+
+
+/*
+Function:   WritableChunk
+Purpose:    a chunk this gallery can change
+Notes:      a chunk shared with the gallery this one was copied from is copied the first time, later
+            changes to it change the copy
+Throws      std::string if it can't allocate memory
+returns:    the chunk
+*/
+GalleryChunk& Gallery::WritableChunk( int chunk )
+{
+   if ( !m_OwnsChunk[chunk] )
+   {
+      m_Chunks[chunk] = cv::Ptr<GalleryChunk>( new GalleryChunk( *m_Chunks[chunk] ) );
+      m_OwnsChunk[chunk] = 1;
+   }
+
+   return *m_Chunks[chunk];
+}
+
+
+
+/*
+Function:   Save
+Purpose:    writes the removed trained classes and every enrolled class left to m_FileName
+Notes:      written next to m_FileName, synced, then renamed and the directory synced, so the file is never
+            half written and the rename survives a crash.  The
+            next id is stored so an id is not handed out again after the class with the largest id is removed
+Throws      std::string if the file can't be written
+returns:    void
+*/
+void Gallery::Save() const
+{
+   std::string tempname = m_FileName;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "Gallery::Save could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   int header[6] = { GALLERY_MAGIC, GALLERY_VERSION, m_nFisherFaces, m_NextID, m_nTrainedRemoved, m_nEnrolled - m_nEnrolledRemoved };
+   out.write( (const char*)header, sizeof(header) );
+   out.write( (const char*)&m_Sequence, sizeof(uint64) );
+   out.write( (const char*)&m_Model->Header().m_ModelID, sizeof(uint64) );
+
+   for ( int row = 0; row < m_nTrained; row++ )
+   {
+      if ( (*m_TrainedRemoved)[row] )
+         out.write( (const char*)&m_TrainedIDs[row], sizeof(personIDType) );
+   }
+
+   for ( int c = 0; c < (int)m_Chunks.size(); c++ )
+   {
+      const GalleryChunk& chunk = *m_Chunks[c];
+      for ( int i = 0; i < chunk.m_nRows; i++ )
+      {
+         if ( chunk.m_Removed[i] )
+            continue;
+
+         int length = (int)chunk.m_Names[i].size();
+         out.write( (const char*)&chunk.m_IDs[i], sizeof(personIDType) );
+         out.write( (const char*)&chunk.m_Thresholds[i], sizeof(float) );
+         out.write( (const char*)&length, sizeof(int) );
+         out.write( chunk.m_Names[i].data(), length );
+         out.write( (const char*)( chunk.m_Rows + (size_t)i * m_Stride ), m_nFisherFaces * sizeof(float) );
+      }
+   }
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "Gallery::Save could not write ";
+      err += tempname;
+      throw err;
+   }
+
+   SyncFile( tempname.c_str() );
+#ifdef _WIN32
+   remove(m_FileName.c_str());
+#endif
+   if ( rename(tempname.c_str(), m_FileName.c_str()) != 0 )
+   {
+      std::string err = "Gallery::Save could not rename ";
+      err += tempname;
+      throw err;
+   }
+   SyncDirectory( m_FileName.c_str() );
+}
+
+
+
+/*
+Function:   Load
+Purpose:    reads the enrolled classes from m_FileName
+Notes:      a removed id has to be a trained class, enrolled ids have to be larger than every id before them.
+            The gallery has to have been written with this model, not an earlier training of the database
+            with the same number of fisherfaces.  A name can't be longer than the rest of the file
+Throws      std::string if the file is not a gallery of this model or an id is already used
+returns:    void
+*/
+void Gallery::Load()
+{
+   std::string err = "Gallery::Load - not a valid gallery for this database: ";
+   err += m_FileName;
+
+   std::ifstream in(m_FileName.c_str(), std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      throw err;
+
+   in.seekg( 0, std::ios::end );
+   std::streamoff fileSize = in.tellg();
+   in.seekg( 0, std::ios::beg );
+
+   int header[6];
+   uint64 modelID = 0;
+   in.read( (char*)header, sizeof(header) );
+   in.read( (char*)&m_Sequence, sizeof(uint64) );
+   in.read( (char*)&modelID, sizeof(uint64) );
+   if ( !in || header[0] != GALLERY_MAGIC || header[1] != GALLERY_VERSION || header[2] != m_nFisherFaces || header[4] < 0 || header[5] < 0 )
+      throw err;
+   if ( modelID != m_Model->Header().m_ModelID )
+   {
+      err = "Gallery::Load - the gallery was enrolled into another training of the database: ";
+      err += m_FileName;
+      throw err;
+   }
+
+   for ( int i = 0; i < header[4]; i++ )
+   {
+      personIDType id;
+      in.read( (char*)&id, sizeof(personIDType) );
+      int row = in ? Find( id ) : -1;
+      if ( row == -1 || row >= m_nTrained )
+         throw err;
+      SetRemoved( row, 1 );
+   }
+
+   std::vector<float> centroid( m_nFisherFaces );
+   for ( int i = 0; i < header[5]; i++ )
+   {
+      personIDType id;
+      float threshold;
+      int length;
+      in.read( (char*)&id, sizeof(personIDType) );
+      in.read( (char*)&threshold, sizeof(float) );
+      in.read( (char*)&length, sizeof(int) );
+      if ( !in || id < m_NextID || length < 0 || length > fileSize - (std::streamoff)in.tellg() )
+         throw err;
+
+      std::string name( length, ' ' );
+      if ( length )
+         in.read( &name[0], length );
+      in.read( (char*)&centroid[0], m_nFisherFaces * sizeof(float) );
+      if ( !in )
+         throw err;
+
+      Append( id, name, &centroid[0], threshold );
+   }
+
+   if ( header[3] > m_NextID )
+      m_NextID = header[3];
+}
@@ -0,0 +1,161 @@
+#ifndef GALLERY_H
+#define GALLERY_H
+
+/*
+   Gallery.h
+   Description:   the classes a recognizer searches, the trained classes of the database followed by the
+                  classes enrolled since it was trained.  The trained classes stay in the mapped model,
+                  enrolled classes are kept in memory.  Changes are made with Apply, one GalleryLog record
+                  at a time, the recognizer logs them and checkpoints the gallery as <database>.gallery
+                  so it is loaded again with the database.
+
+   Layout:        GALLERY_MAGIC, GALLERY_VERSION, fisherfaces, next person id, number of trained classes
+                  removed, number of enrolled classes, sequence of the last log record applied as a
+                  uint64, the model's m_ModelID, then the ids of the trained classes removed, then
+                  each enrolled class's id, threshold, name as its length and characters, and fisherfaces
+                  floats of centroid.  Removed enrolled classes are not written
+
+   Notes:         rows are numbered trained first then enrolled, so row numbers from a search of the
+                  trained rows, like an index search, are gallery rows.  Enrolled rows are kept in chunks
+                  of GALLERY_CHUNK_ROWS, padded to the model's centroid stride and MODEL_FILE_ALIGN aligned,
+                  the same as the trained rows, so the distance kernel can scan a chunk at a time.  Training
+                  the database again removes the gallery file, enrolled classes belong to the fisher space
+                  they were projected into, and its log.
+                  A gallery a recognizer has published is never changed, it is copied and the copy
+                  changed then published in its place, so searches can keep reading the one they have.
+                  The copy shares the chunks and the trained removed flags, it copies a chunk or the flags
+                  only when it changes them, so a change copies one chunk not every enrolled row.
+                  A removed class is a tombstone, its row stays where it is and is marked in TrainedRemoved
+                  or its chunk's m_Removed so searches skip it.  Trained rows stay tombstones until the database
+                  is trained again, the indexes are built over them.  Enrolled rows are dropped by Compact
+*/
+
+#include "Utilities.h"
+#include "ModelFile.h"
+#include "GalleryLog.h"
+#include <vector>
+
+
+#define GALLERY_MAGIC            0x59524C47     // "GLRY"
+#define GALLERY_VERSION          4
+#define GALLERY_CHUNK_ROWS       256            // enrolled rows in a chunk, a change copies only the chunk it is in
+#define GALLERY_COMPACT_RATIO    0.25           // fraction of the enrolled rows removed before they are compacted
+
+
+// <database>.gallery
+std::string GalleryFileName( const char* database );
+
+
+/*
+   GalleryChunk holds GALLERY_CHUNK_ROWS enrolled classes.  Every gallery copied from the one that made it
+   shares it, so once a gallery with it is published it is never changed, a gallery changing it changes
+   a copy of its own.  Every chunk of a gallery is full but the last
+*/
+struct GalleryChunk
+{
+   int                        m_Stride;      // floats per row
+   int                        m_nRows;
+   int                        m_nRemoved;
+   void*                      m_Block;       // allocation holding m_Rows
+   float*                     m_Rows;        // room for GALLERY_CHUNK_ROWS rows, MODEL_FILE_ALIGN aligned
+   personIDType               m_IDs[GALLERY_CHUNK_ROWS];
+   float                      m_Thresholds[GALLERY_CHUNK_ROWS];
+   uchar                      m_Removed[GALLERY_CHUNK_ROWS];   // 1 for each row removed
+   std::string                m_Names[GALLERY_CHUNK_ROWS];
+
+   GalleryChunk( int stride );
+   GalleryChunk( const GalleryChunk& chunk );
+   ~GalleryChunk();
+
+   const uchar*   Removed() const         { return m_nRemoved ? m_Removed : NULL; }
+
+private:
+   /// Not implemented
+   GalleryChunk& operator=(const GalleryChunk&);
+
+   void Allocate();
+};
+
+
+class Gallery
+{
+public:
+   Gallery();
+   Gallery( const Gallery& gallery );
+   ~Gallery();
+
+   // the trained classes of model, which has to stay open, and the classes enrolled in filename if it exists
+   void Open( const ModelFile& model, const char* filename );
+
+   // enrolls or removes a class, a removed class is only marked.  An enrolled class takes the record's id,
+   // which has to be NextID() or larger.  Throws std::string if the record can't be applied, then the
+   // gallery is left as it was
+   void Apply( const GalleryLogRecord& record );
+
+   // writes the gallery to the file it was opened from.  Throws std::string if it can't
+   void Save() const;
+
+   // drops the removed enrolled rows so the rest are dense again, this renumbers the enrolled rows
+   void Compact();
+   bool NeedsCompaction() const;
+
+   // row of the class with id, -1 if there is none or it was removed
+   int            Find( personIDType id ) const;
+
+   personIDType   NextID() const          { return m_NextID; }
+   uint64         Sequence() const        { return m_Sequence; }
+
+   int            Size() const            { return m_nTrained + m_nEnrolled; }
+   int            Live() const            { return Size() - m_nTrainedRemoved - m_nEnrolledRemoved; }
+   int            Trained() const         { return m_nTrained; }
+   int            Enrolled() const        { return m_nEnrolled; }
+   int            FisherFaces() const     { return m_nFisherFaces; }
+   int            Stride() const          { return m_Stride; }
+
+   // Trained() rows each Stride() floats apart, then the Enrolled() rows in chunks of GALLERY_CHUNK_ROWS,
+   // gallery row Trained() + chunk * GALLERY_CHUNK_ROWS + i is row i of the chunk
+   const float*         TrainedRows() const     { return m_TrainedRows; }
+   int                  Chunks() const          { return (int)m_Chunks.size(); }
+   const GalleryChunk&  Chunk( int chunk ) const { return *m_Chunks[chunk]; }
+   const float*         Row( int row ) const;
+
+   // one flag per trained row, set if it was removed.  NULL if none were removed
+   const uchar*   TrainedRemoved() const  { return m_nTrainedRemoved ? &(*m_TrainedRemoved)[0] : NULL; }
+   bool           Removed( int row ) const;
+
+   personIDType   ID( int row ) const;
+   const char*    Name( int row ) const;
+   float          Threshold( int row ) const;
+
+private:
+   /// Not implemented, copy construct a new gallery instead
+   Gallery& operator=(const Gallery&);
+
+   void Append( personIDType id, const std::string& name, const float* centroid, float threshold );
+   void SetRemoved( int row, uchar removed );
+   GalleryChunk& WritableChunk( int chunk );
+   void Load();
+
+   std::string                m_FileName;
+   const ModelFile*           m_Model;
+   int                        m_nFisherFaces;
+   int                        m_Stride;            // floats per row
+   personIDType               m_NextID;            // one more than the largest id in the gallery
+   uint64                     m_Sequence;          // last log record applied
+
+   int                        m_nTrained;
+   const float*               m_TrainedRows;       // in the model
+   const personIDType*        m_TrainedIDs;
+   const float*               m_TrainedThresholds;
+   int                        m_nTrainedRemoved;
+   cv::Ptr< std::vector<uchar> > m_TrainedRemoved; // 1 for each trained row removed, shared with the gallery copied
+   bool                       m_OwnsTrainedRemoved; // false until this gallery copies m_TrainedRemoved to change it
+
+   int                        m_nEnrolled;
+   int                        m_nEnrolledRemoved;
+   std::vector< cv::Ptr<GalleryChunk> > m_Chunks;
+   std::vector<uchar>         m_OwnsChunk;         // 1 for each chunk this gallery made or copied, it can change them
+};
+
+
+#endif
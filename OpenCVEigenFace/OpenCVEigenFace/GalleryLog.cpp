@@ -0,0 +1,726 @@
+#include "GalleryLog.h"
+#include "StageCache.h"
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+
+
+#define GALLERY_LOG_RECORD_HEADER   (sizeof(uint64) + 2 * sizeof(int))     // sequence, type, payload size
+
+
+
+/*
+Function:   GalleryLogFileName
+Purpose:    where the changes made to a database's gallery since its last checkpoint are logged
+Notes:
+Throws
+returns:    <database>.gallery.log
+*/
+std::string GalleryLogFileName( const char* database )
+{
+   std::string name = database;
+   name += ".gallery.log";
+   return name;
+}
+
+
+
+/*
+Function:   OpenDescriptor
+Purpose:    opens a file for the low level writes the log needs
+Notes:      the streams can't sync a file to disk, a descriptor can
+Throws
+returns:    the descriptor, -1 if it can't be opened
+*/
+static int OpenDescriptor( const char* filename, bool append )
+{
+#ifdef _WIN32
+   return _open( filename, ( append ? _O_WRONLY | _O_APPEND : _O_RDWR ) | _O_BINARY );
+#else
+   return open( filename, append ? O_WRONLY | O_APPEND : O_RDWR );
+#endif
+}
+
+
+
+/*
+Function:   SyncDescriptor
+Purpose:    waits until everything written to a descriptor is on disk
+Notes:
+Throws
+returns:    false if it fails
+*/
+static bool SyncDescriptor( int file )
+{
+#ifdef _WIN32
+   return _commit( file ) == 0;
+#else
+   return fsync( file ) == 0;
+#endif
+}
+
+
+
+/*
+Function:   CloseDescriptor
+Purpose:
+Notes:
+Throws
+returns:    void
+*/
+static void CloseDescriptor( int file )
+{
+#ifdef _WIN32
+   _close( file );
+#else
+   close( file );
+#endif
+}
+
+
+
+/*
+Function:   LockDescriptor
+Purpose:    takes an exclusive advisory lock on an open file without waiting for it
+Notes:      the lock is held until the descriptor is closed.  It is taken per open file, so a second
+            open of the same file is refused the lock from this process as well as from another
+Throws
+returns:    false if another open of the file holds the lock
+*/
+static bool LockDescriptor( int file )
+{
+#ifdef _WIN32
+   OVERLAPPED overlapped;
+   memset( &overlapped, 0, sizeof(overlapped) );
+   return LockFileEx( (HANDLE)_get_osfhandle( file ), LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped ) != 0;
+#else
+   return flock( file, LOCK_EX | LOCK_NB ) == 0;
+#endif
+}
+
+
+
+/*
+Function:   SyncFile
+Purpose:    flushes a file that was written with a stream to disk
+Notes:      called before a finished file is renamed onto its real name, so a crash can't leave the
+            real name holding a file that was never written out
+Throws      std::string if the file can't be opened or synced
+returns:    void
+*/
+void SyncFile( const char* filename )
+{
+   int file = OpenDescriptor( filename, false );
+   bool synced = file != -1 && SyncDescriptor( file );
+   if ( file != -1 )
+      CloseDescriptor( file );
+
+   if ( !synced )
+   {
+      std::string err = "SyncFile could not sync ";
+      err += filename;
+      throw err;
+   }
+}
+
+
+
+/*
+Function:   SyncDirectory
+Purpose:    flushes the directory a file was renamed into to disk
+Notes:      a rename only changes the directory, until the directory is synced a crash can bring back
+            the old file under the name.  Windows can't open a directory as a file, NTFS journals the
+            rename itself, so there it does nothing
+Throws      std::string if the directory can't be opened or synced
+returns:    void
+*/
+void SyncDirectory( const char* filename )
+{
+#ifndef _WIN32
+   std::string directory = filename;
+   size_t slash = directory.find_last_of( '/' );
+   if ( slash == std::string::npos )
+      directory = ".";
+   else
+      directory.erase( slash ? slash : 1 );
+
+   int file = open( directory.c_str(), O_RDONLY );
+   bool synced = file != -1 && fsync( file ) == 0;
+   if ( file != -1 )
+      close( file );
+
+   if ( !synced )
+   {
+      std::string err = "SyncDirectory could not sync ";
+      err += directory;
+      throw err;
+   }
+#endif
+}
+
+
+
+/*
+Function:   PutBytes
+Purpose:    appends bytes to a buffer
+Notes:
+Throws
+returns:    void
+*/
+static void PutBytes( std::vector<char>& buffer, const void* data, size_t bytes )
+{
+   const char* p = (const char*)data;
+   buffer.insert( buffer.end(), p, p + bytes );
+}
+
+
+
+/*
+Function:   GetBytes
+Purpose:    reads bytes from a buffer
+Notes:
+Throws
+returns:    false if the buffer ends first
+*/
+static bool GetBytes( const std::vector<char>& buffer, size_t& pos, size_t end, void* data, size_t bytes )
+{
+   if ( end - pos < bytes )
+      return false;
+
+   memcpy( data, &buffer[pos], bytes );
+   pos += bytes;
+   return true;
+}
+
+
+
+/*
+Function:   RecordChecksum
+Purpose:    checksum of a record's header and payload
+Notes:
+Throws
+returns:    the checksum
+*/
+static uint64 RecordChecksum( uint64 sequence, int type, int bytes, const char* payload )
+{
+   StageHash checksum;
+   checksum.Add( sequence );
+   checksum.Add( type );
+   checksum.Add( bytes );
+   checksum.Add( payload, bytes );
+   return checksum.Value();
+}
+
+
+
+/*
+Function:   PutRecord
+Purpose:    appends a record as it is stored in the log
+Notes:      see GalleryLog.h for the layout
+Throws
+returns:    void
+*/
+static void PutRecord( const GalleryLogRecord& record, int nFisherFaces, std::vector<char>& buffer )
+{
+   std::vector<char> payload;
+   PutBytes( payload, &record.m_ID, sizeof(personIDType) );
+
+   if ( record.m_Type == GALLERY_LOG_ENROLL )
+   {
+      int length = (int)record.m_Name.size();
+      PutBytes( payload, &record.m_Threshold, sizeof(float) );
+      PutBytes( payload, &length, sizeof(int) );
+      PutBytes( payload, record.m_Name.data(), length );
+      PutBytes( payload, &record.m_Centroid[0], nFisherFaces * sizeof(float) );
+   }
+
+   int bytes = (int)payload.size();
+   uint64 checksum = RecordChecksum( record.m_Sequence, record.m_Type, bytes, &payload[0] );
+
+   PutBytes( buffer, &record.m_Sequence, sizeof(uint64) );
+   PutBytes( buffer, &record.m_Type, sizeof(int) );
+   PutBytes( buffer, &bytes, sizeof(int) );
+   PutBytes( buffer, &payload[0], bytes );
+   PutBytes( buffer, &checksum, sizeof(uint64) );
+}
+
+
+
+/*
+Function:   GetRecord
+Purpose:    reads the record at pos
+Notes:      pos is only moved past a whole record whose checksum matches
+Throws
+returns:    false if the record is torn, corrupt or not a record of a gallery with nFisherFaces
+*/
+static bool GetRecord( const std::vector<char>& buffer, size_t& pos, int nFisherFaces, GalleryLogRecord& record )
+{
+   size_t next = pos;
+   int bytes = 0;
+
+   if ( !GetBytes( buffer, next, buffer.size(), &record.m_Sequence, sizeof(uint64) ) ||
+        !GetBytes( buffer, next, buffer.size(), &record.m_Type, sizeof(int) ) ||
+        !GetBytes( buffer, next, buffer.size(), &bytes, sizeof(int) ) ||
+        bytes < (int)sizeof(personIDType) || buffer.size() - next < bytes + sizeof(uint64) )
+      return false;
+
+   size_t payload = next;
+   size_t end = next + bytes;
+   uint64 checksum;
+   next = end;
+   GetBytes( buffer, next, buffer.size(), &checksum, sizeof(uint64) );
+   if ( checksum != RecordChecksum( record.m_Sequence, record.m_Type, bytes, &buffer[payload] ) )
+      return false;
+
+   GetBytes( buffer, payload, end, &record.m_ID, sizeof(personIDType) );
+
+   if ( record.m_Type == GALLERY_LOG_ENROLL )
+   {
+      int length = 0;
+      if ( !GetBytes( buffer, payload, end, &record.m_Threshold, sizeof(float) ) ||
+           !GetBytes( buffer, payload, end, &length, sizeof(int) ) ||
+           length < 0 || end - payload != length + nFisherFaces * sizeof(float) )
+         return false;
+
+      record.m_Name.assign( &buffer[payload], length );
+      payload += length;
+      record.m_Centroid.resize( nFisherFaces );
+      GetBytes( buffer, payload, end, &record.m_Centroid[0], nFisherFaces * sizeof(float) );
+   }
+   else if ( record.m_Type != GALLERY_LOG_REMOVE || payload != end )
+   {
+      return false;
+   }
+
+   pos = next;
+   return true;
+}
+
+
+
+/*
+Function:   GalleryLog constructor
+Purpose:
+Notes:      Open has to be called before anything else
+Throws
+*/
+GalleryLog::GalleryLog() : m_nFisherFaces(0), m_ModelID(0), m_bReadOnly(true), m_LockFile(-1), m_File(-1), m_bFailed(true), m_Appended(0),
+   m_Durable(0), m_nRecords(0)
+{
+}
+
+
+
+/*
+Function:   GalleryLog destructor
+Purpose:    closes the log and gives up the lock on it
+Notes:      every record committed is already on disk
+Throws
+*/
+GalleryLog::~GalleryLog()
+{
+   Close();
+   Unlock();
+}
+
+
+
+/*
+Function:   Open
+Purpose:    reads a log and opens it to append more records
+Notes:      the records numbered sequence or less are already in the gallery file and are counted but not
+            returned.  A log that does not exist is created empty.  The lock file is locked before the
+            log is read, so only one GalleryLog in any process writes the log at a time.
+            A read only log never writes or locks anything, a missing log has no records and the records
+            before a torn one are returned.  Nothing can be appended to it
+Throws      std::string if filename is not a gallery log, is the log of a gallery with a different number
+            of fisherfaces or of another model, can't be created or is locked by another GalleryLog
+returns:    false if the log ends in a torn record
+*/
+bool GalleryLog::Open( const char* filename, int nFisherFaces, uint64 modelID, uint64 sequence, std::vector<GalleryLogRecord>& records,
+                       bool readOnly )
+{
+   Close();
+   Unlock();
+
+   m_FileName = filename;
+   m_ModelID = modelID;
+   m_bReadOnly = readOnly;
+   m_nFisherFaces = nFisherFaces;
+   m_Buffer.clear();
+   m_Appended = sequence;
+   m_Durable = sequence;
+   m_nRecords = 0;
+   records.clear();
+   m_bFailed = true;
+
+   if ( !m_bReadOnly )
+      LockLog();
+
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+   {
+      if ( !m_bReadOnly )
+         Reset( sequence );
+      return true;
+   }
+
+   std::vector<char> data( (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>() );
+   in.close();
+
+   std::string err = "GalleryLog::Open - not a log of this gallery: ";
+   err += filename;
+
+   int header[3];
+   uint64 logModelID = 0;
+   size_t pos = 0;
+   if ( !GetBytes( data, pos, data.size(), header, sizeof(header) ) ||
+        !GetBytes( data, pos, data.size(), &logModelID, sizeof(uint64) ) )
+      return false;
+   if ( header[0] != GALLERY_LOG_MAGIC || header[1] != GALLERY_LOG_VERSION || header[2] != nFisherFaces )
+      throw err;
+   if ( logModelID != modelID )
+   {
+      err = "GalleryLog::Open - the log was written for another training of the database: ";
+      err += filename;
+      throw err;
+   }
+
+   bool whole = true;
+   while ( pos < data.size() )
+   {
+      GalleryLogRecord record;
+      if ( !GetRecord( data, pos, nFisherFaces, record ) )
+      {
+         whole = false;
+         break;
+      }
+
+      m_nRecords++;
+      if ( record.m_Sequence > m_Appended )
+      {
+         m_Appended = record.m_Sequence;
+         records.push_back( record );
+      }
+   }
+   m_Durable = m_Appended;
+
+   m_bFailed = !whole || m_bReadOnly;
+   if ( !m_bFailed )
+      OpenForAppend();
+
+   return whole;
+}
+
+
+
+/*
+Function:   Append
+Purpose:    adds a record to the log
+Notes:      the record is only buffered, it is not on disk until Commit
+Throws      std::string if the log can't be appended to
+returns:    the record's sequence number
+*/
+uint64 GalleryLog::Append( GalleryLogRecord& record )
+{
+   ScopedLock buffer( m_BufferLock );
+
+   if ( m_bFailed )
+   {
+      std::string err = m_bReadOnly ? "GalleryLog::Append - the log was opened read only: " :
+                                      "GalleryLog::Append - the log can't be written, open the database again: ";
+      err += m_FileName;
+      throw err;
+   }
+
+   record.m_Sequence = m_Appended + 1;
+   PutRecord( record, m_nFisherFaces, m_Buffer );
+
+   m_Appended = record.m_Sequence;
+   m_nRecords++;
+   return m_Appended;
+}
+
+
+
+/*
+Function:   Commit
+Purpose:    makes a record durable
+Notes:      the thread that gets m_CommitLock writes everything buffered with one sync.  Threads that
+            waited for it find their records already on disk and return without writing, or write
+            everything buffered while they waited with the next sync
+Throws      std::string if the records can't be written
+returns:    void
+*/
+void GalleryLog::Commit( uint64 sequence )
+{
+   {
+      ScopedLock buffer( m_BufferLock );
+      if ( m_Durable >= sequence )
+         return;
+   }
+
+   ScopedLock committing( m_CommitLock );
+
+   std::vector<char> pending;
+   uint64 last = 0;
+   {
+      ScopedLock buffer( m_BufferLock );
+      if ( m_Durable >= sequence )
+         return;
+      if ( m_bFailed )
+      {
+         std::string err = "GalleryLog::Commit - the log can't be written: ";
+         err += m_FileName;
+         throw err;
+      }
+
+      pending.swap( m_Buffer );
+      last = m_Appended;
+   }
+
+   try
+   {
+      Write( pending );
+   }
+   catch (...)
+   {
+      ScopedLock buffer( m_BufferLock );
+      m_bFailed = true;
+      throw;
+   }
+
+   ScopedLock buffer( m_BufferLock );
+   m_Durable = last;
+}
+
+
+
+/*
+Function:   Reset
+Purpose:    replaces the log with an empty one
+Notes:      called once the gallery up to record sequence is in the gallery file.  Records still
+            buffered are dropped, they are in the gallery file so their commits return at once.
+            The empty log is written next to the log then renamed, so a crash leaves the old log or
+            the empty one
+Throws      std::string if the log can't be written or was opened read only
+returns:    void
+*/
+void GalleryLog::Reset( uint64 sequence )
+{
+   if ( m_bReadOnly )
+   {
+      std::string err = "GalleryLog::Reset - the log was opened read only: ";
+      err += m_FileName;
+      throw err;
+   }
+
+   ScopedLock committing( m_CommitLock );
+   Close();
+
+   {
+      ScopedLock buffer( m_BufferLock );
+      m_Buffer.clear();
+      m_Appended = sequence;
+      m_Durable = sequence;
+      m_nRecords = 0;
+      m_bFailed = true;
+   }
+
+   std::string tempname = m_FileName;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   int header[3] = { GALLERY_LOG_MAGIC, GALLERY_LOG_VERSION, m_nFisherFaces };
+   out.write( (const char*)header, sizeof(header) );
+   out.write( (const char*)&m_ModelID, sizeof(uint64) );
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "GalleryLog::Reset could not write ";
+      err += tempname;
+      throw err;
+   }
+
+   SyncFile( tempname.c_str() );
+#ifdef _WIN32
+   remove(m_FileName.c_str());
+#endif
+   if ( rename(tempname.c_str(), m_FileName.c_str()) != 0 )
+   {
+      std::string err = "GalleryLog::Reset could not rename ";
+      err += tempname;
+      throw err;
+   }
+   SyncDirectory( m_FileName.c_str() );
+
+   OpenForAppend();
+
+   ScopedLock buffer( m_BufferLock );
+   m_bFailed = false;
+}
+
+
+
+/*
+Function:   Records
+Purpose:    size of the log, to know when to checkpoint
+Notes:
+Throws
+returns:    records in the log file and the buffer
+*/
+int GalleryLog::Records() const
+{
+   ScopedLock buffer( m_BufferLock );
+   return m_nRecords;
+}
+
+
+
+/*
+Function:   Durable
+Purpose:    how far the log is on disk, a change is only made visible once it is
+Notes:
+Throws
+returns:    sequence of the last record written and synced, or in the gallery file
+*/
+uint64 GalleryLog::Durable() const
+{
+   ScopedLock buffer( m_BufferLock );
+   return m_Durable;
+}
+
+
+
+/*
+Function:   OpenForAppend
+Purpose:    opens m_FileName to write records after the ones in it
+Notes:
+Throws      std::string if it can't be opened
+returns:    void
+*/
+void GalleryLog::OpenForAppend()
+{
+   m_File = OpenDescriptor( m_FileName.c_str(), true );
+   if ( m_File == -1 )
+   {
+      std::string err = "GalleryLog could not open ";
+      err += m_FileName;
+      throw err;
+   }
+}
+
+
+
+/*
+Function:   LockLog
+Purpose:    takes the exclusive lock on the log's lock file, <log>.lock
+Notes:      the lock file is never renamed or removed, the log itself is replaced by Reset and a lock
+            on the file replaced would not keep another GalleryLog from locking the new one.  Held until Unlock
+Throws      std::string if the lock file can't be opened or another GalleryLog holds the lock
+returns:    void
+*/
+void GalleryLog::LockLog()
+{
+   std::string lockname = m_FileName;
+   lockname += ".lock";
+
+#ifdef _WIN32
+   m_LockFile = _open( lockname.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+   m_LockFile = open( lockname.c_str(), O_RDWR | O_CREAT, 0666 );
+#endif
+   if ( m_LockFile == -1 )
+   {
+      std::string err = "GalleryLog could not open ";
+      err += lockname;
+      throw err;
+   }
+
+   if ( !LockDescriptor( m_LockFile ) )
+   {
+      Unlock();
+      std::string err = "GalleryLog::Open - the database is already open for changes by another recognizer: ";
+      err += m_FileName;
+      throw err;
+   }
+}
+
+
+
+/*
+Function:   Unlock
+Purpose:    gives up the lock on the log's lock file
+Notes:      closing the lock file releases the lock
+Throws
+returns:    void
+*/
+void GalleryLog::Unlock()
+{
+   if ( m_LockFile != -1 )
+   {
+      CloseDescriptor( m_LockFile );
+      m_LockFile = -1;
+   }
+}
+
+
+
+/*
+Function:   Close
+Purpose:    closes the log file
+Notes:
+Throws
+returns:    void
+*/
+void GalleryLog::Close()
+{
+   if ( m_File != -1 )
+   {
+      CloseDescriptor( m_File );
+      m_File = -1;
+   }
+}
+
+
+
+/*
+Function:   Write
+Purpose:    writes records to the end of the log and syncs it
+Notes:      called holding m_CommitLock
+Throws      std::string if the write or sync fails
+returns:    void
+*/
+void GalleryLog::Write( const std::vector<char>& data )
+{
+   std::string err = "GalleryLog could not write ";
+   err += m_FileName;
+
+   size_t written = 0;
+   while ( written < data.size() )
+   {
+#ifdef _WIN32
+      int n = _write( m_File, &data[written], (unsigned int)(data.size() - written) );
+#else
+      int n = (int)write( m_File, &data[written], data.size() - written );
+#endif
+      if ( n <= 0 )
+         throw err;
+      written += n;
+   }
+
+   if ( !SyncDescriptor( m_File ) )
+      throw err;
+}
@@ -0,0 +1,126 @@
+#ifndef GALLERYLOG_H
+#define GALLERYLOG_H
+
+/*
+   GalleryLog.h
+   Description:   append only log of the enrollments and removals made since the gallery was last
+                  checkpointed, stored as <database>.gallery.log.  A change costs one record appended
+                  to the log instead of writing the whole gallery, the gallery file is only written by
+                  a checkpoint, which then empties the log.  Opening the database replays the log onto
+                  the gallery file.
+
+   Layout:        GALLERY_LOG_MAGIC, GALLERY_LOG_VERSION, fisherfaces, the model's m_ModelID as a uint64, then records.  A record is its
+                  sequence number, type and payload size, the payload, then a StageHash checksum of all
+                  of them.  An enroll payload is the id, threshold, name as its length and characters and
+                  fisherfaces floats of centroid, a remove payload is the id
+
+   Notes:         records are numbered from 1 and never renumbered.  The gallery file stores the number
+                  of the last record it includes, so records left in the log by a crash after a checkpoint
+                  are skipped by the replay instead of applied twice.  A crash while appending leaves a
+                  torn record at the end, the replay stops at the first record that is short or fails its
+                  checksum and the database is checkpointed so the log is whole again.
+                  Group commit: Append only adds a record to a buffer.  Commit writes and syncs the
+                  buffer, every record appended by any thread up to then goes to disk with one sync, so
+                  threads committing at the same time share a sync instead of waiting for one each.
+                  A log opened to be written holds an exclusive advisory lock on <database>.gallery.log.lock
+                  until it is destroyed, so two recognizers, in one process or several, never append records
+                  with the same sequence numbers or reset the log under each other.  A log opened read only
+                  neither locks nor writes anything
+*/
+
+#include "Utilities.h"
+#include "Lock.h"
+#include <vector>
+
+
+#define GALLERY_LOG_MAGIC              0x474F4C47     // "GLOG"
+#define GALLERY_LOG_VERSION            2
+#define GALLERY_LOG_CHECKPOINT_RECORDS 4096           // records in the log before the gallery is checkpointed
+
+#define GALLERY_LOG_ENROLL             1
+#define GALLERY_LOG_REMOVE             2
+
+
+// <database>.gallery.log
+std::string GalleryLogFileName( const char* database );
+
+// flushes a written file to disk, throws std::string if it can't
+void SyncFile( const char* filename );
+
+// flushes the directory holding filename to disk after it was renamed, throws std::string if it can't
+void SyncDirectory( const char* filename );
+
+
+// one change to the gallery
+struct GalleryLogRecord
+{
+   uint64               m_Sequence;
+   int                  m_Type;              // GALLERY_LOG_ENROLL or GALLERY_LOG_REMOVE
+   personIDType         m_ID;
+   float                m_Threshold;         // enroll only
+   std::string          m_Name;              // enroll only
+   std::vector<float>   m_Centroid;          // enroll only, fisherfaces floats
+
+   GalleryLogRecord() : m_Sequence(0), m_Type(0), m_ID(0), m_Threshold(0.0f) {}
+};
+
+
+class GalleryLog
+{
+public:
+   GalleryLog();
+   ~GalleryLog();
+
+   // reads the records of filename numbered after sequence, creating the log if there is none and it is not readOnly
+   // returns false if the log ends in a torn record, then nothing can be appended until Reset
+   // throws std::string if filename is not a log of a gallery with nFisherFaces of the model modelID or another log has it open to write
+   bool   Open( const char* filename, int nFisherFaces, uint64 modelID, uint64 sequence, std::vector<GalleryLogRecord>& records,
+                bool readOnly = false );
+
+   // buffers record, setting its sequence number.  Throws std::string if an earlier write failed
+   uint64 Append( GalleryLogRecord& record );
+
+   // returns once record sequence and every one before it is on disk
+   // throws std::string if they can't be written, the log can't be appended to again
+   void   Commit( uint64 sequence );
+
+   // empties the log after the gallery up to record sequence was written, the next record is sequence + 1
+   // throws std::string if the log can't be written or is read only
+   void   Reset( uint64 sequence );
+
+   // records in the log file or buffered
+   int    Records() const;
+
+   // sequence of the last record on disk
+   uint64 Durable() const;
+
+private:
+   /// Not implemented, the log owns an open file
+   GalleryLog(const GalleryLog&);
+   GalleryLog& operator=(const GalleryLog&);
+
+   void   LockLog();
+   void   Unlock();
+   void   OpenForAppend();
+   void   Close();
+   void   Write( const std::vector<char>& data );
+
+   std::string          m_FileName;
+   int                  m_nFisherFaces;
+   uint64               m_ModelID;           // m_ModelID of the model the records were projected with
+   bool                 m_bReadOnly;         // never written, locked, appended to or reset
+   int                  m_LockFile;          // descriptor of <log>.lock holding the lock, -1 when not locked
+   int                  m_File;              // file descriptor, -1 when closed
+   bool                 m_bFailed;           // a write failed or the log is torn
+
+   mutable Lock         m_BufferLock;        // held to append to or take m_Buffer
+   std::vector<char>    m_Buffer;            // records appended but not yet written
+   uint64               m_Appended;          // sequence of the last record appended
+   uint64               m_Durable;           // sequence of the last record on disk
+   int                  m_nRecords;
+
+   Lock                 m_CommitLock;        // one thread writes and syncs at a time
+};
+
+
+#endif
@@ -0,0 +1,194 @@
+#include "GeneralizedEigen.h"
+#include "ParallelGEMM.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+
+#define GENERALIZED_EIGEN_PARALLEL_ROWS   64       // fewest rows before a Cholesky column is split between threads
+
+
+
+/*
+Function:   CholeskyFactor
+Purpose:    factors the symmetric matrix a = L L^T, L is lower triangular
+Notes:      a column of L at a time, each entry is a dot product of two rows of L so the reads are
+            contiguous.  The entries below the diagonal of a column don't depend on each other, so
+            long columns are split between threads.  The upper triangle of L is left as zeros
+Throws      std::string if a is not positive definite
+returns:    void
+*/
+static void CholeskyFactor( const CvMat* a, CvMat* L )
+{
+   int d = a->rows;
+   cvSetZero( L );
+
+   for ( int j = 0; j < d; j++ )
+   {
+      const double* Lj = L->data.db + (size_t)j * d;
+
+      double sum = a->data.db[(size_t)j * d + j];
+      for ( int k = 0; k < j; k++ )
+         sum -= Lj[k] * Lj[k];
+
+      if ( sum <= 0.0 )
+         throw std::string("SymmetricGeneralizedEigen - within class scatter is not positive definite");
+
+      double pivot = sqrt(sum);
+      L->data.db[(size_t)j * d + j] = pivot;
+
+#pragma omp parallel for schedule(static) if ( d - j > GENERALIZED_EIGEN_PARALLEL_ROWS )
+      for ( int i = j + 1; i < d; i++ )
+      {
+         double* Li = L->data.db + (size_t)i * d;
+
+         double dot = a->data.db[(size_t)i * d + j];
+         for ( int k = 0; k < j; k++ )
+            dot -= Li[k] * Lj[k];
+
+         Li[j] = dot / pivot;
+      }
+   }
+}
+
+
+
+/*
+Function:   SymmetricGeneralizedEigen
+Purpose:    the top generalized eigenvectors of Sb v = lambda Sw v
+Notes:      Sw = L L^T, then each between class row is whitened, w = L^-1 r.  The whitened rows W give
+            L^-1 Sb L^-T = W^T W, whose eigenvectors y are found from the smaller of W W^T and W^T W.
+            Each answer is v = L^-T y, which already has v^T Sw v = 1.
+            Nothing bigger than d x d is ever decomposed and no inverse is formed, only triangular solves
+Throws      std::string if the sizes are wrong or Sw is not positive definite
+returns:    void
+*/
+void SymmetricGeneralizedEigen( const CvMat* withinScatter, const CvMat* betweenFactor, CvMat* eigenVectors, CvMat* eigenValues )
+{
+   int d = withinScatter->rows;
+   int C = betweenFactor->rows;
+   int k = eigenVectors->rows;
+
+   if ( withinScatter->cols != d || betweenFactor->cols != d || eigenVectors->cols != d ||
+        k < 1 || k > std::min(C, d) || eigenValues->rows * eigenValues->cols != k )
+      throw std::string("SymmetricGeneralizedEigen - number of eigenvectors or matrix sizes are not valid");
+
+   // small problem is classes x classes when there are fewer classes than dimensions
+   bool classSide = C <= d;
+   int n = classSide ? C : d;
+
+   CvMat* a = cvCreateMat( d, d, CV_64FC1 );
+   CvMat* L = cvCreateMat( d, d, CV_64FC1 );
+   CvMat* whitened = cvCreateMat( C, d, CV_64FC1 );
+   CvMat* gram = cvCreateMat( n, n, CV_64FC1 );
+   CvMat* evects = cvCreateMat( n, n, CV_64FC1 );
+   CvMat* evals = cvCreateMat( n, 1, CV_64FC1 );
+   CvMat* rotation = cvCreateMat( k, C, CV_64FC1 );
+   CvMat* y = cvCreateMat( k, d, CV_64FC1 );
+
+   try
+   {
+      cvConvert( withinScatter, a );
+
+      double trace = 0.0;
+      for ( int i = 0; i < d; i++ )
+         trace += a->data.db[(size_t)i * d + i];
+      double ridge = GENERALIZED_EIGEN_RIDGE * std::max( trace / d, DBL_MIN );
+      for ( int i = 0; i < d; i++ )
+         a->data.db[(size_t)i * d + i] += ridge;
+
+      CholeskyFactor( a, L );
+
+      // w = L^-1 r by forward substitution, one class per thread
+#pragma omp parallel for schedule(static)
+      for ( int c = 0; c < C; c++ )
+      {
+         const float* r = (const float*)( betweenFactor->data.ptr + (size_t)c * betweenFactor->step );
+         double* w = whitened->data.db + (size_t)c * d;
+
+         for ( int i = 0; i < d; i++ )
+         {
+            const double* Li = L->data.db + (size_t)i * d;
+
+            double sum = r[i];
+            for ( int j = 0; j < i; j++ )
+               sum -= Li[j] * w[j];
+
+            w[i] = sum / Li[i];
+         }
+      }
+
+      if ( classSide )
+      {
+         // W W^T = Z S Z^T, then the eigenvectors of W^T W are y = Z^T W / sqrt(S)
+         ParallelGEMM( whitened, whitened, 1, gram, CV_GEMM_B_T );
+         cvEigenVV( gram, evects, evals, DBL_EPSILON );
+
+         double largest = std::max( evals->data.db[0], 0.0 );
+         for ( int i = 0; i < k; i++ )
+         {
+            double eval = std::max( evals->data.db[i], 0.0 );
+            double scale = eval > largest * DBL_EPSILON ? 1.0 / sqrt(eval) : 0.0;
+
+            for ( int j = 0; j < C; j++ )
+               rotation->data.db[i*C+j] = evects->data.db[i*n+j] * scale;
+
+            eigenValues->data.fl[i] = (float)eval;
+         }
+
+         ParallelGEMM( rotation, whitened, 1, y, 0 );
+      }
+      else
+      {
+         ParallelGEMM( whitened, whitened, 1, gram, CV_GEMM_A_T );
+         cvEigenVV( gram, evects, evals, DBL_EPSILON );
+
+         for ( int i = 0; i < k; i++ )
+         {
+            memcpy( y->data.db + (size_t)i * d, evects->data.db + (size_t)i * n, d * sizeof(double) );
+            eigenValues->data.fl[i] = (float)std::max( evals->data.db[i], 0.0 );
+         }
+      }
+
+      // v = L^-T y by back substitution, a row of L at a time so the reads stay contiguous
+#pragma omp parallel for schedule(static)
+      for ( int i = 0; i < k; i++ )
+      {
+         double* v = y->data.db + (size_t)i * d;
+
+         for ( int row = d - 1; row >= 0; row-- )
+         {
+            const double* Lrow = L->data.db + (size_t)row * d;
+
+            v[row] /= Lrow[row];
+            for ( int j = 0; j < row; j++ )
+               v[j] -= Lrow[j] * v[row];
+         }
+
+         float* dst = (float*)( eigenVectors->data.ptr + (size_t)i * eigenVectors->step );
+         for ( int j = 0; j < d; j++ )
+            dst[j] = (float)v[j];
+      }
+   }
+   catch (...)
+   {
+      cvReleaseMat(&a);
+      cvReleaseMat(&L);
+      cvReleaseMat(&whitened);
+      cvReleaseMat(&gram);
+      cvReleaseMat(&evects);
+      cvReleaseMat(&evals);
+      cvReleaseMat(&rotation);
+      cvReleaseMat(&y);
+      throw;
+   }
+
+   cvReleaseMat(&a);
+   cvReleaseMat(&L);
+   cvReleaseMat(&whitened);
+   cvReleaseMat(&gram);
+   cvReleaseMat(&evects);
+   cvReleaseMat(&evals);
+   cvReleaseMat(&rotation);
+   cvReleaseMat(&y);
+}
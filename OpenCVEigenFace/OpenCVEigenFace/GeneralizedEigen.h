@@ -0,0 +1,27 @@
+#ifndef GENERALIZEDEIGEN_H
+#define GENERALIZEDEIGEN_H
+
+/*
+   GeneralizedEigen.h
+   Description:   solves the LDA eigen problem Sb v = lambda Sw v without inverting Sw.  Sw = L L^T is
+                  factored with a Cholesky, which turns the problem into an ordinary symmetric one for
+                  L^-1 Sb L^-T, and v = L^-T y maps the answers back.
+
+   Notes:         Sb is passed as one row per class, Sb = sum of r^T r, so L^-1 Sb L^-T is never formed,
+                  only the small classes x classes eigen problem of the whitened rows is decomposed.
+                  This is the same reduction LAPACK's sygv uses for symmetric-definite problems
+*/
+
+#include "Utilities.h"
+
+
+#define GENERALIZED_EIGEN_RIDGE     1e-6     // added to Sw's diagonal, relative to its average diagonal, so a nearly singular Sw still factors
+
+
+// withinScatter is d x d, symmetric positive definite, float or double.  betweenFactor is C x d, one row per class with
+// Sb = betweenFactor^T * betweenFactor.  eigenVectors gets the top k generalized eigenvectors as k rows of d
+// floats scaled so v^T Sw v = 1, eigenValues gets k floats in decreasing order
+void SymmetricGeneralizedEigen( const CvMat* withinScatter, const CvMat* betweenFactor, CvMat* eigenVectors, CvMat* eigenValues );
+
+
+#endif
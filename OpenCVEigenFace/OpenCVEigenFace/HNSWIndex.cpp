@@ -0,0 +1,510 @@
+#include "HNSWIndex.h"
+#include <fstream>
+#include <algorithm>
+#include <math.h>
+#include <limits.h>
+
+
+
+// orders a heap so the closest node is on top
+struct CloserOnTop
+{
+   bool operator()( const RowDistance& a, const RowDistance& b ) const { return b < a; }
+};
+
+
+
+/*
+Function:   HNSWIndexFileName
+Purpose:    name of the index of a database
+Notes:
+Throws
+returns:    database with .hnsw appended
+*/
+std::string HNSWIndexFileName( const char* database )
+{
+   std::string name(database);
+   name += ".hnsw";
+   return name;
+}
+
+
+
+/*
+Function:   HNSWIndex constructor
+Purpose:
+Notes:      M is the number of links per node, level 0 has 2*M
+Throws
+*/
+HNSWIndex::HNSWIndex( int M, int efConstruction ) : m_M(M), m_MaxM0(2*M), m_EfConstruction(efConstruction),
+   m_RNG(cvRNG(0x48534E57)), m_EntryPoint(-1), m_MaxLevel(0)
+{
+   if ( m_M < 2 )
+      throw std::string("HNSWIndex - M should be at least 2");
+
+   m_LevelMult = 1.0 / log((double)m_M);
+}
+
+
+
+/*
+Function:   Build
+Purpose:    builds the graph over nVectors rows
+Notes:      any existing graph is thrown away.  The same vectors always give the same graph
+Throws
+returns:    void
+*/
+void HNSWIndex::Build( const float* vectors, int nVectors, int stride )
+{
+   m_RNG = cvRNG(0x48534E57);
+   m_EntryPoint = -1;
+   m_MaxLevel = 0;
+   m_Levels.clear();
+   m_Links.clear();
+
+   m_Levels.reserve(nVectors);
+   m_Links.reserve(nVectors);
+
+   for ( int node = 0; node < nVectors; node++ )
+      Insert( vectors, stride, node );
+}
+
+
+
+/*
+Function:   Insert
+Purpose:    adds row node of vectors to the graph
+Notes:      nodes are added in order, node has to be Size()
+Throws      std::string if node is out of order
+returns:    void
+*/
+void HNSWIndex::Insert( const float* vectors, int stride, int node )
+{
+   if ( node != Size() )
+      throw std::string("HNSWIndex::Insert - nodes have to be inserted in order");
+
+   int level = RandomLevel();
+   m_Levels.push_back(level);
+   m_Links.push_back( std::vector<int>( (1 + m_MaxM0) + level * (1 + m_M), 0 ) );
+
+   if ( m_EntryPoint == -1 )
+   {
+      m_EntryPoint = node;
+      m_MaxLevel = level;
+      return;
+   }
+
+   const float* query = vectors + (size_t)node * stride;
+
+   // walk down the levels above the new node's top level
+   int entry = m_EntryPoint;
+   for ( int l = m_MaxLevel; l > level; l-- )
+      entry = GreedyClosest( vectors, stride, query, entry, l );
+
+   std::vector<RowDistance> neighbours;
+   for ( int l = std::min(level, m_MaxLevel); l >= 0; l-- )
+   {
+      SearchLevel( vectors, stride, query, entry, m_EfConstruction, l, m_BuildScratch );
+      neighbours = m_BuildScratch.m_Results;
+      entry = neighbours[0].m_Row;
+
+      SelectNeighbours( vectors, stride, neighbours, m_M );
+
+      int* links = Links(node, l);
+      links[0] = (int)neighbours.size();
+      for ( size_t i = 0; i < neighbours.size(); i++ )
+      {
+         links[1+i] = neighbours[i].m_Row;
+         Connect( vectors, stride, neighbours[i].m_Row, node, l );
+      }
+   }
+
+   if ( level > m_MaxLevel )
+   {
+      m_MaxLevel = level;
+      m_EntryPoint = node;
+   }
+}
+
+
+
+/*
+Function:   Search
+Purpose:    finds the k nodes closest to query
+Notes:      efSearch candidates are kept on level 0, larger is slower with better recall.
+            best must have room for k, it is filled closest first.  Skipped nodes still link the graph
+            together so they are walked through, they are only left out of the results
+Throws
+returns:    number of nodes in best
+*/
+int HNSWIndex::Search( const float* vectors, int stride, const float* query, int k, int efSearch, RowDistance* best, HNSWScratch& scratch,
+                       const unsigned char* skip ) const
+{
+   if ( m_EntryPoint == -1 || k <= 0 )
+      return 0;
+
+   int entry = m_EntryPoint;
+   for ( int l = m_MaxLevel; l > 0; l-- )
+      entry = GreedyClosest( vectors, stride, query, entry, l );
+
+   SearchLevel( vectors, stride, query, entry, std::max(efSearch, k), 0, scratch, skip );
+
+   int nFound = std::min( k, (int)scratch.m_Results.size() );
+   for ( int i = 0; i < nFound; i++ )
+      best[i] = scratch.m_Results[i];
+
+   return nFound;
+}
+
+
+
+/*
+Function:   Save
+Purpose:    writes the graph to filename
+Notes:      written next to filename then renamed, so a failed write never leaves a half written index
+            that a recognizer would load
+Throws      std::string if the file can not be written
+returns:    void
+*/
+void HNSWIndex::Save( const char* filename ) const
+{
+   std::string tempname = filename;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "HNSWIndex::Save could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   int header[8] = { HNSW_FILE_MAGIC, HNSW_FILE_VERSION, m_M, m_MaxM0, m_EfConstruction, Size(), m_EntryPoint, m_MaxLevel };
+   out.write( (const char*)header, sizeof(header) );
+
+   for ( int node = 0; node < Size(); node++ )
+   {
+      out.write( (const char*)&m_Levels[node], sizeof(int) );
+      out.write( (const char*)&m_Links[node][0], m_Links[node].size() * sizeof(int) );
+   }
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "HNSWIndex::Save could not write ";
+      err += tempname;
+      throw err;
+   }
+
+#ifdef _WIN32
+   remove(filename);
+#endif
+   if ( rename(tempname.c_str(), filename) != 0 )
+   {
+      std::string err = "HNSWIndex::Save could not rename ";
+      err += tempname;
+      throw err;
+   }
+}
+
+
+
+/*
+Function:   Load
+Purpose:    reads a graph written by Save
+Notes:      every link count has to fit its level and every link has to be a node with that level,
+            and the entry point has to be on the top level, so a search never reads outside the graph
+Throws      std::string if the file can not be read or is not an index
+returns:    void
+*/
+void HNSWIndex::Load( const char* filename )
+{
+   std::string err = "HNSWIndex::Load - not a valid index: ";
+   err += filename;
+
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      throw err;
+
+   int header[8];
+   in.read( (char*)header, sizeof(header) );
+   if ( !in || header[0] != HNSW_FILE_MAGIC || header[1] != HNSW_FILE_VERSION || header[2] < 2 || header[3] < header[2] ||
+        header[4] < 1 || header[5] < 0 || header[7] < 0 ||
+        (1 + (double)header[3]) + (double)header[7] * (1 + header[2]) > INT_MAX / sizeof(int) )
+      throw err;
+
+   m_M = header[2];
+   m_MaxM0 = header[3];
+   m_EfConstruction = header[4];
+   m_EntryPoint = header[6];
+   m_MaxLevel = header[7];
+   m_LevelMult = 1.0 / log((double)m_M);
+
+   int nNodes = header[5];
+   m_Levels.resize(nNodes);
+   m_Links.resize(nNodes);
+
+   for ( int node = 0; node < nNodes; node++ )
+   {
+      in.read( (char*)&m_Levels[node], sizeof(int) );
+      if ( !in || m_Levels[node] < 0 || m_Levels[node] > m_MaxLevel )
+         throw err;
+
+      m_Links[node].resize( (1 + m_MaxM0) + m_Levels[node] * (1 + m_M) );
+      in.read( (char*)&m_Links[node][0], m_Links[node].size() * sizeof(int) );
+      if ( !in )
+         throw err;
+   }
+
+   // checked once every node's level is known
+   for ( int node = 0; node < nNodes; node++ )
+   {
+      for ( int level = 0; level <= m_Levels[node]; level++ )
+      {
+         const int* links = Links(node, level);
+         if ( links[0] < 0 || links[0] > MaxLinks(level) )
+            throw err;
+
+         for ( int i = 1; i <= links[0]; i++ )
+         {
+            if ( links[i] < 0 || links[i] >= nNodes || m_Levels[links[i]] < level )
+               throw err;
+         }
+      }
+   }
+
+   if ( nNodes && ( m_EntryPoint < 0 || m_EntryPoint >= nNodes || m_Levels[m_EntryPoint] != m_MaxLevel ) )
+      throw err;
+}
+
+
+
+/*
+Function:   RandomLevel
+Purpose:    picks the top level of a new node
+Notes:      exponentially fewer nodes on each level up
+Throws
+returns:    level
+*/
+int HNSWIndex::RandomLevel()
+{
+   double r = 1.0 - cvRandReal(&m_RNG);   // (0,1]
+   return (int)floor( -log(r) * m_LevelMult );
+}
+
+
+
+/*
+Function:   Links
+Purpose:    finds a node's links on a level
+Notes:      element 0 is the number of links, the links follow
+Throws
+returns:    pointer to the count
+*/
+int* HNSWIndex::Links( int node, int level )
+{
+   int offset = level == 0 ? 0 : (1 + m_MaxM0) + (level-1) * (1 + m_M);
+   return &m_Links[node][offset];
+}
+
+const int* HNSWIndex::Links( int node, int level ) const
+{
+   int offset = level == 0 ? 0 : (1 + m_MaxM0) + (level-1) * (1 + m_M);
+   return &m_Links[node][offset];
+}
+
+
+
+/*
+Function:   GreedyClosest
+Purpose:    walks a level from entry towards query until no link is closer
+Notes:      used on the upper levels where only one candidate is needed
+Throws
+returns:    closest node found
+*/
+int HNSWIndex::GreedyClosest( const float* vectors, int stride, const float* query, int entry, int level ) const
+{
+   int current = entry;
+   float currentDistance = SquaredDistance( query, vectors + (size_t)current * stride, stride );
+
+   bool changed = true;
+   while ( changed )
+   {
+      changed = false;
+
+      const int* links = Links(current, level);
+      for ( int i = 1; i <= links[0]; i++ )
+      {
+         float d = SquaredDistance( query, vectors + (size_t)links[i] * stride, stride );
+         if ( d < currentDistance )
+         {
+            currentDistance = d;
+            current = links[i];
+            changed = true;
+         }
+      }
+   }
+
+   return current;
+}
+
+
+
+/*
+Function:   SearchLevel
+Purpose:    best first search of one level starting at entry
+Notes:      keeps the ef closest nodes, they are left in scratch.m_Results closest first.  A skipped node
+            is expanded like any other but never kept, so the search goes on past it until ef nodes
+            that are not skipped are found
+Throws
+returns:    void
+*/
+void HNSWIndex::SearchLevel( const float* vectors, int stride, const float* query, int entry, int ef, int level, HNSWScratch& scratch,
+                             const unsigned char* skip ) const
+{
+   // new visited mark, only clear the marks when the counter wraps
+   if ( scratch.m_Visited.size() < m_Levels.size() )
+      scratch.m_Visited.resize( m_Levels.size(), 0 );
+   if ( ++scratch.m_Mark == 0 )
+   {
+      std::fill( scratch.m_Visited.begin(), scratch.m_Visited.end(), 0 );
+      scratch.m_Mark = 1;
+   }
+
+   std::vector<RowDistance>& candidates = scratch.m_Candidates;
+   std::vector<RowDistance>& results = scratch.m_Results;
+   candidates.clear();
+   results.clear();
+
+   RowDistance start;
+   start.m_Row = entry;
+   start.m_Distance = SquaredDistance( query, vectors + (size_t)entry * stride, stride );
+   scratch.m_Visited[entry] = scratch.m_Mark;
+
+   candidates.push_back(start);
+   if ( !skip || !skip[entry] )
+      results.push_back(start);
+
+   while ( !candidates.empty() )
+   {
+      RowDistance closest = candidates.front();
+
+      // every candidate left is farther than the worst result
+      if ( (int)results.size() >= ef && results.front() < closest )
+         break;
+
+      std::pop_heap( candidates.begin(), candidates.end(), CloserOnTop() );
+      candidates.pop_back();
+
+      const int* links = Links(closest.m_Row, level);
+      for ( int i = 1; i <= links[0]; i++ )
+      {
+         int node = links[i];
+         if ( scratch.m_Visited[node] == scratch.m_Mark )
+            continue;
+         scratch.m_Visited[node] = scratch.m_Mark;
+
+         RowDistance next;
+         next.m_Row = node;
+         next.m_Distance = SquaredDistance( query, vectors + (size_t)node * stride, stride );
+
+         if ( (int)results.size() < ef || next < results.front() )
+         {
+            candidates.push_back(next);
+            std::push_heap( candidates.begin(), candidates.end(), CloserOnTop() );
+
+            if ( skip && skip[node] )
+               continue;
+
+            results.push_back(next);
+            std::push_heap( results.begin(), results.end() );
+
+            if ( (int)results.size() > ef )
+            {
+               std::pop_heap( results.begin(), results.end() );
+               results.pop_back();
+            }
+         }
+      }
+   }
+
+   std::sort_heap( results.begin(), results.end() );
+}
+
+
+
+/*
+Function:   SelectNeighbours
+Purpose:    picks at most maxLinks links out of candidates, sorted closest first
+Notes:      a candidate is only kept when it is closer to the base node than to every kept
+            candidate, that keeps links spread out in different directions instead of all in one cluster
+Throws
+returns:    void, the kept candidates are left in candidates
+*/
+void HNSWIndex::SelectNeighbours( const float* vectors, int stride, std::vector<RowDistance>& candidates, int maxLinks ) const
+{
+   if ( (int)candidates.size() <= maxLinks )
+      return;
+
+   std::vector<RowDistance> selected;
+   selected.reserve(maxLinks);
+
+   for ( size_t i = 0; i < candidates.size() && (int)selected.size() < maxLinks; i++ )
+   {
+      const float* candidate = vectors + (size_t)candidates[i].m_Row * stride;
+
+      bool keep = true;
+      for ( size_t j = 0; j < selected.size(); j++ )
+      {
+         if ( SquaredDistance( candidate, vectors + (size_t)selected[j].m_Row * stride, stride ) < candidates[i].m_Distance )
+         {
+            keep = false;
+            break;
+         }
+      }
+
+      if ( keep )
+         selected.push_back(candidates[i]);
+   }
+
+   candidates.swap(selected);
+}
+
+
+
+/*
+Function:   Connect
+Purpose:    adds a link from node to neighbour on level
+Notes:      if node is full its links are re-selected from the old links and neighbour
+Throws
+returns:    void
+*/
+void HNSWIndex::Connect( const float* vectors, int stride, int node, int neighbour, int level )
+{
+   int* links = Links(node, level);
+   int maxLinks = MaxLinks(level);
+
+   if ( links[0] < maxLinks )
+   {
+      links[1 + links[0]++] = neighbour;
+      return;
+   }
+
+   const float* base = vectors + (size_t)node * stride;
+
+   std::vector<RowDistance> candidates(links[0] + 1);
+   for ( int i = 0; i < links[0]; i++ )
+   {
+      candidates[i].m_Row = links[1+i];
+      candidates[i].m_Distance = SquaredDistance( base, vectors + (size_t)links[1+i] * stride, stride );
+   }
+   candidates[links[0]].m_Row = neighbour;
+   candidates[links[0]].m_Distance = SquaredDistance( base, vectors + (size_t)neighbour * stride, stride );
+
+   std::sort( candidates.begin(), candidates.end() );
+   SelectNeighbours( vectors, stride, candidates, maxLinks );
+
+   links[0] = (int)candidates.size();
+   for ( size_t i = 0; i < candidates.size(); i++ )
+      links[1+i] = candidates[i].m_Row;
+}
@@ -0,0 +1,97 @@
+#ifndef HNSWINDEX_H
+#define HNSWINDEX_H
+
+/*
+   HNSWIndex.h
+   Description:   hierarchical navigable small world graph over the projected classes, used to find the
+                  closest classes without comparing the probe to every class.
+
+   Notes:         the index only stores the graph.  The vectors stay in the model (or gallery) and are
+                  passed to every call, node i is row i of the vectors.  Rows follow the rules in
+                  DistanceKernel.h: padded to a multiple of DISTANCE_KERNEL_WIDTH and aligned.
+
+                  Malkov and Yashunin, "Efficient and robust approximate nearest neighbor search using
+                  Hierarchical Navigable Small World graphs"
+*/
+
+#include "Utilities.h"
+#include "DistanceKernel.h"
+#include <vector>
+
+
+#define HNSW_FILE_MAGIC          0x57534E48     // "HNSW"
+#define HNSW_FILE_VERSION        1
+
+#define HNSW_DEFAULT_M                16        // links per node on the upper levels, twice this on level 0
+#define HNSW_DEFAULT_EF_CONSTRUCTION  200       // candidates kept while inserting
+#define HNSW_DEFAULT_EF_SEARCH        64        // candidates kept while searching, the recall/latency knob
+
+
+/*
+   HNSWScratch holds the visited marks and heaps of a search so searches do not allocate.
+   Each thread searching needs its own.
+*/
+struct HNSWScratch
+{
+   std::vector<unsigned int>  m_Visited;     // m_Visited[node] == m_Mark when node was seen by this search
+   unsigned int               m_Mark;
+   std::vector<RowDistance>   m_Candidates;  // nodes still to expand, closest on top
+   std::vector<RowDistance>   m_Results;     // closest nodes found, closest first once a search is done
+
+   HNSWScratch() : m_Mark(0) {}
+};
+
+
+// name of the index stored next to a database
+std::string HNSWIndexFileName( const char* database );
+
+
+
+class HNSWIndex
+{
+public:
+   HNSWIndex( int M = HNSW_DEFAULT_M, int efConstruction = HNSW_DEFAULT_EF_CONSTRUCTION );
+
+   void Build( const float* vectors, int nVectors, int stride );
+   void Insert( const float* vectors, int stride, int node );
+
+   // nodes with skip[node] set are walked through but never returned, a NULL skip returns any node
+   int  Search( const float* vectors, int stride, const float* query, int k, int efSearch, RowDistance* best, HNSWScratch& scratch,
+                const unsigned char* skip = NULL ) const;
+
+   void Save( const char* filename ) const;
+   void Load( const char* filename );
+
+   int  Size() const { return (int)m_Levels.size(); }
+   bool Empty() const { return m_Levels.empty(); }
+
+private:
+   int        RandomLevel();
+   int        MaxLinks( int level ) const { return level == 0 ? m_MaxM0 : m_M; }
+
+   // links of node on level, count then MaxLinks(level) slots
+   int*       Links( int node, int level );
+   const int* Links( int node, int level ) const;
+
+   int        GreedyClosest( const float* vectors, int stride, const float* query, int entry, int level ) const;
+   void       SearchLevel( const float* vectors, int stride, const float* query, int entry, int ef, int level,
+                           HNSWScratch& scratch, const unsigned char* skip = NULL ) const;
+   void       SelectNeighbours( const float* vectors, int stride, std::vector<RowDistance>& candidates, int maxLinks ) const;
+   void       Connect( const float* vectors, int stride, int node, int neighbour, int level );
+
+   int                              m_M;
+   int                              m_MaxM0;
+   int                              m_EfConstruction;
+   double                           m_LevelMult;      // 1/ln(M), spreads the levels
+   CvRNG                            m_RNG;
+
+   int                              m_EntryPoint;     // node on the top level, -1 when empty
+   int                              m_MaxLevel;
+   std::vector<int>                 m_Levels;         // top level of each node
+   std::vector< std::vector<int> >  m_Links;          // each node's links, level 0 first
+
+   HNSWScratch                      m_BuildScratch;   // used by Insert
+};
+
+
+#endif
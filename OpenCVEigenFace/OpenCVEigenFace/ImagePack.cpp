@@ -0,0 +1,377 @@
+#include "ImagePack.h"
+#include "Training.h"
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+
+
+
+/*
+Function:   IsImagePack
+Purpose:    tells an image pack from an image list
+Notes:      only the magic number is checked, Open checks the rest
+Throws
+returns:    true if filename starts with IMAGE_PACK_MAGIC
+*/
+bool IsImagePack( const char* filename )
+{
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      return false;
+
+   unsigned int magic = 0;
+   in.read( (char*)&magic, sizeof(magic) );
+   return in && magic == IMAGE_PACK_MAGIC;
+}
+
+
+
+/*
+Function:   PadTo
+Purpose:    writes zeros until position is a multiple of IMAGE_PACK_ALIGN
+Notes:      position is the number of bytes written so far and is updated
+Throws
+returns:    void
+*/
+static void PadTo( std::ostream& out, uint64& position )
+{
+   static const char padding[IMAGE_PACK_ALIGN] = { 0 };
+
+   uint64 aligned = ( ( position + IMAGE_PACK_ALIGN - 1 ) / IMAGE_PACK_ALIGN ) * IMAGE_PACK_ALIGN;
+   out.write( padding, (std::streamsize)(aligned - position) );
+   position = aligned;
+}
+
+
+
+/*
+Function:   WriteStringTable
+Purpose:    writes strings as a count, count+1 offsets, then the nul terminated characters
+Notes:      position is updated
+Throws
+returns:    void
+*/
+static void WriteStringTable( std::ostream& out, const std::vector<std::string>& strings, uint64& position )
+{
+   unsigned int count = (unsigned int)strings.size();
+   std::vector<unsigned int> offsets(count+1);
+
+   unsigned int chars = 0;
+   for ( unsigned int i = 0; i < count; i++ )
+   {
+      offsets[i] = chars;
+      chars += (unsigned int)strings[i].size() + 1;
+   }
+   offsets[count] = chars;
+
+   out.write( (const char*)&count, sizeof(unsigned int) );
+   out.write( (const char*)&offsets[0], sizeof(unsigned int) * (count+1) );
+   for ( unsigned int i = 0; i < count; i++ )
+      out.write( strings[i].c_str(), strings[i].size() + 1 );
+
+   position += sizeof(unsigned int) * ( (uint64)count + 2 ) + chars;
+}
+
+
+
+/*
+Function:   PackImages
+Purpose:    writes every image of an image list into one image pack
+Notes:      IMAGE_PACK_BLOCK images are decoded in parallel into a block of rows, then the block is
+            written, so only one block is in memory.  The first bad image in list order is reported.
+            The pack is written next to packfile then renamed over it
+Throws      std::string if an image can't be loaded, the images are different sizes or the pack can't be written
+returns:    number of images packed
+*/
+int PackImages( const char* imagelist, const char* packfile )
+{
+   if ( IsImagePack(imagelist) )
+      throw std::string("PackImages - the image list is already a pack");
+
+   std::vector<Image> images;
+   ReadImageList( imagelist, images );
+
+   int nImages = (int)images.size();
+   if ( nImages == 0 )
+      throw std::string("PackImages - there are no images to pack");
+
+   IplImage* first = cvLoadImage( images[0].m_ImageName.c_str(), CV_LOAD_IMAGE_GRAYSCALE );
+   if ( !first )
+   {
+      std::string err = "PackImages could not load image ";
+      err += images[0].m_ImageName;
+      throw err;
+   }
+
+   ImagePackHeader header;
+   memset( &header, 0, sizeof(header) );
+   header.m_Magic = IMAGE_PACK_MAGIC;
+   header.m_Version = IMAGE_PACK_VERSION;
+   header.m_HeaderSize = sizeof(ImagePackHeader);
+   header.m_Width = first->width;
+   header.m_Height = first->height;
+   header.m_nImages = nImages;
+   header.m_RowStride = ( ( header.m_Width * header.m_Height + IMAGE_PACK_ALIGN - 1 ) / IMAGE_PACK_ALIGN ) * IMAGE_PACK_ALIGN;
+   cvReleaseImage(&first);
+
+   std::string tempname = packfile;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "PackImages could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   // the header is written again at the end with the offsets filled in
+   out.write( (const char*)&header, sizeof(header) );
+   uint64 position = sizeof(header);
+   PadTo( out, position );
+   header.m_PixelOffset = position;
+
+   int width = header.m_Width;
+   int height = header.m_Height;
+   int stride = header.m_RowStride;
+   std::vector<uchar> block( (size_t)std::min(nImages, IMAGE_PACK_BLOCK) * stride );
+   std::vector<char> status( nImages, IMAGE_LOADED );
+
+   for ( int start = 0; start < nImages; start += IMAGE_PACK_BLOCK )
+   {
+      int end = std::min( start + IMAGE_PACK_BLOCK, nImages );
+      memset( &block[0], 0, block.size() );
+
+#pragma omp parallel for schedule(dynamic)
+      for ( int i = start; i < end; i++ )
+      {
+         IplImage* image = cvLoadImage( images[i].m_ImageName.c_str(), CV_LOAD_IMAGE_GRAYSCALE );
+
+         if ( !image )
+         {
+            status[i] = IMAGE_NOT_LOADED;
+            continue;
+         }
+
+         if ( image->width != width || image->height != height )
+         {
+            status[i] = IMAGE_WRONG_SIZE;
+         }
+         else
+         {
+            uchar* row = &block[(size_t)(i - start) * stride];
+            for ( int y = 0; y < height; y++ )
+               memcpy( row + (size_t)y * width, image->imageData + (size_t)y * image->widthStep, width );
+         }
+
+         cvReleaseImage(&image);
+      }
+
+      for ( int i = start; i < end; i++ )
+      {
+         if ( status[i] == IMAGE_NOT_LOADED )
+         {
+            std::string err = "PackImages could not load image ";
+            err += images[i].m_ImageName;
+            throw err;
+         }
+
+         if ( status[i] == IMAGE_WRONG_SIZE )
+            throw std::string("PackImages: Images should be same size");
+      }
+
+      out.write( (const char*)&block[0], (std::streamsize)(end - start) * stride );
+      position += (uint64)(end - start) * stride;
+   }
+
+   std::vector<personIDType> ids;
+   std::vector<std::string> personNames;
+   std::vector<std::string> imageNames;
+   for ( int i = 0; i < nImages; i++ )
+   {
+      ids.push_back( images[i].m_ID );
+      personNames.push_back( images[i].m_PersonName );
+      imageNames.push_back( images[i].m_ImageName );
+   }
+
+   PadTo( out, position );
+   header.m_IDOffset = position;
+   out.write( (const char*)&ids[0], sizeof(personIDType) * nImages );
+   position += sizeof(personIDType) * (uint64)nImages;
+
+   PadTo( out, position );
+   header.m_PersonNameOffset = position;
+   WriteStringTable( out, personNames, position );
+
+   PadTo( out, position );
+   header.m_ImageNameOffset = position;
+   WriteStringTable( out, imageNames, position );
+
+   header.m_FileSize = position;
+   out.seekp( 0 );
+   out.write( (const char*)&header, sizeof(header) );
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "PackImages could not write ";
+      err += tempname;
+      throw err;
+   }
+
+#ifdef _WIN32
+   remove(packfile);
+#endif
+   if ( rename(tempname.c_str(), packfile) != 0 )
+   {
+      std::string err = "PackImages could not rename ";
+      err += tempname;
+      throw err;
+   }
+
+   return nImages;
+}
+
+
+
+
+////////////////////////////////////////////
+//           ImagePack class              //
+////////////////////////////////////////////
+
+
+/*
+Function:   ImagePack constructor
+Purpose:
+Notes:      Open has to be called before anything else
+Throws
+*/
+ImagePack::ImagePack() : m_Header(NULL), m_IDs(NULL)
+{
+}
+
+
+
+/*
+Function:   Open
+Purpose:    maps a pack and checks that everything in it is inside the file
+Notes:      every string has at least its nul, so a string table's offsets must increase, and its
+            characters must end in a nul, so every string String hands out ends inside the table
+Throws      std::string if the file can't be mapped or is not a valid pack
+returns:    void
+*/
+void ImagePack::Open( const char* filename )
+{
+   m_FileName = filename;
+   m_File.Open(filename);
+
+   std::string err = "ImagePack - not a valid image pack: ";
+   err += filename;
+
+   uint64 size = m_File.Size();
+   if ( size < sizeof(ImagePackHeader) )
+      throw err;
+
+   m_Header = (const ImagePackHeader*)m_File.Data();
+
+   if ( m_Header->m_Magic != IMAGE_PACK_MAGIC || m_Header->m_HeaderSize != sizeof(ImagePackHeader) )
+      throw err;
+
+   if ( m_Header->m_Version != IMAGE_PACK_VERSION )
+   {
+      std::stringstream s;
+      s << "ImagePack - " << filename << " is version " << m_Header->m_Version << ", expected version " << IMAGE_PACK_VERSION << ", repack";
+      throw s.str();
+   }
+
+   uint64 nImages = (uint64)m_Header->m_nImages;
+   if ( m_Header->m_Width < 1 || m_Header->m_Height < 1 || m_Header->m_nImages < 0 || m_Header->m_FileSize != size ||
+        m_Header->m_RowStride < m_Header->m_Width * m_Header->m_Height || m_Header->m_RowStride % IMAGE_PACK_ALIGN ||
+        m_Header->m_PixelOffset % IMAGE_PACK_ALIGN || m_Header->m_PixelOffset + nImages * m_Header->m_RowStride > size ||
+        m_Header->m_IDOffset % IMAGE_PACK_ALIGN || m_Header->m_IDOffset + nImages * sizeof(personIDType) > size )
+      throw err;
+
+   uint64 tables[2] = { m_Header->m_PersonNameOffset, m_Header->m_ImageNameOffset };
+   for ( int i = 0; i < 2; i++ )
+   {
+      if ( tables[i] % IMAGE_PACK_ALIGN || tables[i] + sizeof(unsigned int) * (nImages + 2) > size )
+         throw err;
+
+      const unsigned int* table = (const unsigned int*)( m_File.Data() + tables[i] );
+      if ( table[0] != nImages || tables[i] + sizeof(unsigned int) * (nImages + 2) + table[nImages + 1] > size )
+         throw err;
+
+      for ( uint64 j = 1; j <= nImages; j++ )
+      {
+         if ( table[j] >= table[j + 1] )
+            throw err;
+      }
+
+      const char* chars = (const char*)( table + nImages + 2 );
+      if ( nImages > 0 && chars[table[nImages + 1] - 1] != '\0' )
+         throw err;
+   }
+
+   m_IDs = (const personIDType*)( m_File.Data() + m_Header->m_IDOffset );
+}
+
+
+
+/*
+Function:   String
+Purpose:    gets a string out of the string table at offset
+Notes:
+Throws      std::string if index is out of range
+returns:    nul terminated string in the mapping
+*/
+const char* ImagePack::String( uint64 offset, int index ) const
+{
+   const unsigned int* table = (const unsigned int*)( m_File.Data() + offset );
+
+   if ( index < 0 || (unsigned int)index >= table[0] )
+      throw std::string("ImagePack::String - string index out of range");
+
+   return (const char*)table + sizeof(unsigned int) * ( (uint64)table[0] + 2 ) + table[index+1];
+}
+
+
+
+/*
+Function:   PersonName
+Purpose:    name of the person in an image
+Notes:
+Throws      std::string if index is out of range
+returns:    nul terminated string in the mapping
+*/
+const char* ImagePack::PersonName( int index ) const
+{
+   return String( m_Header->m_PersonNameOffset, index );
+}
+
+
+
+/*
+Function:   ImageName
+Purpose:    file an image was packed from
+Notes:
+Throws      std::string if index is out of range
+returns:    nul terminated string in the mapping
+*/
+const char* ImagePack::ImageName( int index ) const
+{
+   return String( m_Header->m_ImageNameOffset, index );
+}
+
+
+
+/*
+Function:   InitMatHeader
+Purpose:    points mat at the pixels, no data is copied
+Notes:      each row is one image, the padding at the end of the rows is skipped by the step
+Throws
+returns:    void
+*/
+void ImagePack::InitMatHeader( CvMat* mat ) const
+{
+   cvInitMatHeader( mat, Count(), Width() * Height(), CV_8UC1, (void*)Pixels(0), RowStride() );
+}
@@ -0,0 +1,94 @@
+#ifndef IMAGEPACK_H
+#define IMAGEPACK_H
+
+/*
+   ImagePack.h
+   Description:   every preprocessed face of an image list in one file, so training maps one file
+                  instead of opening and decoding each image.  The pixels are one uint8 matrix, an image
+                  per row, that the trainer uses in place.
+
+   Layout:        ImagePackHeader
+                  pixels, m_nImages rows of m_RowStride bytes, each row an image of m_Width * m_Height
+                  person id of each image, int
+                  string table, person name of each image
+                  string table, file name each image was packed from
+
+   Notes:         the pixels and every table start on an IMAGE_PACK_ALIGN byte boundary and the rows are
+                  padded to it.  String tables are laid out like the model file's, a count, count+1
+                  offsets, then the nul terminated characters.  Values are in the byte order of the
+                  machine that packed the images
+*/
+
+#include "Utilities.h"
+#include "MappedFile.h"
+#include <vector>
+
+
+#define IMAGE_PACK_MAGIC      0x4B415046     // "FPAK"
+#define IMAGE_PACK_VERSION    1
+#define IMAGE_PACK_ALIGN      64             // alignment of the pixels, every row and every table
+#define IMAGE_PACK_BLOCK      256            // images decoded together while packing
+
+
+struct ImagePackHeader
+{
+   unsigned int   m_Magic;
+   unsigned int   m_Version;
+   unsigned int   m_HeaderSize;           // sizeof(ImagePackHeader)
+   int            m_Width;
+   int            m_Height;
+   int            m_nImages;
+   int            m_RowStride;            // bytes per row of pixels
+   int            m_Reserved;
+   uint64         m_PixelOffset;          // every offset is from the start of the file
+   uint64         m_IDOffset;
+   uint64         m_PersonNameOffset;
+   uint64         m_ImageNameOffset;
+   uint64         m_FileSize;
+};
+
+
+// true if filename starts like an image pack, an image list doesn't
+bool IsImagePack( const char* filename );
+
+// loads every image of imagelist and writes them to packfile, returns the number of images packed
+// throws std::string if an image can't be loaded, they are different sizes, or the pack can't be written
+int PackImages( const char* imagelist, const char* packfile );
+
+
+
+/*
+   ImagePack maps a pack written by PackImages.  Nothing is copied, the pointers it hands out
+   point into the mapping and are valid until the ImagePack is destroyed.
+*/
+class ImagePack
+{
+public:
+   ImagePack();
+
+   void Open( const char* filename );
+
+   int            Width() const     { return m_Header->m_Width; }
+   int            Height() const    { return m_Header->m_Height; }
+   int            Count() const     { return m_Header->m_nImages; }
+   int            RowStride() const { return m_Header->m_RowStride; }
+
+   const uchar*   Pixels( int index ) const { return m_File.Data() + m_Header->m_PixelOffset + (uint64)index * m_Header->m_RowStride; }
+   personIDType   ID( int index ) const     { return m_IDs[index]; }
+   const char*    PersonName( int index ) const;
+   const char*    ImageName( int index ) const;
+
+   // m_nImages rows of m_Width * m_Height uint8 pointing at the pixels
+   void           InitMatHeader( CvMat* mat ) const;
+
+private:
+   const char*    String( uint64 offset, int index ) const;
+
+   MappedFile                 m_File;
+   std::string                m_FileName;
+   const ImagePackHeader*     m_Header;
+   const personIDType*        m_IDs;
+};
+
+
+#endif
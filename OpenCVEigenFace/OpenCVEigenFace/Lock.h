@@ -0,0 +1,94 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+/*
+   Lock.h
+   Description:   a mutex for the few instructions that read or replace shared state.  It is an
+                  OpenMP lock so it is available wherever the parallel loops are, without OpenMP
+                  there is only one thread and locking does nothing
+
+   Notes:         hold it for as little as possible, never while computing or doing I/O.
+                  AtomicLoad and AtomicStore read and replace a pointer other threads read without
+                  a lock, with a full memory barrier either side so a store one thread makes before
+                  reading a pointer is seen by a thread that replaced the pointer then reads the store
+*/
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+// orders every load and store before it with every one after it, on every processor
+inline void FullBarrier()
+{
+#ifdef _MSC_VER
+   long barrier = 0;
+   _InterlockedOr( &barrier, 0 );      // interlocked instructions are full barriers
+#else
+   __sync_synchronize();
+#endif
+}
+
+
+// an aligned pointer is read and written in one access, the barriers order it with everything else
+template<typename T> inline T* AtomicLoad( T* const volatile& shared )
+{
+   FullBarrier();
+   T* value = shared;
+   FullBarrier();
+   return value;
+}
+
+template<typename T> inline void AtomicStore( T* volatile& shared, T* value )
+{
+   FullBarrier();
+   shared = value;
+   FullBarrier();
+}
+
+
+class Lock
+{
+public:
+#ifdef _OPENMP
+   Lock()            { omp_init_lock(&m_Lock); }
+   ~Lock()           { omp_destroy_lock(&m_Lock); }
+   void Acquire()    { omp_set_lock(&m_Lock); }
+   void Release()    { omp_unset_lock(&m_Lock); }
+#else
+   Lock()            {}
+   void Acquire()    {}
+   void Release()    {}
+#endif
+
+private:
+   /// Not implemented
+   Lock(const Lock&);
+   Lock& operator=(const Lock&);
+
+#ifdef _OPENMP
+   omp_lock_t  m_Lock;
+#endif
+};
+
+
+// holds a Lock until it goes out of scope, so an exception can't leave it held
+class ScopedLock
+{
+public:
+   ScopedLock( Lock& lock ) : m_Lock(lock) { m_Lock.Acquire(); }
+   ~ScopedLock()                           { m_Lock.Release(); }
+
+private:
+   /// Not implemented
+   ScopedLock(const ScopedLock&);
+   ScopedLock& operator=(const ScopedLock&);
+
+   Lock&       m_Lock;
+};
+
+
+#endif
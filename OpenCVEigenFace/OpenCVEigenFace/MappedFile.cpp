@@ -0,0 +1,138 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+
+/*
+Function:   MappedFile constructor
+Purpose:
+Notes:      nothing is mapped until Open is called
+Throws
+*/
+#ifdef _WIN32
+MappedFile::MappedFile() : m_Data(NULL), m_Size(0), m_File(INVALID_HANDLE_VALUE), m_Mapping(NULL)
+#else
+MappedFile::MappedFile() : m_Data(NULL), m_Size(0), m_File(-1)
+#endif
+{
+}
+
+
+
+/*
+Function:   MappedFile destructor
+Purpose:    unmaps the file
+Notes:
+Throws
+*/
+MappedFile::~MappedFile()
+{
+   Close();
+}
+
+
+
+/*
+Function:   Open
+Purpose:    maps filename read only into memory
+Notes:      the mapping is shared, so every process mapping the same file uses the same pages
+Throws      std::string if the file can not be opened or mapped
+returns:    void
+*/
+void MappedFile::Open(const char* filename)
+{
+   Close();
+
+   std::string err = "MappedFile could not map ";
+   err += filename;
+
+#ifdef _WIN32
+   m_File = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if ( m_File == INVALID_HANDLE_VALUE )
+      throw err;
+
+   LARGE_INTEGER size;
+   if ( !GetFileSizeEx(m_File, &size) || size.QuadPart == 0 )
+   {
+      Close();
+      throw err;
+   }
+   m_Size = (uint64)size.QuadPart;
+
+   m_Mapping = CreateFileMappingA(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+   if ( !m_Mapping )
+   {
+      Close();
+      throw err;
+   }
+
+   m_Data = (const unsigned char*)MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+   if ( !m_Data )
+   {
+      Close();
+      throw err;
+   }
+#else
+   m_File = open(filename, O_RDONLY);
+   if ( m_File < 0 )
+      throw err;
+
+   struct stat st;
+   if ( fstat(m_File, &st) != 0 || st.st_size == 0 )
+   {
+      Close();
+      throw err;
+   }
+   m_Size = (uint64)st.st_size;
+
+   void* data = mmap(NULL, (size_t)m_Size, PROT_READ, MAP_SHARED, m_File, 0);
+   if ( data == MAP_FAILED )
+   {
+      Close();
+      throw err;
+   }
+   m_Data = (const unsigned char*)data;
+#endif
+}
+
+
+
+/*
+Function:   Close
+Purpose:    unmaps the file and closes it
+Notes:      safe to call more than once
+Throws
+returns:    void
+*/
+void MappedFile::Close()
+{
+#ifdef _WIN32
+   if ( m_Data )
+      UnmapViewOfFile(m_Data);
+   if ( m_Mapping )
+      CloseHandle(m_Mapping);
+   if ( m_File != INVALID_HANDLE_VALUE )
+      CloseHandle(m_File);
+
+   m_Mapping = NULL;
+   m_File = INVALID_HANDLE_VALUE;
+#else
+   if ( m_Data )
+      munmap((void*)m_Data, (size_t)m_Size);
+   if ( m_File >= 0 )
+      close(m_File);
+
+   m_File = -1;
+#endif
+
+   m_Data = NULL;
+   m_Size = 0;
+}
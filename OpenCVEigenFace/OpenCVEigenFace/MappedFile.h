@@ -0,0 +1,44 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+/*
+   MappedFile.h
+   Description:   maps a whole file read only into memory (mmap, or MapViewOfFile on windows)
+                  so large data can be used in place without reading or parsing it
+
+*/
+
+#include "Utilities.h"
+
+
+class MappedFile
+{
+public:
+   MappedFile();
+   ~MappedFile();
+
+   void Open(const char* filename);
+   void Close();
+
+   bool                 IsOpen() const { return m_Data != NULL; }
+   const unsigned char* Data() const   { return m_Data; }
+   uint64               Size() const   { return m_Size; }
+
+private:
+   /// Not implemented, a mapping can not be copied
+   MappedFile(const MappedFile&);
+   MappedFile& operator=(const MappedFile&);
+
+   const unsigned char*    m_Data;        // start of the mapping
+   uint64                  m_Size;        // size of the file in bytes
+
+#ifdef _WIN32
+   void*                   m_File;        // file HANDLE
+   void*                   m_Mapping;     // file mapping HANDLE
+#else
+   int                     m_File;        // file descriptor
+#endif
+};
+
+
+#endif
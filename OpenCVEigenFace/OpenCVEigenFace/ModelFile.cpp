@@ -0,0 +1,373 @@
+#include "ModelFile.h"
+#include "GalleryLog.h"
+#include <fstream>
+#include <cstdio>
+
+
+
+/*
+Function:   AlignedStride
+Purpose:    rounds cols up so a row of floats fills a whole number of MODEL_FILE_ALIGN blocks
+Notes:
+Throws
+returns:    number of floats per row
+*/
+int AlignedStride( int cols )
+{
+   int floatsPerBlock = MODEL_FILE_ALIGN / sizeof(float);
+   return ( ( cols + floatsPerBlock - 1 ) / floatsPerBlock ) * floatsPerBlock;
+}
+
+
+
+
+////////////////////////////////////////////
+//         ModelFileWriter class          //
+////////////////////////////////////////////
+
+
+/*
+Function:   ModelFileWriter constructor
+Purpose:
+Notes:      callers fill in the rest of Header() before calling Write
+Throws
+*/
+ModelFileWriter::ModelFileWriter()
+{
+   memset(&m_Header, 0, sizeof(m_Header));
+   m_Header.m_Magic = MODEL_FILE_MAGIC;
+   m_Header.m_Version = MODEL_FILE_VERSION;
+   m_Header.m_HeaderSize = sizeof(ModelFileHeader);
+}
+
+
+
+/*
+Function:   AddSection
+Purpose:    adds a section with a copy of size bytes of data
+Notes:
+Throws
+returns:    void
+*/
+void ModelFileWriter::AddSection( unsigned int id, const void* data, uint64 size )
+{
+   m_SectionIDs.push_back(id);
+   m_Sections.push_back( std::vector<char>( (size_t)size ) );
+
+   if ( size )
+      memcpy( &m_Sections.back()[0], data, (size_t)size );
+}
+
+
+
+/*
+Function:   AddStringTable
+Purpose:    adds a section holding strings
+Notes:      layout is count, count+1 offsets, then the nul terminated characters
+Throws
+returns:    void
+*/
+void ModelFileWriter::AddStringTable( unsigned int id, const std::vector<std::string>& strings )
+{
+   unsigned int count = (unsigned int)strings.size();
+   std::vector<unsigned int> offsets(count+1);
+
+   unsigned int chars = 0;
+   for ( unsigned int i = 0; i < count; i++ )
+   {
+      offsets[i] = chars;
+      chars += (unsigned int)strings[i].size() + 1;
+   }
+   offsets[count] = chars;
+
+   size_t size = sizeof(unsigned int) * (count+2) + chars;
+   std::vector<char> section(size);
+
+   char* p = &section[0];
+   memcpy( p, &count, sizeof(unsigned int) );
+   p += sizeof(unsigned int);
+   memcpy( p, &offsets[0], sizeof(unsigned int) * (count+1) );
+   p += sizeof(unsigned int) * (count+1);
+
+   for ( unsigned int i = 0; i < count; i++ )
+   {
+      memcpy( p + offsets[i], strings[i].c_str(), strings[i].size() + 1 );
+   }
+
+   m_SectionIDs.push_back(id);
+   m_Sections.push_back(section);
+}
+
+
+
+/*
+Function:   AddMatrix
+Purpose:    adds a float matrix, each row padded with zeros to stride floats
+Notes:
+Throws      std::string if the matrix is not a float matrix or stride is too small
+returns:    void
+*/
+void ModelFileWriter::AddMatrix( unsigned int id, const CvMat* mat, int stride )
+{
+   if ( CV_MAT_TYPE(mat->type) != CV_32FC1 )
+      throw std::string("ModelFileWriter::AddMatrix - only float matrices can be stored");
+
+   if ( stride < mat->cols )
+      throw std::string("ModelFileWriter::AddMatrix - stride is smaller than the matrix");
+
+   std::vector<char> section( (size_t)mat->rows * stride * sizeof(float), 0 );
+
+   for ( int row = 0; row < mat->rows; row++ )
+   {
+      memcpy( &section[(size_t)row * stride * sizeof(float)], mat->data.ptr + (size_t)row * mat->step, mat->cols * sizeof(float) );
+   }
+
+   m_SectionIDs.push_back(id);
+   m_Sections.push_back(section);
+}
+
+
+
+/*
+Function:   Write
+Purpose:    writes the header, section table and sections to filename
+Notes:      the file is written next to filename, synced, then renamed over it, so a recognizer that
+            has the old file mapped keeps working and a crash never leaves a partly written model
+Throws      std::string if the file can not be written
+returns:    void
+*/
+void ModelFileWriter::Write( const char* filename )
+{
+   m_Header.m_nSections = (unsigned int)m_Sections.size();
+
+   // lay out the sections after the header and the section table
+   std::vector<ModelSectionEntry> table(m_Sections.size());
+   uint64 offset = sizeof(ModelFileHeader) + sizeof(ModelSectionEntry) * table.size();
+
+   for ( size_t i = 0; i < table.size(); i++ )
+   {
+      offset = ( ( offset + MODEL_FILE_ALIGN - 1 ) / MODEL_FILE_ALIGN ) * MODEL_FILE_ALIGN;
+
+      table[i].m_ID = m_SectionIDs[i];
+      table[i].m_Reserved = 0;
+      table[i].m_Offset = offset;
+      table[i].m_Size = m_Sections[i].size();
+
+      offset += m_Sections[i].size();
+   }
+
+   std::string tempname = filename;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "ModelFileWriter could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   out.write( (const char*)&m_Header, sizeof(ModelFileHeader) );
+   if ( !table.empty() )
+      out.write( (const char*)&table[0], sizeof(ModelSectionEntry) * table.size() );
+
+   uint64 written = sizeof(ModelFileHeader) + sizeof(ModelSectionEntry) * table.size();
+   static const char padding[MODEL_FILE_ALIGN] = { 0 };
+
+   for ( size_t i = 0; i < table.size(); i++ )
+   {
+      out.write( padding, (std::streamsize)(table[i].m_Offset - written) );
+      if ( !m_Sections[i].empty() )
+         out.write( &m_Sections[i][0], m_Sections[i].size() );
+      written = table[i].m_Offset + table[i].m_Size;
+   }
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "ModelFileWriter could not write ";
+      err += tempname;
+      throw err;
+   }
+
+   SyncFile( tempname.c_str() );
+#ifdef _WIN32
+   remove(filename);
+#endif
+   if ( rename(tempname.c_str(), filename) != 0 )
+   {
+      std::string err = "ModelFileWriter could not rename ";
+      err += tempname;
+      throw err;
+   }
+   SyncDirectory( filename );
+}
+
+
+
+
+////////////////////////////////////////////
+//            ModelFile class             //
+////////////////////////////////////////////
+
+
+/*
+Function:   ModelFile constructor
+Purpose:
+Notes:
+Throws
+*/
+ModelFile::ModelFile() : m_Header(NULL), m_Sections(NULL)
+{
+}
+
+
+
+/*
+Function:   Open
+Purpose:    maps filename and checks the header and section table
+Notes:      the sections themselves are not read, the pages are loaded when they are used
+Throws      std::string if the file can not be mapped or is not a model file
+returns:    void
+*/
+void ModelFile::Open( const char* filename )
+{
+   m_FileName = filename;
+   m_File.Open(filename);
+
+   std::string err = "ModelFile - not a valid model file: ";
+   err += filename;
+
+   if ( m_File.Size() < sizeof(ModelFileHeader) )
+      throw err;
+
+   m_Header = (const ModelFileHeader*)m_File.Data();
+
+   if ( m_Header->m_Magic != MODEL_FILE_MAGIC || m_Header->m_HeaderSize != sizeof(ModelFileHeader) )
+      throw err;
+
+   if ( m_Header->m_Version != MODEL_FILE_VERSION )
+   {
+      std::stringstream s;
+      s << "ModelFile - " << filename << " is version " << m_Header->m_Version << ", expected version " << MODEL_FILE_VERSION << ", retrain";
+      throw s.str();
+   }
+
+   uint64 tableEnd = sizeof(ModelFileHeader) + (uint64)sizeof(ModelSectionEntry) * m_Header->m_nSections;
+   if ( tableEnd > m_File.Size() )
+      throw err;
+
+   m_Sections = (const ModelSectionEntry*)( m_File.Data() + sizeof(ModelFileHeader) );
+
+   for ( unsigned int i = 0; i < m_Header->m_nSections; i++ )
+   {
+      if ( m_Sections[i].m_Offset % MODEL_FILE_ALIGN || m_Sections[i].m_Offset + m_Sections[i].m_Size > m_File.Size() )
+         throw err;
+   }
+}
+
+
+
+/*
+Function:   Section
+Purpose:    finds a section
+Notes:      size is set to the size of the section in bytes when it is not NULL
+Throws
+returns:    pointer to the section in the mapping, NULL if the model does not have the section
+*/
+const void* ModelFile::Section( unsigned int id, uint64* size ) const
+{
+   for ( unsigned int i = 0; i < m_Header->m_nSections; i++ )
+   {
+      if ( m_Sections[i].m_ID == id )
+      {
+         if ( size )
+            *size = m_Sections[i].m_Size;
+         return m_File.Data() + m_Sections[i].m_Offset;
+      }
+   }
+
+   if ( size )
+      *size = 0;
+   return NULL;
+}
+
+
+
+/*
+Function:   RequiredSection
+Purpose:    finds a section that has to be in the model
+Notes:
+Throws      std::string if the section is missing or smaller than size bytes
+returns:    pointer to the section in the mapping
+*/
+const void* ModelFile::RequiredSection( unsigned int id, uint64 size ) const
+{
+   uint64 sectionSize = 0;
+   const void* section = Section(id, &sectionSize);
+
+   if ( !section || sectionSize < size )
+   {
+      std::stringstream s;
+      s << "ModelFile - section " << id << " is missing or too small in " << m_FileName;
+      throw s.str();
+   }
+
+   return section;
+}
+
+
+
+/*
+Function:   StringCount
+Purpose:    number of strings in a string table section
+Notes:
+Throws      std::string if the section is missing
+returns:    number of strings
+*/
+int ModelFile::StringCount( unsigned int id ) const
+{
+   const unsigned int* table = (const unsigned int*)RequiredSection(id, sizeof(unsigned int));
+   return (int)table[0];
+}
+
+
+
+/*
+Function:   String
+Purpose:    gets a string out of a string table section
+Notes:
+Throws      std::string if the section is missing or index is out of range
+returns:    nul terminated string in the mapping
+*/
+const char* ModelFile::String( unsigned int id, int index ) const
+{
+   uint64 size = 0;
+   const unsigned int* table = (const unsigned int*)RequiredSection(id, sizeof(unsigned int));
+   Section(id, &size);
+
+   unsigned int count = table[0];
+   uint64 charsStart = sizeof(unsigned int) * ( (uint64)count + 2 );
+
+   if ( index < 0 || (unsigned int)index >= count || charsStart > size || table[index+1] > size - charsStart )
+      throw std::string("ModelFile::String - string index out of range");
+
+   return (const char*)table + charsStart + table[index+1];
+}
+
+
+
+/*
+Function:   InitMatHeader
+Purpose:    points mat at a float matrix section, no data is copied
+Notes:      stride is the number of floats per row stored in the file
+Throws      std::string if the section is missing or too small
+returns:    void
+*/
+void ModelFile::InitMatHeader( unsigned int id, CvMat* mat, int rows, int cols, int stride ) const
+{
+   const void* data = RequiredSection( id, (uint64)rows * stride * sizeof(float) );
+
+   // the mapping is read only, the recognizer only ever reads these matrices
+   cvInitMatHeader( mat, rows, cols, CV_32FC1, (void*)data, stride * sizeof(float) );
+}
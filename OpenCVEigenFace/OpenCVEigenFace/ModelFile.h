@@ -0,0 +1,133 @@
+#ifndef MODELFILE_H
+#define MODELFILE_H
+
+/*
+   ModelFile.h
+   Description:   binary format of the trained database.  The file is a header, a section table
+                  and the sections, each section starts on a MODEL_FILE_ALIGN byte boundary so the
+                  recognizer can map the file and use the matrices in place without parsing them.
+
+   Layout:        ModelFileHeader
+                  ModelSectionEntry[m_nSections]
+                  sections, aligned
+
+   Notes:         values are stored in the byte order of the machine that trained the database
+*/
+
+#include "Utilities.h"
+#include "MappedFile.h"
+#include <vector>
+
+
+#define MODEL_FILE_MAGIC      0x41444C46     // "FLDA"
+#define MODEL_FILE_VERSION    3              // 2: centroid rows padded to AlignedStride, 3: m_ModelID
+#define MODEL_FILE_ALIGN      64             // alignment of every section and of every matrix row
+
+
+// the sections stored in a model file
+enum ModelSectionID
+{
+   MODEL_SECTION_NAMES = 1,         // string table, name of each class
+   MODEL_SECTION_CLASS_IDS,         // int per class, person id of each class
+   MODEL_SECTION_PROJECTION,        // float, m_nFisherFaces rows of m_ProjectionStride, fused LDA * PCA projection
+   MODEL_SECTION_PROJECTED_MEAN,    // float, m_nFisherFaces, projection of the average image
+   MODEL_SECTION_CENTROIDS,         // float, m_nClasses rows of m_CentroidStride, each class's projected average, zero padded
+   MODEL_SECTION_THRESHOLDS,        // float per class, largest distance of a training image from its class centroid
+   MODEL_SECTION_IMAGE_IDS,         // int per training image, person id
+   MODEL_SECTION_IMAGE_NAMES,       // string table, file name of each training image
+   MODEL_SECTION_IMAGE_HASHES,      // uint64 per training image, StageCache hash of its contents, only with a stage cache
+   MODEL_SECTION_STAGE_KEYS         // 3 uint64, StageCache keys of the subspace and projection and the PCA options key, only with a stage cache
+};
+
+
+struct ModelFileHeader
+{
+   unsigned int   m_Magic;
+   unsigned int   m_Version;
+   unsigned int   m_HeaderSize;           // sizeof(ModelFileHeader)
+   unsigned int   m_nSections;            // entries in the section table following the header
+   int            m_Width;                // training image width
+   int            m_Height;               // training image height
+   int            m_nImages;              // number of training images
+   int            m_nClasses;             // number of people
+   int            m_nFisherFaces;         // dimension of the fisher space
+   int            m_ProjectionStride;     // floats per row of MODEL_SECTION_PROJECTION
+   int            m_CentroidStride;       // floats per row of MODEL_SECTION_CENTROIDS
+   int            m_nEigenFaces;          // dimension of the PCA space the fisher space was found in
+   double         m_EuclideanThreshold;
+   uint64         m_ModelID;              // StageHash of the projection and projected mean, the gallery and its log
+                                          // store it so they are never loaded with a model they were not projected with
+};
+
+
+struct ModelSectionEntry
+{
+   unsigned int   m_ID;                   // ModelSectionID
+   unsigned int   m_Reserved;
+   uint64         m_Offset;               // from the start of the file
+   uint64         m_Size;                 // in bytes
+};
+
+
+// number of floats to store a row of cols floats so the next row stays aligned
+int AlignedStride( int cols );
+
+
+
+/*
+   ModelFileWriter collects the sections of a model then writes the file in one go.
+   String tables are stored as a count, count+1 offsets into the characters, then the
+   nul terminated characters.
+*/
+class ModelFileWriter
+{
+public:
+   ModelFileWriter();
+
+   ModelFileHeader& Header() { return m_Header; }
+
+   void AddSection( unsigned int id, const void* data, uint64 size );
+   void AddStringTable( unsigned int id, const std::vector<std::string>& strings );
+   void AddMatrix( unsigned int id, const CvMat* mat, int stride );
+
+   void Write( const char* filename );
+
+private:
+   ModelFileHeader                  m_Header;
+   std::vector<unsigned int>        m_SectionIDs;
+   std::vector< std::vector<char> > m_Sections;
+};
+
+
+
+/*
+   ModelFile maps a model written by ModelFileWriter.  Nothing is copied, all of the
+   pointers it hands out point into the mapping and are valid until the ModelFile is destroyed.
+*/
+class ModelFile
+{
+public:
+   ModelFile();
+
+   void Open( const char* filename );
+
+   const ModelFileHeader& Header() const { return *m_Header; }
+
+   const void* Section( unsigned int id, uint64* size = NULL ) const;
+   const void* RequiredSection( unsigned int id, uint64 size ) const;
+
+   int         StringCount( unsigned int id ) const;
+   const char* String( unsigned int id, int index ) const;
+
+   void        InitMatHeader( unsigned int id, CvMat* mat, int rows, int cols, int stride ) const;
+
+private:
+   MappedFile                 m_File;
+   std::string                m_FileName;
+   const ModelFileHeader*     m_Header;
+   const ModelSectionEntry*   m_Sections;
+};
+
+
+
+#endif
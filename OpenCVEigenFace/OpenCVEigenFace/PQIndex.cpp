@@ -0,0 +1,348 @@
+#include "PQIndex.h"
+#include <fstream>
+#include <float.h>
+#include <algorithm>
+
+
+
+/*
+Function:   PQIndexFileName
+Purpose:    name of the product quantized index of a database
+Notes:
+Throws
+returns:    database with .pq appended
+*/
+std::string PQIndexFileName( const char* database )
+{
+   std::string name(database);
+   name += ".pq";
+   return name;
+}
+
+
+
+/*
+Function:   PQIndex constructor
+Purpose:
+Notes:      nSubspaces is the number of bytes stored per vector, it is reduced to the vector
+            length if the vectors are shorter
+Throws      std::string if nSubspaces is not positive
+*/
+PQIndex::PQIndex( int nSubspaces ) : m_nSubspaces(nSubspaces), m_nCentroids(0), m_SubDim(0), m_Dim(0), m_nVectors(0)
+{
+   if ( m_nSubspaces < 1 )
+      throw std::string("PQIndex - there should be at least 1 subspace");
+}
+
+
+
+/*
+Function:   Build
+Purpose:    trains the codebooks on the vectors then encodes every vector
+Notes:      vectors are nVectors rows of stride floats, only the first dim floats of each are used
+Throws      std::string if the codebooks can't be trained
+returns:    void
+*/
+void PQIndex::Build( const float* vectors, int nVectors, int stride, int dim )
+{
+   m_Dim = dim;
+   m_nSubspaces = std::min( m_nSubspaces, dim );
+   m_SubDim = ( dim + m_nSubspaces - 1 ) / m_nSubspaces;
+   m_nSubspaces = ( dim + m_SubDim - 1 ) / m_SubDim;      // no piece is all padding
+   m_nVectors = nVectors;
+   m_Codebooks.clear();
+   m_Codes.clear();
+
+   if ( nVectors == 0 )
+   {
+      m_nCentroids = 0;
+      return;
+   }
+
+   TrainCodebooks( vectors, nVectors, stride );
+
+   m_Codes.resize( (size_t)nVectors * m_nSubspaces );
+   for ( int row = 0; row < nVectors; row++ )
+      Encode( vectors + (size_t)row * stride, &m_Codes[(size_t)row * m_nSubspaces] );
+}
+
+
+
+/*
+Function:   Search
+Purpose:    finds the k vectors closest to query
+Notes:      every code is scanned with the asymmetric distance keeping the nRerank closest, those are
+            re-ranked with the exact distance to their rows of vectors.  best must have room for k,
+            it is filled closest first with exact distances.  A skipped code is not scored
+Throws
+returns:    number of vectors in best
+*/
+int PQIndex::Search( const float* vectors, int stride, const float* query, int k, int nRerank, RowDistance* best, PQScratch& scratch,
+                     const unsigned char* skip ) const
+{
+   if ( m_nVectors == 0 || k <= 0 )
+      return 0;
+
+   // distance from each piece of the query to each codeword
+   std::vector<float>& table = scratch.m_Table;
+   table.resize( m_nSubspaces * m_nCentroids );
+   for ( int s = 0; s < m_nSubspaces; s++ )
+   {
+      for ( int c = 0; c < m_nCentroids; c++ )
+      {
+         const float* codeword = &m_Codebooks[ ((size_t)s * m_nCentroids + c) * m_SubDim ];
+         float d = 0.0f;
+         for ( int j = 0; j < m_SubDim; j++ )
+         {
+            float diff = Piece(query, s, j) - codeword[j];
+            d += diff * diff;
+         }
+         table[s * m_nCentroids + c] = d;
+      }
+   }
+
+   // bounded max heap of the closest codes, like ClosestRows
+   int nCandidates = std::min( std::max(k, nRerank), m_nVectors );
+   std::vector<RowDistance>& candidates = scratch.m_Candidates;
+   candidates.clear();
+
+   const uchar* code = &m_Codes[0];
+   for ( int row = 0; row < m_nVectors; row++, code += m_nSubspaces )
+   {
+      if ( skip && skip[row] )
+         continue;
+
+      RowDistance candidate;
+      candidate.m_Distance = 0.0f;
+      candidate.m_Row = row;
+      for ( int s = 0; s < m_nSubspaces; s++ )
+         candidate.m_Distance += table[s * m_nCentroids + code[s]];
+
+      if ( (int)candidates.size() < nCandidates )
+      {
+         candidates.push_back(candidate);
+         std::push_heap( candidates.begin(), candidates.end() );
+      }
+      else if ( candidate < candidates.front() )
+      {
+         std::pop_heap( candidates.begin(), candidates.end() );
+         candidates.back() = candidate;
+         std::push_heap( candidates.begin(), candidates.end() );
+      }
+   }
+
+   // re-rank with the exact rows
+   for ( size_t i = 0; i < candidates.size(); i++ )
+      candidates[i].m_Distance = SquaredDistance( query, vectors + (size_t)candidates[i].m_Row * stride, stride );
+   std::sort( candidates.begin(), candidates.end() );
+
+   int nFound = std::min( k, (int)candidates.size() );
+   for ( int i = 0; i < nFound; i++ )
+      best[i] = candidates[i];
+
+   return nFound;
+}
+
+
+
+/*
+Function:   Save
+Purpose:    writes the codebooks and codes to filename
+Notes:      written next to filename then renamed, so a failed write never leaves a half written index
+            that a recognizer would load
+Throws      std::string if the file can not be written
+returns:    void
+*/
+void PQIndex::Save( const char* filename ) const
+{
+   std::string tempname = filename;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "PQIndex::Save could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   int header[7] = { PQ_FILE_MAGIC, PQ_FILE_VERSION, m_nSubspaces, m_nCentroids, m_SubDim, m_Dim, m_nVectors };
+   out.write( (const char*)header, sizeof(header) );
+   if ( !m_Codebooks.empty() )
+      out.write( (const char*)&m_Codebooks[0], m_Codebooks.size() * sizeof(float) );
+   if ( !m_Codes.empty() )
+      out.write( (const char*)&m_Codes[0], m_Codes.size() );
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "PQIndex::Save could not write ";
+      err += tempname;
+      throw err;
+   }
+
+#ifdef _WIN32
+   remove(filename);
+#endif
+   if ( rename(tempname.c_str(), filename) != 0 )
+   {
+      std::string err = "PQIndex::Save could not rename ";
+      err += tempname;
+      throw err;
+   }
+}
+
+
+
+/*
+Function:   Load
+Purpose:    reads an index written by Save
+Notes:
+Throws      std::string if the file can not be read or is not an index
+returns:    void
+*/
+void PQIndex::Load( const char* filename )
+{
+   std::string err = "PQIndex::Load - not a valid index: ";
+   err += filename;
+
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      throw err;
+
+   int header[7];
+   in.read( (char*)header, sizeof(header) );
+   if ( !in || header[0] != PQ_FILE_MAGIC || header[1] != PQ_FILE_VERSION || header[2] < 1 ||
+        header[3] < 0 || header[3] > PQ_MAX_CENTROIDS || header[4] < 0 || header[5] < 0 || header[6] < 0 ||
+        header[2] * header[4] < header[5] || ( header[6] > 0 && header[3] == 0 ) )
+      throw err;
+
+   m_nSubspaces = header[2];
+   m_nCentroids = header[3];
+   m_SubDim = header[4];
+   m_Dim = header[5];
+   m_nVectors = header[6];
+
+   m_Codebooks.resize( (size_t)m_nSubspaces * m_nCentroids * m_SubDim );
+   m_Codes.resize( (size_t)m_nVectors * m_nSubspaces );
+   if ( !m_Codebooks.empty() )
+      in.read( (char*)&m_Codebooks[0], m_Codebooks.size() * sizeof(float) );
+   if ( !m_Codes.empty() )
+      in.read( (char*)&m_Codes[0], m_Codes.size() );
+   if ( !in )
+      throw err;
+
+   for ( size_t i = 0; i < m_Codes.size(); i++ )
+   {
+      if ( m_Codes[i] >= m_nCentroids )
+         throw err;
+   }
+}
+
+
+
+/*
+Function:   TrainCodebooks
+Purpose:    clusters each subspace with k-means, the cluster centers are the codewords
+Notes:      at most PQ_TRAINING_SAMPLES rows, spread evenly over the vectors, are clustered
+Throws      std::string if k-means fails
+returns:    void
+*/
+void PQIndex::TrainCodebooks( const float* vectors, int nVectors, int stride )
+{
+   int nSamples = std::min( nVectors, PQ_TRAINING_SAMPLES );
+   m_nCentroids = std::min( nSamples, PQ_MAX_CENTROIDS );
+   m_Codebooks.resize( (size_t)m_nSubspaces * m_nCentroids * m_SubDim );
+
+   CvMat* samples = cvCreateMat( nSamples, m_SubDim, CV_32FC1 );
+   CvMat* labels = cvCreateMat( nSamples, 1, CV_32SC1 );
+   CvMat* centers = cvCreateMat( m_nCentroids, m_SubDim, CV_32FC1 );
+
+   try
+   {
+      for ( int s = 0; s < m_nSubspaces; s++ )
+      {
+         for ( int i = 0; i < nSamples; i++ )
+         {
+            const float* vector = vectors + ( (uint64)i * nVectors / nSamples ) * stride;
+            float* sample = (float*)(samples->data.ptr + (size_t)i * samples->step);
+            for ( int j = 0; j < m_SubDim; j++ )
+               sample[j] = Piece(vector, s, j);
+         }
+
+         // same seed every time so the same vectors give the same index
+         CvRNG rng = cvRNG(0x50510000 + s);
+         cvKMeans2( samples, m_nCentroids, labels, cvTermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 25, 1e-4),
+                    1, &rng, 0, centers );
+
+         for ( int c = 0; c < m_nCentroids; c++ )
+         {
+            const float* center = (const float*)(centers->data.ptr + (size_t)c * centers->step);
+            std::copy( center, center + m_SubDim, &m_Codebooks[ ((size_t)s * m_nCentroids + c) * m_SubDim ] );
+         }
+      }
+   }
+   catch (...)
+   {
+      cvReleaseMat(&samples);
+      cvReleaseMat(&labels);
+      cvReleaseMat(&centers);
+      throw std::string("PQIndex::TrainCodebooks k-means failed");
+   }
+
+   cvReleaseMat(&samples);
+   cvReleaseMat(&labels);
+   cvReleaseMat(&centers);
+}
+
+
+
+/*
+Function:   Encode
+Purpose:    finds the closest codeword to each piece of a vector
+Notes:      code has room for m_nSubspaces bytes
+Throws
+returns:    void
+*/
+void PQIndex::Encode( const float* vector, uchar* code ) const
+{
+   for ( int s = 0; s < m_nSubspaces; s++ )
+   {
+      float bestDistance = FLT_MAX;
+      int bestCentroid = 0;
+
+      for ( int c = 0; c < m_nCentroids; c++ )
+      {
+         const float* codeword = &m_Codebooks[ ((size_t)s * m_nCentroids + c) * m_SubDim ];
+         float d = 0.0f;
+         for ( int j = 0; j < m_SubDim; j++ )
+         {
+            float diff = Piece(vector, s, j) - codeword[j];
+            d += diff * diff;
+         }
+
+         if ( d < bestDistance )
+         {
+            bestDistance = d;
+            bestCentroid = c;
+         }
+      }
+
+      code[s] = (uchar)bestCentroid;
+   }
+}
+
+
+
+/*
+Function:   Piece
+Purpose:    value j of piece subspace of a vector
+Notes:      the last piece runs past m_Dim when m_Dim is not a multiple of m_nSubspaces, those values are 0
+Throws
+returns:    the value
+*/
+float PQIndex::Piece( const float* vector, int subspace, int j ) const
+{
+   int index = subspace * m_SubDim + j;
+   return index < m_Dim ? vector[index] : 0.0f;
+}
@@ -0,0 +1,83 @@
+#ifndef PQINDEX_H
+#define PQINDEX_H
+
+/*
+   PQIndex.h
+   Description:   product quantized copy of the projected classes.  Each class vector is split into
+                  m_nSubspaces pieces and each piece is stored as the byte index of its closest
+                  codeword, so a class takes m_nSubspaces bytes instead of a padded row of floats.
+
+   Notes:         a search builds a table of the distance from each piece of the probe to every
+                  codeword, then the distance to a class is m_nSubspaces table lookups (asymmetric
+                  distance).  The closest candidates found that way are re-ranked with the exact
+                  float rows, which stay in the model and are passed to Search the same way as
+                  HNSWIndex: padded to a multiple of DISTANCE_KERNEL_WIDTH and aligned.
+
+                  Jegou, Douze and Schmid, "Product quantization for nearest neighbor search"
+*/
+
+#include "Utilities.h"
+#include "DistanceKernel.h"
+#include <vector>
+
+
+#define PQ_FILE_MAGIC            0x49515150     // "PQQI"
+#define PQ_FILE_VERSION          1
+
+#define PQ_MAX_CENTROIDS         256            // codewords per subspace, codes are one byte
+#define PQ_DEFAULT_SUBSPACES     16             // bytes per class
+#define PQ_DEFAULT_RERANK        64             // candidates re-ranked with the exact rows
+#define PQ_TRAINING_SAMPLES      65536          // most rows used to train the codebooks
+
+
+/*
+   PQScratch holds the lookup table and candidate heap of a search so searches do not allocate.
+   Each thread searching needs its own.
+*/
+struct PQScratch
+{
+   std::vector<float>         m_Table;       // m_nSubspaces tables of m_nCentroids distances
+   std::vector<RowDistance>   m_Candidates;  // closest by asymmetric distance, farthest on top
+};
+
+
+
+// name of the product quantized index stored next to a database
+std::string PQIndexFileName( const char* database );
+
+
+
+class PQIndex
+{
+public:
+   PQIndex( int nSubspaces = PQ_DEFAULT_SUBSPACES );
+
+   void Build( const float* vectors, int nVectors, int stride, int dim );
+
+   // vectors with skip[row] set are never returned, a NULL skip returns any vector
+   int  Search( const float* vectors, int stride, const float* query, int k, int nRerank, RowDistance* best, PQScratch& scratch,
+                const unsigned char* skip = NULL ) const;
+
+   void Save( const char* filename ) const;
+   void Load( const char* filename );
+
+   int  Size() const { return m_nVectors; }
+   bool Empty() const { return m_nVectors == 0; }
+
+private:
+   void  TrainCodebooks( const float* vectors, int nVectors, int stride );
+   void  Encode( const float* vector, uchar* code ) const;
+   float Piece( const float* vector, int subspace, int j ) const;
+
+   int                  m_nSubspaces;
+   int                  m_nCentroids;        // codewords per subspace, at most PQ_MAX_CENTROIDS
+   int                  m_SubDim;            // floats per piece, the last piece is zero padded
+   int                  m_Dim;               // real length of the vectors
+   int                  m_nVectors;
+
+   std::vector<float>   m_Codebooks;         // m_nSubspaces * m_nCentroids codewords of m_SubDim floats
+   std::vector<uchar>   m_Codes;             // m_nVectors codes of m_nSubspaces bytes
+};
+
+
+#endif
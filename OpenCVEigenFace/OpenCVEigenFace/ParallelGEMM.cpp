@@ -0,0 +1,145 @@
+#include "ParallelGEMM.h"
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+
+/*
+Function:   ParallelGEMM
+Purpose:    D = alpha * op(A) * op(B) with the rows or the columns of D split between threads
+Notes:      a panel of D's rows only needs the same rows of op(A), and a panel of D's columns the same
+            columns of op(B), so the panels are independent.  D is split whichever way gives more panels,
+            up to one per thread.  Randomized PCA multiplies k + oversample rows by the whole data matrix,
+            split by rows that is only one or two panels.
+            The sizes are checked first because an error thrown inside a parallel loop can't be caught
+Throws      std::string if the matrices do not fit together
+returns:    void
+*/
+void ParallelGEMM( const CvMat* A, const CvMat* B, double alpha, CvMat* D, int tABC )
+{
+   bool aTransposed = ( tABC & CV_GEMM_A_T ) != 0;
+   bool bTransposed = ( tABC & CV_GEMM_B_T ) != 0;
+
+   int aRows = aTransposed ? A->cols : A->rows;
+   int aCols = aTransposed ? A->rows : A->cols;
+   int bRows = bTransposed ? B->cols : B->rows;
+   int bCols = bTransposed ? B->rows : B->cols;
+
+   if ( ( tABC & CV_GEMM_C_T ) || aCols != bRows || D->rows != aRows || D->cols != bCols ||
+        CV_MAT_TYPE(A->type) != CV_MAT_TYPE(B->type) || CV_MAT_TYPE(A->type) != CV_MAT_TYPE(D->type) )
+      throw std::string("ParallelGEMM - matrix sizes or types do not match");
+
+   int nThreads = 1;
+#ifdef _OPENMP
+   nThreads = omp_get_max_threads();
+#endif
+
+   // one panel per thread unless that makes the panels too small
+   int rows = D->rows;
+   int panelRows = std::max( (rows + nThreads - 1) / nThreads, PARALLEL_GEMM_PANEL_ROWS );
+   int nPanels = (rows + panelRows - 1) / panelRows;
+
+   int cols = D->cols;
+   int panelCols = std::max( (cols + nThreads - 1) / nThreads, PARALLEL_GEMM_PANEL_COLS );
+   int nColPanels = (cols + panelCols - 1) / panelCols;
+
+   if ( nPanels <= 1 && nColPanels <= 1 )
+   {
+      cvGEMM( A, B, alpha, NULL, 0, D, tABC );
+      return;
+   }
+
+   if ( nColPanels > nPanels )
+   {
+#pragma omp parallel for schedule(static)
+      for ( int panel = 0; panel < nColPanels; panel++ )
+      {
+         int first = panel * panelCols;
+         int last = std::min( first + panelCols, cols );
+
+         // columns of op(B) are rows of B when it is transposed
+         CvMat BPanel, DPanel;
+         if ( bTransposed )
+            cvGetRows( B, &BPanel, first, last );
+         else
+            cvGetCols( B, &BPanel, first, last );
+         cvGetCols( D, &DPanel, first, last );
+
+         cvGEMM( A, &BPanel, alpha, NULL, 0, &DPanel, tABC );
+      }
+      return;
+   }
+
+#pragma omp parallel for schedule(static)
+   for ( int panel = 0; panel < nPanels; panel++ )
+   {
+      int first = panel * panelRows;
+      int last = std::min( first + panelRows, rows );
+
+      CvMat APanel, DPanel;
+      if ( aTransposed )
+         cvGetCols( A, &APanel, first, last );
+      else
+         cvGetRows( A, &APanel, first, last );
+      cvGetRows( D, &DPanel, first, last );
+
+      cvGEMM( &APanel, B, alpha, NULL, 0, &DPanel, tABC );
+   }
+}
+
+
+
+/*
+Function:   ParallelMulTransposed
+Purpose:    D = A^T * A with the rows of D split between threads
+Notes:      each panel of D's rows only multiplies from the diagonal to the right, about half the work
+            of a GEMM.  The panels on the left are the widest, so they are handed out dynamically
+Throws      std::string if the matrices do not fit together or are not both float or both double
+returns:    void
+*/
+void ParallelMulTransposed( const CvMat* A, CvMat* D )
+{
+   int d = A->cols;
+   int type = CV_MAT_TYPE(A->type);
+
+   if ( D->rows != d || D->cols != d || ( type != CV_32FC1 && type != CV_64FC1 ) || CV_MAT_TYPE(D->type) != type )
+      throw std::string("ParallelMulTransposed - matrix sizes or types do not match");
+
+   int nPanels = (d + PARALLEL_GEMM_PANEL_ROWS - 1) / PARALLEL_GEMM_PANEL_ROWS;
+
+#pragma omp parallel for schedule(dynamic)
+   for ( int panel = 0; panel < nPanels; panel++ )
+   {
+      int first = panel * PARALLEL_GEMM_PANEL_ROWS;
+      int last = std::min( first + PARALLEL_GEMM_PANEL_ROWS, d );
+
+      // D[first..last, first..d] = A[:, first..last]^T * A[:, first..d]
+      CvMat APanel, ARight, DPanel;
+      cvGetCols( A, &APanel, first, last );
+      cvGetCols( A, &ARight, first, d );
+      cvGetSubRect( D, &DPanel, cvRect(first, first, d - first, last - first) );
+
+      cvGEMM( &APanel, &ARight, 1, NULL, 0, &DPanel, CV_GEMM_A_T );
+   }
+
+   // copy the upper triangle to the lower
+#pragma omp parallel for schedule(static)
+   for ( int row = 1; row < d; row++ )
+   {
+      if ( type == CV_32FC1 )
+      {
+         float* lower = (float*)(D->data.ptr + (size_t)row * D->step);
+         for ( int col = 0; col < row; col++ )
+            lower[col] = ((const float*)(D->data.ptr + (size_t)col * D->step))[row];
+      }
+      else
+      {
+         double* lower = (double*)(D->data.ptr + (size_t)row * D->step);
+         for ( int col = 0; col < row; col++ )
+            lower[col] = ((const double*)(D->data.ptr + (size_t)col * D->step))[row];
+      }
+   }
+}
@@ -0,0 +1,30 @@
+#ifndef PARALLELGEMM_H
+#define PARALLELGEMM_H
+
+/*
+   ParallelGEMM.h
+   Description:   matrix multiply for the large training matrices, the rows of the result are split into
+                  panels and each panel is a separate cvGEMM run on its own thread.  A result with too few
+                  rows to give every thread a panel, like the products of randomized PCA, is split into
+                  panels of columns instead.
+
+   Notes:         threads come from OpenMP, without it the panels run one after another.  Each row panel
+                  reads all of op(B) once and each column panel all of op(A), so panels are kept large
+                  enough that they are not re-read too often
+*/
+
+#include "Utilities.h"
+
+
+#define PARALLEL_GEMM_PANEL_ROWS    64       // fewest rows of the result per panel
+#define PARALLEL_GEMM_PANEL_COLS    256      // fewest columns of the result per panel
+
+
+// D = alpha * op(A) * op(B), tABC can have CV_GEMM_A_T and CV_GEMM_B_T
+void ParallelGEMM( const CvMat* A, const CvMat* B, double alpha, CvMat* D, int tABC = 0 );
+
+// D = A^T * A for float or double matrices, only the upper triangle is multiplied then it is copied to the lower (SYRK)
+void ParallelMulTransposed( const CvMat* A, CvMat* D );
+
+
+#endif
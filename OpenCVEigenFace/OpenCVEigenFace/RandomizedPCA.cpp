@@ -0,0 +1,162 @@
+#include "RandomizedPCA.h"
+#include "ParallelGEMM.h"
+#include <algorithm>
+#include <math.h>
+
+
+#define RANDOMIZED_PCA_RANK_EPSILON    1e-6     // directions this small relative to the largest are dropped
+
+
+
+/*
+Function:   OrthonormalizeRows
+Purpose:    makes the rows of m orthonormal, spanning the same space
+Notes:      m = V^T m scaled by 1/sqrt of the eigenvalues of m * m^T, so all of the work is GEMMs.
+            Rows that are not independent come out as zero.  Done twice because the first pass loses
+            accuracy when the rows are close to dependent
+Throws
+returns:    void
+*/
+static void OrthonormalizeRows( CvMat* m )
+{
+   int n = m->rows;
+
+   CvMat* gram = cvCreateMat( n, n, CV_32FC1 );
+   CvMat* gram64 = cvCreateMat( n, n, CV_64FC1 );
+   CvMat* evects = cvCreateMat( n, n, CV_64FC1 );
+   CvMat* evals = cvCreateMat( n, 1, CV_64FC1 );
+   CvMat* whiten = cvCreateMat( n, n, CV_32FC1 );
+   CvMat* result = cvCreateMat( n, m->cols, CV_32FC1 );
+
+   try
+   {
+      for ( int pass = 0; pass < 2; pass++ )
+      {
+         ParallelGEMM( m, m, 1, gram, CV_GEMM_B_T );
+         cvConvert( gram, gram64 );
+         cvEigenVV( gram64, evects, evals, DBL_EPSILON );
+
+         double largest = evals->data.db[0];
+         for ( int i = 0; i < n; i++ )
+         {
+            double eval = evals->data.db[i];
+            double scale = ( eval > largest * RANDOMIZED_PCA_RANK_EPSILON && eval > 0.0 ) ? 1.0 / sqrt(eval) : 0.0;
+
+            for ( int j = 0; j < n; j++ )
+               whiten->data.fl[i*n+j] = (float)( evects->data.db[i*n+j] * scale );
+         }
+
+         ParallelGEMM( whiten, m, 1, result, 0 );
+         cvCopy( result, m );
+      }
+   }
+   catch (...)
+   {
+      cvReleaseMat(&gram);
+      cvReleaseMat(&gram64);
+      cvReleaseMat(&evects);
+      cvReleaseMat(&evals);
+      cvReleaseMat(&whiten);
+      cvReleaseMat(&result);
+      throw;
+   }
+
+   cvReleaseMat(&gram);
+   cvReleaseMat(&gram64);
+   cvReleaseMat(&evects);
+   cvReleaseMat(&evals);
+   cvReleaseMat(&whiten);
+   cvReleaseMat(&result);
+}
+
+
+
+/*
+Function:   RandomizedPCA
+Purpose:    finds the k largest eigenvalues of data * data^T and the matching eigenvectors of data^T * data
+Notes:      l = k + oversample random combinations of data's columns give a basis Q for the space holding
+            the top components.  Each power iteration multiplies by data * data^T, which pushes the
+            basis towards the top components.  Then B = Q^T * data is only l rows, and B * B^T = U S^2 U^T
+            gives the eigenvalues S^2 and the eigenvectors U^T * B / S.
+            The random numbers are seeded the same every time so training is repeatable
+Throws      std::string if k is too large or the output matrices are the wrong size
+returns:    void
+*/
+void RandomizedPCA( const CvMat* data, int k, int oversample, int nPowerIterations, CvMat* eigenVectors, CvMat* eigenValues )
+{
+   int N = data->rows;
+   int P = data->cols;
+
+   if ( k < 1 || k > std::min(N, P) || eigenVectors->rows != k || eigenVectors->cols != P || eigenValues->rows * eigenValues->cols != k )
+      throw std::string("RandomizedPCA - number of components or output size is not valid");
+
+   int l = std::min( k + std::max(oversample, 0), std::min(N, P) );
+
+   CvMat* omega = cvCreateMat( l, P, CV_32FC1 );
+   CvMat* basis = cvCreateMat( l, N, CV_32FC1 );      // Q^T, rows span the top of data's column space
+   CvMat* range = cvCreateMat( l, P, CV_32FC1 );      // Q^T * data
+   CvMat* gram = cvCreateMat( l, l, CV_32FC1 );
+   CvMat* gram64 = cvCreateMat( l, l, CV_64FC1 );
+   CvMat* evects = cvCreateMat( l, l, CV_64FC1 );
+   CvMat* evals = cvCreateMat( l, 1, CV_64FC1 );
+   CvMat* rotation = cvCreateMat( k, l, CV_32FC1 );
+
+   try
+   {
+      CvRNG rng = cvRNG(0x52504341);
+      cvRandArr( &rng, omega, CV_RAND_NORMAL, cvRealScalar(0), cvRealScalar(1) );
+
+      // basis = (data * omega^T)^T, stored transposed so each basis vector is a row
+      ParallelGEMM( omega, data, 1, basis, CV_GEMM_B_T );
+      OrthonormalizeRows( basis );
+
+      for ( int i = 0; i < nPowerIterations; i++ )
+      {
+         ParallelGEMM( basis, data, 1, range, 0 );
+         OrthonormalizeRows( range );
+         ParallelGEMM( range, data, 1, basis, CV_GEMM_B_T );
+         OrthonormalizeRows( basis );
+      }
+
+      // B = Q^T * data, then the small eigen problem B * B^T
+      ParallelGEMM( basis, data, 1, range, 0 );
+      ParallelGEMM( range, range, 1, gram, CV_GEMM_B_T );
+      cvConvert( gram, gram64 );
+      cvEigenVV( gram64, evects, evals, DBL_EPSILON );
+
+      // eigenvector i = U_i^T * B / s_i
+      for ( int i = 0; i < k; i++ )
+      {
+         double eval = std::max( evals->data.db[i], 0.0 );
+         double scale = eval > 0.0 ? 1.0 / sqrt(eval) : 0.0;
+
+         for ( int j = 0; j < l; j++ )
+            rotation->data.fl[i*l+j] = (float)( evects->data.db[i*l+j] * scale );
+
+         eigenValues->data.fl[i] = (float)eval;
+      }
+
+      ParallelGEMM( rotation, range, 1, eigenVectors, 0 );
+   }
+   catch (...)
+   {
+      cvReleaseMat(&omega);
+      cvReleaseMat(&basis);
+      cvReleaseMat(&range);
+      cvReleaseMat(&gram);
+      cvReleaseMat(&gram64);
+      cvReleaseMat(&evects);
+      cvReleaseMat(&evals);
+      cvReleaseMat(&rotation);
+      throw;
+   }
+
+   cvReleaseMat(&omega);
+   cvReleaseMat(&basis);
+   cvReleaseMat(&range);
+   cvReleaseMat(&gram);
+   cvReleaseMat(&gram64);
+   cvReleaseMat(&evects);
+   cvReleaseMat(&evals);
+   cvReleaseMat(&rotation);
+}
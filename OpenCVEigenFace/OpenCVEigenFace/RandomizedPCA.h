@@ -0,0 +1,28 @@
+#ifndef RANDOMIZEDPCA_H
+#define RANDOMIZEDPCA_H
+
+/*
+   RandomizedPCA.h
+   Description:   finds the top principal components of a large set of images without forming the
+                  images x images covariance matrix.  A random projection finds a small subspace that
+                  holds the top components, a few power iterations sharpen it, then only a
+                  (k + oversample) sized problem is decomposed exactly.
+
+   Notes:         all of the large products go through ParallelGEMM.
+                  Halko, Martinsson and Tropp, "Finding structure with randomness: Probabilistic
+                  algorithms for constructing approximate matrix decompositions"
+*/
+
+#include "Utilities.h"
+
+
+#define RANDOMIZED_PCA_DEFAULT_OVERSAMPLE       10     // extra directions searched beyond k
+#define RANDOMIZED_PCA_DEFAULT_POWER_ITERATIONS 2      // more is slower but more accurate when the eigenvalues decay slowly
+
+
+// data is N rows of P floats, already centered.  eigenVectors gets k rows of P floats, unit length,
+// eigenValues gets k floats in decreasing order, the eigenvalues of data * data^T like cvCalcEigenObjects
+void RandomizedPCA( const CvMat* data, int k, int oversample, int nPowerIterations, CvMat* eigenVectors, CvMat* eigenValues );
+
+
+#endif
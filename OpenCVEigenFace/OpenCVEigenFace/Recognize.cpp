@@ -2,13 +2,16 @@
 #include "FaceDetector.h"
 #include "PreProcess.h"
 #include <fstream>
+#include <algorithm>
 #include "HTMLHelper.h"
 
 /* 
 Function:   Recognize
 Purpose:    Recognize a face 
 Arguments:  1) the image with the face to recognize 2) the trained database
-Notes:      Function will return empty string if we don't find the person
+Notes:      Function will return empty string if we don't find the person.
+            This loads the database for a single search, callers doing more than one
+            search should keep a Recognizer around instead
 Returns:    std::string with persons name we found
 Throws:     std::string if it can't open file or create memory
 */
@@ -17,12 +20,10 @@ std::string Recognize( const char* image, const char* database, double& distance
    std::string personFound = "";
    try
    {
-      Recognizer r(image, database);
-      r.LoadTrainingDatabase();
+      Recognizer r(database, true);
 
       // find the person
-      std::string foundPerson = "";
-      personFound = r.FindFace(0, distance);
+      personFound = r.Recognize(image, distance);
    }
    catch (...)
    {
@@ -36,49 +37,935 @@ std::string Recognize( const char* image, const char* database, double& distance
 
 /* 
 Function:   Recognizer class constructor
-Purpose:     
-Arguments:  1) the image with the face to recognize 2) the trained database
+Purpose:    loads the trained database so the recognizer is ready to search
+Arguments:  1) the trained database 2) true to only search it, nothing is written and it can't be changed
+Notes:      the destructor does not run if this throws, so the gallery is freed here
+Throws:     std::string if it can't open file or create memory, or the database is already open for
+            changes by another recognizer and bSearchOnly is false
+*/
+Recognizer::Recognizer( const char* database, bool bSearchOnly ) : m_DatabaseName(database), m_bSearchOnly(bSearchOnly), m_nImages(0),
+   m_Width(0), m_Height(0), m_ImageIDs(NULL), m_EuclideanThreshold(0.0), m_nClasses(0), m_nEigenFaces(0), m_nFisherFaces(0),
+   m_CentroidStride(0), m_Gallery(NULL),
+   m_SearchMode(SEARCH_EXACT), m_EfSearch(HNSW_DEFAULT_EF_SEARCH), m_nRerank(PQ_DEFAULT_RERANK), m_IDFound(0), m_DistanceFound(0.0), m_PersonFound("")
+{
+   try
+   {
+      LoadTrainingDatabase();
+      m_Workspace = cv::Ptr<Workspace>( new Workspace(*this) );
+   }
+   catch (...)
+   {
+      FreeGalleries();
+      throw;
+   }
+}
+
+
+
+
+/* 
+Function:   Recognizer class destructor
+Purpose:    clean up memory that Recognizer uses     
 Notes:      
-Throws:     std::string if it can't open file or create memory
 */
-Recognizer::Recognizer( const char* image, const char* database ) : m_DatabaseName(database), m_nPeople(0), m_nEigenVals(0), m_SearchImageName(image), m_FaceImage(NULL), m_nFacesToFind(0), m_EuclideanThreshold(0.0),
-   m_IDFound(0), m_DistanceFound(0.0), m_PersonFound("")
+Recognizer::~Recognizer()
+{
+   // the matrices point into m_Model, it unmaps the database
+   m_Workspace.release();
+   FreeGalleries();
+}
+
+
+
+
+/* 
+Function:   Recognize
+Purpose:    searches the database for the face in a probe image
+Arguments:  1) the probe face, it should already be pre-processed 2) distance to the closest face
+Notes:      can be called any number of times, the database is not reloaded
+Returns:    name of person, if it finds it, empty if it does not find the face
+Throws:     std::string if somthing goes wrong
+*/
+std::string Recognizer::Recognize( const IplImage* probe, double& distance )
+{
+   if ( !probe )
+      throw std::string("Recognizer::Recognize received null image as argument");
+
+   return FindFace(probe, distance);
+}
+
+
+
+
+/* 
+Function:   Recognize
+Purpose:    loads a probe image from disk and searches the database for the face
+Arguments:  1) the image with the face to recognize 2) distance to the closest face
+Notes:      given face should be pre-processed
+Returns:    name of person, if it finds it, empty if it does not find the face
+Throws:     std::string if it can't load the image
+*/
+std::string Recognizer::Recognize( const char* image, double& distance )
+{
+   IplImage* faceImage = cvLoadImage(image,0);  // give face should be pre-processed
+   if ( !faceImage )
+   {
+      std::string err;
+      err = "Recognizer could not load image: ";
+      err += image;
+      throw err;
+   }
+
+   std::string personFound = "";
+   try
+   {
+      personFound = FindFace(faceImage, distance);
+   }
+   catch (...)
+   {
+      cvReleaseImage(&faceImage);
+      throw;
+   }
+
+   cvReleaseImage(&faceImage);
+   return personFound;
+}
+
+
+
+
+/* 
+Function:   LoadTrainingDatabase
+Purpose:    maps the training database that was creating during the training session
+Notes:      called once by the constructor, nothing is parsed or copied.  The matrices are
+            headers pointing into the mapping.  The indexes only cover the trained classes, the
+            enrolled classes in the gallery are loaded after them and the gallery log replayed onto
+            them.  A log with a torn record at the end, from a crash while appending, or a long log
+            is checkpointed, unless the recognizer is search only.  Then the records before a torn one
+            are replayed and nothing is written
+Returns:    
+throws:     std::string if can't open training data or somthing else goes wrong
+*/
+void Recognizer::LoadTrainingDatabase()
+{
+   m_Model.Open( m_DatabaseName.c_str() );
+
+   const ModelFileHeader& header = m_Model.Header();
+   m_nImages = header.m_nImages;
+   m_Width = header.m_Width;
+   m_Height = header.m_Height;
+   m_nClasses = header.m_nClasses;
+   m_nEigenFaces = header.m_nEigenFaces;
+   m_nFisherFaces = header.m_nFisherFaces;
+   m_CentroidStride = header.m_CentroidStride;
+   m_EuclideanThreshold = header.m_EuclideanThreshold;
+
+   if ( m_nClasses < 1 || m_nFisherFaces < 1 || m_Width * m_Height > header.m_ProjectionStride ||
+        header.m_ProjectionStride % DISTANCE_KERNEL_WIDTH ||
+        m_nFisherFaces > m_CentroidStride || m_CentroidStride % DISTANCE_KERNEL_WIDTH ||
+        ( m_nEigenFaces && m_nFisherFaces > m_nEigenFaces ) )
+   {
+      std::string err = "Recognizer::LoadTrainingDatabase database header is not valid ";
+      err += m_DatabaseName;
+      throw err;
+   }
+
+   m_ImageIDs = (const personIDType*)m_Model.RequiredSection( MODEL_SECTION_IMAGE_IDS, m_nImages * sizeof(personIDType) );
+
+   if ( m_Model.StringCount( MODEL_SECTION_NAMES ) != m_nClasses || m_Model.StringCount( MODEL_SECTION_IMAGE_NAMES ) != m_nImages )
+   {
+      std::string err = "Recognizer::LoadTrainingDatabase database name tables are not valid ";
+      err += m_DatabaseName;
+      throw err;
+   }
+
+   // row i of m_ProjectedFaceMatrix belongs to class m_Gallery->ID(i), the enrolled classes follow
+   m_Model.InitMatHeader( MODEL_SECTION_CENTROIDS, &m_ProjectedFaceMatrix, m_nClasses, m_nFisherFaces, m_CentroidStride );
+   Gallery* gallery = new Gallery();
+   try
+   {
+      gallery->Open( m_Model, GalleryFileName( m_DatabaseName.c_str() ).c_str() );
+
+      // then the changes logged since the gallery file was last checkpointed
+      std::vector<GalleryLogRecord> records;
+      bool whole = m_Log.Open( GalleryLogFileName( m_DatabaseName.c_str() ).c_str(), m_nFisherFaces, header.m_ModelID, gallery->Sequence(),
+                               records, m_bSearchOnly );
+      for ( size_t i = 0; i < records.size(); i++ )
+         gallery->Apply( records[i] );
+      if ( gallery->NeedsCompaction() )
+         gallery->Compact();
+
+      if ( !m_bSearchOnly && ( !whole || m_Log.Records() >= GALLERY_LOG_CHECKPOINT_RECORDS ) )
+         WriteCheckpoint( *gallery );
+   }
+   catch (...)
+   {
+      delete gallery;
+      throw;
+   }
+   m_Gallery = gallery;
+   m_Model.InitMatHeader( MODEL_SECTION_PROJECTION, &m_FisherProjection, m_nFisherFaces, m_Width * m_Height, header.m_ProjectionStride );
+   m_Model.InitMatHeader( MODEL_SECTION_PROJECTED_MEAN, &m_ProjectedMean, m_nFisherFaces, 1, 1 );
+
+   // the indexes are optional, but one that does not match the database is an error
+   std::string pqName = PQIndexFileName( m_DatabaseName.c_str() );
+   std::ifstream pqFile( pqName.c_str(), std::ios::in | std::ios::binary );
+   if ( pqFile.is_open() )
+   {
+      pqFile.close();
+      m_PQIndex.Load( pqName.c_str() );
+      if ( m_PQIndex.Size() != m_nClasses )
+      {
+         std::string err = "Recognizer::LoadTrainingDatabase index does not match the database ";
+         err += pqName;
+         throw err;
+      }
+      m_SearchMode = SEARCH_PQ;
+   }
+
+   std::string indexName = HNSWIndexFileName( m_DatabaseName.c_str() );
+   std::ifstream indexFile( indexName.c_str(), std::ios::in | std::ios::binary );
+   if ( indexFile.is_open() )
+   {
+      indexFile.close();
+      m_Index.Load( indexName.c_str() );
+      if ( m_Index.Size() != m_nClasses )
+      {
+         std::string err = "Recognizer::LoadTrainingDatabase index does not match the database ";
+         err += indexName;
+         throw err;
+      }
+      m_SearchMode = SEARCH_HNSW;
+   }
+}
+
+
+
+/* 
+Function:   CheckWritable
+Purpose:    makes sure the database can be changed
+Arguments:  1) name of the method checking, for the error
+Notes:      
+Returns:    
+Throws:     std::string if the recognizer was opened search only
+*/
+void Recognizer::CheckWritable( const char* caller ) const
+{
+   if ( m_bSearchOnly )
+   {
+      std::string err = "Recognizer::";
+      err += caller;
+      err += " - the database was opened search only ";
+      err += m_DatabaseName;
+      throw err;
+   }
+}
+
+
+
+/* 
+Function:   HasIndex
+Purpose:    checks if the database has the index a search mode needs
+Notes:      the exact scan needs no index
+Returns:    true if mode can be used
+Throws:     
+*/
+bool Recognizer::HasIndex( SearchMode mode ) const
+{
+   if ( mode == SEARCH_HNSW )
+      return !m_Index.Empty();
+   if ( mode == SEARCH_PQ )
+      return !m_PQIndex.Empty();
+
+   return true;
+}
+
+
+
+/* 
+Function:   SetSearchMode
+Purpose:    picks the exact scan or the HNSW index for every search
+Notes:      
+Returns:    
+Throws:     std::string if an index is asked for and the database does not have it
+*/
+void Recognizer::SetSearchMode( SearchMode mode )
+{
+   if ( !HasIndex(mode) )
+   {
+      std::string err = "Recognizer::SetSearchMode database has no index ";
+      err += mode == SEARCH_HNSW ? HNSWIndexFileName( m_DatabaseName.c_str() ) : PQIndexFileName( m_DatabaseName.c_str() );
+      throw err;
+   }
+
+   m_SearchMode = mode;
+}
+
+
+
+/* 
+Function:   SetEfSearch
+Purpose:    sets the number of candidates an index search keeps
+Notes:      larger finds the true closest classes more often but is slower.  A search for k
+            classes always keeps at least k
+Returns:    
+Throws:     std::string if efSearch is not positive
+*/
+void Recognizer::SetEfSearch( int efSearch )
+{
+   if ( efSearch < 1 )
+      throw std::string("Recognizer::SetEfSearch efSearch should be at least 1");
+
+   m_EfSearch = efSearch;
+}
+
+
+
+/* 
+Function:   SetRerank
+Purpose:    sets the number of candidates a product quantized search re-ranks with the exact rows
+Notes:      larger finds the true closest classes more often but is slower.  A search for k
+            classes always re-ranks at least k
+Returns:    
+Throws:     std::string if nRerank is not positive
+*/
+void Recognizer::SetRerank( int nRerank )
+{
+   if ( nRerank < 1 )
+      throw std::string("Recognizer::SetRerank nRerank should be at least 1");
+
+   m_nRerank = nRerank;
+}
+
+
+
+
+/* 
+Function:   FindFace
+Purpose:    attempts to find a face in the database
+Notes:      this function uses distance to determine how 
+confident we are with the closest face, the threshold value can be adjusted
+to try to prevent false positive results.  Searches with the recognizer's workspace and
+remembers the result for GenResults
+Returns:    name of person, if it finds it, empty if it does not find the face
+throws:     std::string if the probe is the wrong size
+*/
+std::string Recognizer::FindFace( const IplImage* probeImage, double& distance )
+{
+   RecognitionResult result;
+   Recognize( probeImage, *m_Workspace, result );
+
+   distance = result.m_Distance;
+   m_IDFound = result.m_ID;
+   m_DistanceFound = result.m_Distance;
+   m_PersonFound = result.m_Name;
+
+   return result.m_Name;
+}
+
+
+
+
+/* 
+Function:   Recognize
+Purpose:    finds the class closest to a probe face
+Arguments:  1) the probe face, it should already be pre-processed 2) the calling thread's workspace
+            3) the person found, id 0 and an empty name if there are no classes
+Notes:      the probe is projected into the workspace and the search only reads the model, so threads
+            can call this at the same time with a workspace each.  Nothing is allocated, result's name
+            reuses the string it already has when it is long enough
+Returns:    
+Throws:     std::string if the probe is missing or the wrong size or the workspace is another recognizer's
+*/
+void Recognizer::Recognize( const IplImage* probe, Workspace& workspace, RecognitionResult& result ) const
+{
+   if ( !probe )
+      throw std::string("Recognizer::Recognize received null image as argument");
+   CheckWorkspace( workspace, "Recognize" );
+
+   ProjectProbe( probe, workspace );
+
+   const Gallery& gallery = AcquireGallery( workspace );
+   double distance = DBL_MAX;
+   int bestClass = ClosestClass( gallery, workspace.m_Projected, distance, m_SearchMode, workspace.m_Search );
+
+   if ( bestClass != -1 && bestClass < gallery.Size() )
+   {
+      // row bestClass is class gallery.ID(bestClass)
+      result.m_ID = gallery.ID( bestClass );
+      result.m_Name = gallery.Name( bestClass );
+   }
+   else
+   {
+      result.m_ID = 0;
+      result.m_Name.clear();
+   }
+
+   result.m_Distance = distance;
+}
+
+
+
+
+/* 
+Function:   FindTopK
+Purpose:    finds the k people closest to a face
+Arguments:  1) the probe face, it should already be pre-processed 2) number of people to find 
+            3) the people found, closest first
+Notes:      searches with the recognizer's workspace, see the version below
+Returns:    
+Throws:     std::string if the probe is missing or the wrong size
+*/
+void Recognizer::FindTopK( const IplImage* probe, int k, std::vector<RecognitionResult>& results )
+{
+   FindTopK( probe, k, *m_Workspace, results );
+}
+
+
+
+
+/* 
+Function:   FindTopK
+Purpose:    finds the k people closest to a face
+Arguments:  1) the probe face, it should already be pre-processed 2) number of people to find 
+            3) the calling thread's workspace 4) the people found, closest first
+Notes:      the exact search is one scan of the database, the k closest are kept in a bounded heap
+            while scanning.  results has fewer than k entries if the database has fewer than k people.
+            Thread safe the same as Recognize.  results is resized rather than cleared, so passing the
+            same vector each time reuses its entries and nothing is allocated
+Returns:    
+Throws:     std::string if the probe is missing or the wrong size or the workspace is another recognizer's
+*/
+void Recognizer::FindTopK( const IplImage* probe, int k, Workspace& workspace, std::vector<RecognitionResult>& results ) const
+{
+   if ( !probe )
+      throw std::string("Recognizer::FindTopK received null image as argument");
+   CheckWorkspace( workspace, "FindTopK" );
+
+   if ( k <= 0 )
+   {
+      results.clear();
+      return;
+   }
+
+   ProjectProbe( probe, workspace );
+
+   if ( (int)workspace.m_Best.size() < k )
+      workspace.m_Best.resize(k);
+
+   const Gallery& gallery = AcquireGallery( workspace );
+   int nFound = ClosestClasses( gallery, workspace.m_Projected, k, &workspace.m_Best[0], m_SearchMode, workspace.m_Search );
+
+   results.resize(nFound);
+   for ( int i = 0; i < nFound; i++ )
+      FillResult(gallery, workspace.m_Best[i], results[i]);
+}
+
+
+
+
+/* 
+Function:   RecognizeBatch
+Purpose:    searches the database for the faces in many probe images at once
+Arguments:  1) the probe faces, they should already be pre-processed 2) one result per probe, in the same order
+Notes:      see the top k version below
+Returns:    
+Throws:     std::string if a probe is missing or the wrong size
+*/
+void Recognizer::RecognizeBatch( const std::vector<const IplImage*>& probes, std::vector<RecognitionResult>& results )
+{
+   std::vector< std::vector<RecognitionResult> > topResults;
+   RecognizeBatch(probes, 1, topResults);
+
+   results.resize(probes.size());
+   for ( size_t i = 0; i < probes.size(); i++ )
+   {
+      if ( topResults[i].empty() )
+         results[i] = RecognitionResult();
+      else
+         results[i] = topResults[i][0];
+   }
+}
+
+
+
+
+/* 
+Function:   RecognizeBatch
+Purpose:    finds the k people closest to the faces in many probe images at once
+Arguments:  1) the probe faces, they should already be pre-processed 2) number of people to find for each probe
+            3) for each probe in the same order, the people found closest first
+Notes:      probes are packed RECOGNIZE_BATCH_SIZE at a time as the rows of one matrix and projected
+            with a single GEMM, so each row of m_FisherProjection is read once per batch instead of once per probe.
+            This does not change the results of the last search used by GenResults
+Returns:    
+Throws:     std::string if a probe is missing or the wrong size
+*/
+void Recognizer::RecognizeBatch( const std::vector<const IplImage*>& probes, int k, std::vector< std::vector<RecognitionResult> >& results )
+{
+   int size = m_FisherProjection.cols;
+   int nProbes = (int)probes.size();
+
+   results.clear();
+   results.resize(nProbes);
+
+   int batchSize = nProbes < RECOGNIZE_BATCH_SIZE ? nProbes : RECOGNIZE_BATCH_SIZE;
+   if ( batchSize == 0 || k <= 0 )
+      return;
+
+   // each probe is a row of probeBatch, so probeBatch is the transpose of the size x N probe matrix
+   CvMat* probeBatch = cvCreateMat(batchSize, size, CV_32FC1);
+   CvMat* projectedBatch = cvCreateMat(batchSize, m_CentroidStride, CV_32FC1);
+   cvSetZero(projectedBatch);   // the padding after m_nFisherFaces stays zero
+
+   Workspace& workspace = *m_Workspace;
+   if ( (int)workspace.m_Best.size() < k )
+      workspace.m_Best.resize(k);
+
+   // every probe of the batch is searched in the same gallery
+   const Gallery& gallery = AcquireGallery( workspace );
+
+   try
+   {
+      for ( int first = 0; first < nProbes; first += batchSize )
+      {
+         int n = nProbes - first < batchSize ? nProbes - first : batchSize;
+         ProjectBatch(probes, first, n, probeBatch, projectedBatch);
+
+         for ( int i = 0; i < n; i++ )
+         {
+            float* projected = projectedBatch->data.fl + (i*m_CentroidStride);
+            int nFound = ClosestClasses( gallery, projected, k, &workspace.m_Best[0], m_SearchMode, workspace.m_Search );
+
+            std::vector<RecognitionResult>& probeResults = results[first+i];
+            probeResults.resize(nFound);
+            for ( int j = 0; j < nFound; j++ )
+               FillResult(gallery, workspace.m_Best[j], probeResults[j]);
+         }
+      }
+   }
+   catch (...)
+   {
+      cvReleaseMat(&probeBatch);
+      cvReleaseMat(&projectedBatch);
+      throw;
+   }
+
+   cvReleaseMat(&probeBatch);
+   cvReleaseMat(&projectedBatch);
+}
+
+
+
+
+/* 
+Function:   RecognizeFiles
+Purpose:    loads and searches many probe images on all the threads
+Arguments:  1) the probe images, they should already be pre-processed 2) number of people to find for each probe
+            3) for each probe in the same order, the people found closest first
+            4) for each probe in the same order, why it was not searched, empty if it was
+Notes:      the probes are handed out RECOGNIZE_FILES_CHUNK at a time to whichever thread is free next, a
+            thread loads its chunk, projects it with one GEMM and searches each probe.  Each thread has its
+            own workspace and batch matrices, the model and the gallery snapshot are shared and only read,
+            so nothing is locked once the workspaces are made and the threads only meet to take the next chunk.  Every probe's results
+            go to its own entry, so they are in the order of images however the chunks were shared out.
+            An error thrown inside a parallel loop can't be caught, so the workspaces, the batch matrices and
+            room for each probe's results are allocated for every thread before the loop, and a probe that
+            can't be loaded or is the wrong size is reported in errors instead and the rest are still searched.
+            This does not change the results of the last search used by GenResults
+Returns:    
+Throws:     std::string or cv::Exception if the workspaces or batch matrices can't be allocated
+*/
+void Recognizer::RecognizeFiles( const std::vector<std::string>& images, int k, std::vector< std::vector<RecognitionResult> >& results,
+                                 std::vector<std::string>& errors )
+{
+   int size = m_FisherProjection.cols;
+   int nProbes = (int)images.size();
+
+   results.clear();
+   results.resize(nProbes);
+   errors.clear();
+   errors.resize(nProbes);
+
+   if ( nProbes == 0 || k <= 0 )
+      return;
+
+   int nChunks = (nProbes + RECOGNIZE_FILES_CHUNK - 1) / RECOGNIZE_FILES_CHUNK;
+
+   int nThreads = 1;
+#ifdef _OPENMP
+   nThreads = omp_get_max_threads();
+#endif
+
+   // each thread's workspace, batch matrices and chunk of probes, indexed by its thread number
+   std::vector<Workspace*> workspaces( nThreads, (Workspace*)NULL );
+   std::vector<CvMat*> probeBatches( nThreads, (CvMat*)NULL );
+   std::vector<CvMat*> projectedBatches( nThreads, (CvMat*)NULL );
+   std::vector<const IplImage*> probes( nThreads * RECOGNIZE_FILES_CHUNK );
+   std::vector<int> probeIndex( nThreads * RECOGNIZE_FILES_CHUNK );
+
+   try
+   {
+      for ( int thread = 0; thread < nThreads; thread++ )
+      {
+         workspaces[thread] = new Workspace(*this);
+         workspaces[thread]->m_Best.resize(k);
+         probeBatches[thread] = cvCreateMat(RECOGNIZE_FILES_CHUNK, size, CV_32FC1);
+         projectedBatches[thread] = cvCreateMat(RECOGNIZE_FILES_CHUNK, m_CentroidStride, CV_32FC1);
+         cvSetZero(projectedBatches[thread]);   // the padding after m_nFisherFaces stays zero
+      }
+      for ( int i = 0; i < nProbes; i++ )
+         results[i].reserve(k);
+   }
+   catch (...)
+   {
+      for ( int thread = 0; thread < nThreads; thread++ )
+      {
+         delete workspaces[thread];
+         cvReleaseMat(&probeBatches[thread]);
+         cvReleaseMat(&projectedBatches[thread]);
+      }
+      throw;
+   }
+
+   // every probe is searched in the same gallery, the recognizer's workspace keeps it while the threads search it
+   const Gallery& gallery = AcquireGallery( *m_Workspace );
+
+#pragma omp parallel num_threads(nThreads)
+   {
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      Workspace& workspace = *workspaces[thread];
+      CvMat* probeBatch = probeBatches[thread];
+      CvMat* projectedBatch = projectedBatches[thread];
+      int firstProbe = thread * RECOGNIZE_FILES_CHUNK;
+
+#pragma omp for schedule(dynamic)
+      for ( int chunk = 0; chunk < nChunks; chunk++ )
+      {
+         int first = chunk * RECOGNIZE_FILES_CHUNK;
+         int last = first + RECOGNIZE_FILES_CHUNK < nProbes ? first + RECOGNIZE_FILES_CHUNK : nProbes;
+
+         // the probes of the chunk that can be searched, checked so ProjectBatch can't throw
+         int n = 0;
+         for ( int i = first; i < last; i++ )
+         {
+            IplImage* probe = cvLoadImage(images[i].c_str(), 0);
+            if ( !probe )
+            {
+               errors[i] = "could not load image";
+            }
+            else if ( probe->width * probe->height != size )
+            {
+               errors[i] = "image is not the same size as the training images";
+               cvReleaseImage(&probe);
+            }
+            else
+            {
+               probes[firstProbe + n] = probe;
+               probeIndex[firstProbe + n++] = i;
+            }
+         }
+
+         if ( n > 0 )
+            ProjectBatch(probes, firstProbe, n, probeBatch, projectedBatch);
+
+         for ( int i = 0; i < n; i++ )
+         {
+            float* projected = projectedBatch->data.fl + (i*m_CentroidStride);
+            int nFound = ClosestClasses( gallery, projected, k, &workspace.m_Best[0], m_SearchMode, workspace.m_Search );
+
+            std::vector<RecognitionResult>& probeResults = results[probeIndex[firstProbe + i]];
+            probeResults.resize(nFound);
+            for ( int j = 0; j < nFound; j++ )
+               FillResult(gallery, workspace.m_Best[j], probeResults[j]);
+
+            cvReleaseImage( (IplImage**)&probes[firstProbe + i] );
+         }
+      }
+   }
+
+   for ( int thread = 0; thread < nThreads; thread++ )
+   {
+      delete workspaces[thread];
+      cvReleaseMat(&probeBatches[thread]);
+      cvReleaseMat(&projectedBatches[thread]);
+   }
+}
+
+
+
+
+/* 
+Function:   BenchmarkIndex
+Purpose:    measures the recall and speed of the current search mode against the exact scan
+Arguments:  1) the probe faces, they should already be pre-processed 2) number of people to find for each probe
+            3) the averages over all the probes
+Notes:      each probe is projected once then searched both ways, only the searches are timed.
+            Recall@k is the fraction of the exact k closest classes the index also returned.
+            The search mode is passed to each search, it is never changed
+Returns:    
+Throws:     std::string if the search mode is exact or a probe is missing or the wrong size
+*/
+void Recognizer::BenchmarkIndex( const std::vector<const IplImage*>& probes, int k, SearchBenchmark& benchmark )
+{
+   if ( m_SearchMode == SEARCH_EXACT )
+      throw std::string("Recognizer::BenchmarkIndex the search mode should be an index");
+
+   benchmark = SearchBenchmark();
+   benchmark.m_k = k;
+   if ( probes.empty() || k <= 0 )
+      return;
+
+   std::vector<RowDistance> exact(k);
+   std::vector<RowDistance> approximate(k);
+
+   Workspace& workspace = *m_Workspace;
+   const Gallery& gallery = AcquireGallery( workspace );
+   int64 exactTicks = 0;
+   int64 indexTicks = 0;
+   int nExact = 0;
+   int nMatched = 0;
+
+   for ( size_t i = 0; i < probes.size(); i++ )
+   {
+      if ( !probes[i] )
+         throw std::string("Recognizer::BenchmarkIndex received null image as argument");
+      ProjectProbe(probes[i], workspace);
+
+      int64 start = cvGetTickCount();
+      int nFound = ClosestClasses( gallery, workspace.m_Projected, k, &exact[0], SEARCH_EXACT, workspace.m_Search );
+      exactTicks += cvGetTickCount() - start;
+
+      start = cvGetTickCount();
+      int nApproximate = ClosestClasses( gallery, workspace.m_Projected, k, &approximate[0], m_SearchMode, workspace.m_Search );
+      indexTicks += cvGetTickCount() - start;
+
+      for ( int e = 0; e < nFound; e++ )
+      {
+         for ( int a = 0; a < nApproximate; a++ )
+         {
+            if ( approximate[a].m_Row == exact[e].m_Row )
+            {
+               nMatched++;
+               break;
+            }
+         }
+      }
+      nExact += nFound;
+   }
+
+   // cvGetTickFrequency is ticks per microsecond
+   double msPerTick = 1.0 / ( cvGetTickFrequency() * 1000.0 );
+   benchmark.m_nProbes = (int)probes.size();
+   benchmark.m_Recall = nExact ? (double)nMatched / nExact : 1.0;
+   benchmark.m_ExactMs = exactTicks * msPerTick / probes.size();
+   benchmark.m_IndexMs = indexTicks * msPerTick / probes.size();
+}
+
+
+
+
+/* 
+Function:   Remove
+Purpose:    removes a person from the database without training again
+Arguments:  1) id of the person, trained or enrolled
+Notes:      the class is removed from a copy of the newest gallery which is published once the removal
+            is committed, the same as Enroll, so searches already running finish with the gallery they started with.  The row
+            is a tombstone every search skips.  When GALLERY_COMPACT_RATIO of the enrolled rows are
+            tombstones the copy is compacted before it is published, searches never see that happen.
+            The removal is logged and committed the same as an enrollment
+Returns:    
+Throws:     std::string if the person is not in the database, the log can't be written or the recognizer is search only
+*/
+void Recognizer::Remove( personIDType id )
+{
+   CheckWritable( "Remove" );
+
+   GalleryLogRecord record;
+   record.m_Type = GALLERY_LOG_REMOVE;
+   record.m_ID = id;
+   uint64 sequence = 0;
+
+   {
+      ScopedLock removing( m_WriterLock );
+      if ( NewestGallery()->Find( id ) == -1 )
+      {
+         std::stringstream err;
+         err << "Recognizer::Remove - person id " << id << " is not in the database";
+         throw err.str();
+      }
+
+      Gallery* next = new Gallery( *NewestGallery() );
+      try
+      {
+         m_Pending.reserve( m_Pending.size() + 1 );
+         sequence = m_Log.Append( record );
+         next->Apply( record );
+         if ( next->NeedsCompaction() )
+            next->Compact();
+      }
+      catch (...)
+      {
+         delete next;
+         throw;
+      }
+      m_Pending.push_back( next );
+   }
+
+   FinishChange( sequence );
+}
+
+
+
+
+/* 
+Function:   Checkpoint
+Purpose:    writes the gallery file and empties the gallery log
+Notes:      done by Enroll and Remove every GALLERY_LOG_CHECKPOINT_RECORDS changes, so opening the database
+            never replays more than that.  Searches go on while it writes, enrollments and removals wait
+Returns:    
+Throws:     std::string if the gallery file or the log can't be written or the recognizer is search only
+*/
+void Recognizer::Checkpoint()
+{
+   CheckWritable( "Checkpoint" );
+
+   ScopedLock writing( m_WriterLock );
+   WriteCheckpoint( *NewestGallery() );
+}
+
+
+
+
+/* 
+Function:   WriteCheckpoint
+Purpose:    folds the gallery log into the gallery file
+Notes:      called holding m_WriterLock with the newest gallery, or before the recognizer is used, so every
+            record logged is in gallery.  The gallery file stores the sequence of its last record and is synced
+            before the log is emptied, so a crash in between only leaves records the replay skips.  Every
+            change is on disk after it, so the changes waiting for a commit are published
+Returns:    
+Throws:     std::string if the gallery file or the log can't be written
+*/
+void Recognizer::WriteCheckpoint( const Gallery& gallery )
+{
+   gallery.Save();
+   m_Log.Reset( gallery.Sequence() );
+   PublishCommitted();
+}
+
+
+
+
+/* 
+Function:   FinishChange
+Purpose:    commits a logged enrollment or removal then publishes it
+Arguments:  1) sequence of the change's log record
+Notes:      called without m_WriterLock, so changes from several threads share a sync.  Every change that
+            is on disk is published, which may include changes other threads logged after this one.  If the
+            commit fails the changes not on disk are dropped, searches never see them, and the log can't be
+            appended to until Checkpoint.  The log is checkpointed once it is GALLERY_LOG_CHECKPOINT_RECORDS long
+Returns:    
+Throws:     std::string if the log or the checkpoint can't be written
+*/
+void Recognizer::FinishChange( uint64 sequence )
 {
-   m_FaceImage = cvLoadImage(image,0);  // give face should be pre-processed
-   if ( m_FaceImage )
+   try
    {
-      m_nFacesToFind = 1;
-      m_FacesToFind = (IplImage**)cvAlloc(m_nFacesToFind*sizeof(IplImage*));
-      m_FacesToFind[0] = m_FaceImage;
+      m_Log.Commit( sequence );
    }
-   else
+   catch (...)
    {
-      std::string err;
-      err = "Recognizer could not load image: ";
-      err += image;
-      throw err;
+      ScopedLock failing( m_WriterLock );
+      PublishCommitted();
+      DropUncommitted();
+      throw;
    }
+
+   ScopedLock publishing( m_WriterLock );
+   PublishCommitted();
+   if ( m_Log.Records() >= GALLERY_LOG_CHECKPOINT_RECORDS )
+      WriteCheckpoint( *NewestGallery() );
 }
 
 
 
 
 /* 
-Function:   Recognizer class destructor
-Purpose:    clean up memory that Recognizer uses     
-Notes:      
+Function:   PublishCommitted
+Purpose:    publishes the newest gallery whose changes are all on disk
+Notes:      called holding m_WriterLock.  The committed galleries before it were never published, no
+            search can have them, so they are freed at once
+Returns:    
+Throws:     
 */
-Recognizer::~Recognizer()
+void Recognizer::PublishCommitted()
+{
+   uint64 durable = m_Log.Durable();
+   size_t nCommitted = 0;
+   while ( nCommitted < m_Pending.size() && m_Pending[nCommitted]->Sequence() <= durable )
+      nCommitted++;
+
+   if ( nCommitted == 0 )
+      return;
+
+   for ( size_t i = 0; i + 1 < nCommitted; i++ )
+      delete m_Pending[i];
+
+   Gallery* newest = m_Pending[nCommitted - 1];
+   m_Pending.erase( m_Pending.begin(), m_Pending.begin() + nCommitted );
+   PublishGallery( newest );
+}
+
+
+
+
+/* 
+Function:   DropUncommitted
+Purpose:    forgets the changes that could not be committed
+Notes:      called holding m_WriterLock after PublishCommitted, so every gallery left was never published
+Returns:    
+Throws:     
+*/
+void Recognizer::DropUncommitted()
+{
+   for ( size_t i = 0; i < m_Pending.size(); i++ )
+      delete m_Pending[i];
+   m_Pending.clear();
+}
+
+
+
+
+/* 
+Function:   ProjectProbe
+Purpose:    projects a probe face onto the fisher space
+Arguments:  1) the probe face, it should already be pre-processed 2) the workspace to project it into
+Notes:      m_FisherProjection is m_nFisherFaces rows and size (image size) cols, it was created during training 
+            by multiplying the LDA eigenvectors by the PCA eigenvectors.  Only the first m_nFisherFaces floats
+            of workspace.m_Projected are written.  Its rows are aligned and padded with zeros to their stride,
+            and so is workspace.m_Probe, so each is one DotProduct with the distance kernel's instructions.
+            cvMatMul would allocate a buffer for a vector this long on every call
+Returns:    
+Throws:     std::string if the probe is the wrong size
+*/
+void Recognizer::ProjectProbe( const IplImage* probeImage, Workspace& workspace ) const
 {
-   // release the image with all of the faces
-   cvReleaseImage(&m_FaceImage);
+   int size = m_FisherProjection.cols;
+   if ( probeImage->width * probeImage->height != size )
+      throw std::string("Recognizer::ProjectProbe - probe image is not the same size as the training images");
 
+   ImageToMatrix(probeImage, workspace.m_Probe, size);
 
-   // release eigen vectors
-   for ( int i = 0; i < m_nEigenVals; i++ )
+   // project the probe and center it, m_ProjectedMean is the projected average image
+   int stride = ProjectionStride();
+   for ( int row = 0; row < m_nFisherFaces; row++ )
    {
-      if ( m_EigenVectorArray[i] )
-         cvReleaseImage(&m_EigenVectorArray[i]);
+      const float* projection = (const float*)( m_FisherProjection.data.ptr + (size_t)row * m_FisherProjection.step );
+      workspace.m_Projected[row] = DotProduct( workspace.m_Probe, projection, stride ) - m_ProjectedMean.data.fl[row];
    }
 }
 
@@ -86,214 +973,553 @@ Recognizer::~Recognizer()
 
 
 /* 
-Function:   LoadTrainingDatabase
-Purpose:    loads to training database that was creating during the training session
+Function:   CheckWorkspace
+Purpose:    makes sure a workspace was made for this recognizer, its buffers are sized for it
+Arguments:  1) the workspace 2) name of the method checking, for the error
 Notes:      
-Returns:    true if success
-throws:     std::string if can't open training data or somthing else goes wrong
+Returns:    
+Throws:     std::string if the workspace was made for another recognizer
 */
-bool Recognizer::LoadTrainingDatabase()
+void Recognizer::CheckWorkspace( const Workspace& workspace, const char* caller ) const
 {
-   bool bRet = false;
-   CvFileStorage* database = NULL;
+   if ( workspace.m_Recognizer != this )
+   {
+      std::string err = "Recognizer::";
+      err += caller;
+      err += " - the workspace was made for another recognizer";
+      throw err;
+   }
+}
+
+
 
-   database = cvOpenFileStorage( m_DatabaseName, 0, CV_STORAGE_READ );
 
-   if ( !database )
+/* 
+Function:   ProjectBatch
+Purpose:    projects n probe faces onto the fisher space with one GEMM
+Arguments:  1) the probe faces, they should already be pre-processed 2) first probe to project 3) number to project
+            4) at least n rows of image size cols 5) at least n rows of m_CentroidStride cols, one projection per row
+Notes:      only the first m_nFisherFaces cols of each row of projectedBatch are written, the padding is left as it was
+Returns:    
+Throws:     std::string if a probe is missing or the wrong size
+*/
+void Recognizer::ProjectBatch( const std::vector<const IplImage*>& probes, int first, int n, CvMat* probeBatch, CvMat* projectedBatch ) const
+{
+   int size = m_FisherProjection.cols;
+
+   for ( int i = 0; i < n; i++ )
    {
-      std::string err = "Recognizer::LoadTrainingDatabase could not open database ";
-      err += m_DatabaseName;
-      throw err;
+      const IplImage* probe = probes[first+i];
+      if ( !probe )
+         throw std::string("Recognizer::ProjectBatch received null image as argument");
+      if ( probe->width * probe->height != size )
+         throw std::string("Recognizer::ProjectBatch - probe image is not the same size as the training images");
+
+      ImageToMatrix(probe, probeBatch->data.fl + (i*size), size);
    }
 
-   m_nImages = cvReadIntByName( database, 0, "nImages", 0 );
-   m_nPeople = cvReadIntByName( database, 0, "nPeople", 0 );
+   // projectedBatch = probeBatch * m_FisherProjection^T, n rows of m_nFisherFaces
+   CvMat probes_n, projected_n;
+   cvGetRows(probeBatch, &probes_n, 0, n);
+   cvGetSubRect(projectedBatch, &projected_n, cvRect(0, 0, m_nFisherFaces, n));
+   cvGEMM(&probes_n, &m_FisherProjection, 1, NULL, 0, &projected_n, CV_GEMM_B_T);
 
-   // read person names and original image names
-   for ( int i = 0; i < m_nPeople; i++ )
+   for ( int i = 0; i < n; i++ )
    {
-      std::string tempName;
-      char varname[256];
-      sprintf(varname,"PersonID_%d",i+1);
-      tempName = cvReadStringByName( database, 0, varname, 0 );
-      m_Names.push_back(tempName);
+      float* projected = projectedBatch->data.fl + (i*m_CentroidStride);
 
-      sprintf(varname, "ImageID_%d", i);
-      tempName = cvReadStringByName( database, 0, varname, 0 );
-      m_OriginalImages.push_back(tempName);
+      // center the projection
+      for ( int col = 0; col < m_nFisherFaces; col++ )
+         projected[col] -= m_ProjectedMean.data.fl[col];
    }
+}
 
 
-   m_nEigenVals = cvReadIntByName( database, 0, "nLDAEigens", 0 );
-   m_PersonIDMatrix = (CvMat*)cvReadByName( database, 0, "PersonIDMatrix", 0 );
-   m_nClasses = cvReadIntByName( database, 0, "nClasses", 0 );
-   m_nFisherFaces = cvReadIntByName( database, 0, "nFisherFaces", 0 );
 
-   for ( int i = 0; i < m_nImages; i++ )
+
+/* 
+Function:   Enroll
+Purpose:    adds a person to the database without training again
+Arguments:  1) the person's name 2) the person's faces, they should already be pre-processed
+Notes:      the faces are projected with the database's projection, the same as a probe, and the class is
+            their average, the same as a trained class's centroid.  The class threshold is the largest
+            distance of one of the faces from it, the same as CalculateThresholds.
+            The faces are projected before m_WriterLock is taken, then the newest gallery is copied and the
+            class enrolled into the copy.  Enrollments and removals from several threads are done one at a time.
+            The enrollment is appended to the gallery log holding m_WriterLock and committed after it is
+            released, so enrollments from several threads share a sync.  The copy is only published once the
+            log record is on disk, see FinishChange, so a search never finds a person a crash could forget.
+            Searches already running finish with the gallery they started with.  This returns once the
+            person is published, a later Recognizer on the same database finds the person too
+Returns:    the person id given to the new class
+Throws:     std::string if a face is missing or the wrong size, the log can't be written or the recognizer is search only
+*/
+personIDType Recognizer::Enroll( const std::string& name, const std::vector<const IplImage*>& faces )
+{
+   CheckWritable( "Enroll" );
+
+   int nFaces = (int)faces.size();
+   if ( nFaces == 0 )
+      throw std::string("Recognizer::Enroll needs at least one face");
+
+   CvMat* probeBatch = cvCreateMat(nFaces, m_FisherProjection.cols, CV_32FC1);
+   CvMat* projectedBatch = cvCreateMat(nFaces, m_CentroidStride, CV_32FC1);
+   cvSetZero(projectedBatch);
+   std::vector<double> mean(m_nFisherFaces, 0.0);
+   GalleryLogRecord record;
+   record.m_Type = GALLERY_LOG_ENROLL;
+   record.m_Name = name;
+   record.m_Centroid.resize(m_nFisherFaces);
+   std::vector<float>& centroid = record.m_Centroid;
+   uint64 sequence = 0;
+   Gallery* next = NULL;
+
+   try
    {
-      std::map<personIDType, int>::iterator it;
-      personIDType id = m_PersonIDMatrix->data.i[i];
-      it = m_ClassCountMap.find(id);
+      ProjectBatch(faces, 0, nFaces, probeBatch, projectedBatch);
 
-      if ( it == m_ClassCountMap.end() )
+      for ( int i = 0; i < nFaces; i++ )
       {
-         m_ClassCountMap[id] = 1;
+         const float* projected = projectedBatch->data.fl + (i*m_CentroidStride);
+         for ( int col = 0; col < m_nFisherFaces; col++ )
+            mean[col] += projected[col];
       }
-      else
+      for ( int col = 0; col < m_nFisherFaces; col++ )
+         centroid[col] = (float)( mean[col] / nFaces );
+
+      double threshold = 0.0;
+      for ( int i = 0; i < nFaces; i++ )
       {
-         m_ClassCountMap[id]++;
+         const float* projected = projectedBatch->data.fl + (i*m_CentroidStride);
+
+         double e_distance = 0.0;
+         for ( int col = 0; col < m_nFisherFaces; col++ )
+         {
+            double d = projected[col] - centroid[col];
+            e_distance += d*d;
+         }
+
+         if ( e_distance > threshold )
+            threshold = e_distance;
       }
 
-      m_ClassToIndexMap.insert( pair<personIDType, int>(id, i) );
+      record.m_Threshold = (float)threshold;
+
+      ScopedLock enrolling( m_WriterLock );
+      next = new Gallery( *NewestGallery() );
+      m_Pending.reserve( m_Pending.size() + 1 );
+      record.m_ID = next->NextID();
+      sequence = m_Log.Append( record );
+      next->Apply( record );
+
+      // reserved above, the pending list owns it now
+      m_Pending.push_back( next );
+      next = NULL;
+   }
+   catch (...)
+   {
+      delete next;
+      cvReleaseMat(&probeBatch);
+      cvReleaseMat(&projectedBatch);
+      throw;
    }
 
+   cvReleaseMat(&probeBatch);
+   cvReleaseMat(&projectedBatch);
+
+   FinishChange( sequence );
+   return record.m_ID;
+}
+
+
+
 
-   m_EigenValueMatrix = (CvMat*)cvReadByName( database, 0, "PCAEigenValues", 0 );
-   m_ProjectedFaceMatrix = (CvMat*)cvReadByName( database, 0, "ProjectedLDAFaceMat", 0 );
+/* 
+Function:   FillResult
+Purpose:    fills in a search result from a row of the gallery
+Notes:      
+Returns:    
+Throws:     
+*/
+void Recognizer::FillResult( const Gallery& gallery, const RowDistance& match, RecognitionResult& result ) const
+{
+   // row match.m_Row is class gallery.ID(match.m_Row)
+   result.m_ID = gallery.ID( match.m_Row );
+   result.m_Name = gallery.Name( match.m_Row );
+   result.m_Distance = match.m_Distance;
+}
 
 
-   m_LDAEigenVectors = (CvMat*)cvReadByName( database, 0, "LDAEigenVectors", 0 );
-   m_LDAEigenValues = (CvMat*)cvReadByName( database, 0, "LDAEigenValues", 0 );
 
-   m_AverageImage = (IplImage*)cvReadByName( database, 0, "AverageImage", 0 );
-   m_AverageProjectedImage = (CvMat*)cvReadByName( database, 0, "AverageProjectedImage", 0 );
 
-   m_EigenVectorArray = (IplImage**)cvAlloc(m_nImages*sizeof(IplImage*));
-   for ( int i = 0; i < m_nEigenVals; i++ )
+/* 
+Function:   ClosestClass
+Purpose:    finds the class closest to a projected probe
+Arguments:  1) the gallery snapshot to search 2) probe projected onto the fisher space, m_CentroidStride long
+            and zero after m_nFisherFaces 3) distance to the closest class 4) how to search the trained classes
+            5) the searching thread's scratch
+Notes:      uses the least Euclidean Distance comparing the projected probe to each m_ProjectedFaceMatrix row
+            and each enrolled chunk's rows, the rows are padded to m_CentroidStride so the distance kernel always fills its vector lanes
+Returns:    gallery row of the closest class, -1 if there are no classes
+Throws:     
+*/
+int Recognizer::ClosestClass( const Gallery& gallery, const float* projectedProbe, double& distance, SearchMode mode, SearchScratch& scratch ) const
+{
+   if ( mode != SEARCH_EXACT )
    {
-      char var[256];
-      sprintf(var ,"PCAEigenVector_%d",i);
-      m_EigenVectorArray[i] = (IplImage*)cvReadByName(database, 0, var, 0);
+      RowDistance best;
+      if ( ClosestClasses( gallery, projectedProbe, 1, &best, mode, scratch ) == 0 )
+      {
+         distance = FLT_MAX;
+         return -1;
+      }
+
+      distance = best.m_Distance;
+      return best.m_Row;
    }
 
+   float bestChoiceDiff = FLT_MAX;
+   int bestClass = ClosestRow( projectedProbe, m_ProjectedFaceMatrix.data.fl, m_nClasses, m_CentroidStride, bestChoiceDiff, gallery.TrainedRemoved() );
 
-   m_EuclideanThreshold = cvReadRealByName( database, 0, "EuclideanThreshold", 0 );
- 
-   cvReleaseFileStorage(&database);
+   for ( int c = 0; c < gallery.Chunks(); c++ )
+   {
+      const GalleryChunk& chunk = gallery.Chunk(c);
+      float enrolledDiff = FLT_MAX;
+      int enrolledClass = ClosestRow( projectedProbe, chunk.m_Rows, chunk.m_nRows, m_CentroidStride, enrolledDiff, chunk.Removed() );
+      if ( enrolledClass != -1 && enrolledDiff < bestChoiceDiff )
+      {
+         bestChoiceDiff = enrolledDiff;
+         bestClass = gallery.Trained() + c * GALLERY_CHUNK_ROWS + enrolledClass;
+      }
+   }
 
-   return bRet;
+   distance = bestChoiceDiff;
+   return bestClass;
 }
 
 
 
 
 /* 
-Function:   FindFace
-Purpose:    attempts to find a face in the database
-Notes:      this function uses distance to determine how 
-confident we are with the closest face, the threshold value can be adjusted
-to try to prevent false positive results
-Returns:    name of person, if it finds it, empty if it does not find the face
-throws:     
+Function:   ClosestClasses
+Purpose:    finds the k classes closest to a projected probe
+Arguments:  1) the gallery snapshot to search 2) probe projected onto the fisher space, m_CentroidStride long
+            and zero after m_nFisherFaces 3) number of classes to find 4) the classes found closest first, room for k
+            5) how to search the trained classes 6) the searching thread's scratch
+Notes:      every search goes through here so the search mode is checked in one place.  The search mode
+            only picks how the trained classes are searched, the enrolled classes are always scanned.
+            Removed classes are skipped by every search
+Returns:    number of classes found, the rows are gallery rows
+Throws:     
 */
-std::string Recognizer::FindFace( int faceNum, double& distance )
+int Recognizer::ClosestClasses( const Gallery& gallery, const float* projectedProbe, int k, RowDistance* best, SearchMode mode, SearchScratch& scratch ) const
 {
-   std::string personName = "";
+   int nFound = 0;
 
-   // project the test face onto
-   // the PCA subspace so try to find a match
-   if ( faceNum < 0 || faceNum >= m_nFacesToFind )
-      throw std::string("Recognizer::FindFace - Invalid face number argument");
+   if ( mode == SEARCH_HNSW )
+      nFound = m_Index.Search( m_ProjectedFaceMatrix.data.fl, m_CentroidStride, projectedProbe, k, m_EfSearch, best, scratch.m_HNSW, gallery.TrainedRemoved() );
+   else if ( mode == SEARCH_PQ )
+      nFound = m_PQIndex.Search( m_ProjectedFaceMatrix.data.fl, m_CentroidStride, projectedProbe, k, m_nRerank, best, scratch.m_PQ, gallery.TrainedRemoved() );
+   else
+      nFound = ClosestRows( projectedProbe, m_ProjectedFaceMatrix.data.fl, m_nClasses, m_CentroidStride, k, best, gallery.TrainedRemoved() );
+
+   return MergeEnrolled( gallery, projectedProbe, k, best, nFound, scratch );
+}
 
-   // first project the face to find onto the PCA subspace
-   float * tempFaceToFind = NULL;
-   tempFaceToFind = (float *)cvAlloc( (m_nImages-1)*sizeof(float) );
-   cvEigenDecomposite(m_FacesToFind[0], m_nEigenVals, m_EigenVectorArray, 0, 0, m_AverageImage, tempFaceToFind);
-   
 
 
-   // multiply Fisherfaces and Eigenfaces
-   // m_LDAEigenVectors is nClass rows and m_nEigenVals cols
-   // m_PCAEigenVectors is m_nEigenVal rows and m*n (image size) cols
 
-   // store m_PCAEigenVectors in a matrix
-   int size = m_EigenVectorArray[0]->width * m_EigenVectorArray[0]->height;
-   CvMat* PCAEigenVectors = cvCreateMat( m_nEigenVals, size, CV_32FC1);
-   for ( int row = 0; row < m_nEigenVals; row++ )
+/* 
+Function:   MergeClosest
+Purpose:    merges two lists of rows sorted closest first
+Arguments:  1) the first list 2) its length 3) the second list 4) its length 5) most rows to keep
+            6) the merged list, room for k
+Notes:      a row of the first list comes first when the distances are equal
+Returns:    number of rows merged
+Throws:     
+*/
+static int MergeClosest( const RowDistance* first, int nFirst, const RowDistance* second, int nSecond, int k, RowDistance* merged )
+{
+   int f = 0;
+   int s = 0;
+   int n = 0;
+   while ( n < k && ( f < nFirst || s < nSecond ) )
    {
-      float* temp = new float[size];
-      ImageToMatrixf(m_EigenVectorArray[row],  temp, size);
-      for ( int col = 0; col < size; col++ )
-      {
-         PCAEigenVectors->data.fl[row*m_EigenVectorArray[0]->width + col] = temp[col];
-      }
-      delete [] temp;
+      if ( s == nSecond || ( f < nFirst && first[f].m_Distance <= second[s].m_Distance ) )
+         merged[n++] = first[f++];
+      else
+         merged[n++] = second[s++];
    }
 
-  
-   // multiply m_LDAEigenVectors by PCAEigenVecotors with 
-   CvMat* res = cvCreateMat(m_nClasses-1, size, CV_32FC1);
-   cvMatMul( m_LDAEigenVectors, PCAEigenVectors, res);
-   
-   // res is now m_nClasses-1 rows and size cols
-   // multiply it by the probe image face which is 1 row and size cols
-   // actually transpose the probe image to be size rows and 1 col
-   // the resulting matrix will be m_nClasses-1 rows and 1 col
-   // the transpose of this matrix is the projected probe image we will use to compare distances
+   return n;
+}
+
+
+
+
+/* 
+Function:   MergeEnrolled
+Purpose:    adds the enrolled classes to the k closest trained classes
+Arguments:  1) the gallery snapshot searched 2) probe projected onto the fisher space 3) number of classes to find 
+            4) the trained classes found closest first, room for k 5) number of trained classes found
+            6) the searching thread's scratch
+Notes:      each enrolled chunk is scanned exactly and merged into the k closest enrolled rows so far, then
+            those are merged with the trained classes, a trained class comes first when the distances are
+            equal.  scratch.m_Merge only grows, so searches with the same k don't allocate
+Returns:    number of classes found
+Throws:     
+*/
+int Recognizer::MergeEnrolled( const Gallery& gallery, const float* projectedProbe, int k, RowDistance* best, int nFound, SearchScratch& scratch ) const
+{
+   if ( gallery.Chunks() == 0 )
+      return nFound;
+
+   if ( (int)scratch.m_Merge.size() < 3*k )
+      scratch.m_Merge.resize(3*k);
+
+   RowDistance* enrolled = &scratch.m_Merge[0];
+   RowDistance* chunkFound = &scratch.m_Merge[k];
+   RowDistance* merged = &scratch.m_Merge[2*k];
+   int nEnrolledFound = 0;
+
+   for ( int c = 0; c < gallery.Chunks(); c++ )
+   {
+      const GalleryChunk& chunk = gallery.Chunk(c);
+      int nChunkFound = ClosestRows( projectedProbe, chunk.m_Rows, chunk.m_nRows, m_CentroidStride, k, chunkFound, chunk.Removed() );
+
+      int firstRow = gallery.Trained() + c * GALLERY_CHUNK_ROWS;
+      for ( int i = 0; i < nChunkFound; i++ )
+         chunkFound[i].m_Row += firstRow;
 
-   // Store original image as matrix with size rows and 1 col
-   CvMat* probe = cvCreateMat(size, 1, CV_32FC1);
-   ImageToMatrix(m_FacesToFind[faceNum], probe->data.fl, size);
+      nEnrolledFound = MergeClosest( enrolled, nEnrolledFound, chunkFound, nChunkFound, k, merged );
+      std::swap( enrolled, merged );
+   }
+
+   // merged is free again, the trained classes are copied there so best can take the result
+   for ( int i = 0; i < nFound; i++ )
+      merged[i] = best[i];
+
+   return MergeClosest( merged, nFound, enrolled, nEnrolledFound, k, best );
+}
 
-   /*
-   for ( int i = 0; i < size; i++ )
-      cout << probe->data.fl[i] << " ";
 
-   */
 
-   // Store m_AverageImage in matrix
-   CvMat* avgImg = cvCreateMat(size, 1, CV_32FC1);
-   ImageToMatrixf(m_AverageImage, avgImg->data.fl, size);
 
-   // center probe
-   cvSub(probe, avgImg, probe);
 
-   // multiply res by the probe
-   CvMat* ProjectedProbe = cvCreateMat(1, m_nClasses-1, CV_32FC1);
-   CvMat* ProjectedProbe_t = cvCreateMat(m_nClasses-1, 1, CV_32FC1);
-   cvMatMul(res,probe,ProjectedProbe_t);
-   cvTranspose(ProjectedProbe_t, ProjectedProbe);
+/* 
+Function:   Workspace class constructor
+Purpose:    allocates the probe buffers of a search with recognizer
+Arguments:  1) the recognizer the workspace is for
+Notes:      cvAlloc doesn't align to MODEL_FILE_ALIGN so the block is over allocated and each buffer
+            starts on an aligned float.  The buffers are zeroed once, so their padding stays zero, projecting
+            only writes the pixels and the fisherfaces before it
+Throws:     std::string if it can't allocate memory
+*/
+Workspace::Workspace( const Recognizer& recognizer ) : m_Recognizer(&recognizer), m_Gallery(NULL), m_Block(NULL), m_Probe(NULL), m_Projected(NULL)
+{
+   size_t probeBytes = recognizer.ProjectionStride() * sizeof(float);
+   size_t projectedBytes = recognizer.CentroidStride() * sizeof(float);
 
+   m_Block = cvAlloc( probeBytes + projectedBytes + MODEL_FILE_ALIGN );
+   if ( !m_Block )
+      throw std::string("Workspace could not allocate the probe buffers");
 
-   // now we can find the least Euclidean Distance comparing the ProjectedProbe 
-   // to each m_ProjectedFaceMatrix
-   double bestChoiceDiff = DBL_MAX;
-   int bestClass = -1;
+   m_Probe = (float*)( ( (size_t)m_Block + MODEL_FILE_ALIGN - 1 ) & ~(size_t)(MODEL_FILE_ALIGN - 1) );
+   m_Projected = (float*)( (char*)m_Probe + probeBytes );
+   memset( m_Probe, 0, probeBytes + projectedBytes );
 
-   int row = 0;
-   for ( row = 0 ; row < m_nClasses; row++ )
+   try
    {
-      double distance = 0.0;
+      recognizer.AddWorkspace( this );
+   }
+   catch (...)
+   {
+      cvFree(&m_Block);
+      throw;
+   }
+}
 
-      for ( int col = 0; col < m_nClasses-1; col++ )
-      {
-         // cout << ProjectedProbe->data.fl[col] << "    " << m_ProjectedFaceMatrix->data.fl[row*m_nClasses+col] << endl;
-         float d = ProjectedProbe->data.fl[col] - m_ProjectedFaceMatrix->data.fl[row*m_nClasses+col];
-         distance += d*d;
-      }
 
-      if ( distance < bestChoiceDiff )
-      {
-         bestChoiceDiff = distance;
-         bestClass = row;
-      }
+
+
+/* 
+Function:   Workspace class destructor
+Purpose:    frees the probe buffers
+Notes:      the snapshot it has can be freed from now on
+*/
+Workspace::~Workspace()
+{
+   m_Recognizer->RemoveWorkspace( this );
+   if ( m_Block )
+      cvFree(&m_Block);
+}
+
+
+
+
+/* 
+Function:   AcquireGallery
+Purpose:    the gallery to search
+Notes:      lock free.  The snapshot is marked in workspace before it is used, and used only if it is
+            still the published one after that, so a writer replacing it either sees the mark or the
+            search reads the new one.  The mark stays until the workspace's next search, a replaced
+            snapshot is not freed while a workspace has it
+Returns:    the current gallery snapshot, valid until workspace searches again or is destroyed
+Throws:     
+*/
+const Gallery& Recognizer::AcquireGallery( Workspace& workspace ) const
+{
+   const Gallery* gallery = AtomicLoad( m_Gallery );
+   for ( ;; )
+   {
+      AtomicStore( workspace.m_Gallery, gallery );
+
+      const Gallery* current = AtomicLoad( m_Gallery );
+      if ( current == gallery )
+         return *gallery;
+      gallery = current;
    }
+}
 
 
-   // find the index from classToIndexMap
-   pair<multimap<personIDType, int>::iterator, multimap<personIDType, int>::iterator> eq;
-   eq = m_ClassToIndexMap.equal_range(bestClass);
 
-   if ( bestClass != -1 && bestClass <= m_nClasses )
+
+/* 
+Function:   PublishGallery
+Purpose:    makes gallery the one every new search uses
+Notes:      called holding m_WriterLock, the recognizer owns gallery from now on and it must not be
+            changed.  The previous snapshot is retired and freed once no workspace has it
+Returns:    
+Throws:     
+*/
+void Recognizer::PublishGallery( Gallery* gallery )
+{
+   Gallery* previous = m_Gallery;
+   try
+   {
+      m_Retired.reserve( m_Retired.size() + 1 );
+   }
+   catch (...)
    {
-      std::multimap<personIDType,int>::iterator it;
-      it = eq.first;
-      personName = m_Names[it->second];
+      delete gallery;
+      throw;
    }
 
-   return personName;
+   AtomicStore( m_Gallery, gallery );
+   m_Retired.push_back( previous );
+   ReclaimGalleries();
+}
+
 
-   
+
+
+/* 
+Function:   ReclaimGalleries
+Purpose:    frees the retired snapshots no workspace has
+Notes:      called holding m_WriterLock after m_Gallery was replaced, a search that marks a retired
+            snapshot from now on sees it is not the published one and does not use it.
+            m_WorkspaceLock is only held to read the marks, the snapshots are freed after it
+Returns:    
+Throws:     
+*/
+void Recognizer::ReclaimGalleries()
+{
+   std::vector<const Gallery*> inUse;
+   {
+      ScopedLock lock( m_WorkspaceLock );
+      inUse.reserve( m_Workspaces.size() );
+      for ( size_t i = 0; i < m_Workspaces.size(); i++ )
+      {
+         const Gallery* gallery = AtomicLoad( m_Workspaces[i]->m_Gallery );
+         if ( gallery )
+            inUse.push_back( gallery );
+      }
+   }
+
+   std::vector<Gallery*> unused;
+   size_t nKept = 0;
+   for ( size_t i = 0; i < m_Retired.size(); i++ )
+   {
+      if ( std::find( inUse.begin(), inUse.end(), m_Retired[i] ) != inUse.end() )
+         m_Retired[nKept++] = m_Retired[i];
+      else
+         unused.push_back( m_Retired[i] );
+   }
+   m_Retired.resize( nKept );
+
+   for ( size_t i = 0; i < unused.size(); i++ )
+      delete unused[i];
+}
+
+
+
+
+/* 
+Function:   FreeGalleries
+Purpose:    frees the published snapshot, every retired one and the ones never published
+Notes:      only when no workspace is left to search them
+Returns:    
+Throws:     
+*/
+void Recognizer::FreeGalleries()
+{
+   DropUncommitted();
+   for ( size_t i = 0; i < m_Retired.size(); i++ )
+      delete m_Retired[i];
+   m_Retired.clear();
+
+   delete m_Gallery;
+   m_Gallery = NULL;
+}
+
+
+
+
+/* 
+Function:   AddWorkspace
+Purpose:    lets ReclaimGalleries see which snapshot a workspace has
+Notes:      
+Returns:    
+Throws:     
+*/
+void Recognizer::AddWorkspace( Workspace* workspace ) const
+{
+   ScopedLock lock( m_WorkspaceLock );
+   m_Workspaces.push_back( workspace );
+}
+
+
+
+
+/* 
+Function:   RemoveWorkspace
+Purpose:    forgets a workspace that is being destroyed
+Notes:      
+Returns:    
+Throws:     
+*/
+void Recognizer::RemoveWorkspace( Workspace* workspace ) const
+{
+   ScopedLock lock( m_WorkspaceLock );
+   std::vector<Workspace*>::iterator found = std::find( m_Workspaces.begin(), m_Workspaces.end(), workspace );
+   if ( found != m_Workspaces.end() )
+      m_Workspaces.erase( found );
+}
+
+
+
+
+/* 
+Function:   Classes
+Purpose:    number of people in the database
+Notes:      takes m_WriterLock so the gallery is not replaced while it is counted, it is not for searching
+Returns:    trained and enrolled classes not removed
+Throws:     
+*/
+int Recognizer::Classes() const
+{
+   ScopedLock lock( m_WriterLock );
+   return m_Gallery->Live();
 }
 
 
@@ -303,13 +1529,13 @@ std::string Recognizer::FindFace( int faceNum, double& distance )
 /*
 function:	GenResults
 Purpose:	Generate html and image results for face search
-Notes: 
+Notes:          uses the results of the last call to Recognize
 */
-void Recognizer::GenResults(std::string& resultsDir)
+void Recognizer::GenResults(const char* searchImage, std::string& resultsDir)
 {
    // lets name the results after the image we searched for
    // first I need to get just the image name and remove the directories
-   std::string searchImageName(m_SearchImageName);
+   std::string searchImageName(searchImage);
 
    // get rid of directory
    int pos = 0;
@@ -352,7 +1578,12 @@ void Recognizer::GenResults(std::string& resultsDir)
    saveImageName = saveImageName.substr(0, saveImageName.size()-4); // chop extension
    saveImageName += ".jpg"; // add new extension
 
-   cvSaveImage(saveImageName.c_str(), m_FaceImage);
+   IplImage* faceImage = cvLoadImage(searchImage, 0);
+   if ( faceImage )
+   {
+      cvSaveImage(saveImageName.c_str(), faceImage);
+      cvReleaseImage(&faceImage);
+   }
    html << GetText("Search Face", "h2", "    ");
    std::string tempname = ""; // cut out directory, assume all files in same location
    pos = saveImageName.find_last_of('/');
@@ -382,9 +1613,9 @@ void Recognizer::GenResults(std::string& resultsDir)
       // save original images to load into html
       for ( int i = 0; i < m_nImages; i++ )
       {
-         if ( m_PersonIDMatrix->data.i[i] == m_IDFound )
+         if ( m_ImageIDs[i] == m_IDFound )
          {
-            std::string original = m_OriginalImages[i];
+            std::string original = m_Model.String( MODEL_SECTION_IMAGE_NAMES, i );
             // load the original
             IplImage* image = cvLoadImage(original.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
             if ( image )
@@ -434,54 +1665,3 @@ void Recognizer::GenResults(std::string& resultsDir)
    html.close();
    
 }
-
-
-
-/*   
-function:	BetweenClassThreshold
-Purpose:	calculate threshold based on distance for each projected image in a specific class
-Notes:          populates e_threshold and m_threshold with values
-returns:        
-*/
-void Recognizer::BetweenClassThreshold( int personID, double& e_threshold, double& m_threshold )
-{
-   int nImagesInClass = 0;
-   int *class_indexes = NULL;
-   class_indexes = new int [m_nImages];
-
-   // find all indexes with personID
-   for ( int col = 0; col < m_nImages; col++ )
-   {
-      if ( personID == m_PersonIDMatrix->data.i[col] )
-      {
-         class_indexes[nImagesInClass++] = col;
-      }
-   }
-
-   if ( !nImagesInClass )
-      throw std::string("BetweenClassThreshold could not find any images with class");
-
-   // what is the max distance between any image in this class
-   double maxE = 0.0;
-   double maxM = 0.0;
-   int index = 0;
-   while ( index <= nImagesInClass )
-   {
-      for ( int row = class_indexes[index]; row < nImagesInClass; row++ )
-      {
-         double e_distance = 0.0;
-         double m_distance = 0.0;
-
-         for ( int col = 0; col < m_nEigenVals; col++ )
-         {
-            double d = m_ProjectedFaceMatrix->data.fl[index*m_nEigenVals + col]  ;
-            // TODO
-         }
-      }
-   }
-
-   e_threshold = maxE;
-   m_threshold = maxM;
-
-   delete class_indexes;
-}
@@ -11,68 +11,243 @@ Date:          Feb 20th 2010
 
 
 #include "Utilities.h"
+#include "ModelFile.h"
+#include "DistanceKernel.h"
+#include "HNSWIndex.h"
+#include "PQIndex.h"
+#include "Gallery.h"
+#include "Lock.h"
 #include <vector>
 
 
 std::string Recognize(const char* image, const char* database, double& distance, std::string& resultsdir);
 
 
+// number of probes RecognizeBatch projects with each GEMM
+#define RECOGNIZE_BATCH_SIZE  256
 
+// number of probes a thread of RecognizeFiles loads, projects and searches at a time
+#define RECOGNIZE_FILES_CHUNK 16
+
+
+// result of searching for one probe
+struct RecognitionResult
+{
+   personIDType   m_ID;          // person id found, 0 if there was no match
+   std::string    m_Name;        // name of the person found
+   double         m_Distance;    // distance to the person found
+
+   RecognitionResult() : m_ID(0), m_Name(""), m_Distance(DBL_MAX) {}
+};
+
+
+
+// how the recognizer finds the closest classes
+enum SearchMode
+{
+   SEARCH_EXACT,        // compare the probe with every class
+   SEARCH_HNSW,         // walk the HNSW index, approximate
+   SEARCH_PQ            // scan the product quantized codes then re-rank the closest exactly, approximate
+};
+
+
+/*
+   SearchScratch holds the buffers a search needs besides the probe so searches do not allocate.
+   Each thread searching needs its own.
+*/
+struct SearchScratch
+{
+   HNSWScratch                m_HNSW;
+   PQScratch                  m_PQ;
+   std::vector<RowDistance>   m_Merge;       // enrolled classes found then the trained ones, k of each
+};
+
+
+class Recognizer;
+
+/*
+   Workspace holds everything a search writes, allocated once so searching does not allocate.
+   The probe buffers are sized for the recognizer when the workspace is made, the scratch that
+   depends on k or the index grows on the first searches then is reused.  A recognizer is only
+   read by the searches that take a workspace, so any number of threads can search it at once
+   each with its own workspace.  A workspace can only be used with the recognizer it was made for,
+   and has to be destroyed before it.
+*/
+struct Workspace
+{
+   const Recognizer*          m_Recognizer;
+   const Gallery* volatile    m_Gallery;     // snapshot the last search used, not freed while a workspace has it
+   void*                      m_Block;       // allocation holding m_Probe and m_Projected
+   float*                     m_Probe;       // the probe image as floats, projection stride floats zero after the pixels
+   float*                     m_Projected;   // the projected probe, centroid stride floats zero after the fisherfaces
+   SearchScratch              m_Search;
+   std::vector<RowDistance>   m_Best;        // classes found, grows to k
+
+   Workspace( const Recognizer& recognizer );
+   ~Workspace();
+
+private:
+   /// Not implemented, each thread makes its own
+   Workspace(const Workspace&);
+   Workspace& operator=(const Workspace&);
+};
+
+
+// exact search compared with an approximate search over a set of probes
+struct SearchBenchmark
+{
+   int      m_nProbes;
+   int      m_k;
+   double   m_Recall;            // fraction of the exact k closest the approximate search also found
+   double   m_ExactMs;           // average exact search time per probe, projection not included
+   double   m_IndexMs;           // average approximate search time per probe, projection not included
+
+   SearchBenchmark() : m_nProbes(0), m_k(0), m_Recall(0.0), m_ExactMs(0.0), m_IndexMs(0.0) {}
+};
+
+
+
+/*
+   Recognizer loads the trained database once in its constructor and can then
+   be used to search for any number of probe images.  Keep one around for the
+   life of the process rather than creating one per search.
+   If the database has an HNSW index (<database>.hnsw) or a product quantized index
+   (<database>.pq) it is loaded and used, HNSW first.  SetSearchMode picks another index
+   or switches back to the exact scan.
+   Enroll adds a person without training again, their faces are projected with the
+   database's projection and the class is logged in <database>.gallery.log, which
+   Checkpoint folds into <database>.gallery.  A change is only published once its log record
+   is on disk, a search never finds a person a crash could forget.  Enrolled classes
+   are not in the indexes, every search scans them exactly and merges them with the
+   trained classes it found.  Remove takes a trained or enrolled person out of every search
+   without training again.
+   Only one recognizer at a time, in any process, can open a database to change it, the gallery
+   log is locked while it is open.  A recognizer opened search only replays the log in memory and
+   never creates, writes or locks a file, so any number of them can search a database, on read only
+   storage too, while one other recognizer changes it.  It can't Enroll, Remove or Checkpoint, and
+   only sees the changes made before it was opened.
+   The gallery is published as a snapshot that is never changed.  A search takes the current
+   snapshot when it starts and uses it to the end without taking a lock, Enroll and Remove copy
+   it, change the copy and publish the copy in its place.  So one thread can search while
+   others enroll and remove and the search never waits for them.  The search marks the snapshot
+   it took in its workspace, a snapshot that has been replaced is freed once no workspace has it.
+   The model is never changed after it is loaded, the const search methods only read it and write
+   into the Workspace they are given, so threads can search at the same time with a workspace
+   each and nothing is allocated or locked once the workspaces have warmed up.  The search methods
+   without a workspace share one in the recognizer and remember the last result for GenResults, only
+   one thread should use them at a time.  RecognizeFiles spreads a list of probes over all the threads
+   itself, each with its own workspace.  Change the search mode before searching from several threads.
+*/
 class Recognizer
 {
 public:
-   Recognizer(const char* image, const char* database);
+   Recognizer(const char* database, bool bSearchOnly = false);
    ~Recognizer();
 
+   std::string Recognize( const IplImage* probe, double& distance );
+   std::string Recognize( const char* image, double& distance );
+
+   void        FindTopK( const IplImage* probe, int k, std::vector<RecognitionResult>& results );
 
-   bool        LoadTrainingDatabase();
-   std::string FindFace( int faceNum, double& distance );
+   // thread safe, workspace is the calling thread's own
+   void        Recognize( const IplImage* probe, Workspace& workspace, RecognitionResult& result ) const;
+   void        FindTopK( const IplImage* probe, int k, Workspace& workspace, std::vector<RecognitionResult>& results ) const;
 
-   void	      GenResults(std::string& resultsdir);
+   void        RecognizeBatch( const std::vector<const IplImage*>& probes, std::vector<RecognitionResult>& results );
+   void        RecognizeBatch( const std::vector<const IplImage*>& probes, int k, std::vector< std::vector<RecognitionResult> >& results );
+   void        RecognizeFiles( const std::vector<std::string>& images, int k, std::vector< std::vector<RecognitionResult> >& results,
+                               std::vector<std::string>& errors );
+
+   void        BenchmarkIndex( const std::vector<const IplImage*>& probes, int k, SearchBenchmark& benchmark );
+
+   personIDType Enroll( const std::string& name, const std::vector<const IplImage*>& faces );
+   void        Remove( personIDType id );
+   void        Checkpoint();
+
+   int         EigenFaces() const { return m_nEigenFaces; }
+   int         FisherFaces() const { return m_nFisherFaces; }
+   int         ProjectionStride() const { return m_FisherProjection.step / sizeof(float); }
+   int         CentroidStride() const { return m_CentroidStride; }
+   int         Classes() const;
+
+   bool        HasIndex( SearchMode mode ) const;
+   SearchMode  GetSearchMode() const { return m_SearchMode; }
+   void        SetSearchMode( SearchMode mode );
+   void        SetEfSearch( int efSearch );
+   void        SetRerank( int nRerank );
+
+   void	      GenResults(const char* searchImage, std::string& resultsdir);
 
 private:
+   /// Not implemented, the recognizer owns a mapping of the database
+   Recognizer(const Recognizer&);
+   Recognizer& operator=(const Recognizer&);
+
+   friend struct Workspace;
 
-   /// Not implemented
-   void BetweenClassThreshold( int personID, double& e_threshold, double& m_threshold  );
+   void        LoadTrainingDatabase();
+   void        CheckWritable( const char* caller ) const;
+   std::string FindFace( const IplImage* probe, double& distance );
+   void        ProjectProbe( const IplImage* probe, Workspace& workspace ) const;
+   void        CheckWorkspace( const Workspace& workspace, const char* caller ) const;
+   void        ProjectBatch( const std::vector<const IplImage*>& probes, int first, int n, CvMat* probeBatch, CvMat* projectedBatch ) const;
+   void        FillResult( const Gallery& gallery, const RowDistance& match, RecognitionResult& result ) const;
+   int         ClosestClass( const Gallery& gallery, const float* projectedProbe, double& distance, SearchMode mode, SearchScratch& scratch ) const;
+   int         ClosestClasses( const Gallery& gallery, const float* projectedProbe, int k, RowDistance* best, SearchMode mode, SearchScratch& scratch ) const;
+   int         MergeEnrolled( const Gallery& gallery, const float* projectedProbe, int k, RowDistance* best, int nFound, SearchScratch& scratch ) const;
+
+   const Gallery& AcquireGallery( Workspace& workspace ) const;
+   void        PublishGallery( Gallery* gallery );
+   Gallery*    NewestGallery() const { return m_Pending.empty() ? m_Gallery : m_Pending.back(); }
+   void        PublishCommitted();
+   void        DropUncommitted();
+   void        FinishChange( uint64 sequence );
+   void        ReclaimGalleries();
+   void        FreeGalleries();
+   void        AddWorkspace( Workspace* workspace ) const;
+   void        RemoveWorkspace( Workspace* workspace ) const;
+   void        WriteCheckpoint( const Gallery& gallery );
 
    // training member variables
-   const char*             m_DatabaseName;
+   std::string             m_DatabaseName;
+   bool                    m_bSearchOnly;       // opened only to search, no file is written
+   ModelFile               m_Model;             // the mapped database, everything below points into it
    int                     m_nImages;           // number of images in database
-   int                     m_nPeople;           // number of people in database
-   std::vector<std::string> m_Names;            // names of people in database
-   std::vector<std::string> m_OriginalImages;   // names of original images in database that were used for training
-
-   int                     m_nEigenVals;        // the number of eigen values stored in database
-   CvMat*                  m_PersonIDMatrix;    // matrix to store person ids
-   CvMat*                  m_EigenValueMatrix;  // matrix to store Eigen values
-   CvMat*                  m_ProjectedFaceMatrix; // matrix to store projected faces
-   IplImage*               m_AverageImage;      // the average trained face
-   IplImage**              m_EigenVectorArray;  // array to store eigen vectors
+   int                     m_Width;             // width of training images
+   int                     m_Height;            // height of training images
+   const personIDType*     m_ImageIDs;          // person id of each training image
+   CvMat                   m_ProjectedFaceMatrix; // matrix to store projected faces, one row per class
 
    double                  m_EuclideanThreshold;
-   
-   const char*             m_SearchImageName;   // name if search image
-   IplImage*               m_FaceImage;         // original image with faces to find, could be more than one
-   IplImage**              m_FacesToFind;       // array of Faces to find
-   int                     m_nFacesToFind;
 
    ///////// LDA
-   int                               m_nClasses;
-   int                               m_nFisherFaces;
-   std::map<personIDType, CvMat*>    m_ClassToImageMap;         // each classes projected image array
-   std::map<personIDType, int>       m_ClassCountMap;           // number of images in each class
-   std::multimap<personIDType, int>  m_ClassToIndexMap;         // stores each class's index into m_EigenVectorArray
-
-   // averages
-   std::map<personIDType, CvMat*>    m_ClassToAverageImageMap;  // each classes average projected image
-   CvMat*                            m_AverageProjectedImage; 
-   
-   // EigenVectors and EigenValues for the LDA subspace
-   CvMat*                             m_LDAEigenVectors;
-   CvMat*                             m_LDAEigenValues;
-
-
-   // results
+   int                     m_nClasses;
+   int                     m_nEigenFaces;       // PCA dimension used in training, the projection is fused so only for reporting
+   int                     m_nFisherFaces;
+   int                     m_CentroidStride;    // floats per row of m_ProjectedFaceMatrix, padded for the distance kernel
+   Gallery* volatile       m_Gallery;           // rows of m_ProjectedFaceMatrix then the enrolled classes, with their ids, names and thresholds.
+                                                // Read with AtomicLoad, replaced holding m_WriterLock
+   std::vector<Gallery*>   m_Retired;           // snapshots replaced that a workspace may still have, freed by ReclaimGalleries
+   std::vector<Gallery*>   m_Pending;           // galleries with changes logged but not yet committed, in sequence order
+   mutable std::vector<Workspace*> m_Workspaces; // every workspace made for the recognizer
+   mutable Lock            m_WorkspaceLock;     // held to add or remove a workspace, or read which snapshots they have
+   mutable Lock            m_WriterLock;        // held while the next gallery is built, one enrollment or removal at a time
+   GalleryLog              m_Log;               // changes since the gallery file was written, appended holding m_WriterLock
+
+   // fused LDA and PCA projection, probe is projected with m_FisherProjection * probe - m_ProjectedMean
+   CvMat                   m_FisherProjection;  // m_nFisherFaces rows, image size cols
+   CvMat                   m_ProjectedMean;     // m_nFisherFaces rows, 1 col
+
+   // approximate search
+   HNSWIndex               m_Index;             // empty if the database has no HNSW index
+   SearchMode              m_SearchMode;
+   int                     m_EfSearch;          // candidates kept by an index search
+   PQIndex                 m_PQIndex;           // empty if the database has no product quantized index
+   int                     m_nRerank;           // candidates re-ranked exactly by a product quantized search
+   cv::Ptr<Workspace>      m_Workspace;         // for the searches without a workspace of their own
+
+
+   // results of the last search
    int 			            m_IDFound;
    double                  m_DistanceFound;
    std::string             m_PersonFound;     // if we din't find a person it remains ""
@@ -0,0 +1,620 @@
+#include "ShardedTraining.h"
+#include "Training.h"
+#include "ParallelGEMM.h"
+#include "ImagePack.h"
+#include "GalleryLog.h"
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+
+/*
+Function:   ShardBasisFileName
+Purpose:    where the coordinator stores the PCA subspace for the shards
+Notes:
+Throws
+returns:    <database>.pca
+*/
+std::string ShardBasisFileName( const char* database )
+{
+   std::string name = database;
+   name += ".pca";
+   return name;
+}
+
+
+
+/*
+Function:   ShardPartialFileName
+Purpose:    where a shard stores its part of the training set
+Notes:
+Throws
+returns:    <database>.shard<shard>
+*/
+std::string ShardPartialFileName( const char* database, int shard )
+{
+   std::ostringstream name;
+   name << database << ".shard" << shard;
+   return name.str();
+}
+
+
+
+/*
+Function:   ShardFailedFileName
+Purpose:    where a shard stores the error it failed with
+Notes:
+Throws
+returns:    <database>.shard<shard>.failed
+*/
+std::string ShardFailedFileName( const char* database, int shard )
+{
+   return ShardPartialFileName( database, shard ) + ".failed";
+}
+
+
+
+/*
+Function:   RenameOver
+Purpose:    moves a finished temporary file onto its real name
+Notes:      the file is synced before the rename and the directory after, so a crash leaves
+            either the old file or the whole new one; rename won't replace a file on Windows,
+            so the old one is removed first
+Throws      std::string if the sync or the rename fails
+returns:    void
+*/
+static void RenameOver( const std::string& tempname, const char* filename )
+{
+   SyncFile( tempname.c_str() );
+#ifdef _WIN32
+   remove(filename);
+#endif
+   if ( rename(tempname.c_str(), filename) != 0 )
+   {
+      std::string err = "ShardedTraining could not rename ";
+      err += tempname;
+      throw err;
+   }
+   SyncDirectory( filename );
+}
+
+
+
+/*
+Function:   WriteString
+Purpose:    writes a string as its length then its characters
+Notes:
+Throws
+returns:    void
+*/
+static void WriteString( std::ostream& out, const std::string& str )
+{
+   int length = (int)str.size();
+   out.write( (const char*)&length, sizeof(int) );
+   out.write( str.data(), length );
+}
+
+
+
+/*
+Function:   ReadString
+Purpose:    reads a string written by WriteString
+Notes:
+Throws
+returns:    false if the string could not be read
+*/
+static bool ReadString( std::istream& in, std::string& str )
+{
+   int length = 0;
+   in.read( (char*)&length, sizeof(int) );
+   if ( !in || length < 0 )
+      return false;
+
+   str.resize(length);
+   if ( length )
+      in.read( &str[0], length );
+   return !in.fail();
+}
+
+
+
+/*
+Function:   ShardBasis::Save
+Purpose:    writes the subspace to filename
+Notes:
+Throws      std::string if the file can not be written or the vectors are not the sizes the header says
+returns:    void
+*/
+void ShardBasis::Save( const char* filename ) const
+{
+   size_t size = (size_t)m_Width * m_Height;
+   if ( m_nEigenFaces < 1 || m_Average.size() != size || m_EigenVectors.size() != size * m_nEigenFaces || m_EigenValues.size() != (size_t)m_nEigenFaces )
+      throw std::string("ShardBasis::Save - the subspace is not complete");
+
+   std::string tempname = filename;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "ShardBasis::Save could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   int header[5] = { SHARD_BASIS_MAGIC, SHARD_FILE_VERSION, m_Width, m_Height, m_nEigenFaces };
+   out.write( (const char*)header, sizeof(header) );
+   out.write( (const char*)&m_Average[0], m_Average.size() * sizeof(float) );
+   out.write( (const char*)&m_EigenVectors[0], m_EigenVectors.size() * sizeof(float) );
+   out.write( (const char*)&m_EigenValues[0], m_EigenValues.size() * sizeof(float) );
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "ShardBasis::Save could not write ";
+      err += tempname;
+      throw err;
+   }
+
+   RenameOver( tempname, filename );
+}
+
+
+
+/*
+Function:   ShardBasis::Load
+Purpose:    reads a subspace written by Save
+Notes:
+Throws      std::string if the file can not be read or is not a subspace
+returns:    void
+*/
+void ShardBasis::Load( const char* filename )
+{
+   std::string err = "ShardBasis::Load - not a valid PCA subspace: ";
+   err += filename;
+
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      throw err;
+
+   int header[5];
+   in.read( (char*)header, sizeof(header) );
+   if ( !in || header[0] != SHARD_BASIS_MAGIC || header[1] != SHARD_FILE_VERSION || header[2] < 1 || header[3] < 1 || header[4] < 1 )
+      throw err;
+
+   m_Width = header[2];
+   m_Height = header[3];
+   m_nEigenFaces = header[4];
+
+   size_t size = (size_t)m_Width * m_Height;
+   m_Average.resize(size);
+   m_EigenVectors.resize(size * m_nEigenFaces);
+   m_EigenValues.resize(m_nEigenFaces);
+
+   in.read( (char*)&m_Average[0], m_Average.size() * sizeof(float) );
+   in.read( (char*)&m_EigenVectors[0], m_EigenVectors.size() * sizeof(float) );
+   in.read( (char*)&m_EigenValues[0], m_EigenValues.size() * sizeof(float) );
+   if ( !in )
+      throw err;
+}
+
+
+
+/*
+Function:   ShardPartial::Save
+Purpose:    writes the shard's images, projected faces and statistics to filename
+Notes:
+Throws      std::string if the file can not be written
+returns:    void
+*/
+void ShardPartial::Save( const char* filename ) const
+{
+   std::string tempname = filename;
+   tempname += ".tmp";
+
+   std::ofstream out(tempname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if ( !out.is_open() )
+   {
+      std::string err = "ShardPartial::Save could not open ";
+      err += tempname;
+      throw err;
+   }
+
+   int header[6] = { SHARD_PARTIAL_MAGIC, SHARD_FILE_VERSION, m_Shard, m_nShards, (int)m_IDs.size(), m_Stats.Dimension() };
+   out.write( (const char*)header, sizeof(header) );
+
+   for ( size_t i = 0; i < m_IDs.size(); i++ )
+   {
+      out.write( (const char*)&m_IDs[i], sizeof(personIDType) );
+      WriteString( out, m_PersonNames[i] );
+      WriteString( out, m_ImageNames[i] );
+   }
+
+   if ( !m_Projected.empty() )
+      out.write( (const char*)&m_Projected[0], m_Projected.size() * sizeof(float) );
+   m_Stats.Write( out );
+
+   out.close();
+   if ( out.fail() )
+   {
+      std::string err = "ShardPartial::Save could not write ";
+      err += tempname;
+      throw err;
+   }
+
+   RenameOver( tempname, filename );
+}
+
+
+
+/*
+Function:   ShardPartial::Load
+Purpose:    reads a shard written by Save
+Notes:
+Throws      std::string if the file can not be read or is not a shard
+returns:    void
+*/
+void ShardPartial::Load( const char* filename )
+{
+   std::string err = "ShardPartial::Load - not a valid shard: ";
+   err += filename;
+
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      throw err;
+
+   int header[6];
+   in.read( (char*)header, sizeof(header) );
+   if ( !in || header[0] != SHARD_PARTIAL_MAGIC || header[1] != SHARD_FILE_VERSION || header[4] < 0 || header[5] < 1 )
+      throw err;
+
+   m_Shard = header[2];
+   m_nShards = header[3];
+
+   int nImages = header[4];
+   m_IDs.resize(nImages);
+   m_PersonNames.resize(nImages);
+   m_ImageNames.resize(nImages);
+
+   for ( int i = 0; i < nImages; i++ )
+   {
+      in.read( (char*)&m_IDs[i], sizeof(personIDType) );
+      if ( !in || !ReadString( in, m_PersonNames[i] ) || !ReadString( in, m_ImageNames[i] ) )
+         throw err;
+   }
+
+   m_Projected.resize( (size_t)nImages * header[5] );
+   if ( !m_Projected.empty() )
+      in.read( (char*)&m_Projected[0], m_Projected.size() * sizeof(float) );
+   if ( !in )
+      throw err;
+
+   m_Stats.Read( in );
+   if ( m_Stats.Dimension() != header[5] || m_Stats.Count() != nImages )
+      throw err;
+}
+
+
+
+/*
+Function:   ShardRange
+Purpose:    the part of the image list a shard trains on
+Notes:      contiguous, so the shards put back in order give the image list's order
+Throws
+returns:    void
+*/
+void ShardRange( int nImages, int shard, int nShards, int& first, int& last )
+{
+   first = (int)( (long long)nImages * shard / nShards );
+   last = (int)( (long long)nImages * (shard + 1) / nShards );
+}
+
+
+
+/*
+Function:   WriteShardFailure
+Purpose:    leaves a shard's error where the coordinator looks for the shard
+Notes:      written next to its name then renamed like the shard's file.  Nothing is thrown, the
+            shard's own error is the one reported
+Throws
+returns:    void
+*/
+static void WriteShardFailure( const char* database, int shard, const std::string& error )
+{
+   std::string filename = ShardFailedFileName( database, shard );
+   std::string tempname = filename + ".tmp";
+
+   {
+      std::ofstream out( tempname.c_str(), std::ios::out | std::ios::trunc );
+      if ( !out.is_open() )
+         return;
+      out << error << std::endl;
+      if ( !out )
+         return;
+   }
+
+   try
+   {
+      RenameOver( tempname, filename.c_str() );
+   }
+   catch (...)
+   {
+      remove( tempname.c_str() );
+   }
+}
+
+
+
+/*
+Function:   ProjectShard
+Purpose:    loads a shard's images, projects them onto the coordinator's PCA subspace and writes them with their statistics
+Notes:      SHARD_BLOCK_IMAGES images are loaded at a time, centered, and projected with one GEMM, so a
+            shard never holds more than one block of images.  The image list can be an image pack
+Throws      std::string if the subspace, an image or the image list can't be read, or the shard can't be written
+returns:    void
+*/
+static void ProjectShard( const char* imagelist, const char* database, int shard, int nShards )
+{
+   ShardBasis basis;
+   basis.Load( ShardBasisFileName(database).c_str() );
+
+   std::vector<Image> images;
+   ReadImageList( imagelist, images );
+
+   // a pack's pixels are read in place instead of decoding each image
+   ImagePack pack;
+   bool packed = IsImagePack( imagelist );
+   if ( packed )
+   {
+      pack.Open( imagelist );
+      if ( pack.Width() != basis.m_Width || pack.Height() != basis.m_Height )
+         throw std::string("TrainShard: Images should be same size");
+   }
+
+   int first, last;
+   ShardRange( (int)images.size(), shard, nShards, first, last );
+
+   int size = basis.m_Width * basis.m_Height;
+   int d = basis.m_nEigenFaces;
+
+   ShardPartial partial;
+   partial.m_Shard = shard;
+   partial.m_nShards = nShards;
+   partial.m_Stats.Reset( d );
+   partial.m_Projected.resize( (size_t)(last - first) * d );
+
+   CvMat eigenVectors;
+   cvInitMatHeader( &eigenVectors, d, size, CV_32FC1, &basis.m_EigenVectors[0] );
+
+   int blockImages = std::max( std::min( last - first, SHARD_BLOCK_IMAGES ), 1 );
+   CvMat* block = cvCreateMat( blockImages, size, CV_32FC1 );
+
+   try
+   {
+      for ( int start = first; start < last; start += blockImages )
+      {
+         int end = std::min( start + blockImages, last );
+
+         for ( int i = start; i < end; i++ )
+         {
+            float* row = block->data.fl + (size_t)(i - start) * size;
+
+            partial.m_IDs.push_back( images[i].m_ID );
+            partial.m_PersonNames.push_back( images[i].m_PersonName );
+            partial.m_ImageNames.push_back( images[i].m_ImageName );
+
+            if ( packed )
+            {
+               const uchar* pixels = pack.Pixels(i);
+               for ( int col = 0; col < size; col++ )
+                  row[col] = pixels[col] - basis.m_Average[col];
+               continue;
+            }
+
+            IplImage* image = cvLoadImage( images[i].m_ImageName.c_str(), CV_LOAD_IMAGE_GRAYSCALE );
+            if ( !image )
+            {
+               std::string err = "TrainShard could not load image ";
+               err += images[i].m_ImageName;
+               throw err;
+            }
+
+            if ( image->width != basis.m_Width || image->height != basis.m_Height )
+            {
+               cvReleaseImage(&image);
+               throw std::string("TrainShard: Images should be same size");
+            }
+
+            ImageToMatrix( image, row, size );
+            cvReleaseImage(&image);
+
+            for ( int col = 0; col < size; col++ )
+               row[col] -= basis.m_Average[col];
+         }
+
+         CvMat blockRows, projected;
+         cvGetRows( block, &blockRows, 0, end - start );
+         cvInitMatHeader( &projected, end - start, d, CV_32FC1, &partial.m_Projected[(size_t)(start - first) * d] );
+
+         ParallelGEMM( &blockRows, &eigenVectors, 1, &projected, CV_GEMM_B_T );
+         partial.m_Stats.AddRows( &projected, &partial.m_IDs[start - first] );
+      }
+   }
+   catch (...)
+   {
+      cvReleaseMat(&block);
+      throw;
+   }
+
+   cvReleaseMat(&block);
+
+   partial.Save( ShardPartialFileName(database, shard).c_str() );
+}
+
+
+
+/*
+Function:   TrainShard
+Purpose:    does a shard's work, or leaves the error where the coordinator looks for the shard
+Notes:      a failure marker from an earlier run of the shard is removed first
+Throws      std::string if the shard failed
+returns:    void
+*/
+void TrainShard( const char* imagelist, const char* database, int shard, int nShards )
+{
+   if ( nShards < 1 || shard < 0 || shard >= nShards )
+      throw std::string("TrainShard - shard number is not valid");
+
+   remove( ShardFailedFileName(database, shard).c_str() );
+
+   try
+   {
+      ProjectShard( imagelist, database, shard, nShards );
+   }
+   catch ( std::string& err )
+   {
+      WriteShardFailure( database, shard, err );
+      throw;
+   }
+   catch (...)
+   {
+      WriteShardFailure( database, shard, "unknown error" );
+      throw;
+   }
+}
+
+
+
+/*
+Function:   RunShards
+Purpose:    runs every shard on this machine
+Notes:      each shard is a forked process with one OpenMP thread, so the shards use the cores instead
+            of the matrix products.  The coordinator has already run parallel loops and cvGEMM, so its OpenMP
+            pool and OpenCV's own thread pool exist, but only the forking thread is copied into a shard.
+            A shard sets both to one thread, omp_set_num_threads for the parallel loops and cvSetNumThreads
+            for the cvGEMM calls in ParallelGEMM, so its work runs on that thread and never waits for the
+            pools' threads, which aren't there.  Windows has no fork, so there the shards run one after
+            another in this process
+Throws      std::string if a shard fails
+returns:    void
+*/
+void RunShards( const char* imagelist, const char* database, int nShards )
+{
+#ifdef _WIN32
+   for ( int shard = 0; shard < nShards; shard++ )
+      TrainShard( imagelist, database, shard, nShards );
+#else
+   std::vector<pid_t> workers;
+
+   for ( int shard = 0; shard < nShards; shard++ )
+   {
+      pid_t pid = fork();
+
+      if ( pid == 0 )
+      {
+         int status = 0;
+         try
+         {
+#ifdef _OPENMP
+            omp_set_num_threads(1);
+#endif
+            cvSetNumThreads(1);
+            TrainShard( imagelist, database, shard, nShards );
+         }
+         catch ( std::string& err )
+         {
+            std::cerr << "Shard " << shard << ": " << err << std::endl;
+            status = 1;
+         }
+         catch (...)
+         {
+            status = 1;
+         }
+         _exit(status);
+      }
+
+      if ( pid < 0 )
+         break;
+
+      workers.push_back(pid);
+   }
+
+   bool failed = (int)workers.size() != nShards;
+   for ( size_t i = 0; i < workers.size(); i++ )
+   {
+      int status = 0;
+      if ( waitpid( workers[i], &status, 0 ) != workers[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+         failed = true;
+   }
+
+   if ( failed )
+      throw std::string("RunShards - a training shard failed");
+#endif
+}
+
+
+
+/*
+Function:   WaitForShards
+Purpose:    waits for shards run on other machines to finish
+Notes:      a shard's file only appears once it is complete, so this only has to look for each file.
+            A shard that failed writes its failure marker instead, a shard that crashed writes nothing,
+            so there is also a time limit for all of them
+Throws      std::string with the shard's error if one failed, or if they aren't all done within timeoutSeconds
+returns:    void
+*/
+void WaitForShards( const char* database, int nShards, int timeoutSeconds )
+{
+   time_t start = time(NULL);
+
+   for ( int shard = 0; shard < nShards; shard++ )
+   {
+      std::string filename = ShardPartialFileName( database, shard );
+      std::string failedname = ShardFailedFileName( database, shard );
+
+      for ( ;; )
+      {
+         std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+         if ( in.is_open() )
+            break;
+
+         std::ifstream failed(failedname.c_str());
+         if ( failed.is_open() )
+         {
+            std::string reason;
+            std::getline( failed, reason );
+
+            std::ostringstream err;
+            err << "WaitForShards - shard " << shard << " failed: " << reason;
+            throw err.str();
+         }
+
+         if ( timeoutSeconds > 0 && difftime( time(NULL), start ) >= timeoutSeconds )
+         {
+            std::ostringstream err;
+            err << "WaitForShards - shard " << shard << " did not finish within " << timeoutSeconds << " seconds";
+            throw err.str();
+         }
+
+#ifdef _WIN32
+         Sleep( SHARD_POLL_SECONDS * 1000 );
+#else
+         sleep( SHARD_POLL_SECONDS );
+#endif
+      }
+   }
+}
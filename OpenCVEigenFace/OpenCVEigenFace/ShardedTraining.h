@@ -0,0 +1,88 @@
+#ifndef SHARDEDTRAINING_H
+#define SHARDEDTRAINING_H
+
+/*
+   ShardedTraining.h
+   Description:   splits the expensive part of training, loading and projecting every image, between
+                  worker processes.  The coordinator finds the PCA subspace from a sample of the images
+                  and writes it as <database>.pca.  Each shard takes a contiguous part of the image list,
+                  projects its images onto the subspace and writes its projected faces and TrainingStats
+                  as <database>.shard<n>.  The coordinator then merges the shards and does the LDA.
+
+   Notes:         on one machine the shards are forked processes, on Windows they run one after another
+                  in the coordinator.  Shards can also run on other machines that share the files, each
+                  runs TrainShard and the coordinator waits for their files to appear.  A shard that fails
+                  writes <database>.shard<n>.failed with its error instead, and the coordinator throws it.
+                  Files are written next to their name then renamed, so a file that exists is complete
+*/
+
+#include "Utilities.h"
+#include "TrainingStats.h"
+#include <vector>
+
+
+#define SHARD_BASIS_MAGIC        0x53414350  // 'PCAS'
+#define SHARD_PARTIAL_MAGIC      0x44524853  // 'SHRD'
+#define SHARD_FILE_VERSION       2
+#define SHARD_BLOCK_IMAGES       256         // images a shard loads and projects together
+#define SHARD_POLL_SECONDS       5           // how often the coordinator looks for shards on other machines
+#define SHARD_DEFAULT_TIMEOUT_SECONDS  (24*60*60)  // how long the coordinator waits for shards on other machines
+
+
+// <database>.pca, <database>.shard<n> and <database>.shard<n>.failed
+std::string ShardBasisFileName(const char* database);
+std::string ShardPartialFileName(const char* database, int shard);
+std::string ShardFailedFileName(const char* database, int shard);
+
+
+// the PCA subspace every shard projects onto, also the PCA stage of StageCache
+struct ShardBasis
+{
+   int                  m_Width;
+   int                  m_Height;
+   int                  m_nEigenFaces;
+   std::vector<float>   m_Average;        // average image, m_Width * m_Height
+   std::vector<float>   m_EigenVectors;   // m_nEigenFaces rows of m_Width * m_Height
+   std::vector<float>   m_EigenValues;    // m_nEigenFaces, normalized to add up to 1, the stage cache keeps them
+
+   ShardBasis() : m_Width(0), m_Height(0), m_nEigenFaces(0) {}
+
+   void Save(const char* filename) const;
+   void Load(const char* filename);
+};
+
+
+// one shard's part of the training set, in image list order, also the projection stage of StageCache
+struct ShardPartial
+{
+   int                        m_Shard;
+   int                        m_nShards;
+   std::vector<personIDType>  m_IDs;
+   std::vector<std::string>   m_PersonNames;
+   std::vector<std::string>   m_ImageNames;
+   std::vector<float>         m_Projected;      // one row of m_Stats.Dimension() per image
+   TrainingStats              m_Stats;
+
+   ShardPartial() : m_Shard(0), m_nShards(0) {}
+
+   void Save(const char* filename) const;
+   void Load(const char* filename);
+};
+
+
+// images [first, last) of nImages belong to shard
+void ShardRange(int nImages, int shard, int nShards, int& first, int& last);
+
+// one shard's work, reads <database>.pca and writes <database>.shard<shard>
+// if it fails it writes <database>.shard<shard>.failed then throws
+void TrainShard(const char* imagelist, const char* database, int shard, int nShards);
+
+// every shard on this machine, throws std::string if any of them fails
+void RunShards(const char* imagelist, const char* database, int nShards);
+
+// waits until every shard's file has been written by workers on other machines
+// throws std::string if a shard failed or they aren't all written within timeoutSeconds, 0 waits forever
+void WaitForShards(const char* database, int nShards, int timeoutSeconds);
+
+
+#endif
@@ -0,0 +1,177 @@
+#include "StageCache.h"
+#include "Training.h"
+#include "ImagePack.h"
+#include <fstream>
+#include <stdio.h>
+
+
+#define FNV_OFFSET_BASIS   14695981039346656037ULL
+#define FNV_PRIME          1099511628211ULL
+
+
+
+/*
+Function:   StageHash constructor
+Purpose:
+Notes:
+Throws
+*/
+StageHash::StageHash() : m_Hash(FNV_OFFSET_BASIS)
+{
+}
+
+
+
+/*
+Function:   Add
+Purpose:    hashes bytes into the key
+Notes:
+Throws
+returns:    void
+*/
+void StageHash::Add( const void* data, size_t bytes )
+{
+   const uchar* p = (const uchar*)data;
+
+   for ( size_t i = 0; i < bytes; i++ )
+   {
+      m_Hash ^= p[i];
+      m_Hash *= FNV_PRIME;
+   }
+}
+
+
+
+/*
+Function:   Add
+Purpose:    hashes a string into the key
+Notes:      the length goes first so "ab" then "c" is not the same as "a" then "bc"
+Throws
+returns:    void
+*/
+void StageHash::Add( const std::string& value )
+{
+   Add( (int)value.size() );
+   Add( value.data(), value.size() );
+}
+
+
+
+/*
+Function:   StageCacheFileName
+Purpose:    where a stage with key is cached
+Notes:
+Throws
+returns:    <directory>/<key>.<stage>
+*/
+std::string StageCacheFileName( const std::string& directory, uint64 key, const char* stage )
+{
+   char hex[17];
+   sprintf( hex, "%08x%08x", (unsigned int)(key >> 32), (unsigned int)(key & 0xFFFFFFFF) );
+
+   std::string name = directory;
+   if ( !name.empty() && name[name.size()-1] != '/' && name[name.size()-1] != '\\' )
+      name += "/";
+   name += hex;
+   name += ".";
+   name += stage;
+   return name;
+}
+
+
+
+/*
+Function:   HashFile
+Purpose:    hashes the contents of a file
+Notes:      read STAGE_CACHE_READ_BYTES at a time so the file is never held in memory
+Throws
+returns:    false if the file can't be read
+*/
+static bool HashFile( const char* filename, uint64& hash )
+{
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if ( !in.is_open() )
+      return false;
+
+   StageHash fileHash;
+   std::vector<char> buffer(STAGE_CACHE_READ_BYTES);
+
+   while ( in )
+   {
+      in.read( &buffer[0], buffer.size() );
+      fileHash.Add( &buffer[0], (size_t)in.gcount() );
+   }
+
+   if ( in.bad() )
+      return false;
+
+   hash = fileHash.Value();
+   return true;
+}
+
+
+
+/*
+Function:   HashTrainingImages
+Purpose:    hashes everything training reads from an image list or pack
+Notes:      each image is hashed in parallel, an image file's bytes or a pack's pixels, then the entries
+            and image hashes are combined in list order.  The first image that can't be read in list
+            order is reported, whichever thread found it
+Throws      std::string if the list or an image can't be read
+returns:    the hash, imageHashes has each image's contents hash
+*/
+uint64 HashTrainingImages( const char* imagelist, std::vector<uint64>& imageHashes )
+{
+   std::vector<Image> images;
+   ReadImageList( imagelist, images );
+
+   int nImages = (int)images.size();
+   imageHashes.assign( nImages, 0 );
+   std::vector<char> status( nImages, IMAGE_LOADED );
+
+   if ( IsImagePack(imagelist) )
+   {
+      ImagePack pack;
+      pack.Open( imagelist );
+      int size = pack.Width() * pack.Height();
+
+#pragma omp parallel for schedule(static)
+      for ( int i = 0; i < nImages; i++ )
+      {
+         StageHash imageHash;
+         imageHash.Add( pack.Width() );
+         imageHash.Add( pack.Height() );
+         imageHash.Add( pack.Pixels(i), size );
+         imageHashes[i] = imageHash.Value();
+      }
+   }
+   else
+   {
+#pragma omp parallel for schedule(dynamic)
+      for ( int i = 0; i < nImages; i++ )
+      {
+         if ( !HashFile( images[i].m_ImageName.c_str(), imageHashes[i] ) )
+            status[i] = IMAGE_NOT_LOADED;
+      }
+   }
+
+   StageHash hash;
+   hash.Add( nImages );
+
+   for ( int i = 0; i < nImages; i++ )
+   {
+      if ( status[i] != IMAGE_LOADED )
+      {
+         std::string err = "HashTrainingImages could not read image ";
+         err += images[i].m_ImageName;
+         throw err;
+      }
+
+      hash.Add( images[i].m_ID );
+      hash.Add( images[i].m_PersonName );
+      hash.Add( images[i].m_ImageName );
+      hash.Add( imageHashes[i] );
+   }
+
+   return hash.Value();
+}
@@ -0,0 +1,57 @@
+#ifndef STAGECACHE_H
+#define STAGECACHE_H
+
+/*
+   StageCache.h
+   Description:   a directory of training stage outputs named by a hash of everything the stage depends on,
+                  so training again with the same inputs loads a stage instead of computing it.
+                  The PCA stage, the average image, eigenfaces and eigenvalues, is stored as
+                  <key>.pca.  The projection stage, every projected face and the TrainingStats, is
+                  stored as <key>.proj.  Both are the files sharded training already uses, a
+                  ShardBasis and a ShardPartial.
+
+   Notes:         a key hashes the image list entries, the contents of every image, the options the
+                  stage uses and STAGE_CACHE_CODE_VERSION.  The projection's key is made from the PCA
+                  stage's, so anything that changes the subspace changes both.  LDA options are not
+                  in either key, changing them only redoes the LDA.  Files are never overwritten
+                  with different contents, nothing is removed, the directory can be emptied at any time
+*/
+
+#include "Utilities.h"
+#include <vector>
+
+
+#define STAGE_CACHE_CODE_VERSION    1           // change whenever a cached stage would compute something different
+#define STAGE_CACHE_SUBSPACE        "pca"
+#define STAGE_CACHE_PROJECTION      "proj"
+#define STAGE_CACHE_READ_BYTES      65536       // read at a time when hashing an image file
+
+
+// 64 bit FNV-1a, fed a field at a time
+class StageHash
+{
+public:
+   StageHash();
+
+   void Add( const void* data, size_t bytes );
+   void Add( int value )                  { Add( &value, sizeof(value) ); }
+   void Add( uint64 value )               { Add( &value, sizeof(value) ); }
+   void Add( double value )               { Add( &value, sizeof(value) ); }
+   void Add( const std::string& value );
+
+   uint64 Value() const { return m_Hash; }
+
+private:
+   uint64   m_Hash;
+};
+
+
+// <directory>/<key as 16 hex digits>.<stage>
+std::string StageCacheFileName( const std::string& directory, uint64 key, const char* stage );
+
+// hash of every entry of an image list or pack and every image's contents, in list order, imageHashes
+// gets each image's contents hash.  Throws std::string if the list or an image can't be read
+uint64 HashTrainingImages( const char* imagelist, std::vector<uint64>& imageHashes );
+
+
+#endif
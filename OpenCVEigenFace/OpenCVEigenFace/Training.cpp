@@ -1,6 +1,18 @@
 #include "Training.h"
 #include "PreProcess.h"
+#include "ModelFile.h"
+#include "RandomizedPCA.h"
+#include "ParallelGEMM.h"
+#include "GeneralizedEigen.h"
+#include "ShardedTraining.h"
+#include "StageCache.h"
+#include "Gallery.h"
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
 #include <fstream>
+#include <algorithm>
+#include <set>
 #include "HTMLHelper.h"
 
 
@@ -11,17 +23,69 @@ Purpose:    Calls into the Trainer to train the system and load the database
 Notes:      
 Throws      
 */
-void Train(const char* imagelist, const char* database, std::string& resultdir)
+void Train(const char* imagelist, const char* database, std::string& resultdir, const TrainingOptions& options)
 {
    try
    {
-      Trainer trn(imagelist,database);
-      trn.LoadImages();
-      trn.CreateSubspace();
-      trn.ProjectOntoSubSpace();
+      Trainer trn(imagelist,database,options);
+
+      // with a stage cache, stages whose inputs haven't changed are loaded instead of computed
+      trn.HashInputs();
+
+      if ( options.m_bIncremental && trn.UpdateFromPreviousModel() )
+      {
+         // only the images that changed were projected
+         trn.StoreCachedProjection();
+      }
+      else
+      {
+         bool cachedSubspace = trn.LoadCachedSubspace();
+
+         if ( !cachedSubspace || !trn.LoadCachedProjection() )
+         {
+            if ( options.m_nShards > 1 )
+            {
+               // the PCA subspace comes from a sample, the shards project every image onto it
+               for ( int shard = 0; shard < options.m_nShards; shard++ )
+               {
+                  remove( ShardPartialFileName(database, shard).c_str() );
+                  remove( ShardFailedFileName(database, shard).c_str() );
+               }
+
+               if ( !cachedSubspace )
+               {
+                  trn.LoadImages( options.m_PCASampleImages );
+                  trn.CreateSubspace();
+                  trn.StoreCachedSubspace();
+               }
+               trn.StoreBasis();
+
+               if ( options.m_bExternalShards )
+                  WaitForShards( database, options.m_nShards, options.m_ShardTimeoutSeconds );
+               else
+                  RunShards( imagelist, database, options.m_nShards );
+
+               trn.MergeShards( options.m_nShards );
+            }
+            else
+            {
+               trn.LoadImages();
+               if ( !cachedSubspace )
+               {
+                  trn.CreateSubspace();
+                  trn.StoreCachedSubspace();
+               }
+               trn.ProjectOntoSubSpace();
+            }
+
+            trn.StoreCachedProjection();
+         }
+      }
+
       trn.DoLDA();
       trn.CalculateThresholds();
       trn.StoreData();
+      trn.StoreIndexes();
 
    }
    catch (...)
@@ -46,8 +110,12 @@ Purpose:    Constructor for the trainer
 Notes:      
 Throws      
 */
-Trainer::Trainer(const char* imagelist, const char* database) : m_nImages(0), m_Width(0), m_Height(0), m_nEigenVals(0), m_AverageImage(NULL), m_EuclideanThreshold(0.0),
-   m_nLDAEigens(0), m_nClasses(0)
+Trainer::Trainer(const char* imagelist, const char* database, const TrainingOptions& options) : m_Options(options), m_ImagesKey(0), m_OptionsKey(0), m_SubspaceKey(0), m_ProjectionKey(0), m_nImages(0), m_nListImages(0), m_nListClasses(0), m_Width(0), m_Height(0), m_nEigenVals(0),
+   m_ImageArray(NULL), m_ImagePixels(NULL), m_EigenVectorArray(NULL), m_EigenVectorMatrix(NULL), m_ImageMatrix(NULL), m_PersonIDMatrix(NULL), m_EigenValueMatrix(NULL),
+   m_ProjectedFaceMatrix(NULL), m_EuclideanThreshold(0.0), m_ClassThresholds(NULL), m_AverageImage(NULL),
+   m_nClasses(0), m_nLDAEigens(0), m_nFisherFaces(0), m_ClassAverageMat(NULL), m_AverageProjectedImage(NULL),
+   m_WithinScatterMat(NULL), m_BetweenFactorMat(NULL), m_LDAEigenVectors(NULL), m_LDAEigenValues(NULL), m_ProjectedLDAFaceMat(NULL),
+   m_FisherProjection(NULL), m_ProjectedMean(NULL)
 {
    m_ImageFile = imagelist;
    m_DatabaseFile = database;
@@ -66,31 +134,78 @@ Trainer::~Trainer()
 {
    for ( int i = 0; i < m_ImageVec.size(); i++ )
    {
-      cvReleaseImage(&m_ImageVec[i].m_Image);
+      cvReleaseImageHeader(&m_ImageVec[i].m_Image);
+   }
+   if ( m_ImageArray )
+      cvFree(&m_ImageArray);
+   cvReleaseMat(&m_ImagePixels);
+
+   if ( m_EigenVectorArray )
+   {
+      for ( int i = 0; i < m_nEigenVals; i++ )
+         cvReleaseImageHeader(&m_EigenVectorArray[i]);
+      cvFree(&m_EigenVectorArray);
    }
+   cvReleaseMat(&m_EigenVectorMatrix);
+   cvReleaseMat(&m_ImageMatrix);
+   cvReleaseMat(&m_PersonIDMatrix);
+   cvReleaseMat(&m_EigenValueMatrix);
+   cvReleaseMat(&m_ProjectedFaceMatrix);
+
+   cvReleaseMat(&m_AverageProjectedImage);
+   cvReleaseMat(&m_ClassAverageMat);
+   cvReleaseMat(&m_WithinScatterMat);
+   cvReleaseMat(&m_BetweenFactorMat);
+   cvReleaseMat(&m_LDAEigenVectors);
+   cvReleaseMat(&m_LDAEigenValues);
+   cvReleaseMat(&m_ProjectedLDAFaceMat);
+
+   cvReleaseMat(&m_ClassThresholds);
+   cvReleaseMat(&m_FisherProjection);
+   cvReleaseMat(&m_ProjectedMean);
 }
 
 
 
 /* 
-Function:   LoadImages
-Purpose:    reads in m_ImageFile and loads the images
-Notes:      LoadImages will pre-process the images
-Throws      std::string if file can not be opened, or if image can not be found
-returns:    Number if images processed
+Function:   ReadImageList
+Purpose:    reads the id, person name and image name on each line of an image list
+Notes:      the images themselves are not loaded, m_Image is left NULL.  A blank line ends the list.
+            An image pack's table is read the same way
+Throws      std::string if the file can not be opened or a line is not valid
+returns:    void
 */
-int Trainer::LoadImages()
+void ReadImageList(const char* imagelist, std::vector<Image>& images)
 {
-   m_nImages = 0;
+   images.clear();
+
+   if ( IsImagePack(imagelist) )
+   {
+      ImagePack pack;
+      pack.Open(imagelist);
+
+      for ( int i = 0; i < pack.Count(); i++ )
+      {
+         Image img;
+         img.m_ID = pack.ID(i);
+         img.m_PersonName = pack.PersonName(i);
+         img.m_ImageName = pack.ImageName(i);
+
+         if ( img.m_ID == 0 )
+            throw std::string("Trainer::LoadImages - Training person ids should start with 1");
+
+         images.push_back(img);
+      }
+      return;
+   }
 
-   // open the iamges file
-   std::ifstream in(m_ImageFile.c_str());
+   std::ifstream in(imagelist);
 
    if ( !in.is_open() )
    {
       std::string err;
       err = "Trainer could not open images file ";
-      err += m_ImageFile;
+      err += imagelist;
       throw err;
    }
 
@@ -99,84 +214,103 @@ int Trainer::LoadImages()
 
    while ( in.getline(buffer,512) )
    {
-      try
-      {
-         std::string line(buffer);
-         if ( line.empty() )
-            break;
+      std::string line(buffer);
+      if ( line.empty() )
+         break;
 
-         Image img(buffer);
+      Image img(buffer);
 
-         if ( img.m_ID == 0 )
-            throw std::string("Trainer::LoadImages - Training person ids should start with 1");
+      if ( img.m_ID == 0 )
+         throw std::string("Trainer::LoadImages - Training person ids should start with 1");
 
-         m_Names.push_back(img.m_PersonName);
+      images.push_back(img);
+   }
+}
 
-         // load image
-         IplImage* temp = NULL;
-         temp = cvLoadImage(img.m_ImageName.c_str(),CV_LOAD_IMAGE_GRAYSCALE);  // assume image is greyscale since it has been preprocessed 
 
-         if ( !temp )
-         {
-            std::string err;
-            err = "Trainer::LoadImages could not create image for ";
-            err += img.m_ImageName;
-            throw err;
-         }
 
-         IplImage* newtemp = NULL;
+/* 
+Function:   LoadImages
+Purpose:    reads in m_ImageFile and loads the images
+Notes:      LoadImages will pre-process the images.  With sampleImages more than 0 and a longer image
+            list, only that many images spread evenly over the list are loaded, sharded training
+            finds the PCA subspace from them.
+            The image list is read first, so the names and the class counts don't depend on the
+            decoding.  m_ImageFile can also be an image pack, then the images are mapped instead of decoded
+Throws      std::string if file can not be opened, or if image can not be found
+returns:    Number if images processed
+*/
+int Trainer::LoadImages(int sampleImages)
+{
+   m_nImages = 0;
 
-         if ( m_Width == 0 )
-         {
-            m_Width = temp->width;
-            m_Height = temp->height;
-         }
-         else
-         {
-            if ( m_Width != temp->width || m_Height != temp->height )
-               throw std::string("Trainer::LoadImages: Images should be same size");
-         }
+   std::vector<Image> images;
+   ReadImageList( m_ImageFile.c_str(), images );
+
+   int nList = (int)images.size();
+   int nLoad = ( sampleImages > 0 && sampleImages < nList ) ? sampleImages : nList;
 
-         img.m_Image = temp;
+   // the sizes of the whole list, the subspace of a sample is still sized for all of it
+   std::set<personIDType> listIDs;
+   for ( int i = 0; i < nList; i++ )
+      listIDs.insert( images[i].m_ID );
+   m_nListImages = nList;
+   m_nListClasses = (int)listIDs.size();
 
-         m_ImageVec.push_back(img);
+   if ( nLoad == 0 )
+   {
+      std::string err;
+      err = "Trainer::LoadImages - no images in ";
+      err += m_ImageFile;
+      throw err;
+   }
 
-         ////////////////////
-         // 
-         std::map<personIDType, int>::iterator it;
-         it = m_ClassCountMap.find(img.m_ID);
+   std::vector<int> source;
+   for ( int i = 0; i < nLoad; i++ )
+   {
+      source.push_back( (int)( (long long)i * nList / nLoad ) );
+      Image img = images[ source.back() ];
 
-         if ( it == m_ClassCountMap.end() )
-         {
-            m_nClasses++;
-            m_ClassCountMap[img.m_ID] = 1;
-         }
-         else
-         {
-            m_ClassCountMap[img.m_ID]++;
-         }
+      m_ImageVec.push_back(img);
+      m_Names.push_back(img.m_PersonName);
+      m_ImageNames.push_back(img.m_ImageName);
 
+      ////////////////////
+      // 
+      std::map<personIDType, int>::iterator it;
+      it = m_ClassCountMap.find(img.m_ID);
 
+      if ( it == m_ClassCountMap.end() )
+      {
+         m_nClasses++;
+         m_ClassCountMap[img.m_ID] = 1;
       }
-      catch (...)
+      else
       {
-         throw;
+         m_ClassCountMap[img.m_ID]++;
       }
-
-      // success
-      m_nImages++;
    }
 
-   in.close();
+   m_nImages = nLoad;
+
+   if ( IsImagePack( m_ImageFile.c_str() ) )
+      MapImages( source );
+   else
+      DecodeImages();
 
 
    // now store images and person id's in array to pass to eigen functions
+   // each image is a header over its row of m_ImagePixels
+   CvSize imageSize = cvSize( m_Width, m_Height );
    m_ImageArray = (IplImage**)cvAlloc(m_nImages*sizeof(IplImage*));
    m_PersonIDMatrix = cvCreateMat(1,m_nImages,CV_32SC1);   
    for ( int i = 0; i < m_nImages; i++ )
    {
       m_PersonIDMatrix->data.i[i] = m_ImageVec[i].m_ID;
 
+      m_ImageVec[i].m_Image = cvCreateImageHeader( imageSize, IPL_DEPTH_8U, 1 );
+      cvSetData( m_ImageVec[i].m_Image, m_ImagePixels->data.ptr + (size_t)i * m_ImagePixels->step, m_Width );
+
       m_ImageArray[i] = m_ImageVec[i].m_Image;      
 
       // insert index of this classes image
@@ -189,411 +323,1038 @@ int Trainer::LoadImages()
 
 
 /* 
-Function:   CreateSubspace
-Purpose:    finds average image, centers each image around mean, finds covariance matrix, then finds 
-Eigenvectors (Principal components) and Eigenvalues
-Notes:      
-Throws      std::string if it can't allocate memory
-returns:    
+Function:   DecodeImages
+Purpose:    loads every image in m_ImageVec into its row of m_ImagePixels
+Notes:      the first image sets the size, then the rest are decoded in parallel straight into their
+            row.  Every image is checked before any error is reported, and the first bad one in list
+            order is reported, so errors are the same however the threads ran
+Throws      std::string if an image can not be loaded or is a different size
+returns:    void
 */
-void Trainer::CreateSubspace()
+void Trainer::DecodeImages()
 {
-   // we can only find m_nImages - m_nClasses for LDA
-   m_nEigenVals = m_nImages - m_nClasses;
-
-   CvSize size;
-   size.width = m_ImageVec[0].m_Image->width;
-   size.height = m_ImageVec[0].m_Image->height;
-
-   // allocate space for the eigen vectors
-   m_EigenVectorArray    = (IplImage**)cvAlloc(sizeof(IplImage*) * m_nEigenVals);
-   for ( int i = 0; i < m_nEigenVals; i++ )
+   // load image
+   // assume image is greyscale since it has been preprocessed 
+   IplImage* first = cvLoadImage(m_ImageVec[0].m_ImageName.c_str(),CV_LOAD_IMAGE_GRAYSCALE);
+   if ( !first )
    {
-      m_EigenVectorArray[i] = cvCreateImage(size, IPL_DEPTH_32F, 1);   // floating point image
-      
-      if ( !m_EigenVectorArray[i] )
-         throw std::string("Trainer::DoPCA could not allocate EigenVector");
+      std::string err;
+      err = "Trainer::LoadImages could not create image for ";
+      err += m_ImageVec[0].m_ImageName;
+      throw err;
    }
 
-   m_AverageImage = cvCreateImage(size, IPL_DEPTH_32F, 1 );
-   if ( !m_AverageImage )
-      throw std::string("Trainer::DoPCA could not allocate m_AverageImage");
+   m_Width = first->width;
+   m_Height = first->height;
+   int size = m_Width * m_Height;
 
-   // This is how many eigen vectors we will use out of all of them
-   // i.e in the subspace, each image will have nEigenVals 
-   CvTermCriteria limit = cvTermCriteria(CV_TERMCRIT_ITER, m_nEigenVals, 1);
+   m_ImagePixels = cvCreateMat( m_nImages, size, CV_8UC1 );
+   CopyImageToRow( first, m_ImagePixels->data.ptr );
+   cvReleaseImage(&first);
 
-   // these will be the actuall eigen values
-   m_EigenValueMatrix = cvCreateMat(1, m_nEigenVals, CV_32FC1);
+   std::vector<char> status( m_nImages, IMAGE_LOADED );
 
-   // ask openCv to do the work
-   cvCalcEigenObjects( m_nImages, (void*)m_ImageArray, (void*)m_EigenVectorArray, CV_EIGOBJ_NO_CALLBACK, 0, 0, &limit,
-      m_AverageImage, m_EigenValueMatrix->data.fl );
+#pragma omp parallel for schedule(dynamic)
+   for ( int i = 1; i < m_nImages; i++ )
+   {
+      IplImage* temp = cvLoadImage(m_ImageVec[i].m_ImageName.c_str(),CV_LOAD_IMAGE_GRAYSCALE);
 
-   // now we have the averge image, eigenvectors of the covariance matrix, and eigen values
-   cvNormalize(m_EigenValueMatrix, m_EigenValueMatrix, 1, 0, CV_L1, 0);
+      if ( !temp )
+      {
+         status[i] = IMAGE_NOT_LOADED;
+         continue;
+      }
 
-}
+      if ( temp->width != m_Width || temp->height != m_Height )
+         status[i] = IMAGE_WRONG_SIZE;
+      else
+         CopyImageToRow( temp, m_ImagePixels->data.ptr + (size_t)i * size );
 
+      cvReleaseImage(&temp);
+   }
+
+   for ( int i = 1; i < m_nImages; i++ )
+   {
+      if ( status[i] == IMAGE_NOT_LOADED )
+      {
+         std::string err;
+         err = "Trainer::LoadImages could not create image for ";
+         err += m_ImageVec[i].m_ImageName;
+         throw err;
+      }
+
+      if ( status[i] == IMAGE_WRONG_SIZE )
+         throw std::string("Trainer::LoadImages: Images should be same size");
+   }
+}
 
 
 
 /* 
-Function:   ProjectOntoSubspace
-Purpose:    projects the faces onto the PCA subspace
-Notes:      
-Throws      
-returns:    
+Function:   MapImages
+Purpose:    uses the pixels of the image pack m_ImageFile
+Notes:      when every image of the pack is trained on, m_ImagePixels points into the mapping and
+            nothing is copied.  A sample only copies the rows in source
+Throws      std::string if the pack can't be mapped
+returns:    void
 */
-void Trainer::ProjectOntoSubSpace()
+void Trainer::MapImages(const std::vector<int>& source)
 {
-   m_ProjectedFaceMatrix = cvCreateMat(m_nImages, m_nEigenVals, CV_32FC1);
+   m_Pack.Open( m_ImageFile.c_str() );
 
-   // calculate each images projection onto the eigen subspace 
-   // m_ProjectedFaceMatrix->data.fl + (row*nEigenVals) gets us to the row containing the images
-   // projection
-   // m_ProjectedFaceMatrix is a [m_nImages][nEigenVals] matrix
+   m_Width = m_Pack.Width();
+   m_Height = m_Pack.Height();
+   int size = m_Width * m_Height;
 
-   // to avoid getting a bunch of NaN values, I normalize the Eigenvalues to be between 0 and 1
-   cvNormalize(m_EigenValueMatrix, m_EigenValueMatrix, 1, 0, CV_L1, 0);
-
-   for ( int row = 0; row < m_nImages; row++ )
+   if ( m_nImages == m_Pack.Count() )
    {
-      cvEigenDecomposite(m_ImageArray[row], m_nEigenVals, m_EigenVectorArray, 0, 0, m_AverageImage, 
-         m_ProjectedFaceMatrix->data.fl + (row*m_nEigenVals));  
+      m_ImagePixels = cvCreateMatHeader( m_nImages, size, CV_8UC1 );
+      m_Pack.InitMatHeader( m_ImagePixels );
+      return;
    }
 
-   // now the training projection is completed, Each row of m_ProjectedFaceMatrix represents
-   // each image's values projected onto the new subspace.
-   // in other words, where each image used to be a NxM matrix, it is now only nEigenVals long
-   // Thus, we have reduced dimentionality... Yeah
+   m_ImagePixels = cvCreateMat( m_nImages, size, CV_8UC1 );
+   for ( int i = 0; i < m_nImages; i++ )
+      memcpy( m_ImagePixels->data.ptr + (size_t)i * size, m_Pack.Pixels( source[i] ), size );
+}
+
 
+
+/* 
+Function:   CopyImageToRow
+Purpose:    copies a grey scale image into one contiguous row of pixels
+Notes:      decoded images can have padding at the end of each line, the row doesn't
+Throws      
+returns:    void
+*/
+void Trainer::CopyImageToRow(const IplImage* image, uchar* row)
+{
+   for ( int y = 0; y < image->height; y++ )
+      memcpy( row + (size_t)y * image->width, image->imageData + (size_t)y * image->widthStep, image->width );
 }
 
 
 
 /* 
-Function:   DoLDA
-Purpose:    Does all LDA related functions
-Notes:      
-Throws      std::string if somthing goes wrong  
+Function:   CreateSubspace
+Purpose:    finds average image, centers each image around mean, finds covariance matrix, then finds 
+Eigenvectors (Principal components) and Eigenvalues
+Notes:      m_nEigenVals is at most m_nImages - m_nClasses, TrainingOptions can cap it with a
+            fixed number or with the fraction of the variance to keep.  When only a sample was loaded
+            the limit is the whole list's images minus people, the sample's own count can be zero when
+            the list is grouped by person and every sampled image is someone else, and at most the
+            sample less one, the most directions the centered sample spans.  TrainingOptions also picks
+            cvCalcEigenObjects or the randomized solver
+Throws      std::string if it can't allocate memory
 returns:    
 */
-void Trainer::DoLDA()
+void Trainer::CreateSubspace()
 {
-   m_nLDAEigens = m_nEigenVals;
-   m_nFisherFaces = m_nClasses - 1;
+   // we can only find m_nImages - m_nClasses for LDA, the options can ask for fewer
+   m_nEigenVals = m_nListImages - m_nListClasses;
+   if ( m_nImages < m_nListImages && m_nImages - 1 < m_nEigenVals )
+      m_nEigenVals = m_nImages - 1;
+   if ( m_Options.m_nEigenFaces > 0 && m_Options.m_nEigenFaces < m_nEigenVals )
+      m_nEigenVals = m_Options.m_nEigenFaces;
 
-   if ( m_nFisherFaces < 2 )
-      throw std::string("Trainer::DoLDA - number of classes needs to be more than 2" );
+   if ( m_nEigenVals < 1 )
+      throw std::string("Trainer::CreateSubspace - there should be more training images than people");
 
-      // 1. get average of m_ProjectedFaceMatrix
-   m_AverageProjectedImage = cvCreateMat(1, m_nEigenVals, CV_32FC1);
-   CalcAverageImage( m_ProjectedFaceMatrix, m_nImages, m_AverageProjectedImage );
+   AllocateSubspace();
 
-   // 2. break m_ProjectedFaceMatrix into m_ClassToImageMap ( index of row of m_ProjectedFaceMatrix = m_ClassToIndexMap )
-   
-   std::map<personIDType, int>::iterator classIt;
-   for ( classIt = m_ClassCountMap.begin(); classIt != m_ClassCountMap.end(); classIt++ )
+   // every image as a row of one matrix, centered once the average is known
+   CreateImageMatrix();
+
+   if ( m_Options.m_PCAMethod == PCA_RANDOMIZED )
+   {
+      CalcRandomizedPCA();
+   }
+   else
    {
-      pair<multimap<personIDType, int>::iterator, multimap<personIDType, int>::iterator> eq;
-      eq = m_ClassToImageIndexMap.equal_range(classIt->first);
+      // This is how many eigen vectors we will use out of all of them
+      // i.e in the subspace, each image will have nEigenVals 
+      CvTermCriteria limit = cvTermCriteria(CV_TERMCRIT_ITER, m_nEigenVals, 1);
 
-      m_ClassToImageMap[classIt->first] = cvCreateMat( m_ClassCountMap[classIt->first], m_nEigenVals, CV_32FC1 ) ;
+      // ask openCv to do the work
+      cvCalcEigenObjects( m_nImages, (void*)m_ImageArray, (void*)m_EigenVectorArray, CV_EIGOBJ_NO_CALLBACK, 0, 0, &limit,
+         m_AverageImage, m_EigenValueMatrix->data.fl );
 
-      std::multimap<personIDType,int>::iterator it;
-      
-      int row_c = 0;
-      for ( it = eq.first; it != eq.second; it++ )
-      {
-         int cls = (*it).first;
-         int index = (*it).second;
-         for ( int col = 0; col < m_nEigenVals; col++ )
-         {
-            m_ClassToImageMap[cls]->data.fl[row_c*m_nEigenVals + col] = m_ProjectedFaceMatrix->data.fl[index*m_nEigenVals + col];
-         }
-         row_c++;
-      }
+      CenterImageMatrix();
    }
 
-   CalcClassAverageImage();
-   CalcWithinScatterMat();
-   CalcBetweenScatterMat();
-   ProjectOntoLDASubspace();
- 
+   if ( m_Options.m_RetainedVariance > 0.0 && m_Options.m_RetainedVariance < 1.0 )
+      RetainVariance( m_Options.m_RetainedVariance );
+
+   // now we have the averge image, eigenvectors of the covariance matrix, and eigen values
+   cvNormalize(m_EigenValueMatrix, m_EigenValueMatrix, 1, 0, CV_L1, 0);
+
 }
 
 
+
 /* 
-Function:   CalcClassAverageImage
-Purpose:    calculates average image for each class
-Notes:      
-Throws      
+Function:   AllocateSubspace
+Purpose:    allocates the eigenvectors, average image and eigenvalues for m_nEigenVals eigenfaces
+Notes:      the eigenvectors are the rows of m_EigenVectorMatrix, m_EigenVectorArray holds image headers over them
+Throws      std::string if it can't allocate memory
 returns:    void
 */
-void Trainer::CalcClassAverageImage()
+void Trainer::AllocateSubspace()
 {
-   // foreach class, calculate average image
-   std::map<personIDType, int>::iterator it;
-   for ( it = m_ClassCountMap.begin(); it != m_ClassCountMap.end(); it++ )
+   CvSize size;
+   size.width = m_Width;
+   size.height = m_Height;
+
+   // allocate space for the eigen vectors, they are the rows of one matrix and
+   // m_EigenVectorArray holds image headers pointing at the rows
+   m_EigenVectorMatrix   = cvCreateMat(m_nEigenVals, size.width * size.height, CV_32FC1);
+   m_EigenVectorArray    = (IplImage**)cvAlloc(sizeof(IplImage*) * m_nEigenVals);
+   for ( int i = 0; i < m_nEigenVals; i++ )
    {
-      int cls = it->first;
-      int nImages = it->second;
+      m_EigenVectorArray[i] = cvCreateImageHeader(size, IPL_DEPTH_32F, 1);   // floating point image
       
-      m_ClassToAverageImageMap[cls] = cvCreateMat(1, m_nEigenVals, CV_32FC1); 
+      if ( !m_EigenVectorArray[i] )
+         throw std::string("Trainer::DoPCA could not allocate EigenVector");
 
-      CalcAverageImage(m_ClassToImageMap[cls], nImages, m_ClassToAverageImageMap[cls]);
+      cvSetData( m_EigenVectorArray[i], m_EigenVectorMatrix->data.fl + (i * size.width * size.height), size.width * sizeof(float) );
    }
 
+   m_AverageImage = cvCreateImage(size, IPL_DEPTH_32F, 1 );
+   if ( !m_AverageImage )
+      throw std::string("Trainer::DoPCA could not allocate m_AverageImage");
+
+   // these will be the actuall eigen values
+   m_EigenValueMatrix = cvCreateMat(1, m_nEigenVals, CV_32FC1);
 }
 
 
+
+
 /* 
-Function:   ClassAverageImage
-Purpose:    calculates average image for given 
-Notes:      
+Function:   CreateImageMatrix
+Purpose:    copies every training image into a row of m_ImageMatrix
+Notes:      the images are not centered yet, see CenterImageMatrix.  Each row is converted from the same
+            row of m_ImagePixels
 Throws      
 returns:    void
 */
-void Trainer::CalcAverageImage(CvMat* images, int nImages, CvMat* avgImage)
+void Trainer::CreateImageMatrix()
 {
-   // first clear out avgImage
-  for ( int col = 0; col < avgImage->width; col++ )
-    avgImage->data.fl[col] = 0;
-  
-   for ( int row = 0; row < nImages; row++ )
-   {
-      for ( int col = 0; col < images->width; col++ )
-      {
-         avgImage->data.fl[col] += images->data.fl[row*images->width+col];
-      }
-   }
+   int size = m_Width * m_Height;
 
-   for ( int i = 0; i < avgImage->width; i++ )
-      avgImage->data.fl[i] /= nImages;
+   cvReleaseMat(&m_ImageMatrix);
+   m_ImageMatrix = cvCreateMat( m_nImages, size, CV_32FC1 );
 
+#pragma omp parallel for schedule(static)
+   for ( int i = 0; i < m_nImages; i++ )
+   {
+      const uchar* pixels = m_ImagePixels->data.ptr + (size_t)i * m_ImagePixels->step;
+      float* row = m_ImageMatrix->data.fl + ((size_t)i*size);
+
+      for ( int col = 0; col < size; col++ )
+         row[col] = (float)pixels[col];
+   }
 }
 
 
 
 /* 
-Function:   ClassWithinScatterMat
-Purpose:    For LDA implementation
+Function:   CenterImageMatrix
+Purpose:    subtracts m_AverageImage from every row of m_ImageMatrix
 Notes:      
 Throws      
 returns:    void
 */
-
-void Trainer::CalcWithinScatterMat()
+void Trainer::CenterImageMatrix()
 {
-   m_WithinScatterMat = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
-   m_InverseWScatterMat = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
+   int size = m_Width * m_Height;
 
-   for ( int row = 0; row < m_nLDAEigens; row++ )
-   {
-      for ( int col = 0; col < m_nLDAEigens; col++ )
-      {
-         m_WithinScatterMat->data.fl[row*m_nLDAEigens+col] = 0.0;
-      }
-   }
+   CvMat* avgImg = cvCreateMat( 1, size, CV_32FC1 );
+   ImageToMatrixf( m_AverageImage, avgImg->data.fl, size );
 
-   // for each class, loop through and calculate scatter matrix
-   // LOOK: class ID's start with one and don't nessasarily have to be continuous, 
-   // I am going to store each classes scatter in on matrix
-   // So I will just keep track of it.
-   // the class id in m_ClassToAverageImageMap maps to the matrix
-
-   std::map<personIDType, CvMat*>::iterator classNumIt;
-   for ( classNumIt = m_ClassToImageMap.begin(); classNumIt != m_ClassToImageMap.end(); classNumIt++ )
+#pragma omp parallel for schedule(static)
+   for ( int i = 0; i < m_nImages; i++ )
    {
-      CvMat* temp             = cvCreateMat( 1, m_nLDAEigens, CV_32FC1 );
-      CvMat* temp_transposed  = cvCreateMat( m_nLDAEigens, 1, CV_32FC1 );
-      CvMat* res              = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
-      CvMat* tempclass        = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
-
-      for ( int row = 0; row < m_nLDAEigens; row++ )
-      {
-         temp->data.fl[row] = temp_transposed->data.fl[row] = 0.0;
-         
-         for ( int col = 0; col < m_nLDAEigens; col++ )
-         {
-            res->data.fl[row*m_nLDAEigens+col] = 0.0;
-            tempclass->data.fl[row*m_nLDAEigens+col] = 0.0;
-         }
-      }
-
-      // use m_ClassToImageIndex to find indices of this classes projected images in m_ProjectedFaceMatrix      
-      pair<multimap<personIDType, int>::iterator, multimap<personIDType, int>::iterator> eq;
-      eq = m_ClassToImageIndexMap.equal_range(classNumIt->first);
-      std::multimap<personIDType,int>::iterator it;
-      
-      for ( it = eq.first; it != eq.second; it++ )
-      {
-         // subtract the class mean from the projected values for this class's image
-         // store values in temp
-         CvMat* projectedImage = cvCreateMat( 1, m_nEigenVals, CV_32FC1 );
-         for ( int col = 0; col < m_nEigenVals; col++ )
-            projectedImage->data.fl[col] = m_ProjectedFaceMatrix->data.fl[it->second*m_nEigenVals+col];
-         
-         cvSub( projectedImage, m_ClassToAverageImageMap[it->first], temp );
-
-         cvTranspose(temp, temp_transposed);
-
-         // multiply temp_transposed * temp_transposed 
-         // res=(temp_transposed)*(temp_transposed)^T
-         cvMulTransposed(temp_transposed, res, 0);
-
-         // add this classes result to the tempclass matrix, store result in tempclass
-         cvAdd(res, tempclass, tempclass);
-      }
-      
-      // divide all values by the number of images in this class
-      double nImages = (double)m_ClassCountMap[classNumIt->first];
-      cvDiv( NULL, tempclass, tempclass, nImages );
-
-      cvAdd(m_WithinScatterMat, tempclass, m_WithinScatterMat);
+      float* row = m_ImageMatrix->data.fl + ((size_t)i*size);
+      for ( int col = 0; col < size; col++ )
+         row[col] -= avgImg->data.fl[col];
    }
 
-   // find inverse of m_WithinScatterMat, store in m_InverseWScatterMat
-   cvInvert( m_WithinScatterMat, m_InverseWScatterMat );
+   cvReleaseMat(&avgImg);
 }
 
 
+
 /* 
-Function:   ClassBetweenScatterMat
-Purpose:    For LDA implementation
-Notes:      
-Throws      
+Function:   CalcRandomizedPCA
+Purpose:    finds the average image and the top m_nEigenVals eigenvectors with RandomizedPCA
+Notes:      works on the centered m_ImageMatrix so every product is a single GEMM.
+            Gives the same eigenvalue scale as cvCalcEigenObjects, the eigenvectors may have the opposite sign
+Throws      std::string if RandomizedPCA fails
 returns:    void
 */
-void Trainer::CalcBetweenScatterMat()
+void Trainer::CalcRandomizedPCA()
 {
-   m_BetweenScatterMat = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
+   int size = m_Width * m_Height;
 
-   for ( int row = 0; row < m_nLDAEigens; row++ )
-   {
-      for ( int col = 0; col < m_nLDAEigens; col++ )
-      {
-         m_BetweenScatterMat->data.fl[row*m_nLDAEigens+col] = 0.0;
-      }
-   }
+   CvMat* avgImg = cvCreateMat( 1, size, CV_32FC1 );
+   cvReduce( m_ImageMatrix, avgImg, 0, CV_REDUCE_AVG );
 
-   std::map<personIDType, CvMat*>::iterator classNumIt;
-   for ( classNumIt = m_ClassToImageMap.begin(); classNumIt != m_ClassToImageMap.end(); classNumIt++ )
+   // copy the average into m_AverageImage, its rows may be padded
+   for ( int row = 0; row < m_Height; row++ )
    {
-      CvMat *temp = cvCreateMat( 1, m_nLDAEigens, CV_32FC1 );
-      CvMat *res = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
-
-      for ( int row = 0; row < m_nLDAEigens; row++ )
-      {
-         temp->data.fl[row] = 0.0;
-
-         for ( int col = 0; col < m_nLDAEigens; col++ )
-         {
-            res->data.fl[row*m_nLDAEigens+col]=0.0;
-         }
-      }
-
-      // subtract class mean by total mean, put in temp
-      cvSub( m_ClassToAverageImageMap[classNumIt->first], m_AverageProjectedImage, temp );
-
-      // multiply temp * temp^t and put into res
-      cvMulTransposed( temp, res, 1 );
-
-      // divide res by class number scalar
-      cvDiv( NULL, res, res, m_ClassCountMap[classNumIt->first] );
+      float* therow = (float*)(m_AverageImage->imageData + (row*m_AverageImage->widthStep));
+      for ( int col = 0; col < m_Width; col++ )
+         therow[col] = avgImg->data.fl[row*m_Width+col];
+   }
+   cvReleaseMat(&avgImg);
 
-      // sum all of it up
-      cvAdd( res, m_BetweenScatterMat, m_BetweenScatterMat );
+   CenterImageMatrix();
 
-   }
+   RandomizedPCA( m_ImageMatrix, m_nEigenVals, m_Options.m_PCAOversample, m_Options.m_PCAPowerIterations,
+                  m_EigenVectorMatrix, m_EigenValueMatrix );
 }
 
 
 
 /* 
-Function:   ProjectOntoLDASubspace
-Purpose:    For LDA implementation
-Notes:      
+Function:   RetainVariance
+Purpose:    drops the eigenvectors not needed to keep a fraction of the variance of the training images
+Notes:      called before the eigenvalues are normalized.  The eigenvalues from cvCalcEigenObjects are the
+            eigenvalues of the sum of the centered images' outer products, so together all of them add up
+            to the sum of the squared distances of the images from m_AverageImage.  That sum is
+            calculated directly from m_ImageMatrix because only m_nEigenVals eigenvalues were found
 Throws      
 returns:    void
 */
-void Trainer::ProjectOntoLDASubspace()
+void Trainer::RetainVariance( double fraction )
 {
-   m_LDAEigenVectors = cvCreateMat( m_nFisherFaces, m_nLDAEigens, CV_32FC1 );
-   m_LDAEigenValues = cvCreateMat( 1, m_nFisherFaces,  CV_32FC1 );
+   // m_ImageMatrix is centered, so the variance is its squared norm
+   double norm = cvNorm( m_ImageMatrix, NULL, CV_L2 );
+   double totalVariance = norm * norm;
+
+   // smallest number of eigenvectors that keep the fraction
+   int nKeep = 0;
+   double retained = 0.0;
+   while ( nKeep < m_nEigenVals && retained < fraction * totalVariance )
+      retained += m_EigenValueMatrix->data.fl[nKeep++];
+
+   if ( nKeep < 1 )
+      nKeep = 1;
+   if ( nKeep == m_nEigenVals )
+      return;
+
+   // the rows stay in m_EigenVectorMatrix, only their headers go
+   for ( int i = nKeep; i < m_nEigenVals; i++ )
+      cvReleaseImageHeader( &m_EigenVectorArray[i] );
+
+   CvMat* eigenValues = cvCreateMat( 1, nKeep, CV_32FC1 );
+   for ( int i = 0; i < nKeep; i++ )
+      eigenValues->data.fl[i] = m_EigenValueMatrix->data.fl[i];
+
+   cvReleaseMat(&m_EigenValueMatrix);
+   m_EigenValueMatrix = eigenValues;
+   m_nEigenVals = nKeep;
+}
+
 
-   // temp matrices to get all eigenVectors and eigenValeus for m_nLDAEigens
-   CvMat* tempVec = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
-   CvMat* tempVal = cvCreateMat( 1, m_nLDAEigens, CV_32FC1 );
 
-   for ( int row = 0; row < m_nLDAEigens; row++ )
+/* 
+Function:   ProjectOntoSubspace
+Purpose:    projects the faces onto the PCA subspace
+Notes:      one GEMM of the centered image matrix and the eigenvector matrix, which gives the same
+            values as cvEigenDecomposite on each image but reads every eigenvector once per panel
+            of images instead of once per image.  m_ImageMatrix is not needed afterwards so it is released.
+            When the subspace came from the stage cache the image matrix is built and centered here
+Throws      
+returns:    
+*/
+void Trainer::ProjectOntoSubSpace()
+{
+   if ( !m_ImageMatrix )
    {
-      tempVal->data.fl[row] = 0.0;  // really column
-      for ( int col = 0; col < m_nLDAEigens; col++ )
-      {
-         tempVec->data.fl[row*m_nLDAEigens+col] = 0.0;
-      }
+      CreateImageMatrix();
+      CenterImageMatrix();
    }
 
-   for ( int row = 0; row < m_nFisherFaces; row ++ )
+   m_ProjectedFaceMatrix = cvCreateMat(m_nImages, m_nEigenVals, CV_32FC1);
+
+   // calculate each images projection onto the eigen subspace 
+   // m_ProjectedFaceMatrix->data.fl + (row*nEigenVals) gets us to the row containing the images
+   // projection
+   // m_ProjectedFaceMatrix is a [m_nImages][nEigenVals] matrix
+
+   // to avoid getting a bunch of NaN values, I normalize the Eigenvalues to be between 0 and 1
+   cvNormalize(m_EigenValueMatrix, m_EigenValueMatrix, 1, 0, CV_L1, 0);
+
+   // m_ProjectedFaceMatrix = m_ImageMatrix * eigenvectors^T
+   CvMat eigenVectors;
+   cvGetRows( m_EigenVectorMatrix, &eigenVectors, 0, m_nEigenVals );
+   ParallelGEMM( m_ImageMatrix, &eigenVectors, 1, m_ProjectedFaceMatrix, CV_GEMM_B_T );
+
+   cvReleaseMat(&m_ImageMatrix);
+
+   // now the training projection is completed, Each row of m_ProjectedFaceMatrix represents
+   // each image's values projected onto the new subspace.
+   // in other words, where each image used to be a NxM matrix, it is now only nEigenVals long
+   // Thus, we have reduced dimentionality... Yeah
+
+}
+
+
+
+/* 
+Function:   StoreBasis
+Purpose:    writes the PCA subspace for the training shards
+Notes:      stored as <database>.pca, see ShardedTraining.h.  The shards load and project every image,
+            so m_ImageMatrix is not needed afterwards and is released
+Throws      std::string if it can't write the subspace
+returns:    void
+*/
+void Trainer::StoreBasis()
+{
+   ShardBasis basis;
+   GetBasis( basis );
+   basis.Save( ShardBasisFileName(m_DatabaseFile.c_str()).c_str() );
+
+   cvReleaseMat(&m_ImageMatrix);
+}
+
+
+
+/* 
+Function:   GetBasis
+Purpose:    copies the PCA subspace into basis
+Notes:      the eigenvalues are the normalized ones
+Throws      
+returns:    void
+*/
+void Trainer::GetBasis(ShardBasis& basis)
+{
+   int size = m_Width * m_Height;
+
+   basis.m_Width = m_Width;
+   basis.m_Height = m_Height;
+   basis.m_nEigenFaces = m_nEigenVals;
+   basis.m_Average.resize(size);
+   basis.m_EigenVectors.assign( m_EigenVectorMatrix->data.fl, m_EigenVectorMatrix->data.fl + (size_t)m_nEigenVals * size );
+   basis.m_EigenValues.assign( m_EigenValueMatrix->data.fl, m_EigenValueMatrix->data.fl + m_nEigenVals );
+   ImageToMatrixf( m_AverageImage, &basis.m_Average[0], size );
+}
+
+
+
+/* 
+Function:   MergeShards
+Purpose:    replaces the loaded images with every shard's projected faces and statistics
+Notes:      the shards are read in order so the images keep the image list's order.  Afterwards
+            m_ProjectedFaceMatrix, m_PersonIDMatrix, the names and the class maps cover the whole
+            image list and m_Stats is ready for DoLDA.  The shard files are removed once merged
+Throws      std::string if a shard can't be read or doesn't match the subspace
+returns:    void
+*/
+void Trainer::MergeShards(int nShards)
+{
+   std::vector<personIDType> ids;
+   std::vector<float> projected;
+
+   m_Names.clear();
+   m_ImageNames.clear();
+   m_Stats.Reset( m_nEigenVals );
+
+   for ( int shard = 0; shard < nShards; shard++ )
    {
-      m_LDAEigenValues->data.fl[row] = 0.0;
-      for ( int col = 0; col < m_nFisherFaces; col++ )
+      std::string filename = ShardPartialFileName( m_DatabaseFile.c_str(), shard );
+
+      ShardPartial partial;
+      partial.Load( filename.c_str() );
+
+      if ( partial.m_Shard != shard || partial.m_nShards != nShards || partial.m_Stats.Dimension() != m_nEigenVals )
       {
-         m_LDAEigenVectors->data.fl[row*m_nFisherFaces+col] = 0.0;
+         std::string err = "Trainer::MergeShards - shard does not match this training: ";
+         err += filename;
+         throw err;
       }
+
+      m_Stats.Merge( partial.m_Stats );
+      ids.insert( ids.end(), partial.m_IDs.begin(), partial.m_IDs.end() );
+      m_Names.insert( m_Names.end(), partial.m_PersonNames.begin(), partial.m_PersonNames.end() );
+      m_ImageNames.insert( m_ImageNames.end(), partial.m_ImageNames.begin(), partial.m_ImageNames.end() );
+      projected.insert( projected.end(), partial.m_Projected.begin(), partial.m_Projected.end() );
    }
 
-   // multiply inverse within scatter mat * within scatter mat, store in temp
-   CvMat* temp = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_32FC1 );
-   cvMul( m_InverseWScatterMat, m_WithinScatterMat, temp );
+   SetProjectedFaces( ids, projected );
 
-   // get the eigenvectors and eigenvalues
-   // CV_SVD_U_T - transposed tempVec will be returned
-   // CV_SVD_MODIFY_A - optimization, means function can modify temp during calculation
-   cvSVD( temp, tempVal, tempVec, NULL, CV_SVD_U_T + CV_SVD_MODIFY_A );
+   for ( int shard = 0; shard < nShards; shard++ )
+      remove( ShardPartialFileName( m_DatabaseFile.c_str(), shard ).c_str() );
+   remove( ShardBasisFileName( m_DatabaseFile.c_str() ).c_str() );
+}
 
-   // only keep up to the number m_nFisherFaces
-   for ( int row = 0; row < m_nFisherFaces; row++ )
+
+
+/* 
+Function:   SetProjectedFaces
+Purpose:    replaces the projected faces and their person ids
+Notes:      projected is one row of m_nEigenVals per id.  The names and m_Stats are left to the caller
+Throws      
+returns:    void
+*/
+void Trainer::SetProjectedFaces(const std::vector<personIDType>& ids, const std::vector<float>& projected)
+{
+   m_nImages = (int)ids.size();
+
+   cvReleaseMat(&m_PersonIDMatrix);
+   m_PersonIDMatrix = cvCreateMat( 1, m_nImages, CV_32SC1 );
+
+   cvReleaseMat(&m_ProjectedFaceMatrix);
+   m_ProjectedFaceMatrix = cvCreateMat( m_nImages, m_nEigenVals, CV_32FC1 );
+   if ( !projected.empty() )
+      memcpy( m_ProjectedFaceMatrix->data.fl, &projected[0], projected.size() * sizeof(float) );
+
+   m_ClassCountMap.clear();
+   m_ClassToImageIndexMap.clear();
+   for ( int i = 0; i < m_nImages; i++ )
    {
-      m_LDAEigenValues->data.fl[row] = tempVal->data.fl[row];
+      m_PersonIDMatrix->data.i[i] = ids[i];
+      m_ClassCountMap[ids[i]]++;
+      m_ClassToImageIndexMap.insert( pair<personIDType, int>(ids[i], i) );
+   }
+
+   m_nClasses = (int)m_ClassCountMap.size();
+}
+
+
+
+/* 
+Function:   HashInputs
+Purpose:    works out the stage cache keys of the PCA and projection stages
+Notes:      does nothing without a cache directory.  The PCA key covers the images and every option
+            CreateSubspace uses, the projection key is the PCA key plus the stage, see StageCache.h.
+            The options are also hashed on their own, the model stores that key so an incremental
+            training can tell if the options changed
+Throws      std::string if the image list or an image can't be read
+returns:    void
+*/
+void Trainer::HashInputs()
+{
+   if ( m_Options.m_CacheDir.empty() )
+      return;
+
+   m_ImagesKey = HashTrainingImages( m_ImageFile.c_str(), m_ImageHashes );
+
+   StageHash options;
+   options.Add( STAGE_CACHE_CODE_VERSION );
+   options.Add( m_Options.m_nEigenFaces );
+   options.Add( m_Options.m_RetainedVariance );
+   options.Add( (int)m_Options.m_PCAMethod );
+   if ( m_Options.m_PCAMethod == PCA_RANDOMIZED )
+   {
+      options.Add( m_Options.m_PCAOversample );
+      options.Add( m_Options.m_PCAPowerIterations );
+   }
+   options.Add( m_Options.m_nShards > 1 ? m_Options.m_PCASampleImages : 0 );
+   m_OptionsKey = options.Value();
+
+   StageHash subspace;
+   subspace.Add( std::string(STAGE_CACHE_SUBSPACE) );
+   subspace.Add( m_ImagesKey );
+   subspace.Add( m_OptionsKey );
+   m_SubspaceKey = subspace.Value();
+
+   StageHash projection;
+   projection.Add( std::string(STAGE_CACHE_PROJECTION) );
+   projection.Add( m_SubspaceKey );
+   m_ProjectionKey = projection.Value();
+}
+
+
+
+/* 
+Function:   LoadCachedSubspace
+Purpose:    loads the PCA stage from the stage cache instead of calling CreateSubspace
+Notes:      a cache file that can't be read is treated as missing, the stage is computed again and
+            the file replaced
+Throws      
+returns:    true if the subspace was loaded
+*/
+bool Trainer::LoadCachedSubspace()
+{
+   if ( m_Options.m_CacheDir.empty() )
+      return false;
+
+   ShardBasis basis;
+   try
+   {
+      basis.Load( StageCacheFileName( m_Options.m_CacheDir, m_SubspaceKey, STAGE_CACHE_SUBSPACE ).c_str() );
+   }
+   catch (std::string&)
+   {
+      return false;
+   }
+
+   m_Width = basis.m_Width;
+   m_Height = basis.m_Height;
+   m_nEigenVals = basis.m_nEigenFaces;
+   AllocateSubspace();
 
-      for ( int col = 0; col < m_nLDAEigens; col++ )
+   int size = m_Width * m_Height;
+   memcpy( m_EigenVectorMatrix->data.fl, &basis.m_EigenVectors[0], (size_t)m_nEigenVals * size * sizeof(float) );
+   memcpy( m_EigenValueMatrix->data.fl, &basis.m_EigenValues[0], m_nEigenVals * sizeof(float) );
+
+   for ( int row = 0; row < m_Height; row++ )
+   {
+      float* therow = (float*)(m_AverageImage->imageData + (row*m_AverageImage->widthStep));
+      memcpy( therow, &basis.m_Average[row*m_Width], m_Width * sizeof(float) );
+   }
+
+   return true;
+}
+
+
+
+/* 
+Function:   LoadCachedProjection
+Purpose:    loads the projection stage from the stage cache instead of loading and projecting the images
+Notes:      the subspace has to be loaded first, the images are never read.  A cache file that can't be
+            read or doesn't match the subspace is treated as missing
+Throws      
+returns:    true if the projected faces and m_Stats were loaded
+*/
+bool Trainer::LoadCachedProjection()
+{
+   if ( m_Options.m_CacheDir.empty() )
+      return false;
+
+   ShardPartial partial;
+   try
+   {
+      partial.Load( StageCacheFileName( m_Options.m_CacheDir, m_ProjectionKey, STAGE_CACHE_PROJECTION ).c_str() );
+   }
+   catch (std::string&)
+   {
+      return false;
+   }
+
+   if ( partial.m_Stats.Dimension() != m_nEigenVals )
+      return false;
+
+   m_Names = partial.m_PersonNames;
+   m_ImageNames = partial.m_ImageNames;
+   m_Stats = partial.m_Stats;
+   SetProjectedFaces( partial.m_IDs, partial.m_Projected );
+
+   return true;
+}
+
+
+
+/* 
+Function:   StoreCachedSubspace
+Purpose:    writes the PCA stage to the stage cache
+Notes:      does nothing without a cache directory
+Throws      std::string if it can't write the cache file
+returns:    void
+*/
+void Trainer::StoreCachedSubspace()
+{
+   if ( m_Options.m_CacheDir.empty() )
+      return;
+
+   ShardBasis basis;
+   GetBasis( basis );
+   basis.Save( StageCacheFileName( m_Options.m_CacheDir, m_SubspaceKey, STAGE_CACHE_SUBSPACE ).c_str() );
+}
+
+
+
+/* 
+Function:   StoreCachedProjection
+Purpose:    writes the projection stage to the stage cache
+Notes:      does nothing without a cache directory.  m_Stats is filled here if it hasn't been, so
+            DoLDA doesn't have to
+Throws      std::string if it can't write the cache file
+returns:    void
+*/
+void Trainer::StoreCachedProjection()
+{
+   if ( m_Options.m_CacheDir.empty() )
+      return;
+
+   AccumulateStats();
+
+   ShardPartial partial;
+   partial.m_Shard = 0;
+   partial.m_nShards = 1;
+   partial.m_IDs.assign( m_PersonIDMatrix->data.i, m_PersonIDMatrix->data.i + m_nImages );
+   partial.m_PersonNames = m_Names;
+   partial.m_ImageNames = m_ImageNames;
+   partial.m_Projected.assign( m_ProjectedFaceMatrix->data.fl, m_ProjectedFaceMatrix->data.fl + (size_t)m_nImages * m_nEigenVals );
+   partial.m_Stats = m_Stats;
+
+   partial.Save( StageCacheFileName( m_Options.m_CacheDir, m_ProjectionKey, STAGE_CACHE_PROJECTION ).c_str() );
+}
+
+
+
+/* 
+Function:   UpdateFromPreviousModel
+Purpose:    trains by updating the database's previous training with the changes to the image list
+Notes:      the previous model records its image hashes and stage keys, its projection and subspace are
+            loaded from the stage cache and the image list is diffed against it.  An image with the same
+            name, person and contents keeps its projected face.  Only added and changed images are loaded
+            and projected, and the statistics only lose the removed faces and gain the new ones, so only
+            the classes that changed are touched.  The PCA subspace is the previous one, new people are
+            projected onto the old eigenfaces, a full training finds a new subspace.
+            Returns false without changing anything when there is no previous training to update, or
+            it was trained with other PCA options
+Throws      std::string if there is no stage cache, or an image can't be loaded or is a different size
+returns:    true if the training was updated, false to train from scratch
+*/
+bool Trainer::UpdateFromPreviousModel()
+{
+   if ( m_Options.m_CacheDir.empty() )
+      throw std::string("Trainer::UpdateFromPreviousModel - incremental training needs a stage cache directory");
+
+   std::vector<uint64> previousHashes;
+   uint64 previousKeys[3];
+   {
+      std::ifstream exists( m_DatabaseFile.c_str() );
+      if ( !exists.is_open() )
+         return false;
+      exists.close();
+
+      // the model is unmapped at the end of this block, StoreData replaces it
+      ModelFile model;
+      try
+      {
+         model.Open( m_DatabaseFile.c_str() );
+      }
+      catch (std::string&)
       {
-         m_LDAEigenVectors->data.fl[row*m_nLDAEigens+col] = tempVec->data.fl[row*m_nLDAEigens+col];
+         return false;
       }
+
+      uint64 hashesSize = 0, keysSize = 0;
+      const uint64* hashes = (const uint64*)model.Section( MODEL_SECTION_IMAGE_HASHES, &hashesSize );
+      const uint64* keys = (const uint64*)model.Section( MODEL_SECTION_STAGE_KEYS, &keysSize );
+      if ( !hashes || !keys || keysSize != sizeof(previousKeys) || hashesSize != model.Header().m_nImages * sizeof(uint64) )
+         return false;
+
+      previousHashes.assign( hashes, hashes + model.Header().m_nImages );
+      previousKeys[0] = keys[0];
+      previousKeys[1] = keys[1];
+      previousKeys[2] = keys[2];
    }
 
-   // now calculate projected images
-   // each class has a projection
-   m_ProjectedLDAFaceMat = cvCreateMat( m_nClasses, m_nFisherFaces, CV_32FC1 );
+   // the previous subspace was found with other options, a full training finds the one they ask for
+   if ( previousKeys[2] != m_OptionsKey )
+      return false;
 
-   std::map<personIDType, CvMat*>::iterator classNumIt;
-   int row = 0;
-   for ( classNumIt = m_ClassToImageMap.begin(); classNumIt != m_ClassToImageMap.end(); classNumIt++ )
+   ShardPartial previous;
+   try
+   {
+      previous.Load( StageCacheFileName( m_Options.m_CacheDir, previousKeys[1], STAGE_CACHE_PROJECTION ).c_str() );
+   }
+   catch (std::string&)
    {
-      // temp matrices for calculations
-      CvMat* PCATemp = cvCreateMat( m_nLDAEigens, 1, CV_32FC1 );
-      CvMat* LDATemp = cvCreateMat( m_nFisherFaces, 1, CV_32FC1 );
-      CvMat* projection = cvCreateMat( 1, m_nFisherFaces, CV_32FC1 );
+      return false;
+   }
+   if ( previous.m_IDs.size() != previousHashes.size() )
+      return false;
 
-      // transpose this classes mean projection
-      cvTranspose( m_ClassToAverageImageMap[classNumIt->first], PCATemp );
+   uint64 subspaceKey = m_SubspaceKey;
+   m_SubspaceKey = previousKeys[0];
+   if ( !LoadCachedSubspace() )
+   {
+      m_SubspaceKey = subspaceKey;
+      return false;
+   }
+   if ( previous.m_Stats.Dimension() != m_nEigenVals )
+      throw std::string("Trainer::UpdateFromPreviousModel - the cached projection doesn't match its subspace");
 
-      // multiply the eigenvectors to the transposed mean, store in LDATemp
-      cvMatMul( m_LDAEigenVectors, PCATemp, LDATemp );
+   // diff the image list against the previous one
+   std::vector<Image> images;
+   ReadImageList( m_ImageFile.c_str(), images );
+   if ( images.size() != m_ImageHashes.size() )
+      throw std::string("Trainer::UpdateFromPreviousModel - the image list changed while training");
 
-      // tranpose and store in projection
-      cvTranspose( LDATemp, projection );
+   int nImages = (int)images.size();
+   int nPrevious = (int)previous.m_IDs.size();
 
-      // copy projection to m_ProjectedLDAFaceMat for perminiant storage
-      for ( int col = 0; col < m_nFisherFaces; col++ )
+   std::multimap<std::string, int> previousRows;
+   for ( int row = 0; row < nPrevious; row++ )
+      previousRows.insert( std::pair<std::string, int>( previous.m_ImageNames[row], row ) );
+
+   std::vector<char> kept( nPrevious, 0 );
+   std::vector<int> reused( nImages, -1 );
+   std::vector<int> added;
+
+   for ( int i = 0; i < nImages; i++ )
+   {
+      std::pair< std::multimap<std::string, int>::iterator, std::multimap<std::string, int>::iterator > range;
+      range = previousRows.equal_range( images[i].m_ImageName );
+
+      for ( std::multimap<std::string, int>::iterator it = range.first; it != range.second; it++ )
       {
-         m_ProjectedLDAFaceMat->data.fl[row*m_nFisherFaces+col] = projection->data.fl[col];
+         int row = it->second;
+         if ( !kept[row] && previous.m_IDs[row] == images[i].m_ID && previous.m_PersonNames[row] == images[i].m_PersonName &&
+              previousHashes[row] == m_ImageHashes[i] )
+         {
+            kept[row] = 1;
+            reused[i] = row;
+            break;
+         }
       }
-      row++;
+
+      if ( reused[i] < 0 )
+         added.push_back(i);
    }
+
+   std::vector<int> removed;
+   for ( int row = 0; row < nPrevious; row++ )
+   {
+      if ( !kept[row] )
+         removed.push_back(row);
+   }
+
+   // the statistics lose the faces that went and gain the ones that came
+   int d = m_nEigenVals;
+   m_Stats = previous.m_Stats;
+
+   CvMat* removedFaces = cvCreateMat( std::max( (int)removed.size(), 1 ), d, CV_32FC1 );
+   CvMat* addedFaces = cvCreateMat( std::max( (int)added.size(), 1 ), d, CV_32FC1 );
+
+   try
+   {
+      std::vector<personIDType> removedIDs;
+      for ( size_t i = 0; i < removed.size(); i++ )
+      {
+         memcpy( removedFaces->data.fl + (size_t)i * d, &previous.m_Projected[(size_t)removed[i] * d], d * sizeof(float) );
+         removedIDs.push_back( previous.m_IDs[removed[i]] );
+      }
+
+      if ( !removed.empty() )
+      {
+         CvMat rows;
+         cvGetRows( removedFaces, &rows, 0, (int)removed.size() );
+         m_Stats.RemoveRows( &rows, &removedIDs[0] );
+      }
+
+      std::vector<personIDType> addedIDs;
+      for ( size_t i = 0; i < added.size(); i++ )
+         addedIDs.push_back( images[added[i]].m_ID );
+
+      if ( !added.empty() )
+      {
+         CvMat rows;
+         cvGetRows( addedFaces, &rows, 0, (int)added.size() );
+         ProjectImages( images, added, &rows );
+         m_Stats.AddRows( &rows, &addedIDs[0] );
+      }
+
+      // every face in image list order
+      std::vector<personIDType> ids( nImages );
+      std::vector<float> projected( (size_t)nImages * d );
+      for ( int i = 0; i < nImages; i++ )
+      {
+         ids[i] = images[i].m_ID;
+         if ( reused[i] >= 0 )
+            memcpy( &projected[(size_t)i * d], &previous.m_Projected[(size_t)reused[i] * d], d * sizeof(float) );
+      }
+      for ( size_t i = 0; i < added.size(); i++ )
+         memcpy( &projected[(size_t)added[i] * d], addedFaces->data.fl + (size_t)i * d, d * sizeof(float) );
+
+      m_Names.clear();
+      m_ImageNames.clear();
+      for ( int i = 0; i < nImages; i++ )
+      {
+         m_Names.push_back( images[i].m_PersonName );
+         m_ImageNames.push_back( images[i].m_ImageName );
+      }
+
+      SetProjectedFaces( ids, projected );
+   }
+   catch (...)
+   {
+      cvReleaseMat(&removedFaces);
+      cvReleaseMat(&addedFaces);
+      throw;
+   }
+
+   cvReleaseMat(&removedFaces);
+   cvReleaseMat(&addedFaces);
+
+   // the projection is the previous subspace with these images
+   StageHash projection;
+   projection.Add( std::string(STAGE_CACHE_PROJECTION) );
+   projection.Add( m_SubspaceKey );
+   projection.Add( m_ImagesKey );
+   m_ProjectionKey = projection.Value();
+
+   return true;
+}
+
+
+
+/* 
+Function:   ProjectImages
+Purpose:    loads images[source[i]] for each i and projects it onto the PCA subspace as row i of projected
+Notes:      the images are loaded like LoadImages does, decoded in parallel or copied from a pack, and
+            projected with one GEMM.  The loaded images are only kept until they are projected
+Throws      std::string if an image can't be loaded or is not the subspace's size
+returns:    void
+*/
+void Trainer::ProjectImages(const std::vector<Image>& images, const std::vector<int>& source, CvMat* projected)
+{
+   int width = m_Width;
+   int height = m_Height;
+
+   m_ImageVec.clear();
+   for ( size_t i = 0; i < source.size(); i++ )
+      m_ImageVec.push_back( images[source[i]] );
+   m_nImages = (int)m_ImageVec.size();
+
+   if ( IsImagePack( m_ImageFile.c_str() ) )
+      MapImages( source );
+   else
+      DecodeImages();
+
+   if ( m_Width != width || m_Height != height )
+      throw std::string("Trainer::ProjectImages: Images should be same size as the subspace");
+
+   CreateImageMatrix();
+   CenterImageMatrix();
+
+   CvMat eigenVectors;
+   cvGetRows( m_EigenVectorMatrix, &eigenVectors, 0, m_nEigenVals );
+   ParallelGEMM( m_ImageMatrix, &eigenVectors, 1, projected, CV_GEMM_B_T );
+
+   cvReleaseMat(&m_ImageMatrix);
+   cvReleaseMat(&m_ImagePixels);
+   m_ImageVec.clear();
+}
+
+
+
+/* 
+Function:   DoLDA
+Purpose:    Does all LDA related functions
+Notes:      
+Throws      std::string if somthing goes wrong  
+returns:    
+*/
+void Trainer::DoLDA()
+{
+   m_nLDAEigens = m_nEigenVals;
+   m_nFisherFaces = m_nClasses - 1;
+
+   if ( m_nFisherFaces < 2 )
+      throw std::string("Trainer::DoLDA - number of classes needs to be more than 2" );
+
+   // the options can ask for fewer, and there can't be more than the PCA subspace has
+   if ( m_Options.m_nFisherFaces > 0 && m_Options.m_nFisherFaces < m_nFisherFaces )
+      m_nFisherFaces = m_Options.m_nFisherFaces;
+   if ( m_nFisherFaces > m_nLDAEigens )
+      m_nFisherFaces = m_nLDAEigens;
+
+   AccumulateStats();
+
+   m_AverageProjectedImage = cvCreateMat(1, m_nLDAEigens, CV_32FC1);
+   m_Stats.Mean( m_AverageProjectedImage );
+
+   CalcClassAverageImage();
+   CalcWithinScatterMat();
+   CalcBetweenScatterMat();
+   ProjectOntoLDASubspace();
+ 
+}
+
+
+/* 
+Function:   AccumulateStats
+Purpose:    one pass over the projected faces collects everything the LDA needs
+Notes:      sharded training and the stage cache have already filled m_Stats, then nothing is done
+Throws      
+returns:    void
+*/
+void Trainer::AccumulateStats()
+{
+   if ( m_Stats.Count() == m_nImages && m_Stats.Dimension() == m_nEigenVals )
+      return;
+
+   m_Stats.Reset( m_nEigenVals );
+   m_Stats.AddRows( m_ProjectedFaceMatrix, (const personIDType*)m_PersonIDMatrix->data.i );
+}
+
+
+
+/* 
+Function:   CalcClassAverageImage
+Purpose:    calculates average image for each class
+Notes:      one row per class in class id order, from the training statistics
+Throws      
+returns:    void
+*/
+void Trainer::CalcClassAverageImage()
+{
+   m_ClassAverageMat = cvCreateMat( m_nClasses, m_nLDAEigens, CV_32FC1 );
+   m_Stats.ClassMeans( m_ClassAverageMat );
+}
+
+
+
+/* 
+Function:   ClassWithinScatterMat
+Purpose:    For LDA implementation
+Notes:      Sw = sum over classes of the class scatter, m_nLDAEigens square, from the training statistics.
+            Kept in doubles like the statistics, it is factored in doubles and rounding it to floats
+            would lose the small directions that decide the fisherfaces
+Throws      
+returns:    void
+*/
+void Trainer::CalcWithinScatterMat()
+{
+   m_WithinScatterMat = cvCreateMat( m_nLDAEigens, m_nLDAEigens, CV_64FC1 );
+   m_Stats.WithinScatter( m_WithinScatterMat );
+}
+
+
+/* 
+Function:   ClassBetweenScatterMat
+Purpose:    For LDA implementation
+Notes:      Sb = sum over classes of class size * (class mean - mean)(class mean - mean)^T.  Only the
+            factor is kept, one row sqrt(class size) * (class mean - mean) per class, Sb = rows^T * rows
+Throws      
+returns:    void
+*/
+void Trainer::CalcBetweenScatterMat()
+{
+   m_BetweenFactorMat = cvCreateMat( m_nClasses, m_nLDAEigens, CV_32FC1 );
+   m_Stats.BetweenFactor( m_BetweenFactorMat );
+}
+
+
+
+/* 
+Function:   ProjectOntoLDASubspace
+Purpose:    For LDA implementation
+Notes:      the fisherfaces are the top generalized eigenvectors of Sb v = lambda Sw v, found by
+            SymmetricGeneralizedEigen without inverting Sw.  They are scaled so v^T Sw v = 1, so distances
+            in the fisher space are measured in units of the within class spread
+Throws      std::string if the within class scatter is singular
+returns:    void
+*/
+void Trainer::ProjectOntoLDASubspace()
+{
+   m_LDAEigenVectors = cvCreateMat( m_nFisherFaces, m_nLDAEigens, CV_32FC1 );
+   m_LDAEigenValues = cvCreateMat( 1, m_nFisherFaces,  CV_32FC1 );
+
+   SymmetricGeneralizedEigen( m_WithinScatterMat, m_BetweenFactorMat, m_LDAEigenVectors, m_LDAEigenValues );
+
+   // now calculate projected images
+   // each class has a projection, its mean projected onto the fisherfaces
+   m_ProjectedLDAFaceMat = cvCreateMat( m_nClasses, m_nFisherFaces, CV_32FC1 );
+   cvGEMM( m_ClassAverageMat, m_LDAEigenVectors, 1, NULL, 0, m_ProjectedLDAFaceMat, CV_GEMM_B_T );
 }
 
 
@@ -601,26 +1362,24 @@ void Trainer::ProjectOntoLDASubspace()
 /* 
 Function:   CalculateThresholds
 Purpose:    calculates thresholds of database used for comparing a probe image
-Notes:      
+Notes:      m_EuclideanThreshold is 1/2 the largest distance between two class projections,
+            m_ClassThresholds is the largest distance of any of a class's images from the class projection
 Throws      
 returns:    void
 */
 void Trainer::CalculateThresholds()
 {
    double maxE = 0.0;
-   int index = 0;
 
-   while ( index <= m_nClasses )
+   for ( int index = 0; index < m_nClasses; index++ )
    {
-
-      for ( int row = index; row < m_nClasses; row++ )
+      for ( int row = index+1; row < m_nClasses; row++ )
       {
          double e_distance = 0.0;
-         double m_distance = 0.0;
 
          for ( int col = 0; col < m_nFisherFaces; col++ )
          {
-            double d = m_ProjectedLDAFaceMat->data.fl[index*m_nClasses +col] - m_ProjectedLDAFaceMat->data.fl[row*m_nClasses + col];
+            double d = m_ProjectedLDAFaceMat->data.fl[index*m_nFisherFaces + col] - m_ProjectedLDAFaceMat->data.fl[row*m_nFisherFaces + col];
 
             double dd = d*d; 
             e_distance += dd;
@@ -629,11 +1388,75 @@ void Trainer::CalculateThresholds()
          if ( e_distance > maxE )
             maxE = e_distance;
       }
-
-      index++;
    }
    m_EuclideanThreshold = maxE * .5;
- 
+
+   // now each class's own threshold, every image projected onto the fisher space the same way the class means were
+   m_ClassThresholds = cvCreateMat( 1, m_nClasses, CV_32FC1 );
+   CvMat* LDAFaces = cvCreateMat( m_nImages, m_nFisherFaces, CV_32FC1 );
+   ParallelGEMM( m_ProjectedFaceMatrix, m_LDAEigenVectors, 1, LDAFaces, CV_GEMM_B_T );
+
+   // rows of m_ProjectedLDAFaceMat are in class id order
+   std::map<personIDType, int> classRows;
+   std::map<personIDType, int>::iterator it;
+   for ( it = m_ClassCountMap.begin(); it != m_ClassCountMap.end(); it++ )
+   {
+      int row = (int)classRows.size();
+      classRows[it->first] = row;
+      m_ClassThresholds->data.fl[row] = 0.0f;
+   }
+
+   for ( int image = 0; image < m_nImages; image++ )
+   {
+      int row = classRows[ m_PersonIDMatrix->data.i[image] ];
+
+      double e_distance = 0.0;
+      for ( int col = 0; col < m_nFisherFaces; col++ )
+      {
+         double d = LDAFaces->data.fl[image*m_nFisherFaces + col] - m_ProjectedLDAFaceMat->data.fl[row*m_nFisherFaces + col];
+         e_distance += d*d;
+      }
+
+      if ( e_distance > m_ClassThresholds->data.fl[row] )
+         m_ClassThresholds->data.fl[row] = (float)e_distance;
+   }
+
+   cvReleaseMat(&LDAFaces);
+}
+
+
+
+/* 
+Function:   CalcFisherProjection
+Purpose:    combines the LDA and PCA eigenvectors into the single projection the recognizer uses
+Notes:      m_FisherProjection = m_LDAEigenVectors * PCA eigenvectors, so a probe x is projected
+            with m_FisherProjection * x - m_ProjectedMean, and the recognizer never needs the eigenfaces
+Throws      
+returns:    void
+*/
+void Trainer::CalcFisherProjection()
+{
+   int size = m_Width * m_Height;
+
+   // the PCA eigenvectors are already the rows of m_EigenVectorMatrix, m_nEigenVals rows and size cols
+   CvMat eigenVectors;
+   cvGetRows( m_EigenVectorMatrix, &eigenVectors, 0, m_nEigenVals );
+
+   // m_LDAEigenVectors is m_nFisherFaces rows and m_nEigenVals cols
+   // the result is m_nFisherFaces rows and size cols, few rows so ParallelGEMM splits its columns
+   cvReleaseMat(&m_FisherProjection);
+   m_FisherProjection = cvCreateMat( m_nFisherFaces, size, CV_32FC1 );
+   ParallelGEMM( m_LDAEigenVectors, &eigenVectors, 1, m_FisherProjection );
+
+   // project the average image now so the recognizer only has to subtract it
+   CvMat* avgImg = cvCreateMat( size, 1, CV_32FC1 );
+   ImageToMatrixf( m_AverageImage, avgImg->data.fl, size );
+
+   cvReleaseMat(&m_ProjectedMean);
+   m_ProjectedMean = cvCreateMat( m_nFisherFaces, 1, CV_32FC1 );
+   cvMatMul( m_FisherProjection, avgImg, m_ProjectedMean );
+
+   cvReleaseMat(&avgImg);
 }
 
 
@@ -641,82 +1464,117 @@ void Trainer::CalculateThresholds()
 /* 
 Function:   StoreData
 Purpose:    writes data from training session to disk
-Notes:      
-Throws      std::string if it can't open training database
+Notes:      the database is a binary ModelFile so the recognizer can map it, only the fused 
+            fisher projection is stored, not the PCA eigenfaces.  Classes enrolled since the
+            database was last trained are removed.  The header's model id is a hash of the projection,
+            a gallery left by a crash before it is removed is refused by the new model
+Throws      std::string if it can't write the training database
 returns:    void
 */
 
 void Trainer::StoreData()
 {
+   CalcFisherProjection();
+
+   ModelFileWriter writer;
+   ModelFileHeader& header = writer.Header();
+
+   header.m_Width = m_Width;
+   header.m_Height = m_Height;
+   header.m_nImages = m_nImages;
+   header.m_nClasses = m_nClasses;
+   header.m_nEigenFaces = m_nEigenVals;
+   header.m_nFisherFaces = m_nFisherFaces;
+   header.m_ProjectionStride = AlignedStride( m_Width * m_Height );
+   header.m_CentroidStride = AlignedStride( m_nFisherFaces );
+   header.m_EuclideanThreshold = m_EuclideanThreshold;
+
+   // the gallery and its log are only loaded with the projection their centroids were projected with
+   StageHash modelID;
+   for ( int row = 0; row < m_nFisherFaces; row++ )
+      modelID.Add( m_FisherProjection->data.ptr + (size_t)row * m_FisherProjection->step, m_FisherProjection->cols * sizeof(float) );
+   modelID.Add( m_ProjectedMean->data.fl, m_nFisherFaces * sizeof(float) );
+   header.m_ModelID = modelID.Value();
 
-   CvFileStorage* database;
-   database = cvOpenFileStorage(m_DatabaseFile.c_str(), 0, CV_STORAGE_WRITE);
-
-   if ( !database )
-      throw std::string("Trainer::StorData could not open database");
-
-   cvWriteInt( database, "nImages", m_nImages );
-   cvWriteInt( database, "nPeople", m_Names.size() );
-
-   // store names
-   for ( int i = 0; i < m_Names.size(); i++ )
+   // each class's id and name, in the same order as the rows of m_ProjectedLDAFaceMat
+   std::vector<personIDType> classIDs;
+   std::vector<std::string> classNames;
+   std::map<personIDType, int>::iterator it;
+   for ( it = m_ClassCountMap.begin(); it != m_ClassCountMap.end(); it++ )
    {
-      char var[256];
-      sprintf(var,"PersonID_%d", (i+1));
-      cvWriteString( database, var, m_Names[i].c_str(), 0 );
+      classIDs.push_back( it->first );
+      classNames.push_back( m_Names[ m_ClassToImageIndexMap.find(it->first)->second ] );
    }
 
+   writer.AddStringTable( MODEL_SECTION_NAMES, classNames );
+   writer.AddSection( MODEL_SECTION_CLASS_IDS, &classIDs[0], classIDs.size() * sizeof(personIDType) );
+   writer.AddMatrix( MODEL_SECTION_PROJECTION, m_FisherProjection, header.m_ProjectionStride );
+   writer.AddMatrix( MODEL_SECTION_PROJECTED_MEAN, m_ProjectedMean, 1 );
+   writer.AddMatrix( MODEL_SECTION_CENTROIDS, m_ProjectedLDAFaceMat, header.m_CentroidStride );
+   writer.AddMatrix( MODEL_SECTION_THRESHOLDS, m_ClassThresholds, m_nClasses );
+   writer.AddSection( MODEL_SECTION_IMAGE_IDS, m_PersonIDMatrix->data.i, m_nImages * sizeof(personIDType) );
    // store database images (in order)
-   for ( int i = 0; i < m_ImageVec.size(); i++ )
-   {
-      char var[256];
-      sprintf(var, "ImageID_%d", i);
-      cvWriteString( database, var, m_ImageVec[i].m_ImageName.c_str(), 0 );
-   }
+   writer.AddStringTable( MODEL_SECTION_IMAGE_NAMES, m_ImageNames );
 
-   cvWriteInt( database, "nLDAEigens", m_nLDAEigens );
-   cvWriteInt( database, "nClasses", m_nClasses );
-   cvWriteInt( database, "nFisherFaces" , m_nFisherFaces );
-   cvWrite( database, "PersonIDMatrix", m_PersonIDMatrix, cvAttrList(0,0) );
-   
-   for ( int i = 0; i < m_nLDAEigens; i++ )
+   // with a stage cache, what incremental training needs to find this training's stages and diff the image list
+   if ( !m_Options.m_CacheDir.empty() && (int)m_ImageHashes.size() == m_nImages )
    {
-      char var[256];
-      sprintf(var, "PCAEigenVector_%d", i);
-      cvWrite( database, var, m_EigenVectorArray[i], cvAttrList(0,0) );
+      uint64 keys[3] = { m_SubspaceKey, m_ProjectionKey, m_OptionsKey };
+      writer.AddSection( MODEL_SECTION_IMAGE_HASHES, &m_ImageHashes[0], m_nImages * sizeof(uint64) );
+      writer.AddSection( MODEL_SECTION_STAGE_KEYS, keys, sizeof(keys) );
    }
-   
-   cvWrite( database, "PCAEigenValues", m_EigenValueMatrix, cvAttrList(0,0) );
-   cvWrite( database, "LDAEigenVectors", m_LDAEigenVectors, cvAttrList(0,0) );
-   cvWrite( database, "LDAEigenValues", m_LDAEigenValues, cvAttrList(0,0) );
-   cvWrite( database, "ProjectedLDAFaceMat", m_ProjectedLDAFaceMat, cvAttrList(0,0) );
-   cvWrite( database, "AverageImage", m_AverageImage, cvAttrList(0,0) );
-   cvWrite( database, "AverageProjectedImage", m_AverageProjectedImage, cvAttrList(0,0) );
 
-   // write each class ID out
-   std::map<personIDType, int>::iterator it;
-   int i = 0;
-   for ( it = m_ClassCountMap.begin(); it != m_ClassCountMap.end(); it++ )
+   writer.Write( m_DatabaseFile.c_str() );
+
+   // classes enrolled into the last training were projected into its fisher space, not this one
+   remove( GalleryFileName( m_DatabaseFile.c_str() ).c_str() );
+   remove( GalleryLogFileName( m_DatabaseFile.c_str() ).c_str() );
+}
+
+
+
+/* 
+Function:   StoreIndexes
+Purpose:    builds the search indexes asked for in the training options over the classes of the stored database
+Notes:      the indexes are built from the database StoreData wrote, so their vectors are the
+            padded and aligned centroid rows the recognizer will search.  The HNSW index is stored as
+            <database>.hnsw and the product quantized index as <database>.pq.  An index left from an
+            earlier training of the same database that was not asked for is removed
+Throws      std::string if it can't read the database or write an index
+returns:    void
+*/
+void Trainer::StoreIndexes()
+{
+   std::string hnswFile = HNSWIndexFileName( m_DatabaseFile.c_str() );
+   std::string pqFile = PQIndexFileName( m_DatabaseFile.c_str() );
+
+   if ( !m_Options.m_bBuildHNSW )
+      remove( hnswFile.c_str() );
+   if ( !m_Options.m_bBuildPQ )
+      remove( pqFile.c_str() );
+   if ( !m_Options.m_bBuildHNSW && !m_Options.m_bBuildPQ )
+      return;
+
+   ModelFile model;
+   model.Open( m_DatabaseFile.c_str() );
+
+   const ModelFileHeader& header = model.Header();
+   CvMat centroids;
+   model.InitMatHeader( MODEL_SECTION_CENTROIDS, &centroids, header.m_nClasses, header.m_nFisherFaces, header.m_CentroidStride );
+
+   if ( m_Options.m_bBuildHNSW )
    {
-      char var[256];
-      sprintf(var, "Class_%d", i++ );
-      cvWriteInt( database, var, it->first );
+      HNSWIndex index( m_Options.m_HNSWM, m_Options.m_HNSWEfConstruction );
+      index.Build( centroids.data.fl, header.m_nClasses, header.m_CentroidStride );
+      index.Save( hnswFile.c_str() );
    }
 
-   // write each classes average image
-   std::map<personIDType, CvMat*>::iterator ImageIt;
-   for ( ImageIt = m_ClassToAverageImageMap.begin(); ImageIt != m_ClassToAverageImageMap.end(); ImageIt++ )
+   if ( m_Options.m_bBuildPQ )
    {
-      char var[256];
-      sprintf(var, "ClassAverageImage_ID%d", ImageIt->first);
-      cvWrite( database, var, ImageIt->second);
+      PQIndex index( m_Options.m_PQSubspaces );
+      index.Build( centroids.data.fl, header.m_nClasses, header.m_CentroidStride, header.m_nFisherFaces );
+      index.Save( pqFile.c_str() );
    }
-
-   // store threshold values
-   cvWriteReal( database, "EuclideanThreshold", m_EuclideanThreshold );
-
-   cvReleaseFileStorage( &database );
-
 }
 
 
@@ -778,7 +1636,7 @@ void Trainer::GenResults(std::string& resultsdir)
    for ( int i = 0; i < people.size(); i++ )
    {
       html << GetText(people[i].c_str(), "h4", "    ");
-      for ( int j = 0; j < m_nImages; j++ )
+      for ( size_t j = 0; j < m_ImageVec.size(); j++ )
       {
          if ( m_ImageVec[j].m_PersonName == people[i] )  //hack
          {
@@ -10,6 +10,12 @@
 */
 
 #include "Utilities.h"
+#include "HNSWIndex.h"
+#include "PQIndex.h"
+#include "RandomizedPCA.h"
+#include "TrainingStats.h"
+#include "ImagePack.h"
+#include "ShardedTraining.h"
 #include <fstream>
 #include <vector>
 #include <map>
@@ -23,7 +29,9 @@ struct Image
    std::string    m_ImageName;
    IplImage*      m_Image;
 
-   Image(const char* buffer)
+   Image() : m_ID(0), m_Image(NULL) {}
+
+   Image(const char* buffer) : m_Image(NULL)
    {
       std::string stuff(buffer);
 
@@ -53,7 +61,63 @@ struct Image
 
 
 
-void Train(const char* imagelist, const char* database, std::string& resultdir);
+// what happened decoding each image in LoadImages
+#define IMAGE_LOADED       0
+#define IMAGE_NOT_LOADED   1
+#define IMAGE_WRONG_SIZE   2
+
+#define TRAINING_DEFAULT_PCA_SAMPLE_IMAGES   4000     // enough images to find the eigenfaces, the rest only need projecting
+
+
+// how CreateSubspace finds the eigenfaces
+enum PCAMethod
+{
+   PCA_EIGEN_OBJECTS,      // cvCalcEigenObjects, decomposes the whole images x images covariance matrix
+   PCA_RANDOMIZED          // RandomizedPCA, only finds the eigenfaces that are kept
+};
+
+
+// choices made when training a database
+struct TrainingOptions
+{
+   bool     m_bBuildHNSW;              // also build an HNSW index over the classes, stored as <database>.hnsw
+   int      m_HNSWM;                   // links per node of the index
+   int      m_HNSWEfConstruction;      // candidates kept while building the index
+   bool     m_bBuildPQ;                // also build a product quantized index, stored as <database>.pq
+   int      m_PQSubspaces;             // bytes stored per class by the product quantized index
+
+   // subspace sizes, 0 keeps the largest LDA allows
+   int      m_nEigenFaces;             // most PCA eigenvectors, at most number of images - number of people
+   double   m_RetainedVariance;        // fraction of the image variance the PCA eigenvectors keep, 0 to 1
+   int      m_nFisherFaces;            // most fisherfaces, at most number of people - 1
+
+   PCAMethod   m_PCAMethod;
+   int         m_PCAOversample;        // randomized PCA only, extra directions searched
+   int         m_PCAPowerIterations;   // randomized PCA only, more is slower and more accurate
+
+   // sharded training, see ShardedTraining.h
+   int      m_nShards;                 // processes that load and project the images, 1 trains in this process
+   bool     m_bExternalShards;         // the shards run on other machines, training waits for their files
+   int      m_ShardTimeoutSeconds;     // how long training waits for the shards on other machines, 0 waits forever
+   int      m_PCASampleImages;         // images the PCA subspace is found from when sharded, 0 for all
+
+   // stage cache, see StageCache.h
+   std::string m_CacheDir;             // existing directory the PCA and projection stages are cached in, empty for none
+   bool     m_bIncremental;            // update the database's previous training from the changes to the image list, needs m_CacheDir
+
+   TrainingOptions() : m_bBuildHNSW(false), m_HNSWM(HNSW_DEFAULT_M), m_HNSWEfConstruction(HNSW_DEFAULT_EF_CONSTRUCTION),
+      m_bBuildPQ(false), m_PQSubspaces(PQ_DEFAULT_SUBSPACES), m_nEigenFaces(0), m_RetainedVariance(0.0), m_nFisherFaces(0),
+      m_PCAMethod(PCA_EIGEN_OBJECTS), m_PCAOversample(RANDOMIZED_PCA_DEFAULT_OVERSAMPLE),
+      m_PCAPowerIterations(RANDOMIZED_PCA_DEFAULT_POWER_ITERATIONS), m_nShards(1), m_bExternalShards(false), m_ShardTimeoutSeconds(SHARD_DEFAULT_TIMEOUT_SECONDS),
+      m_PCASampleImages(TRAINING_DEFAULT_PCA_SAMPLE_IMAGES), m_bIncremental(false) {}
+};
+
+
+
+void Train(const char* imagelist, const char* database, std::string& resultdir, const TrainingOptions& options = TrainingOptions());
+
+// the entries of an image list or an image pack, without loading the images
+void ReadImageList(const char* imagelist, std::vector<Image>& images);
 
 
 
@@ -61,42 +125,77 @@ void Train(const char* imagelist, const char* database, std::string& resultdir);
 class Trainer
 {
 public:
-   Trainer(const char* imagelist, const char* database);
+   Trainer(const char* imagelist, const char* database, const TrainingOptions& options = TrainingOptions());
    ~Trainer();
 
-   int LoadImages();
+   int LoadImages(int sampleImages = 0);
    void CreateSubspace();
    void ProjectOntoSubSpace();
+   void StoreBasis();
+   void MergeShards(int nShards);
+   void HashInputs();
+   bool LoadCachedSubspace();
+   bool LoadCachedProjection();
+   void StoreCachedSubspace();
+   void StoreCachedProjection();
+   bool UpdateFromPreviousModel();
    void DoLDA();
    void StoreData();
+   void StoreIndexes();
    void GenResults(std::string& resultsdir);
    void CalculateThresholds();
 
 private:
+   void DecodeImages();
+   void MapImages(const std::vector<int>& source);
+   void CopyImageToRow(const IplImage* image, uchar* row);
+   void AllocateSubspace();
+   void GetBasis(ShardBasis& basis);
+   void SetProjectedFaces(const std::vector<personIDType>& ids, const std::vector<float>& projected);
+   void AccumulateStats();
+   void ProjectImages(const std::vector<Image>& images, const std::vector<int>& source, CvMat* projected);
+   void CreateImageMatrix();
+   void CenterImageMatrix();
+   void CalcRandomizedPCA();
+   void RetainVariance(double fraction);
    void CalcClassAverageImage();
-   void CalcAverageImage(CvMat* images, int nImages, CvMat* avgImage);
    void CalcWithinScatterMat();
    void CalcBetweenScatterMat();
    void ProjectOntoLDASubspace();
+   void CalcFisherProjection();
    
    std::string             m_ImageFile;      // list of images of faces and thier names
    std::string             m_DatabaseFile;   // where to put the results
+   TrainingOptions         m_Options;
+   uint64                  m_ImagesKey;      // StageCache keys, only set when m_Options.m_CacheDir is
+   uint64                  m_OptionsKey;     // the PCA options part of m_SubspaceKey
+   uint64                  m_SubspaceKey;
+   uint64                  m_ProjectionKey;
+   std::vector<uint64>     m_ImageHashes;    // contents hash of each image of m_ImageFile, only set when m_Options.m_CacheDir is
       
 
    int                     m_nImages;        // number of images(faces)
+   int                     m_nListImages;    // images in m_ImageFile, more than m_nImages when only a sample is loaded
+   int                     m_nListClasses;   // people in m_ImageFile
    int                     m_Width;          // width of training images, all images should be same size
    int                     m_Height;       
    int                     m_nEigenVals;     // number of eigenvalues and eigenvecors used in subspace
    std::vector<Image>      m_ImageVec;       // pointers to each face
-   std::vector<std::string> m_Names;         // names of people
-
-   IplImage**              m_ImageArray;      // array to store images of faces
-   IplImage**              m_EigenVectorArray; // array to store eigen vectors
+   std::vector<std::string> m_Names;         // name of the person in each image
+   std::vector<std::string> m_ImageNames;    // file name of each image
+
+   IplImage**              m_ImageArray;      // array to store images of faces, headers pointing at rows of m_ImagePixels
+   CvMat*                  m_ImagePixels;     // every training image's pixels, one image per row in image list order
+   ImagePack               m_Pack;            // the training images when m_ImageFile is a pack, m_ImagePixels can point into it
+   IplImage**              m_EigenVectorArray; // array to store eigen vectors, headers pointing at rows of m_EigenVectorMatrix
+   CvMat*                  m_EigenVectorMatrix; // eigen vectors, one per row
+   CvMat*                  m_ImageMatrix;      // each image as a row, centered once the average image is known
    CvMat*                  m_PersonIDMatrix;   // matrix to store person ids
    CvMat*                  m_EigenValueMatrix; // matrix to store Eigen values
    CvMat*                  m_ProjectedFaceMatrix; // matrix to store projected faces 
 
    double                  m_EuclideanThreshold;   		// 1/2 the largest euclidean distance for each projected face
+   CvMat*                  m_ClassThresholds;         // largest distance of each class's images from the class projection
    
    IplImage*               m_AverageImage;     // Average image of all training images
    
@@ -105,19 +204,18 @@ private:
    int                               m_nClasses;
    int                               m_nLDAEigens;             // number of eigenvalues and eigenvectors used for LDA
    int                               m_nFisherFaces;           // number of fisherfaces to use
-   std::map<personIDType, CvMat*>    m_ClassToImageMap;        // each classes image array
    std::map<personIDType, int>       m_ClassCountMap;          // number of images in each class
    std::multimap<personIDType, int>  m_ClassToImageIndexMap;   // stores each class's index into m_EigenVectorArray
 
    
    // averages
-   std::map<personIDType, CvMat*>    m_ClassToAverageImageMap;  // each classes average image
+   TrainingStats                     m_Stats;                   // counts, sums and scatter of the projected faces
+   CvMat*                            m_ClassAverageMat;         // each classes average image, one row per class in class id order
    CvMat*                            m_AverageProjectedImage;
    
    // scatter matrices
    CvMat*                             m_WithinScatterMat;
-   CvMat*                             m_InverseWScatterMat;
-   CvMat*                             m_BetweenScatterMat;
+   CvMat*                             m_BetweenFactorMat;       // one row per class, Sb = m_BetweenFactorMat^T * m_BetweenFactorMat
 
    // EigenVectors and EigenValues for the LDA subspace
    CvMat*                             m_LDAEigenVectors;
@@ -125,6 +223,10 @@ private:
 
    CvMat*                             m_ProjectedLDAFaceMat; // projected LDA face matrix
 
+   // fused projection used by the recognizer, m_LDAEigenVectors * PCA eigenvectors
+   CvMat*                             m_FisherProjection;       // m_nFisherFaces rows, image size cols
+   CvMat*                             m_ProjectedMean;          // m_FisherProjection * average image, m_nFisherFaces rows
+
    
    
 };
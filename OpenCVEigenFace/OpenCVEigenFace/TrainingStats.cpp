@@ -0,0 +1,606 @@
+#include "TrainingStats.h"
+#include "ParallelGEMM.h"
+#include <algorithm>
+#include <math.h>
+
+
+
+/* 
+Function:   TrainingStats constructor
+Purpose:    empty statistics, Reset sets the dimension before anything is added
+Notes:      
+Throws      
+*/
+TrainingStats::TrainingStats() : m_Dimension(0), m_Count(0)
+{
+}
+
+
+
+/* 
+Function:   TrainingStats constructor
+Purpose:    empty statistics for faces of dimension floats
+Notes:      
+Throws      
+*/
+TrainingStats::TrainingStats(int dimension) : m_Dimension(0), m_Count(0)
+{
+   Reset(dimension);
+}
+
+
+
+/* 
+Function:   Reset
+Purpose:    throws away everything added and sets the dimension of the faces
+Notes:      
+Throws      
+returns:    void
+*/
+void TrainingStats::Reset(int dimension)
+{
+   m_Dimension = dimension;
+   m_Count = 0;
+   m_ClassIndex.clear();
+   m_ClassCounts.clear();
+   m_ClassMeans.clear();
+   m_Scatter.assign( (size_t)dimension * dimension, 0.0 );
+}
+
+
+
+/* 
+Function:   AddClass
+Purpose:    finds the row of a class, adding an empty one the first time the class is seen
+Notes:      
+Throws      
+returns:    the class's row of m_ClassMeans
+*/
+int TrainingStats::AddClass(personIDType cls)
+{
+   std::map<personIDType, int>::iterator it = m_ClassIndex.find(cls);
+   if ( it != m_ClassIndex.end() )
+      return it->second;
+
+   int index = (int)m_ClassCounts.size();
+   m_ClassIndex[cls] = index;
+   m_ClassCounts.push_back(0);
+   m_ClassMeans.resize( m_ClassMeans.size() + m_Dimension, 0.0 );
+   return index;
+}
+
+
+
+/* 
+Function:   Add
+Purpose:    adds one face
+Notes:      Welford's update, the class mean moves 1 / (n + 1) of the way to the face and the scatter
+            grows by n / (n + 1) times the outer product of the face's difference from the old mean.
+            A rank 1 update of the scatter, AddRows is faster for many faces
+Throws      
+returns:    void
+*/
+void TrainingStats::Add(personIDType cls, const float* face)
+{
+   int index = AddClass(cls);
+   double* mean = &m_ClassMeans[(size_t)index * m_Dimension];
+   int n = m_ClassCounts[index];
+
+   std::vector<double> difference( m_Dimension );
+   for ( int i = 0; i < m_Dimension; i++ )
+      difference[i] = face[i] - mean[i];
+
+   double scale = (double)n / (n + 1);
+   for ( int i = 0; i < m_Dimension; i++ )
+   {
+      mean[i] += difference[i] / (n + 1);
+
+      double* scatter = &m_Scatter[(size_t)i * m_Dimension];
+      for ( int j = 0; j < m_Dimension; j++ )
+         scatter[j] += scale * difference[i] * difference[j];
+   }
+
+   m_ClassCounts[index]++;
+   m_Count++;
+}
+
+
+
+/* 
+Function:   AddRows
+Purpose:    adds each row of faces
+Notes:      see AccumulateRows
+Throws      std::string if faces is not Dimension() floats wide
+returns:    void
+*/
+void TrainingStats::AddRows(const CvMat* faces, const personIDType* classes)
+{
+   AccumulateRows( faces, classes, 1 );
+}
+
+
+
+/* 
+Function:   RemoveRows
+Purpose:    takes faces that were added out of the statistics again
+Notes:      a class left without faces is dropped.  Nothing is changed if a face's class doesn't
+            have enough faces to remove
+Throws      std::string if faces is not Dimension() floats wide or a class doesn't have the faces
+returns:    void
+*/
+void TrainingStats::RemoveRows(const CvMat* faces, const personIDType* classes)
+{
+   std::map<personIDType, int> removed;
+   for ( int row = 0; row < faces->rows; row++ )
+      removed[classes[row]]++;
+
+   std::map<personIDType, int>::iterator it;
+   for ( it = removed.begin(); it != removed.end(); it++ )
+   {
+      std::map<personIDType, int>::iterator cls = m_ClassIndex.find( it->first );
+      if ( cls == m_ClassIndex.end() || m_ClassCounts[cls->second] < it->second )
+         throw std::string("TrainingStats::RemoveRows - removing faces that were not added");
+   }
+
+   AccumulateRows( faces, classes, -1 );
+
+   for ( it = removed.begin(); it != removed.end(); it++ )
+   {
+      int index = m_ClassIndex[it->first];
+      if ( m_ClassCounts[index] == 0 )
+         RemoveClass( it->first );
+   }
+}
+
+
+
+/* 
+Function:   RemoveClass
+Purpose:    drops an empty class
+Notes:      the last class's row is moved into its place so the rows stay packed
+Throws      
+returns:    void
+*/
+void TrainingStats::RemoveClass(personIDType cls)
+{
+   int index = m_ClassIndex[cls];
+   int last = (int)m_ClassCounts.size() - 1;
+
+   if ( index != last )
+   {
+      std::map<personIDType, int>::iterator it;
+      for ( it = m_ClassIndex.begin(); it != m_ClassIndex.end(); it++ )
+      {
+         if ( it->second == last )
+         {
+            it->second = index;
+            break;
+         }
+      }
+
+      m_ClassCounts[index] = m_ClassCounts[last];
+      std::copy( m_ClassMeans.begin() + (size_t)last * m_Dimension, m_ClassMeans.begin() + (size_t)(last + 1) * m_Dimension,
+                 m_ClassMeans.begin() + (size_t)index * m_Dimension );
+   }
+
+   m_ClassIndex.erase(cls);
+   m_ClassCounts.pop_back();
+   m_ClassMeans.resize( (size_t)last * m_Dimension );
+}
+
+
+
+/* 
+Function:   AccumulateRows
+Purpose:    adds or removes each row of faces
+Notes:      the faces are taken TRAINING_STATS_BLOCK_ROWS at a time.  The block's own class means are
+            found first and the block's scatter about them summed with one ParallelMulTransposed, then
+            each class of the block is combined into, or taken out of, its class with CombineClass.
+            sign is 1 to add, -1 to remove
+Throws      std::string if faces is not Dimension() floats wide
+returns:    void
+*/
+void TrainingStats::AccumulateRows(const CvMat* faces, const personIDType* classes, int sign)
+{
+   if ( faces->cols != m_Dimension || CV_MAT_TYPE(faces->type) != CV_32FC1 )
+      throw std::string("TrainingStats::AddRows - faces are not the statistics dimension");
+
+   int blockRows = std::min( faces->rows, TRAINING_STATS_BLOCK_ROWS );
+   if ( blockRows == 0 )
+      return;
+
+   CvMat* block = cvCreateMat( blockRows, m_Dimension, CV_64FC1 );
+   CvMat* factor = cvCreateMat( blockRows, m_Dimension, CV_64FC1 );     // a row per class of the block
+   std::map<personIDType, int> blockIndex;
+   std::vector<personIDType> blockClasses;
+   std::vector<int> blockCounts;
+   std::vector<double> blockMeans;
+   std::vector<int> rowClass( blockRows );
+
+   try
+   {
+      for ( int first = 0; first < faces->rows; first += blockRows )
+      {
+         int last = std::min( first + blockRows, faces->rows );
+
+         blockIndex.clear();
+         blockClasses.clear();
+         blockCounts.clear();
+         blockMeans.clear();
+
+         for ( int row = first; row < last; row++ )
+         {
+            const float* face = (const float*)( faces->data.ptr + (size_t)row * faces->step );
+
+            std::map<personIDType, int>::iterator it = blockIndex.find( classes[row] );
+            int index = (int)blockClasses.size();
+            if ( it == blockIndex.end() )
+            {
+               blockIndex[classes[row]] = index;
+               blockClasses.push_back( classes[row] );
+               blockCounts.push_back( 0 );
+               blockMeans.resize( blockMeans.size() + m_Dimension, 0.0 );
+            }
+            else
+            {
+               index = it->second;
+            }
+
+            double* sum = &blockMeans[(size_t)index * m_Dimension];
+            for ( int col = 0; col < m_Dimension; col++ )
+               sum[col] += face[col];
+
+            blockCounts[index]++;
+            rowClass[row - first] = index;
+         }
+
+         for ( size_t index = 0; index < blockClasses.size(); index++ )
+         {
+            double* mean = &blockMeans[index * m_Dimension];
+            for ( int col = 0; col < m_Dimension; col++ )
+               mean[col] /= blockCounts[index];
+         }
+
+         // the block's faces centered on its own class means
+         for ( int row = first; row < last; row++ )
+         {
+            const float* face = (const float*)( faces->data.ptr + (size_t)row * faces->step );
+            const double* mean = &blockMeans[(size_t)rowClass[row - first] * m_Dimension];
+            double* dst = block->data.db + (size_t)(row - first) * m_Dimension;
+
+            for ( int col = 0; col < m_Dimension; col++ )
+               dst[col] = face[col] - mean[col];
+         }
+
+         AddScatter( block, last - first, sign );
+
+         for ( size_t index = 0; index < blockClasses.size(); index++ )
+         {
+            int cls = AddClass( blockClasses[index] );
+            CombineClass( cls, blockCounts[index], &blockMeans[index * m_Dimension], sign,
+                          factor->data.db + index * m_Dimension );
+         }
+
+         AddScatter( factor, (int)blockClasses.size(), sign );
+         m_Count += sign * (last - first);
+      }
+   }
+   catch (...)
+   {
+      cvReleaseMat(&block);
+      cvReleaseMat(&factor);
+      throw;
+   }
+
+   cvReleaseMat(&block);
+   cvReleaseMat(&factor);
+}
+
+
+
+/* 
+Function:   CombineClass
+Purpose:    adds count faces with mean to a class, or takes them out of it
+Notes:      Chan et al.'s pairwise update.  Call the class without the faces A and the faces B, then
+            the scatter of A + B is the scatter of A plus the scatter of B plus
+            nA nB / (nA + nB) (mean B - mean A)(mean B - mean A)^T.  Only the class mean and count
+            are changed here, factor gets sqrt(nA nB / (nA + nB)) (mean B - mean A) so the caller
+            can add the outer products of every class at once with AddScatter.  Removing finds mean A
+            from the class mean and mean B, a class left without faces gets a zero mean
+Throws      
+returns:    void
+*/
+void TrainingStats::CombineClass(int index, int count, const double* mean, int sign, double* factor)
+{
+   double* classMean = &m_ClassMeans[(size_t)index * m_Dimension];
+   int nA = sign > 0 ? m_ClassCounts[index] : m_ClassCounts[index] - count;
+   int nAB = nA + count;
+
+   if ( nA == 0 )
+   {
+      for ( int col = 0; col < m_Dimension; col++ )
+      {
+         classMean[col] = sign > 0 ? mean[col] : 0.0;
+         factor[col] = 0.0;
+      }
+   }
+   else
+   {
+      double scale = sqrt( (double)nA * count / nAB );
+      for ( int col = 0; col < m_Dimension; col++ )
+      {
+         double meanA = sign > 0 ? classMean[col] : ( nAB * classMean[col] - count * mean[col] ) / nA;
+         double difference = mean[col] - meanA;
+
+         classMean[col] = sign > 0 ? meanA + difference * count / nAB : meanA;
+         factor[col] = scale * difference;
+      }
+   }
+
+   m_ClassCounts[index] = sign > 0 ? nAB : nA;
+}
+
+
+
+/* 
+Function:   AddScatter
+Purpose:    adds sign times the outer products of the first rows rows of factor to the scatter
+Notes:      factor^T factor with one ParallelMulTransposed
+Throws      
+returns:    void
+*/
+void TrainingStats::AddScatter(const CvMat* factor, int rows, int sign)
+{
+   if ( rows == 0 )
+      return;
+
+   CvMat factorRows;
+   cvGetRows( factor, &factorRows, 0, rows );
+   CvMat* product = cvCreateMat( m_Dimension, m_Dimension, CV_64FC1 );
+
+   try
+   {
+      ParallelMulTransposed( &factorRows, product );
+   }
+   catch (...)
+   {
+      cvReleaseMat(&product);
+      throw;
+   }
+
+   for ( size_t i = 0; i < m_Scatter.size(); i++ )
+      m_Scatter[i] += sign * product->data.db[i];
+
+   cvReleaseMat(&product);
+}
+
+
+
+/* 
+Function:   Merge
+Purpose:    adds other's statistics to these
+Notes:      classes are matched by id, a class only other has is added.  Each class is combined with
+            CombineClass, so the scatter is other's scatter plus the outer products of the differences
+            of the class means
+Throws      std::string if the dimensions differ
+returns:    void
+*/
+void TrainingStats::Merge(const TrainingStats& other)
+{
+   if ( other.m_Dimension != m_Dimension )
+      throw std::string("TrainingStats::Merge - statistics have different dimensions");
+
+   CvMat* factor = cvCreateMat( std::max(other.Classes(), 1), std::max(m_Dimension, 1), CV_64FC1 );
+
+   try
+   {
+      int row = 0;
+      std::map<personIDType, int>::const_iterator it;
+      for ( it = other.m_ClassIndex.begin(); it != other.m_ClassIndex.end(); it++ )
+      {
+         int index = AddClass( it->first );
+         CombineClass( index, other.m_ClassCounts[it->second], &other.m_ClassMeans[(size_t)it->second * m_Dimension], 1,
+                       factor->data.db + (size_t)row * m_Dimension );
+         row++;
+      }
+
+      for ( size_t i = 0; i < m_Scatter.size(); i++ )
+         m_Scatter[i] += other.m_Scatter[i];
+
+      AddScatter( factor, row, 1 );
+   }
+   catch (...)
+   {
+      cvReleaseMat(&factor);
+      throw;
+   }
+
+   cvReleaseMat(&factor);
+   m_Count += other.m_Count;
+}
+
+
+
+/* 
+Function:   Write
+Purpose:    writes the statistics to out
+Notes:      a header, then each class's id, count and mean, then the within class scatter
+Throws      
+returns:    void
+*/
+void TrainingStats::Write(std::ostream& out) const
+{
+   int header[5] = { TRAINING_STATS_MAGIC, TRAINING_STATS_VERSION, m_Dimension, m_Count, Classes() };
+   out.write( (const char*)header, sizeof(header) );
+
+   std::map<personIDType, int>::const_iterator it;
+   for ( it = m_ClassIndex.begin(); it != m_ClassIndex.end(); it++ )
+   {
+      out.write( (const char*)&it->first, sizeof(personIDType) );
+      out.write( (const char*)&m_ClassCounts[it->second], sizeof(int) );
+      out.write( (const char*)&m_ClassMeans[(size_t)it->second * m_Dimension], m_Dimension * sizeof(double) );
+   }
+
+   if ( !m_Scatter.empty() )
+      out.write( (const char*)&m_Scatter[0], m_Scatter.size() * sizeof(double) );
+}
+
+
+
+/* 
+Function:   Read
+Purpose:    replaces the statistics with ones written by Write
+Notes:      
+Throws      std::string if in does not hold valid statistics
+returns:    void
+*/
+void TrainingStats::Read(std::istream& in)
+{
+   std::string err = "TrainingStats::Read - not valid training statistics";
+
+   int header[5];
+   in.read( (char*)header, sizeof(header) );
+   if ( !in || header[0] != TRAINING_STATS_MAGIC || header[1] != TRAINING_STATS_VERSION || header[2] < 0 || header[3] < 0 || header[4] < 0 )
+      throw err;
+
+   Reset( header[2] );
+
+   for ( int i = 0; i < header[4]; i++ )
+   {
+      personIDType cls;
+      int count;
+      in.read( (char*)&cls, sizeof(personIDType) );
+      in.read( (char*)&count, sizeof(int) );
+      if ( !in || count < 1 || m_ClassIndex.find(cls) != m_ClassIndex.end() )
+         throw err;
+
+      int index = AddClass( cls );
+      m_ClassCounts[index] = count;
+      if ( m_Dimension > 0 )
+         in.read( (char*)&m_ClassMeans[(size_t)index * m_Dimension], m_Dimension * sizeof(double) );
+   }
+
+   if ( !m_Scatter.empty() )
+      in.read( (char*)&m_Scatter[0], m_Scatter.size() * sizeof(double) );
+   if ( !in )
+      throw err;
+
+   m_Count = header[3];
+}
+
+
+
+/* 
+Function:   ClassIDs
+Purpose:    the id of each class
+Notes:      
+Throws      
+returns:    class ids in increasing order
+*/
+std::vector<personIDType> TrainingStats::ClassIDs() const
+{
+   std::vector<personIDType> ids;
+
+   std::map<personIDType, int>::const_iterator it;
+   for ( it = m_ClassIndex.begin(); it != m_ClassIndex.end(); it++ )
+      ids.push_back( it->first );
+
+   return ids;
+}
+
+
+
+/* 
+Function:   Mean
+Purpose:    average of every face added
+Notes:      
+Throws      
+returns:    void
+*/
+void TrainingStats::Mean(CvMat* mean) const
+{
+   for ( int col = 0; col < m_Dimension; col++ )
+   {
+      double sum = 0.0;
+      for ( size_t index = 0; index < m_ClassCounts.size(); index++ )
+         sum += m_ClassCounts[index] * m_ClassMeans[index * m_Dimension + col];
+
+      cvSetReal1D( mean, col, m_Count > 0 ? sum / m_Count : 0.0 );
+   }
+}
+
+
+
+/* 
+Function:   ClassMeans
+Purpose:    average face of each class, one row per class in ClassIDs order
+Notes:      
+Throws      
+returns:    void
+*/
+void TrainingStats::ClassMeans(CvMat* classMeans) const
+{
+   int row = 0;
+   std::map<personIDType, int>::const_iterator it;
+   for ( it = m_ClassIndex.begin(); it != m_ClassIndex.end(); it++ )
+   {
+      const double* mean = &m_ClassMeans[(size_t)it->second * m_Dimension];
+
+      for ( int col = 0; col < m_Dimension; col++ )
+         cvmSet( classMeans, row, col, mean[col] );
+
+      row++;
+   }
+}
+
+
+
+/* 
+Function:   WithinScatter
+Purpose:    the within class scatter of every face added
+Notes:      it is kept centered on the class means, so it is only converted
+Throws      
+returns:    void
+*/
+void TrainingStats::WithinScatter(CvMat* withinScatter) const
+{
+   if ( m_Scatter.empty() )
+      return;
+
+   CvMat scatter = cvMat( m_Dimension, m_Dimension, CV_64FC1, (void*)&m_Scatter[0] );
+   cvConvert( &scatter, withinScatter );
+}
+
+
+
+/* 
+Function:   BetweenFactor
+Purpose:    the between class scatter as one row per class, in ClassIDs order
+Notes:      row = sqrt(count) * (class mean - mean)
+Throws      
+returns:    void
+*/
+void TrainingStats::BetweenFactor(CvMat* factor) const
+{
+   std::vector<double> mean( m_Dimension, 0.0 );
+   for ( size_t index = 0; index < m_ClassCounts.size(); index++ )
+   {
+      for ( int col = 0; col < m_Dimension; col++ )
+         mean[col] += m_ClassCounts[index] * m_ClassMeans[index * m_Dimension + col];
+   }
+   for ( int col = 0; col < m_Dimension; col++ )
+      mean[col] /= std::max( m_Count, 1 );
+
+   int row = 0;
+   std::map<personIDType, int>::const_iterator it;
+   for ( it = m_ClassIndex.begin(); it != m_ClassIndex.end(); it++ )
+   {
+      const double* classMean = &m_ClassMeans[(size_t)it->second * m_Dimension];
+      double count = m_ClassCounts[it->second];
+
+      for ( int col = 0; col < m_Dimension; col++ )
+         cvmSet( factor, row, col, sqrt(count) * (classMean[col] - mean[col]) );
+
+      row++;
+   }
+}
@@ -0,0 +1,90 @@
+#ifndef TRAININGSTATS_H
+#define TRAININGSTATS_H
+
+/*
+   TrainingStats.h
+   Description:   the sufficient statistics LDA needs from the projected training faces, each class's
+                  count and mean and the within class scatter.  The class averages and the within and
+                  between class scatter all come from these, so the faces only have to be streamed
+                  through once and never grouped by class.
+
+   Notes:         the scatter is kept centered on the class means, never as a sum of x x^T that the means
+                  are subtracted from at the end, which cancels away the precision when the faces are far
+                  from the origin compared to their spread.  Faces are added the way Welford does and
+                  statistics combined the way Chan et al. do, a class's scatter grows by the other part's
+                  scatter plus nA nB / (nA + nB) times the outer product of the difference of their means.
+                  So two TrainingStats with the same dimension can be merged, partial statistics from
+                  different workers or sessions combine into the same result as one pass over all of the
+                  faces, and faces can be taken out again the same way.  Everything is accumulated in
+                  double, memory is classes x dimension + dimension^2 no matter how many faces are added
+*/
+
+#include "Utilities.h"
+#include <map>
+#include <vector>
+#include <fstream>
+
+
+#define TRAINING_STATS_BLOCK_ROWS   256      // faces converted and multiplied together by AddRows
+#define TRAINING_STATS_MAGIC        0x53544154  // 'STAT'
+#define TRAINING_STATS_VERSION      2
+
+
+class TrainingStats
+{
+public:
+   TrainingStats();
+   explicit TrainingStats(int dimension);
+
+   void Reset(int dimension);
+
+   // one face of Dimension() floats
+   void Add(personIDType cls, const float* face);
+
+   // each row of faces is one face, classes has one id per row
+   void AddRows(const CvMat* faces, const personIDType* classes);
+
+   // takes faces added earlier back out, throws std::string if their classes don't have them
+   void RemoveRows(const CvMat* faces, const personIDType* classes);
+
+   // adds other's statistics to these, throws std::string if the dimensions differ
+   void Merge(const TrainingStats& other);
+
+   // binary, so partial statistics can be handed between processes, Read throws std::string if the data is not valid
+   void Write(std::ostream& out) const;
+   void Read(std::istream& in);
+
+   int Dimension() const { return m_Dimension; }
+   int Count() const { return m_Count; }
+   int Classes() const { return (int)m_ClassIndex.size(); }
+
+   // class ids in increasing order, the row order of ClassMeans and BetweenFactor
+   std::vector<personIDType> ClassIDs() const;
+
+   // mean is 1 x Dimension(), classMeans is Classes() x Dimension()
+   void Mean(CvMat* mean) const;
+   void ClassMeans(CvMat* classMeans) const;
+
+   // Sw = sum over classes of sum (x - class mean)(x - class mean)^T, Dimension() square
+   void WithinScatter(CvMat* withinScatter) const;
+
+   // one row sqrt(class count) * (class mean - mean) per class, Sb = factor^T * factor
+   void BetweenFactor(CvMat* factor) const;
+
+private:
+   int AddClass(personIDType cls);
+   void RemoveClass(personIDType cls);
+   void AccumulateRows(const CvMat* faces, const personIDType* classes, int sign);
+   void CombineClass(int index, int count, const double* mean, int sign, double* factor);
+   void AddScatter(const CvMat* factor, int rows, int sign);
+
+   int                           m_Dimension;
+   int                           m_Count;
+   std::map<personIDType, int>   m_ClassIndex;     // class id to its row of m_ClassMeans
+   std::vector<int>              m_ClassCounts;
+   std::vector<double>           m_ClassMeans;     // one row of m_Dimension per class
+   std::vector<double>           m_Scatter;        // sum of (x - class mean)(x - class mean)^T over every face, m_Dimension square
+};
+
+
+#endif